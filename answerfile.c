@@ -0,0 +1,350 @@
+// File   : answerfile.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Answer file parser. See answerfile.h.
+//
+// The mapped file is walked once, line by line, without copying it: section
+// headers select a slice of the schema table, and each key is checked and
+// stored as soon as it is read. Only the final values are allocated.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <string.h>
+
+#include "answerfile.h"
+#include "log.h"
+
+typedef enum {
+    FIELD_STRING,
+    FIELD_SECRET,       // like FIELD_STRING, but never logged
+    FIELD_PATH,         // absolute path
+    FIELD_UINT,
+    FIELD_SIZE,         // guint64
+    FIELD_LIST,         // whitespace or comma separated, replaces the default
+    FIELD_MODE,
+    FIELD_SCHEME,
+    FIELD_USERNAME,     // strings checked the way useradd and hostnamectl would
+    FIELD_HOSTNAME
+} AnswerFieldType;
+
+typedef struct {
+    const char *section;
+    const char *key;
+    AnswerFieldType type;
+    gsize offset;       // into InstallSettings
+    gboolean required;
+} AnswerField;
+
+#define FIELD(section, key, type, member, required) \
+    { section, key, type, G_STRUCT_OFFSET(InstallSettings, member), required }
+
+static const AnswerField schema[] = {
+    FIELD("system",   "mode",          FIELD_MODE,     mode,          FALSE),
+    FIELD("system",   "hostname",      FIELD_HOSTNAME, hostname,      FALSE),
+    FIELD("system",   "config-dir",    FIELD_PATH,     config_dir,    FALSE),
+    FIELD("disk",     "device",        FIELD_PATH,     disk,          TRUE),
+    FIELD("disk",     "extra-devices", FIELD_LIST,     extra_disks,   FALSE),
+    FIELD("layout",   "scheme",        FIELD_SCHEME,   partitioning,  FALSE),
+    FIELD("layout",   "swap",          FIELD_SIZE,     swap_size,     FALSE),
+    FIELD("layout",   "home-disk",     FIELD_PATH,     home_disk,     FALSE),
+    FIELD("user",     "full-name",     FIELD_STRING,   full_name,     FALSE),
+    FIELD("user",     "username",      FIELD_USERNAME, username,      FALSE),
+    FIELD("user",     "password",      FIELD_SECRET,   password,      FALSE),
+    FIELD("user",     "root-password", FIELD_SECRET,   root_password, FALSE),
+    FIELD("user",     "remove",        FIELD_LIST,     remove_users,  FALSE),
+    FIELD("locale",   "locale",        FIELD_STRING,   locale,        FALSE),
+    FIELD("locale",   "timezone",      FIELD_STRING,   timezone,      FALSE),
+    FIELD("locale",   "keymap",        FIELD_STRING,   keymap,        FALSE),
+    FIELD("packages", "install",       FIELD_LIST,     packages,      FALSE),
+    FIELD("packages", "mirror",        FIELD_STRING,   mirror,        FALSE),
+    FIELD("packages", "connections",   FIELD_UINT,     connections,   FALSE),
+    FIELD("packages", "image",         FIELD_PATH,     image,         FALSE),
+    FIELD("services", "enable",        FIELD_LIST,     services,      FALSE),
+};
+
+G_STATIC_ASSERT(G_N_ELEMENTS(schema) <= 64);
+
+static const char * const mode_names[] = {
+    [MODE_NORMAL] = "normal", [MODE_OEM] = "oem", [MODE_RECOVERY] = "recovery", NULL
+};
+
+static const char * const scheme_names[] = {
+    [PARTITION_ERASE] = "erase", [PARTITION_ALONGSIDE] = "alongside",
+    [PARTITION_MANUAL] = "manual", NULL
+};
+
+// A slice of the mapped file; never NUL-terminated
+typedef struct {
+    const char *start;
+    gsize len;
+} Span;
+
+typedef struct {
+    const char *path;
+    guint line;
+    InstallSettings *settings;
+    const char *section;    // a schema string, NULL before the first header
+    guint64 seen;           // one bit per schema entry
+} AnswerParser;
+
+static gboolean span_equal(Span span, const char *str) {
+    return strlen(str) == span.len && memcmp(span.start, str, span.len) == 0;
+}
+
+static Span span_strip(const char *start, const char *end) {
+    while (start < end && g_ascii_isspace(*start))
+        start++;
+    while (end > start && g_ascii_isspace(end[-1]))
+        end--;
+
+    return (Span) { start, end - start };
+}
+
+// A '#' after whitespace starts a trailing comment, unless it is quoted,
+// so values such as passwords can still carry one
+static const char* comment_start(const char *start, const char *end) {
+    gboolean quoted = FALSE;
+
+    for (const char *p = start; p < end; p++) {
+        if (*p == '"')
+            quoted = !quoted;
+        else if (*p == '#' && !quoted && p > start && g_ascii_isspace(p[-1]))
+            return p;
+    }
+
+    return end;
+}
+
+G_GNUC_PRINTF(3, 4)
+static gboolean parse_error(AnswerParser *parser, GError **error, const char *format, ...) {
+    g_autofree char *message = NULL;
+    va_list args;
+
+    va_start(args, format);
+    message = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                "%s:%u: %s", parser->path, parser->line, message);
+    return FALSE;
+}
+
+static int lookup_name(const char * const *names, Span value) {
+    for (int i = 0; names[i] != NULL; i++) {
+        if (span_equal(value, names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+static gboolean parse_section(AnswerParser *parser, Span header, GError **error) {
+    if (header.len < 2 || header.start[header.len - 1] != ']')
+        return parse_error(parser, error, "Malformed section header");
+
+    Span name = span_strip(header.start + 1, header.start + header.len - 1);
+
+    for (guint i = 0; i < G_N_ELEMENTS(schema); i++) {
+        if (span_equal(name, schema[i].section)) {
+            parser->section = schema[i].section;
+            return TRUE;
+        }
+    }
+
+    return parse_error(parser, error, "Unknown section [%.*s]", (int) name.len, name.start);
+}
+
+static gboolean parse_number(AnswerParser *parser, Span value, guint64 max,
+                             guint64 *out, GError **error) {
+    guint64 number = 0;
+
+    if (value.len == 0)
+        return parse_error(parser, error, "Expected a number");
+
+    for (gsize i = 0; i < value.len; i++) {
+        if (!g_ascii_isdigit(value.start[i]))
+            return parse_error(parser, error, "\"%.*s\" is not a number",
+                               (int) value.len, value.start);
+
+        number = number * 10 + (value.start[i] - '0');
+        if (number > max)
+            return parse_error(parser, error, "%.*s is out of range",
+                               (int) value.len, value.start);
+    }
+
+    *out = number;
+    return TRUE;
+}
+
+static char** split_list(Span value) {
+    GPtrArray *items = g_ptr_array_new();
+    const char *end = value.start + value.len;
+    const char *p = value.start;
+
+    while (p < end) {
+        const char *item;
+
+        while (p < end && (g_ascii_isspace(*p) || *p == ','))
+            p++;
+        item = p;
+        while (p < end && !g_ascii_isspace(*p) && *p != ',')
+            p++;
+
+        if (p > item)
+            g_ptr_array_add(items, g_strndup(item, p - item));
+    }
+
+    g_ptr_array_add(items, NULL);
+    return (char **) g_ptr_array_free(items, FALSE);
+}
+
+static gboolean store_value(AnswerParser *parser, const AnswerField *field,
+                            Span value, GError **error) {
+    gpointer member = G_STRUCT_MEMBER_P(parser->settings, field->offset);
+    guint64 number;
+    int index;
+
+    if (field->type == FIELD_USERNAME || field->type == FIELD_HOSTNAME) {
+        g_autofree char *name = g_strndup(value.start, value.len);
+        g_autoptr(GError) invalid = NULL;
+
+        if (field->type == FIELD_USERNAME ? !install_check_username(name, &invalid)
+                                          : !install_check_hostname(name, &invalid))
+            return parse_error(parser, error, "%s", invalid->message);
+    }
+
+    switch (field->type) {
+        case FIELD_PATH:
+            if (value.len == 0 || value.start[0] != '/')
+                return parse_error(parser, error, "%s must be an absolute path", field->key);
+            G_GNUC_FALLTHROUGH;
+        case FIELD_STRING:
+        case FIELD_SECRET:
+        case FIELD_USERNAME:
+        case FIELD_HOSTNAME: {
+            char **string = member;
+
+            if (field->type == FIELD_SECRET && *string != NULL)
+                memset(*string, 0, strlen(*string));
+            g_free(*string);
+            *string = g_strndup(value.start, value.len);
+            break;
+        }
+        case FIELD_UINT:
+            if (!parse_number(parser, value, G_MAXUINT, &number, error))
+                return FALSE;
+            *(guint *) member = number;
+            break;
+        case FIELD_SIZE:
+            if (!parse_number(parser, value, G_MAXUINT64 / 10, &number, error))
+                return FALSE;
+            *(guint64 *) member = number;
+            break;
+        case FIELD_LIST: {
+            char ***list = member;
+
+            g_strfreev(*list);
+            *list = split_list(value);
+            break;
+        }
+        case FIELD_MODE:
+            index = lookup_name(mode_names, value);
+            if (index < 0)
+                return parse_error(parser, error, "Unknown mode \"%.*s\"",
+                                   (int) value.len, value.start);
+            *(InstallerMode *) member = index;
+            break;
+        case FIELD_SCHEME:
+            index = lookup_name(scheme_names, value);
+            if (index < 0)
+                return parse_error(parser, error, "Unknown partitioning scheme \"%.*s\"",
+                                   (int) value.len, value.start);
+            *(PartitionScheme *) member = index;
+            break;
+    }
+
+    if (field->type == FIELD_SECRET) {
+        log_add_secret(*(char **) member);
+        debug_log("Answer file: %s.%s = (hidden)", field->section, field->key);
+    } else {
+        debug_log("Answer file: %s.%s = %.*s", field->section, field->key,
+                  (int) value.len, value.start);
+    }
+
+    return TRUE;
+}
+
+static gboolean parse_assignment(AnswerParser *parser, Span line, GError **error) {
+    const char *equals = memchr(line.start, '=', line.len);
+
+    if (equals == NULL)
+        return parse_error(parser, error, "Expected key = value");
+    if (parser->section == NULL)
+        return parse_error(parser, error, "Key outside of a section");
+
+    Span key = span_strip(line.start, equals);
+    Span value = span_strip(equals + 1, comment_start(equals + 1, line.start + line.len));
+
+    // Quotes are optional and only needed to keep leading or trailing spaces
+    if (value.len >= 2 && value.start[0] == '"' && value.start[value.len - 1] == '"')
+        value = (Span) { value.start + 1, value.len - 2 };
+
+    for (guint i = 0; i < G_N_ELEMENTS(schema); i++) {
+        if (strcmp(schema[i].section, parser->section) != 0 || !span_equal(key, schema[i].key))
+            continue;
+
+        if (parser->seen & (G_GUINT64_CONSTANT(1) << i))
+            return parse_error(parser, error, "%s is set more than once", schema[i].key);
+        parser->seen |= G_GUINT64_CONSTANT(1) << i;
+
+        return store_value(parser, &schema[i], value, error);
+    }
+
+    return parse_error(parser, error, "Unknown key \"%.*s\" in [%s]",
+                       (int) key.len, key.start, parser->section);
+}
+
+gboolean answer_file_load(const char *path, InstallSettings *settings, GError **error) {
+    g_autoptr(GMappedFile) file = g_mapped_file_new(path, FALSE, error);
+    AnswerParser parser = { path, 0, settings, NULL, 0 };
+    const char *p, *end;
+
+    if (file == NULL)
+        return FALSE;
+
+    // An empty file maps to NULL contents
+    p = g_mapped_file_get_contents(file);
+    end = p + g_mapped_file_get_length(file);
+
+    while (p != NULL && p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        const char *line_end = newline != NULL ? newline : end;
+        Span line = span_strip(p, line_end);
+
+        parser.line++;
+        p = newline != NULL ? newline + 1 : end;
+
+        if (line.len == 0 || line.start[0] == '#' || line.start[0] == ';')
+            continue;
+
+        if (line.start[0] == '[') {
+            if (!parse_section(&parser, line, error))
+                return FALSE;
+        } else if (!parse_assignment(&parser, line, error)) {
+            return FALSE;
+        }
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS(schema); i++) {
+        if (schema[i].required && !(parser.seen & (G_GUINT64_CONSTANT(1) << i))) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "%s: [%s] %s is required", path, schema[i].section, schema[i].key);
+            return FALSE;
+        }
+    }
+
+    debug_log("Answer file %s loaded (%u lines)", path, parser.line);
+    return TRUE;
+}
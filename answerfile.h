@@ -0,0 +1,59 @@
+// File   : answerfile.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Answer files for unattended (OEM) installs. The file is a small INI-style
+// document, memory-mapped and validated against a fixed schema in a single
+// pass; anything it doesn't set keeps the value already in the settings.
+//
+//     [system]
+//     mode = oem                  # normal | oem | recovery
+//     hostname = rarch
+//
+//     [disk]
+//     device = /dev/sda           # required
+//     extra-devices = /dev/sdb /dev/sdc   # installed side by side with device
+//
+//     [layout]
+//     scheme = erase              # erase | alongside | manual
+//     swap = 4096                 # MiB
+//     home-disk = /dev/sdb
+//
+//     [user]
+//     full-name = "Jane Doe"
+//     username = jane
+//     password = secret
+//     root-password = secret
+//     remove = olduser            # recovery only: deleted with their home
+//
+//     [locale]
+//     locale = en_US.UTF-8
+//     timezone = Europe/Berlin
+//     keymap = us
+//
+//     [packages]
+//     install = base linux linux-firmware sudo networkmanager
+//     mirror = file:///srv/mirror
+//     connections = 8
+//     image = /srv/rarch-root.sqfs    # deployed instead of installing packages
+//
+//     [services]
+//     enable = NetworkManager sshd
+//
+// Lines starting with # or ; are comments, and so is anything after a #
+// that follows whitespace outside quotes.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_ANSWERFILE_H
+#define RARCH_ANSWERFILE_H
+
+#include <gio/gio.h>
+
+#include "install.h"
+
+// Fills settings from the file at path; errors name the offending line
+gboolean answer_file_load(const char *path, InstallSettings *settings, GError **error);
+
+#endif // RARCH_ANSWERFILE_H
@@ -0,0 +1,509 @@
+// File   : bench.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Benchmark mode. See bench.h.
+//
+// Counters are sampled for the whole process as each scheduler node starts
+// and finishes. CPU time and I/O of commands are included because a child's
+// usage is added to ours once it has been reaped, which happens before the
+// node is reported finished. Steps that ran next to another step share the
+// counters for that time; they are marked "overlapped" in the report, while
+// their wall times are always exact. Peak RSS has no per-step counter: the
+// kernel only keeps a lifetime maximum, so it is reported as such.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <errno.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "answerfile.h"
+#include "bench.h"
+#include "log.h"
+#include "pkgcache.h"
+#include "storage.h"
+
+typedef struct {
+    gint64 wall;            // monotonic, microseconds
+    gint64 cpu;             // user + system of the installer and reaped children, microseconds
+    guint64 read_bytes;     // block I/O, including reaped children
+    guint64 write_bytes;
+    glong process_peak_rss; // KiB, the larger of the installer and its biggest child so far
+} BenchSample;
+
+typedef struct {
+    char *id;
+    BenchSample begin;
+    BenchSample end;
+    gboolean finished;
+    gboolean success;
+    gboolean overlapped;
+} BenchStep;
+
+typedef struct {
+    GMainLoop *loop;
+    Scheduler *scheduler;
+    GError *error;
+    BenchSample start;
+    BenchSample finish;
+    GPtrArray *steps;       // BenchStep*, in start order
+    GHashTable *running;    // id -> BenchStep*
+} BenchRun;
+
+static void bench_step_free(gpointer data) {
+    BenchStep *step = data;
+
+    g_free(step->id);
+    g_free(step);
+}
+
+static gint64 timeval_us(struct timeval time) {
+    return (gint64) time.tv_sec * G_USEC_PER_SEC + time.tv_usec;
+}
+
+static guint64 io_counter(const char *io, const char *key) {
+    const char *line = strstr(io, key);
+
+    return line != NULL ? g_ascii_strtoull(line + strlen(key), NULL, 10) : 0;
+}
+
+static void bench_sample(BenchSample *sample) {
+    g_autofree char *io = NULL;
+    struct rusage self, children;
+
+    sample->wall = g_get_monotonic_time();
+
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    sample->cpu = timeval_us(self.ru_utime) + timeval_us(self.ru_stime) +
+                  timeval_us(children.ru_utime) + timeval_us(children.ru_stime);
+    sample->process_peak_rss = MAX(self.ru_maxrss, children.ru_maxrss);
+
+    if (g_file_get_contents("/proc/self/io", &io, NULL, NULL)) {
+        sample->read_bytes = io_counter(io, "\nread_bytes:");
+        sample->write_bytes = io_counter(io, "\nwrite_bytes:");
+    } else {
+        sample->read_bytes = 0;
+        sample->write_bytes = 0;
+    }
+}
+
+static void on_bench_node(Scheduler *scheduler, const char *id,
+                          SchedulerNodeEvent event, gpointer user_data) {
+    BenchRun *run = user_data;
+    BenchStep *step;
+
+    if (event == SCHEDULER_NODE_STARTED) {
+        GHashTableIter iter;
+        BenchStep *other;
+
+        step = g_new0(BenchStep, 1);
+        step->id = g_strdup(id);
+        bench_sample(&step->begin);
+
+        // Everything already running now shares the counters with this step
+        g_hash_table_iter_init(&iter, run->running);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &other)) {
+            other->overlapped = TRUE;
+            step->overlapped = TRUE;
+        }
+
+        g_ptr_array_add(run->steps, step);
+        g_hash_table_insert(run->running, step->id, step);
+        return;
+    }
+
+    step = g_hash_table_lookup(run->running, id);
+    if (step == NULL)
+        return;
+
+    bench_sample(&step->end);
+    step->finished = TRUE;
+    step->success = event == SCHEDULER_NODE_DONE;
+    g_hash_table_remove(run->running, id);
+}
+
+static void on_bench_progress(Scheduler *scheduler, double fraction,
+                              const char *status, gpointer user_data) {
+    if (status != NULL)
+        debug_log("Benchmark: [%3d%%] %s", (int) (fraction * 100), status);
+}
+
+static void on_bench_finished(GObject *source, GAsyncResult *result, gpointer user_data) {
+    BenchRun *run = user_data;
+
+    scheduler_run_finish(run->scheduler, result, &run->error);
+    bench_sample(&run->finish);
+    g_main_loop_quit(run->loop);
+}
+
+static gboolean on_bench_interrupt(gpointer user_data) {
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+    return G_SOURCE_CONTINUE;
+}
+
+// Runs a setup tool to completion; output receives its stdout when not NULL
+static gboolean run_tool(const char * const *argv, char **output, GError **error) {
+    g_autoptr(GSubprocess) subprocess = NULL;
+    g_autofree char *stdout_buf = NULL;
+    g_autofree char *stderr_buf = NULL;
+
+    debug_log("Benchmark: running %s", argv[0]);
+
+    subprocess = g_subprocess_newv(argv, G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                         G_SUBPROCESS_FLAGS_STDERR_PIPE, error);
+    if (subprocess == NULL)
+        return FALSE;
+
+    if (!g_subprocess_communicate_utf8(subprocess, NULL, NULL, &stdout_buf, &stderr_buf, error))
+        return FALSE;
+
+    if (!g_subprocess_get_successful(subprocess)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "%s failed: %s", argv[0],
+                    stderr_buf != NULL ? g_strstrip(stderr_buf) : "");
+        return FALSE;
+    }
+
+    if (output != NULL)
+        *output = g_strdup(g_strstrip(stdout_buf));
+
+    return TRUE;
+}
+
+// A sparse file of size_mib only takes the space the install actually writes
+static char* create_image(guint64 size_mib, GError **error) {
+    g_autofree char *path = g_build_filename(BENCH_IMAGE_DIR, "rarch-bench-XXXXXX.img", NULL);
+    int fd = g_mkstemp(path);
+
+    if (fd < 0) {
+        int saved = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved),
+                    "Could not create %s: %s", path, g_strerror(saved));
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t) (size_mib * 1024 * 1024)) != 0) {
+        int saved = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved),
+                    "Could not size %s: %s", path, g_strerror(saved));
+        close(fd);
+        g_unlink(path);
+        return NULL;
+    }
+
+    close(fd);
+    return g_steal_pointer(&path);
+}
+
+static void json_string(GString *json, const char *value) {
+    if (value == NULL) {
+        g_string_append(json, "null");
+        return;
+    }
+
+    g_string_append_c(json, '"');
+    for (const char *p = value; *p != '\0'; p++) {
+        switch (*p) {
+            case '"':  g_string_append(json, "\\\""); break;
+            case '\\': g_string_append(json, "\\\\"); break;
+            case '\n': g_string_append(json, "\\n"); break;
+            case '\t': g_string_append(json, "\\t"); break;
+            default:
+                if ((guchar) *p < 0x20)
+                    g_string_append_printf(json, "\\u%04x", (guchar) *p);
+                else
+                    g_string_append_c(json, *p);
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+static void json_metrics(GString *json, const BenchSample *begin, const BenchSample *end) {
+    g_string_append_printf(json,
+                           "\"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+                           "\"read_bytes\": %" G_GUINT64_FORMAT ", "
+                           "\"write_bytes\": %" G_GUINT64_FORMAT ", "
+                           "\"process_peak_rss_kib\": %ld",
+                           (end->wall - begin->wall) / 1000.0,
+                           (end->cpu - begin->cpu) / 1000.0,
+                           end->read_bytes - begin->read_bytes,
+                           end->write_bytes - begin->write_bytes,
+                           end->process_peak_rss);
+}
+
+static char* build_report(const BenchRun *run, const InstallSettings *settings,
+                          guint64 size_mib, const char *started) {
+    GString *json = g_string_new("{\n");
+    struct utsname host;
+
+    if (uname(&host) != 0)
+        memset(&host, 0, sizeof(host));
+
+    g_string_append(json, "  \"version\": \"" RARCH_VERSION "\",\n  \"started\": ");
+    json_string(json, started);
+    g_string_append(json, ",\n  \"host\": { \"kernel\": ");
+    json_string(json, host.release);
+    g_string_append_printf(json, ", \"cpus\": %d },\n", g_get_num_processors());
+
+    g_string_append_printf(json, "  \"target\": { \"size_mib\": %" G_GUINT64_FORMAT
+                                 ", \"swap_mib\": %" G_GUINT64_FORMAT " },\n",
+                           size_mib, settings->swap_size);
+    g_string_append(json, "  \"mirror\": ");
+    json_string(json, settings->mirror);
+    g_string_append(json, ",\n  \"image\": ");
+    json_string(json, settings->image);
+    g_string_append(json, ",\n  \"config_dir\": ");
+    json_string(json, settings->config_dir);
+
+    g_string_append_printf(json, ",\n  \"success\": %s,\n  \"error\": ",
+                           run->error == NULL ? "true" : "false");
+    json_string(json, run->error != NULL ? run->error->message : NULL);
+
+    g_string_append(json, ",\n  \"total\": { ");
+    json_metrics(json, &run->start, &run->finish);
+    g_string_append(json, " },\n  \"steps\": [");
+
+    for (guint i = 0; i < run->steps->len; i++) {
+        const BenchStep *step = g_ptr_array_index(run->steps, i);
+        const BenchSample *end = step->finished ? &step->end : &run->finish;
+
+        g_string_append(json, i == 0 ? "\n    { \"id\": " : ",\n    { \"id\": ");
+        json_string(json, step->id);
+        g_string_append_printf(json, ", \"start_ms\": %.3f, ",
+                               (step->begin.wall - run->start.wall) / 1000.0);
+        json_metrics(json, &step->begin, end);
+        g_string_append_printf(json, ", \"success\": %s, \"overlapped\": %s }",
+                               step->finished && step->success ? "true" : "false",
+                               step->overlapped ? "true" : "false");
+    }
+
+    g_string_append(json, "\n  ]\n}\n");
+    return g_string_free(json, FALSE);
+}
+
+static void print_summary(const BenchRun *run) {
+    g_print("%-16s %11s %11s %12s %12s\n", "step", "wall ms", "cpu ms", "read MiB", "written MiB");
+
+    for (guint i = 0; i < run->steps->len; i++) {
+        const BenchStep *step = g_ptr_array_index(run->steps, i);
+        const BenchSample *end = step->finished ? &step->end : &run->finish;
+
+        g_print("%-16s %11.1f %11.1f %12.1f %12.1f%s\n", step->id,
+                (end->wall - step->begin.wall) / 1000.0,
+                (end->cpu - step->begin.cpu) / 1000.0,
+                (end->read_bytes - step->begin.read_bytes) / 1048576.0,
+                (end->write_bytes - step->begin.write_bytes) / 1048576.0,
+                step->overlapped ? " *" : "");
+    }
+
+    g_print("%-16s %11.1f %11.1f %12.1f %12.1f\n", "total",
+            (run->finish.wall - run->start.wall) / 1000.0,
+            (run->finish.cpu - run->start.cpu) / 1000.0,
+            (run->finish.read_bytes - run->start.read_bytes) / 1048576.0,
+            (run->finish.write_bytes - run->start.write_bytes) / 1048576.0);
+    g_print("Peak RSS: %ld KiB (* ran alongside other steps)\n", run->finish.process_peak_rss);
+}
+
+// Mounts at or below root as (id, mount point) pairs, parents before children
+static GPtrArray* mounts_below(const char *root) {
+    GPtrArray *mounts = g_ptr_array_new_with_free_func(g_free);
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    gsize root_len = strlen(root);
+
+    if (!g_file_get_contents("/proc/self/mountinfo", &contents, NULL, NULL))
+        return mounts;
+
+    // "36 35 98:0 /root /mnt/point rw,noatime shared:1 - ext4 /dev/sda2 rw"
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = g_strsplit(lines[i], " ", 6);
+        g_autofree char *mountpoint = NULL;
+
+        if (g_strv_length(fields) < 5)
+            continue;
+
+        // Spaces and the like are escaped as \ooo
+        mountpoint = g_strcompress(fields[4]);
+        if (strncmp(mountpoint, root, root_len) != 0 ||
+            (mountpoint[root_len] != '\0' && mountpoint[root_len] != '/'))
+            continue;
+
+        g_ptr_array_add(mounts, g_strdup(fields[0]));
+        g_ptr_array_add(mounts, g_steal_pointer(&mountpoint));
+    }
+
+    return mounts;
+}
+
+// Leaves nothing mounted or attached, even after a failed run. Only mounts
+// that weren't there before the run are undone; whatever the host had below
+// the root stays.
+static void release_target(const char *device, const InstallSettings *settings,
+                           GHashTable *host_mounts) {
+    g_autoptr(GPtrArray) mounts = mounts_below(settings->root);
+    GError *error = NULL;
+
+    if (settings->swap_size > 0) {
+        g_autoptr(StorageLayout) layout = storage_layout_new(device, NULL, settings->swap_size);
+        GPtrArray *partitions = storage_layout_get_partitions(layout);
+
+        for (guint i = 0; i < partitions->len; i++) {
+            const StoragePartition *partition = g_ptr_array_index(partitions, i);
+
+            if (partition->role == STORAGE_SWAP) {
+                const char *swapoff_argv[] = { "swapoff", partition->device, NULL };
+
+                if (!run_tool(swapoff_argv, NULL, &error)) {
+                    debug_log("Benchmark: %s", error->message);
+                    g_clear_error(&error);
+                }
+            }
+        }
+    }
+
+    // Children are listed after their parents, so go backwards
+    for (guint i = mounts->len; i >= 2; i -= 2) {
+        const char *id = g_ptr_array_index(mounts, i - 2);
+        const char *umount_argv[] = { "umount", g_ptr_array_index(mounts, i - 1), NULL };
+
+        if (g_hash_table_contains(host_mounts, id))
+            continue;
+
+        if (!run_tool(umount_argv, NULL, &error)) {
+            debug_log("Benchmark: %s", error->message);
+            g_clear_error(&error);
+        }
+    }
+
+    const char *detach_argv[] = { "losetup", "--detach", device, NULL };
+    if (!run_tool(detach_argv, NULL, &error)) {
+        g_printerr("Could not detach %s: %s\n", device, error->message);
+        g_clear_error(&error);
+    }
+}
+
+int bench_run(const InstallerConfig *config) {
+    g_autoptr(InstallSettings) settings = install_settings_new();
+    g_autoptr(GCancellable) cancellable = g_cancellable_new();
+    g_autoptr(GDateTime) now = g_date_time_new_now_utc();
+    g_autofree char *started = g_date_time_format_iso8601(now);
+    g_autofree char *image = NULL;
+    g_autofree char *device = NULL;
+    g_autofree char *report = NULL;
+    g_autoptr(GHashTable) host_mounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr(GPtrArray) mounts = NULL;
+    const char *report_path = config->bench_report != NULL ? config->bench_report : BENCH_DEFAULT_REPORT;
+    guint64 size_mib = config->bench_size > 0 ? (guint64) config->bench_size : BENCH_DEFAULT_SIZE_MIB;
+    BenchRun run = { 0 };
+    guint sigint_id, sigterm_id;
+    GError *error = NULL;
+
+    if (geteuid() != 0) {
+        g_printerr("Benchmark mode needs root to attach a loop device\n");
+        return 1;
+    }
+    if (config->mirror == NULL && config->image == NULL) {
+        g_printerr("Benchmark mode needs a local package mirror (--mirror URL) or a root image "
+                   "(--image FILE) for comparable runs\n");
+        return 1;
+    }
+    if (config->mode == MODE_RECOVERY) {
+        g_printerr("Benchmark mode installs from scratch; it cannot run in recovery mode\n");
+        return 1;
+    }
+
+    installer_config_apply(config, settings);
+    package_cache_start((const char * const *) config->package_caches);
+    if (config->answer_file != NULL && !answer_file_load(config->answer_file, settings, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    image = create_image(size_mib, &error);
+    if (image == NULL) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    const char *attach_argv[] = { "losetup", "--find", "--show", "--partscan", image, NULL };
+    if (!run_tool(attach_argv, &device, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_unlink(image);
+        return 1;
+    }
+
+    // The answer file may describe the system, but the target is always the loop device
+    g_free(settings->disk);
+    settings->disk = g_strdup(device);
+    g_clear_pointer(&settings->home_disk, g_free);
+    settings->partitioning = PARTITION_ERASE;
+    settings->fresh = TRUE;         // every step is timed, none is resumed
+    if (settings->hostname == NULL)
+        settings->hostname = g_strdup("rarch-bench");
+    if (settings->username == NULL)
+        settings->username = g_strdup("bench");
+    if (settings->password == NULL)
+        settings->password = g_strdup("bench");
+
+    // Remembered so the cleanup only undoes what the run mounted
+    mounts = mounts_below(settings->root);
+    for (guint i = 0; i < mounts->len; i += 2)
+        g_hash_table_add(host_mounts, g_strdup(g_ptr_array_index(mounts, i)));
+
+    g_print("Benchmarking on %s (%" G_GUINT64_FORMAT " MiB sparse image %s)\n",
+            device, size_mib, image);
+
+    run.loop = g_main_loop_new(NULL, FALSE);
+    run.steps = g_ptr_array_new_with_free_func(bench_step_free);
+    run.running = g_hash_table_new(g_str_hash, g_str_equal);
+    run.scheduler = install_build_graph(settings);
+    scheduler_set_progress_func(run.scheduler, on_bench_progress, &run);
+    scheduler_set_node_func(run.scheduler, on_bench_node, &run);
+
+    sigint_id = g_unix_signal_add(SIGINT, on_bench_interrupt, cancellable);
+    sigterm_id = g_unix_signal_add(SIGTERM, on_bench_interrupt, cancellable);
+
+    bench_sample(&run.start);
+    scheduler_run_async(run.scheduler, cancellable, on_bench_finished, &run);
+    g_main_loop_run(run.loop);
+
+    g_source_remove(sigint_id);
+    g_source_remove(sigterm_id);
+
+    // Freeing the graph ends its chroot session, which must be gone before unmounting
+    g_clear_pointer(&run.scheduler, scheduler_free);
+    release_target(device, settings, host_mounts);
+    g_unlink(image);
+
+    print_summary(&run);
+    report = build_report(&run, settings, size_mib, started);
+    if (!g_file_set_contents(report_path, report, -1, &error)) {
+        g_printerr("Could not write the benchmark report: %s\n", error->message);
+        g_clear_error(&error);
+    } else {
+        g_print("Report written to %s\n", report_path);
+    }
+
+    g_hash_table_unref(run.running);
+    g_ptr_array_unref(run.steps);
+    g_main_loop_unref(run.loop);
+
+    if (run.error != NULL) {
+        g_printerr("Benchmark install failed: %s\n", run.error->message);
+        g_error_free(run.error);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+// File   : bench.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Benchmark mode (--benchmark): runs the full install graph against a loop
+// device backed by a sparse file and a local package mirror, then writes a
+// JSON report with the wall time, CPU time, bytes read/written and peak RSS
+// of every step. Runs on the same image size and mirror are comparable, so
+// regressions in partitioning, package install or config copy show up as
+// numbers. `make bench` builds the headless binary and runs it; `make
+// bench-image` does the same with a root image deployed instead of packages.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_BENCH_H
+#define RARCH_BENCH_H
+
+#include "config.h"
+
+#define BENCH_IMAGE_DIR         "/var/tmp"
+#define BENCH_DEFAULT_SIZE_MIB  8192
+#define BENCH_DEFAULT_REPORT    "rarch-bench.json"
+
+// Needs root and config->mirror or config->image; returns the process exit status
+int bench_run(const InstallerConfig *config);
+
+#endif // RARCH_BENCH_H
@@ -0,0 +1,316 @@
+// File   : checkpoint.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Checkpoint journal. See checkpoint.h.
+//
+// The journal is a text file of one line per event, appended and synced as
+// it happens: "done ID HASH" once a step finished, "redo ID" before a step
+// with an old record runs again, so a run that dies half way through a redo
+// can't leave a stale record behind. A line without its newline was cut off
+// by the crash and is ignored.
+//
+// Records of steps that finish before the target is mounted ("storage") are
+// held back until it is, and written ahead of everything else.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "log.h"
+#include "storage.h"
+
+#define CHECKPOINT_HEADER "rarch-checkpoints 1\n"
+
+struct _CheckpointJournal {
+    gatomicrefcount ref_count;
+    char *root;
+    char *device;
+    gboolean fresh;
+
+    // Everything below is guarded by lock
+    GMutex lock;
+    gboolean loaded;
+    GHashTable *records;    // id -> hash of its last finished run
+    GString *pending;       // lines not yet written to the journal
+    int fd;                 // -1 until the target is mounted
+};
+
+typedef struct {
+    CheckpointJournal *journal;
+    char *id;
+    char *hash;
+    EngineJob *job;
+} CheckpointJobData;
+
+CheckpointJournal* checkpoint_journal_new(const char *root, const char *device, gboolean fresh) {
+    CheckpointJournal *journal = g_new0(CheckpointJournal, 1);
+
+    g_atomic_ref_count_init(&journal->ref_count);
+    g_mutex_init(&journal->lock);
+    journal->root = g_strdup(root);
+    journal->device = g_strdup(device);
+    journal->fresh = fresh;
+    journal->records = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    journal->pending = g_string_new(NULL);
+    journal->fd = -1;
+
+    return journal;
+}
+
+CheckpointJournal* checkpoint_journal_ref(CheckpointJournal *journal) {
+    g_atomic_ref_count_inc(&journal->ref_count);
+    return journal;
+}
+
+void checkpoint_journal_unref(CheckpointJournal *journal) {
+    if (journal == NULL || !g_atomic_ref_count_dec(&journal->ref_count))
+        return;
+
+    if (journal->pending->len > 0)
+        debug_log("Checkpoints: %" G_GSIZE_FORMAT " bytes of records were never written",
+                  journal->pending->len);
+
+    if (journal->fd >= 0)
+        close(journal->fd);
+    g_hash_table_unref(journal->records);
+    g_string_free(journal->pending, TRUE);
+    g_mutex_clear(&journal->lock);
+    g_free(journal->device);
+    g_free(journal->root);
+    g_free(journal);
+}
+
+// Replays the complete lines of text; anything else (the header) is skipped
+static void apply_lines(CheckpointJournal *journal, const char *text) {
+    const char *end = strrchr(text, '\n');
+    g_autofree char *complete = NULL;
+    g_auto(GStrv) lines = NULL;
+
+    if (end == NULL)
+        return;
+
+    complete = g_strndup(text, end - text);
+    lines = g_strsplit(complete, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = g_strsplit(lines[i], " ", 3);
+        guint n = g_strv_length(fields);
+
+        if (n == 3 && g_strcmp0(fields[0], "done") == 0)
+            g_hash_table_replace(journal->records, g_strdup(fields[1]), g_strdup(fields[2]));
+        else if (n == 2 && g_strcmp0(fields[0], "redo") == 0)
+            g_hash_table_remove(journal->records, fields[1]);
+    }
+}
+
+static void read_journal(CheckpointJournal *journal, const char *root) {
+    g_autofree char *path = g_build_filename(root, CHECKPOINT_JOURNAL_PATH, NULL);
+    g_autofree char *contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return;
+
+    if (!g_str_has_prefix(contents, CHECKPOINT_HEADER)) {
+        debug_log("Checkpoints: ignoring %s, its format is unknown", path);
+        return;
+    }
+
+    apply_lines(journal, contents);
+    debug_log("Checkpoints: %u steps recorded in %s",
+              g_hash_table_size(journal->records), path);
+}
+
+// Before "storage" runs, the target isn't mounted and an earlier journal can
+// only be read off the device itself
+static void read_device_journal(CheckpointJournal *journal, GCancellable *cancellable) {
+    g_autofree char *dir = g_dir_make_tmp("rarch-checkpoints-XXXXXX", NULL);
+    g_autoptr(EngineJob) mount = NULL;
+    g_autoptr(EngineJob) umount = NULL;
+
+    if (dir == NULL)
+        return;
+
+    const char *mount_argv[] = { "mount", "-o", "ro", journal->device, dir, NULL };
+    const char *umount_argv[] = { "umount", dir, NULL };
+
+    // Nothing (or nothing mountable) on the device just means nothing to resume
+    mount = engine_job_new_command("mount", mount_argv);
+    if (engine_job_run(mount, cancellable, NULL)) {
+        read_journal(journal, dir);
+        umount = engine_job_new_command("umount", umount_argv);
+        engine_job_run(umount, NULL, NULL);
+    }
+
+    g_rmdir(dir);
+}
+
+// Call with lock held
+static void load_locked(CheckpointJournal *journal, GCancellable *cancellable) {
+    if (journal->loaded)
+        return;
+
+    journal->loaded = TRUE;
+    if (journal->fresh)
+        return;
+
+    if (storage_is_mounted(journal->root))
+        read_journal(journal, journal->root);
+    else if (journal->device != NULL)
+        read_device_journal(journal, cancellable);
+}
+
+static gboolean write_all(int fd, const char *data, gsize len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return TRUE;
+}
+
+// Call with lock held; FALSE (with errno set) leaves the lines pending
+static gboolean open_locked(CheckpointJournal *journal) {
+    g_autofree char *path = g_build_filename(journal->root, CHECKPOINT_JOURNAL_PATH, NULL);
+    g_autofree char *dir = g_path_get_dirname(path);
+    int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    struct stat st;
+    int dir_fd;
+
+    if (g_mkdir_with_parents(dir, 0755) != 0)
+        return FALSE;
+
+    if (journal->fresh)
+        flags |= O_TRUNC;
+
+    journal->fd = open(path, flags, 0600);
+    if (journal->fd < 0)
+        return FALSE;
+
+    if (fstat(journal->fd, &st) == 0 && st.st_size > 0)
+        return TRUE;
+
+    // A new journal means a new file system: nothing read earlier describes
+    // it, only what this run has done since
+    g_hash_table_remove_all(journal->records);
+    apply_lines(journal, journal->pending->str);
+    g_string_prepend(journal->pending, CHECKPOINT_HEADER);
+
+    // Make the new name itself durable
+    dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    debug_log("Checkpoints: journal started at %s", path);
+    return TRUE;
+}
+
+// Call with lock held. A journal that can't be written only costs the next
+// run its shortcut (the disk may be what just filled up), so failures are
+// logged and the install goes on.
+static void flush_locked(CheckpointJournal *journal) {
+    if (journal->pending->len == 0)
+        return;
+
+    if (journal->fd < 0) {
+        if (!storage_is_mounted(journal->root))
+            return;
+
+        if (!open_locked(journal)) {
+            debug_log("Checkpoints: could not open the journal: %s", g_strerror(errno));
+            return;
+        }
+    }
+
+    if (!write_all(journal->fd, journal->pending->str, journal->pending->len) ||
+        fdatasync(journal->fd) != 0) {
+        debug_log("Checkpoints: could not write the journal: %s", g_strerror(errno));
+        return;
+    }
+
+    g_string_truncate(journal->pending, 0);
+}
+
+static gboolean checkpoint_lookup(CheckpointJournal *journal, const char *id, const char *hash,
+                                  GCancellable *cancellable) {
+    gboolean valid;
+
+    g_mutex_lock(&journal->lock);
+    load_locked(journal, cancellable);
+    valid = g_strcmp0(g_hash_table_lookup(journal->records, id), hash) == 0;
+
+    if (!valid && g_hash_table_remove(journal->records, id)) {
+        g_string_append_printf(journal->pending, "redo %s\n", id);
+        flush_locked(journal);
+    }
+    g_mutex_unlock(&journal->lock);
+
+    return valid;
+}
+
+static void checkpoint_record(CheckpointJournal *journal, const char *id, const char *hash) {
+    g_mutex_lock(&journal->lock);
+    if (hash != NULL) {
+        g_hash_table_replace(journal->records, g_strdup(id), g_strdup(hash));
+        g_string_append_printf(journal->pending, "done %s %s\n", id, hash);
+    }
+
+    // Also where records held back until the target was mounted get written
+    flush_locked(journal);
+    g_mutex_unlock(&journal->lock);
+}
+
+static gboolean run_checkpoint_job(EngineJob *job, gpointer user_data,
+                                   GCancellable *cancellable, GError **error) {
+    CheckpointJobData *data = user_data;
+
+    if (data->hash != NULL && checkpoint_lookup(data->journal, data->id, data->hash, cancellable)) {
+        debug_log("Checkpoints: '%s' is unchanged since the last run, skipping", data->id);
+        engine_job_report(job, 1.0, "Unchanged since the last run");
+        return TRUE;
+    }
+
+    if (!engine_job_run_nested(data->job, job, cancellable, error))
+        return FALSE;
+
+    checkpoint_record(data->journal, data->id, data->hash);
+    return TRUE;
+}
+
+static void checkpoint_job_data_free(gpointer user_data) {
+    CheckpointJobData *data = user_data;
+
+    checkpoint_journal_unref(data->journal);
+    engine_job_unref(data->job);
+    g_free(data->id);
+    g_free(data->hash);
+    g_free(data);
+}
+
+EngineJob* checkpoint_job_new(CheckpointJournal *journal, const char *id, const char *hash,
+                              EngineJob *job) {
+    CheckpointJobData *data = g_new0(CheckpointJobData, 1);
+
+    data->journal = checkpoint_journal_ref(journal);
+    data->id = g_strdup(id);
+    data->hash = g_strdup(hash);
+    data->job = job;
+
+    return engine_job_new_func(engine_job_get_name(job), run_checkpoint_job, data,
+                               checkpoint_job_data_free);
+}
@@ -0,0 +1,39 @@
+// File   : checkpoint.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Resumable installs. A journal on the target records every step that
+// finished together with a hash of its inputs, and is synced after each
+// record. The next run (or Recovery) skips every step whose record still
+// matches and redoes the rest. A step's hash covers its dependencies'
+// hashes too, so changing one input invalidates everything built on it.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_CHECKPOINT_H
+#define RARCH_CHECKPOINT_H
+
+#include "engine.h"
+
+// Relative to the target root; stays on the installed system for Recovery
+#define CHECKPOINT_JOURNAL_PATH "var/lib/rarch/checkpoints"
+
+typedef struct _CheckpointJournal CheckpointJournal;
+
+// device, when not NULL, holds root's file system before anything is
+// mounted there; it is only ever mounted read-only, to find an earlier
+// journal. fresh ignores and replaces whatever an earlier run recorded.
+CheckpointJournal* checkpoint_journal_new(const char *root, const char *device, gboolean fresh);
+CheckpointJournal* checkpoint_journal_ref(CheckpointJournal *journal);
+void checkpoint_journal_unref(CheckpointJournal *journal);
+
+// Runs job (which this takes over) unless journal says id already finished
+// with the same hash, then records it. A NULL hash always runs and is never
+// recorded, for steps that act on the running system or take passwords.
+EngineJob* checkpoint_job_new(CheckpointJournal *journal, const char *id, const char *hash,
+                              EngineJob *job);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(CheckpointJournal, checkpoint_journal_unref)
+
+#endif // RARCH_CHECKPOINT_H
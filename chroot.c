@@ -0,0 +1,334 @@
+// File   : chroot.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Persistent arch-chroot session. See chroot.h.
+//
+// A batch is sent as one shell script: every command runs only while the
+// previous ones succeeded, with stdin from /dev/null (or its own input) so
+// nothing can read the script itself, and the script ends by printing a
+// marker with the serial number, the last step run and its status. Output
+// up to the marker belongs to the batch.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chroot.h"
+#include "log.h"
+
+#define CHROOT_MARKER "@@rarch-done"
+#define CHROOT_LINE_SIZE 1024
+#define CHROOT_STOP_TIMEOUT_USEC (5 * G_USEC_PER_SEC)
+#define CHROOT_STOP_POLL_USEC    (20 * 1000)
+
+// What arch-chroot mounts below the root, normally undone by its exit trap
+static const char * const chroot_mounts[] = {
+    "proc", "sys", "dev", "run", "tmp", "etc/resolv.conf", NULL
+};
+
+typedef struct {
+    char **argv;
+    char *input;
+} ChrootCommand;
+
+struct _ChrootBatch {
+    GPtrArray *commands;    // ChrootCommand*, in order
+};
+
+struct _ChrootSession {
+    gatomicrefcount ref_count;
+    char *root;
+
+    // Everything below is guarded by lock, which is held for a whole batch
+    GMutex lock;
+    GSubprocess *shell;
+    GDataInputStream *output;
+    gboolean broken;
+    guint serial;
+};
+
+typedef struct {
+    ChrootSession *session;
+    ChrootBatch *batch;
+} ChrootJobData;
+
+static void scrub_free(char *secret) {
+    if (secret != NULL)
+        memset(secret, 0, strlen(secret));
+    g_free(secret);
+}
+
+static void chroot_command_free(gpointer data) {
+    ChrootCommand *command = data;
+
+    g_strfreev(command->argv);
+    scrub_free(command->input);
+    g_free(command);
+}
+
+ChrootBatch* chroot_batch_new(void) {
+    ChrootBatch *batch = g_new0(ChrootBatch, 1);
+
+    batch->commands = g_ptr_array_new_with_free_func(chroot_command_free);
+    return batch;
+}
+
+void chroot_batch_free(ChrootBatch *batch) {
+    if (batch == NULL)
+        return;
+
+    g_ptr_array_unref(batch->commands);
+    g_free(batch);
+}
+
+void chroot_batch_add(ChrootBatch *batch, const char * const *argv, const char *input) {
+    ChrootCommand *command = g_new0(ChrootCommand, 1);
+
+    command->argv = g_strdupv((char **) argv);
+    command->input = g_strdup(input);
+    g_ptr_array_add(batch->commands, command);
+}
+
+ChrootSession* chroot_session_new(const char *root) {
+    ChrootSession *session = g_new0(ChrootSession, 1);
+
+    g_atomic_ref_count_init(&session->ref_count);
+    g_mutex_init(&session->lock);
+    session->root = g_strdup(root);
+
+    return session;
+}
+
+ChrootSession* chroot_session_ref(ChrootSession *session) {
+    g_atomic_ref_count_inc(&session->ref_count);
+    return session;
+}
+
+void chroot_session_unref(ChrootSession *session) {
+    if (session == NULL || !g_atomic_ref_count_dec(&session->ref_count))
+        return;
+
+    if (session->shell != NULL) {
+        // End of input ends the shell; arch-chroot then tears its mounts down
+        g_output_stream_close(g_subprocess_get_stdin_pipe(session->shell), NULL, NULL);
+        g_subprocess_wait(session->shell, NULL, NULL);
+        debug_log("Chroot session in %s ended after %u batches", session->root, session->serial);
+    }
+
+    g_clear_object(&session->output);
+    g_clear_object(&session->shell);
+    g_mutex_clear(&session->lock);
+    g_free(session->root);
+    g_free(session);
+}
+
+static gboolean start_shell(ChrootSession *session, GError **error) {
+    GSubprocessLauncher *launcher;
+    const char *argv[] = { "arch-chroot", session->root, "/bin/sh", NULL };
+
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDIN_PIPE |
+                                         G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                         G_SUBPROCESS_FLAGS_STDERR_MERGE);
+    // Keep tool output parseable regardless of the live environment's locale
+    g_subprocess_launcher_setenv(launcher, "LC_ALL", "C", TRUE);
+
+    session->shell = g_subprocess_launcher_spawnv(launcher, argv, error);
+    g_object_unref(launcher);
+    if (session->shell == NULL)
+        return FALSE;
+
+    session->output = g_data_input_stream_new(g_subprocess_get_stdout_pipe(session->shell));
+    g_data_input_stream_set_newline_type(session->output, G_DATA_STREAM_NEWLINE_TYPE_LF);
+
+    debug_log("Chroot session started in %s", session->root);
+    return TRUE;
+}
+
+static void append_command(GString *script, const ChrootCommand *command) {
+    if (command->input != NULL) {
+        char *quoted = g_shell_quote(command->input);
+
+        // printf is a shell builtin, so the input never shows up in a process list
+        g_string_append_printf(script, "printf '%%s' %s | ", quoted);
+        scrub_free(quoted);
+    }
+
+    for (guint i = 0; command->argv[i] != NULL; i++) {
+        g_autofree char *quoted = g_shell_quote(command->argv[i]);
+
+        g_string_append(script, quoted);
+        g_string_append_c(script, ' ');
+    }
+}
+
+static char* build_script(ChrootBatch *batch, guint serial) {
+    GString *script = g_string_new("rarch_status=0; rarch_step=0\n");
+
+    for (guint i = 0; i < batch->commands->len; i++) {
+        g_string_append_printf(script,
+                               "if [ \"$rarch_status\" -eq 0 ]; then rarch_step=%u; { ", i + 1);
+        append_command(script, g_ptr_array_index(batch->commands, i));
+        g_string_append(script, "\n} </dev/null 2>&1; rarch_status=$?; fi\n");
+    }
+
+    g_string_append_printf(script,
+                           "printf '\\n" CHROOT_MARKER " %u %%s %%s\\n' \"$rarch_step\" \"$rarch_status\"\n",
+                           serial);
+
+    return g_string_free(script, FALSE);
+}
+
+// Ends a shell that can't be talked to any more. arch-chroot only unmounts
+// when it exits on its own, so it gets end of input and SIGTERM first and
+// SIGKILL only after a while; whatever it left mounted is unmounted here.
+static void stop_shell(ChrootSession *session) {
+    gint64 deadline = g_get_monotonic_time() + CHROOT_STOP_TIMEOUT_USEC;
+
+    g_output_stream_close(g_subprocess_get_stdin_pipe(session->shell), NULL, NULL);
+    g_subprocess_send_signal(session->shell, SIGTERM);
+
+    // The identifier goes away once the process has been reaped
+    while (g_subprocess_get_identifier(session->shell) != NULL &&
+           g_get_monotonic_time() < deadline)
+        g_usleep(CHROOT_STOP_POLL_USEC);
+
+    if (g_subprocess_get_identifier(session->shell) != NULL) {
+        debug_log("arch-chroot in %s did not exit, killing it", session->root);
+        g_subprocess_force_exit(session->shell);
+        g_subprocess_wait(session->shell, NULL, NULL);
+    }
+
+    for (guint i = 0; chroot_mounts[i] != NULL; i++) {
+        g_autofree char *path = g_build_filename(session->root, chroot_mounts[i], NULL);
+        const char *argv[] = { "umount", "--recursive", path, NULL };
+        g_autoptr(GSubprocess) umount = NULL;
+
+        // Not mounted any more is the usual outcome, and fine
+        umount = g_subprocess_newv(argv, G_SUBPROCESS_FLAGS_STDOUT_SILENCE |
+                                         G_SUBPROCESS_FLAGS_STDERR_SILENCE, NULL);
+        if (umount != NULL && g_subprocess_wait(umount, NULL, NULL) &&
+            g_subprocess_get_successful(umount))
+            debug_log("Unmounted %s left behind by arch-chroot", path);
+    }
+}
+
+// Call with lock held; the session cannot be used after an I/O failure
+static gboolean run_locked(ChrootSession *session, ChrootBatch *batch, EngineJob *job,
+                           GCancellable *cancellable, GError **error) {
+    g_autofree char *marker = NULL;
+    char *script;
+    char last_line[CHROOT_LINE_SIZE] = "";
+    guint step = 0;
+    int status = -1;
+    gboolean written;
+
+    if (session->broken) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                    "The chroot session in %s is no longer usable", session->root);
+        return FALSE;
+    }
+
+    if (session->shell == NULL && !start_shell(session, error)) {
+        session->broken = TRUE;
+        return FALSE;
+    }
+
+    session->serial++;
+    marker = g_strdup_printf(CHROOT_MARKER " %u ", session->serial);
+
+    script = build_script(batch, session->serial);
+    written = g_output_stream_write_all(g_subprocess_get_stdin_pipe(session->shell),
+                                        script, strlen(script), NULL, cancellable, error);
+    scrub_free(script);
+    if (!written)
+        goto broken;
+
+    for (;;) {
+        g_autofree char *line = g_data_input_stream_read_line(session->output, NULL,
+                                                              cancellable, error);
+
+        if (line == NULL) {
+            if (error != NULL && *error == NULL)
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE,
+                            "The chroot session in %s ended unexpectedly", session->root);
+            goto broken;
+        }
+
+        if (g_str_has_prefix(line, marker)) {
+            sscanf(line + strlen(marker), "%u %d", &step, &status);
+            break;
+        }
+
+        if (*line == '\0')
+            continue;
+
+        debug_log("%s: %s", job != NULL ? engine_job_get_name(job) : "chroot", line);
+        g_strlcpy(last_line, line, sizeof(last_line));
+        if (job != NULL)
+            engine_job_report(job, -1.0, line);
+    }
+
+    if (status != 0) {
+        const ChrootCommand *command = step > 0 && step <= batch->commands->len
+                                     ? g_ptr_array_index(batch->commands, step - 1)
+                                     : NULL;
+
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "%s failed (exit status %d)%s%s",
+                    command != NULL ? command->argv[0] : "chroot", status,
+                    last_line[0] != '\0' ? ": " : "", last_line);
+        return FALSE;
+    }
+
+    return TRUE;
+
+broken:
+    // Whatever the shell was doing can't be resynchronized with; stop it
+    session->broken = TRUE;
+    stop_shell(session);
+    return FALSE;
+}
+
+gboolean chroot_session_run(ChrootSession *session,
+                            ChrootBatch *batch,
+                            EngineJob *job,
+                            GCancellable *cancellable,
+                            GError **error) {
+    gboolean success;
+
+    if (batch->commands->len == 0)
+        return TRUE;
+
+    g_mutex_lock(&session->lock);
+    success = run_locked(session, batch, job, cancellable, error);
+    g_mutex_unlock(&session->lock);
+
+    return success;
+}
+
+static void chroot_job_data_free(gpointer data) {
+    ChrootJobData *job_data = data;
+
+    chroot_session_unref(job_data->session);
+    chroot_batch_free(job_data->batch);
+    g_free(job_data);
+}
+
+static gboolean run_chroot_job(EngineJob *job, gpointer user_data,
+                               GCancellable *cancellable, GError **error) {
+    ChrootJobData *data = user_data;
+
+    return chroot_session_run(data->session, data->batch, job, cancellable, error);
+}
+
+EngineJob* chroot_job_new(const char *name, ChrootSession *session, ChrootBatch *batch) {
+    ChrootJobData *data = g_new0(ChrootJobData, 1);
+
+    data->session = chroot_session_ref(session);
+    data->batch = batch;
+
+    return engine_job_new_func(name, run_chroot_job, data, chroot_job_data_free);
+}
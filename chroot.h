@@ -0,0 +1,52 @@
+// File   : chroot.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// One persistent arch-chroot session per install. The first command starts
+// a shell inside the target and every later command is written to it over
+// a pipe, so the mounts and namespaces arch-chroot sets up are paid for
+// once instead of once per step. Commands are grouped into batches that
+// cost a single round trip; a batch stops at its first failing command.
+//
+// Sessions are shared by the steps of one install graph (Recovery's account
+// steps included) and run one batch at a time.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_CHROOT_H
+#define RARCH_CHROOT_H
+
+#include "engine.h"
+
+typedef struct _ChrootSession ChrootSession;
+typedef struct _ChrootBatch ChrootBatch;
+
+// Nothing is started until the first batch runs
+ChrootSession* chroot_session_new(const char *root);
+ChrootSession* chroot_session_ref(ChrootSession *session);
+
+// Dropping the last reference ends the shell, which lets arch-chroot unmount
+void chroot_session_unref(ChrootSession *session);
+
+ChrootBatch* chroot_batch_new(void);
+void chroot_batch_free(ChrootBatch *batch);
+
+// input, when set, is fed to the command's stdin (never its argv) and
+// scrubbed when the batch is freed
+void chroot_batch_add(ChrootBatch *batch, const char * const *argv, const char *input);
+
+// Blocking; output lines are reported as job's status when job is not NULL
+gboolean chroot_session_run(ChrootSession *session,
+                            ChrootBatch *batch,
+                            EngineJob *job,
+                            GCancellable *cancellable,
+                            GError **error);
+
+// A step that runs batch (which the job takes over) in session
+EngineJob* chroot_job_new(const char *name, ChrootSession *session, ChrootBatch *batch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ChrootSession, chroot_session_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ChrootBatch, chroot_batch_free)
+
+#endif // RARCH_CHROOT_H
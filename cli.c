@@ -0,0 +1,195 @@
+// File   : cli.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// The headless front end. See cli.h.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <glib-unix.h>
+#include <signal.h>
+
+#include "answerfile.h"
+#include "bench.h"
+#include "cli.h"
+#include "disks.h"
+#include "log.h"
+#include "pkgcache.h"
+#include "targets.h"
+
+// Unattended installs print one line per status change instead of drawing a UI
+typedef struct {
+    GMainLoop *loop;
+    InstallTargets *targets;
+    GError *error;
+    char **last_status;     // per target
+} UnattendedRun;
+
+static void on_unattended_progress(InstallTargets *targets, guint index,
+                                   InstallTargetState state, double fraction,
+                                   const char *status, gpointer user_data) {
+    UnattendedRun *run = user_data;
+
+    if (status == NULL || g_strcmp0(status, run->last_status[index]) == 0)
+        return;
+
+    g_free(run->last_status[index]);
+    run->last_status[index] = g_strdup(status);
+
+    // With several disks at once every line says which one it is about
+    if (install_targets_get_n_targets(targets) > 1)
+        g_print("[%3d%%] %s: %s\n", (int) (fraction * 100),
+                install_targets_get_disk(targets, index), status);
+    else
+        g_print("[%3d%%] %s\n", (int) (fraction * 100), status);
+}
+
+static void on_unattended_finished(GObject *source, GAsyncResult *result, gpointer user_data) {
+    UnattendedRun *run = user_data;
+
+    install_targets_run_finish(run->targets, result, &run->error);
+    g_main_loop_quit(run->loop);
+}
+
+static gboolean on_unattended_interrupt(gpointer user_data) {
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+    return G_SOURCE_CONTINUE;
+}
+
+// Without an answer file there is nothing to install; list what could be targeted
+static void print_disks(const InstallerConfig *config) {
+    g_autoptr(GPtrArray) disks = disk_scan(config->include_loop);
+
+    g_print("Available disks:\n");
+    for (guint i = 0; i < disks->len; i++) {
+        g_autofree char *description = disk_info_describe(g_ptr_array_index(disks, i));
+        g_print("  %s\n", description);
+    }
+}
+
+// The same plan the "Install alongside" page starts from, shown before it is applied
+static gboolean plan_alongside(InstallSettings *settings, GError **error) {
+    g_autoptr(PartPlan) plan = NULL;
+    g_auto(GStrv) changes = NULL;
+
+    if (settings->disk == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No installation disk given");
+        return FALSE;
+    }
+
+    // As in the graphical installer, a plan covers one disk only
+    if (settings->extra_disks != NULL && settings->extra_disks[0] != NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "Only the \"erase\" layout can install onto several disks");
+        return FALSE;
+    }
+
+    plan = part_plan_read(settings->disk, error);
+    if (plan == NULL || !part_plan_auto_alongside(plan, settings->swap_size, error) ||
+        !part_plan_check(plan, error))
+        return FALSE;
+
+    changes = part_plan_describe_changes(plan);
+    g_print("Partition changes on %s:\n", settings->disk);
+    for (guint i = 0; changes[i] != NULL; i++)
+        g_print("  %s\n", changes[i]);
+
+    settings->plan = g_steal_pointer(&plan);
+    return TRUE;
+}
+
+int cli_run(const InstallerConfig *config) {
+    g_autoptr(InstallSettings) settings = install_settings_new();
+    g_autoptr(GCancellable) cancellable = g_cancellable_new();
+    const char *path = config->answer_file;
+    UnattendedRun run = { 0 };
+    guint sigint_id, sigterm_id;
+    GError *error = NULL;
+
+    if (path == NULL) {
+        g_printerr("Headless mode needs an answer file (--config FILE)\n");
+        print_disks(config);
+        return 1;
+    }
+
+    // Command line settings are the base; the answer file overrides them
+    installer_config_apply(config, settings);
+
+    // Index local package caches while the answer file is read and the disk planned
+    package_cache_start((const char * const *) config->package_caches);
+
+    if (!answer_file_load(path, settings, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    if (settings->partitioning == PARTITION_MANUAL && settings->mode != MODE_RECOVERY) {
+        g_printerr("%s: the \"manual\" layout needs the graphical installer\n", path);
+        return 1;
+    }
+
+    if (settings->partitioning == PARTITION_ALONGSIDE && settings->mode != MODE_RECOVERY &&
+        !plan_alongside(settings, &error)) {
+        g_printerr("%s: %s\n", path, error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    debug_log("Unattended install of %s started", settings->disk);
+
+    run.loop = g_main_loop_new(NULL, FALSE);
+    run.targets = install_targets_new(settings);
+    run.last_status = g_new0(char *, install_targets_get_n_targets(run.targets));
+    install_targets_set_func(run.targets, on_unattended_progress, &run);
+    install_targets_run_async(run.targets, cancellable, on_unattended_finished, &run);
+
+    sigint_id = g_unix_signal_add(SIGINT, on_unattended_interrupt, cancellable);
+    sigterm_id = g_unix_signal_add(SIGTERM, on_unattended_interrupt, cancellable);
+    g_main_loop_run(run.loop);
+    g_source_remove(sigint_id);
+    g_source_remove(sigterm_id);
+
+    for (guint i = 0; i < install_targets_get_n_targets(run.targets); i++)
+        g_free(run.last_status[i]);
+    g_free(run.last_status);
+    install_targets_free(run.targets);
+    g_main_loop_unref(run.loop);
+
+    if (run.error != NULL) {
+        g_printerr("Installation failed: %s\n", run.error->message);
+        g_error_free(run.error);
+        return 1;
+    }
+
+    g_print("Installation finished\n");
+    return 0;
+}
+
+int cli_main(int argc, char *argv[]) {
+    g_autoptr(GOptionContext) context = g_option_context_new(NULL);
+    InstallerConfig *config = installer_config_get();
+    GError *error = NULL;
+
+    g_option_context_set_summary(context, "Rarch Linux Installer (headless)");
+    g_option_context_add_main_entries(context, installer_config_get_entries(), NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    if (config->show_version) {
+        g_print("Rarch Linux Installer v" RARCH_VERSION "\n");
+        return 0;
+    }
+
+    config->headless = TRUE;
+    installer_config_finish(config);
+
+    int status = config->benchmark ? bench_run(config) : cli_run(config);
+    log_shutdown();
+    return status;
+}
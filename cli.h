@@ -0,0 +1,23 @@
+// File   : cli.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// The headless front end: runs an answer file install on a plain main loop
+// and reports progress as text. Nothing here touches GTK, so it works on
+// images without a display server and in the stand-alone headless binary.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_CLI_H
+#define RARCH_CLI_H
+
+#include "config.h"
+
+// Installs from config->answer_file; returns the process exit status
+int cli_run(const InstallerConfig *config);
+
+// Parses the command line itself, for callers that never create a GApplication
+int cli_main(int argc, char *argv[]);
+
+#endif // RARCH_CLI_H
@@ -0,0 +1,137 @@
+// File   : config.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Command line configuration. See config.h.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include "config.h"
+#include "log.h"
+
+static InstallerConfig config = {
+    .mode = MODE_NORMAL,
+    .oem = FALSE,
+    .recovery = FALSE,
+    .fullscreen = FALSE,
+    .debug = FALSE,
+    .headless = FALSE,
+    .include_loop = FALSE,
+    .mirror = NULL,
+    .connections = 0,
+    .package_caches = NULL,
+    .config_dir = NULL,
+    .image = NULL,
+    .home_disk = NULL,
+    .swap_size = 0,
+    .answer_file = NULL,
+    .fresh = FALSE,
+    .benchmark = FALSE,
+    .bench_size = 0,
+    .bench_report = NULL,
+    .show_version = FALSE,
+    .show_help = FALSE
+};
+
+// --help is automatic
+static const GOptionEntry entries[] = {
+    { "version", 'V', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.show_version,
+      "Show version information", NULL },
+    { "oem", 'O', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.oem,
+      "Run in OEM mode", NULL },
+    { "recovery", 'R', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.recovery,
+      "Run in recovery mode", NULL },
+    { "fullscreen", 'f', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.fullscreen,
+      "Run in fullscreen mode", NULL },
+    { "debug", 'd', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.debug,
+      "Enable debug output", NULL },
+    { "headless", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.headless,
+      "Run without GTK (requires --config)", NULL },
+    { "include-loop", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.include_loop,
+      "List loop devices as installation targets (testing)", NULL },
+    { "mirror", 'm', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &config.mirror,
+      "Fetch packages in parallel from a mirror (file:// or http://)", "URL" },
+    { "connections", 'j', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &config.connections,
+      "Concurrent package downloads", "N" },
+    { "package-cache", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY, &config.package_caches,
+      "Extra local package cache to reuse (repeatable)", "DIR" },
+    { "config-dir", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config.config_dir,
+      "Skeleton tree copied into the installed system", "DIR" },
+    { "image", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config.image,
+      "Deploy a root image (squashfs or raw) instead of installing packages", "FILE" },
+    { "home-disk", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &config.home_disk,
+      "Put /home on its own disk when erasing", "DEVICE" },
+    { "swap", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &config.swap_size,
+      "Swap partition size when erasing", "MIB" },
+    { "config", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config.answer_file,
+      "Install unattended from an answer file", "FILE" },
+    { "fresh", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.fresh,
+      "Redo every step instead of resuming an earlier install", NULL },
+    { "benchmark", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &config.benchmark,
+      "Time a full install onto a loop device (requires --mirror)", NULL },
+    { "bench-size", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &config.bench_size,
+      "Size of the sparse benchmark image", "MIB" },
+    { "bench-report", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config.bench_report,
+      "Where to write the JSON benchmark report", "FILE" },
+    { NULL }
+};
+
+InstallerConfig* installer_config_get(void) {
+    return &config;
+}
+
+const GOptionEntry* installer_config_get_entries(void) {
+    return entries;
+}
+
+void installer_config_finish(InstallerConfig *config) {
+    log_set_debug(config->debug);
+    if (config->debug) {
+        g_print("[DEBUG] Debug mode enabled\n");
+    }
+
+    // --recovery wins over --oem, as it always has
+    if (config->recovery) {
+        config->mode = MODE_RECOVERY;
+        debug_log("Recovery mode enabled");
+    } else if (config->oem) {
+        config->mode = MODE_OEM;
+        debug_log("OEM mode enabled");
+    }
+
+    if (config->fullscreen)
+        debug_log("Fullscreen mode enabled");
+    if (config->headless)
+        debug_log("Headless mode enabled");
+    if (config->include_loop)
+        debug_log("Loop devices will be listed as installation targets");
+    if (config->mirror != NULL)
+        debug_log("Installing packages from mirror: %s", config->mirror);
+    if (config->config_dir != NULL)
+        debug_log("Configuration tree: %s", config->config_dir);
+    if (config->image != NULL)
+        debug_log("Root image: %s", config->image);
+    if (config->answer_file != NULL)
+        debug_log("Answer file: %s", config->answer_file);
+    if (config->fresh)
+        debug_log("Ignoring checkpoints of earlier installs");
+    if (config->benchmark)
+        debug_log("Benchmark mode enabled");
+}
+
+void installer_config_apply(const InstallerConfig *config, InstallSettings *settings) {
+    settings->mode = config->mode;
+    settings->connections = MAX(config->connections, 0);
+    settings->swap_size = MAX(config->swap_size, 0);
+    settings->fresh = config->fresh;
+
+    g_free(settings->mirror);
+    settings->mirror = g_strdup(config->mirror);
+    g_free(settings->config_dir);
+    settings->config_dir = g_strdup(config->config_dir);
+    g_free(settings->image);
+    settings->image = g_strdup(config->image);
+    g_free(settings->home_disk);
+    settings->home_disk = g_strdup(config->home_disk);
+}
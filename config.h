@@ -0,0 +1,56 @@
+// File   : config.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Command line configuration shared by the GTK front end and the headless
+// one. Both register the same option table, which stores straight into the
+// process-wide InstallerConfig.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_CONFIG_H
+#define RARCH_CONFIG_H
+
+#include <gio/gio.h>
+
+#include "install.h"
+
+#define RARCH_VERSION "1.0.0"
+
+typedef struct {
+    InstallerMode mode;
+    gboolean oem;
+    gboolean recovery;
+    gboolean fullscreen;
+    gboolean debug;
+    gboolean headless;
+    gboolean include_loop;
+    char *mirror;
+    int connections;
+    char **package_caches;
+    char *config_dir;
+    char *image;
+    char *home_disk;
+    int swap_size;
+    char *answer_file;
+    gboolean fresh;
+    gboolean benchmark;
+    int bench_size;
+    char *bench_report;
+    gboolean show_version;
+    gboolean show_help;
+} InstallerConfig;
+
+InstallerConfig* installer_config_get(void);
+
+// NULL-terminated, for GOptionContext or g_application_add_main_option_entries
+const GOptionEntry* installer_config_get_entries(void);
+
+// Resolves the mode flags and applies --debug; call once after parsing
+void installer_config_finish(InstallerConfig *config);
+
+// Copies the command line parts of the configuration into settings
+void installer_config_apply(const InstallerConfig *config, InstallSettings *settings);
+
+#endif // RARCH_CONFIG_H
@@ -0,0 +1,476 @@
+// File   : disks.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Block device discovery. See disks.h.
+//
+// Hotplug uses the kernel's uevent netlink group directly rather than
+// libudev: the events carry everything needed to decide which disk to
+// re-probe, and the sysfs attributes are the same ones udev would read.
+//
+// Probes of one disk can finish out of order on the pool, so every request
+// carries the disk's generation at the time it was queued; a result older
+// than the latest request for its disk is dropped, the newer one follows.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <errno.h>
+#include <glib-unix.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "disks.h"
+#include "log.h"
+
+#define SYS_BLOCK "/sys/block"
+#define DISK_PROBE_THREADS 4
+#define UEVENT_BUFFER_SIZE (8 * 1024)
+
+// Virtual or non-installable devices that never belong in the disk list
+static const char * const ignored_prefixes[] = {
+    "ram", "zram", "sr", "fd", "dm-", "md", "nbd", NULL
+};
+
+struct _DiskMonitor {
+    gatomicrefcount ref_count;
+    gboolean include_loop;
+    gboolean disposed;
+    DiskMonitorFunc func;
+    gpointer user_data;
+
+    GMainContext *context;
+    GThreadPool *pool;
+    GHashTable *known;      // name -> DiskInfo*, main loop only
+
+    GMutex lock;
+    GHashTable *generations;    // name -> latest queued generation, under lock
+
+    GThread *enumerate;
+    GCancellable *cancellable;
+
+    int uevent_fd;
+    GSource *uevent_source;
+};
+
+typedef struct {
+    char *name;
+    guint generation;
+} ProbeRequest;
+
+typedef struct {
+    DiskMonitor *monitor;
+    char *name;
+    guint generation;
+    DiskInfo *disk;         // NULL when the device is gone or not listable
+} ProbeResult;
+
+static char* read_attribute(const char *name, const char *attribute) {
+    g_autofree char *path = g_build_filename(SYS_BLOCK, name, attribute, NULL);
+    char *contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return NULL;
+
+    return g_strstrip(contents);
+}
+
+static guint64 read_attribute_u64(const char *name, const char *attribute) {
+    g_autofree char *value = read_attribute(name, attribute);
+
+    return value != NULL ? g_ascii_strtoull(value, NULL, 10) : 0;
+}
+
+static guint count_partitions(const char *name) {
+    g_autofree char *path = g_build_filename(SYS_BLOCK, name, NULL);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const char *entry;
+    guint count = 0;
+
+    if (dir == NULL)
+        return 0;
+
+    // Partitions show up as child directories named after the disk (sda1, nvme0n1p1)
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_prefix(entry, name))
+            continue;
+
+        g_autofree char *marker = g_build_filename(path, entry, "partition", NULL);
+        if (g_file_test(marker, G_FILE_TEST_EXISTS))
+            count++;
+    }
+
+    g_dir_close(dir);
+    return count;
+}
+
+static gboolean is_ignored(const char *name, gboolean include_loop) {
+    if (g_str_has_prefix(name, "loop"))
+        return !include_loop;
+
+    for (guint i = 0; ignored_prefixes[i] != NULL; i++) {
+        if (g_str_has_prefix(name, ignored_prefixes[i]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+DiskInfo* disk_info_probe(const char *name, gboolean include_loop) {
+    if (is_ignored(name, include_loop))
+        return NULL;
+
+    // Size is reported in 512-byte sectors regardless of the logical block size
+    guint64 size = read_attribute_u64(name, "size") * 512;
+    if (size == 0)
+        return NULL;
+
+    DiskInfo *disk = g_new0(DiskInfo, 1);
+    disk->name = g_strdup(name);
+    disk->device = g_build_filename("/dev", name, NULL);
+    disk->size = size;
+    disk->optimal_io = read_attribute_u64(name, "queue/optimal_io_size");
+    disk->rotational = read_attribute_u64(name, "queue/rotational") != 0;
+    disk->removable = read_attribute_u64(name, "removable") != 0;
+    disk->read_only = read_attribute_u64(name, "ro") != 0;
+    disk->loop = g_str_has_prefix(name, "loop");
+    disk->n_partitions = count_partitions(name);
+
+    if (disk->loop) {
+        g_autofree char *backing = read_attribute(name, "loop/backing_file");
+        disk->model = backing != NULL ? g_path_get_basename(backing) : NULL;
+    } else {
+        disk->model = read_attribute(name, "device/model");
+    }
+
+    return disk;
+}
+
+DiskInfo* disk_info_copy(const DiskInfo *disk) {
+    DiskInfo *copy = g_memdup2(disk, sizeof(DiskInfo));
+
+    copy->name = g_strdup(disk->name);
+    copy->device = g_strdup(disk->device);
+    copy->model = g_strdup(disk->model);
+
+    return copy;
+}
+
+void disk_info_free(DiskInfo *disk) {
+    if (disk == NULL)
+        return;
+
+    g_free(disk->name);
+    g_free(disk->device);
+    g_free(disk->model);
+    g_free(disk);
+}
+
+static gboolean disk_info_equal(const DiskInfo *a, const DiskInfo *b) {
+    return a->size == b->size &&
+           a->optimal_io == b->optimal_io &&
+           a->rotational == b->rotational &&
+           a->removable == b->removable &&
+           a->read_only == b->read_only &&
+           a->n_partitions == b->n_partitions &&
+           g_strcmp0(a->model, b->model) == 0;
+}
+
+char* disk_info_describe(const DiskInfo *disk) {
+    g_autofree char *size = g_format_size(disk->size);
+    const char *kind;
+
+    if (disk->loop)
+        kind = "Loop";
+    else if (disk->removable)
+        kind = "Removable";
+    else if (disk->rotational)
+        kind = "HDD";
+    else
+        kind = "SSD";
+
+    if (disk->model != NULL && *disk->model != '\0')
+        return g_strdup_printf("%s - %s %s (%s)", disk->device, size, kind, disk->model);
+
+    return g_strdup_printf("%s - %s %s", disk->device, size, kind);
+}
+
+static GPtrArray* list_block_names(void) {
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    GDir *dir = g_dir_open(SYS_BLOCK, 0, NULL);
+    const char *entry;
+
+    if (dir == NULL)
+        return names;
+
+    while ((entry = g_dir_read_name(dir)) != NULL)
+        g_ptr_array_add(names, g_strdup(entry));
+
+    g_dir_close(dir);
+    return names;
+}
+
+GPtrArray* disk_scan(gboolean include_loop) {
+    GPtrArray *disks = g_ptr_array_new_with_free_func((GDestroyNotify) disk_info_free);
+    g_autoptr(GPtrArray) names = list_block_names();
+
+    for (guint i = 0; i < names->len; i++) {
+        DiskInfo *disk = disk_info_probe(g_ptr_array_index(names, i), include_loop);
+
+        if (disk != NULL)
+            g_ptr_array_add(disks, disk);
+    }
+
+    return disks;
+}
+
+static DiskMonitor* disk_monitor_ref(DiskMonitor *monitor) {
+    g_atomic_ref_count_inc(&monitor->ref_count);
+    return monitor;
+}
+
+static void disk_monitor_unref(DiskMonitor *monitor) {
+    if (!g_atomic_ref_count_dec(&monitor->ref_count))
+        return;
+
+    g_hash_table_unref(monitor->known);
+    g_hash_table_unref(monitor->generations);
+    g_mutex_clear(&monitor->lock);
+    g_object_unref(monitor->cancellable);
+    g_main_context_unref(monitor->context);
+    g_free(monitor);
+}
+
+static void probe_request_free(gpointer data) {
+    ProbeRequest *request = data;
+
+    g_free(request->name);
+    g_free(request);
+}
+
+// Any thread; takes ownership of name
+static void queue_probe(DiskMonitor *monitor, char *name) {
+    ProbeRequest *request = g_new0(ProbeRequest, 1);
+
+    g_mutex_lock(&monitor->lock);
+    request->generation = GPOINTER_TO_UINT(g_hash_table_lookup(monitor->generations, name)) + 1;
+    g_hash_table_insert(monitor->generations, g_strdup(name),
+                        GUINT_TO_POINTER(request->generation));
+    g_mutex_unlock(&monitor->lock);
+
+    request->name = name;
+    g_thread_pool_push(monitor->pool, request, NULL);
+}
+
+static void probe_result_free(gpointer data) {
+    ProbeResult *result = data;
+
+    disk_monitor_unref(result->monitor);
+    disk_info_free(result->disk);
+    g_free(result->name);
+    g_free(result);
+}
+
+// Main loop: turn a fresh probe into an added / changed / removed event
+static gboolean deliver_probe_result(gpointer data) {
+    ProbeResult *result = data;
+    DiskMonitor *monitor = result->monitor;
+    DiskInfo *known;
+    guint latest;
+
+    if (monitor->disposed)
+        return G_SOURCE_REMOVE;
+
+    g_mutex_lock(&monitor->lock);
+    latest = GPOINTER_TO_UINT(g_hash_table_lookup(monitor->generations, result->name));
+    g_mutex_unlock(&monitor->lock);
+
+    if (result->generation != latest) {
+        debug_log("Dropping stale probe of %s", result->name);
+        return G_SOURCE_REMOVE;
+    }
+
+    known = g_hash_table_lookup(monitor->known, result->name);
+
+    if (result->disk == NULL) {
+        if (known != NULL) {
+            debug_log("Disk removed: %s", known->device);
+            monitor->func(DISK_REMOVED, known, monitor->user_data);
+            g_hash_table_remove(monitor->known, result->name);
+        }
+    } else if (known == NULL) {
+        debug_log("Disk added: %s", result->disk->device);
+        g_hash_table_insert(monitor->known, g_strdup(result->name), result->disk);
+        monitor->func(DISK_ADDED, g_steal_pointer(&result->disk), monitor->user_data);
+    } else if (!disk_info_equal(known, result->disk)) {
+        debug_log("Disk changed: %s", result->disk->device);
+        g_hash_table_insert(monitor->known, g_strdup(result->name), result->disk);
+        monitor->func(DISK_CHANGED, g_steal_pointer(&result->disk), monitor->user_data);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void probe_in_thread(gpointer data, gpointer user_data) {
+    ProbeRequest *request = data;
+    DiskMonitor *monitor = user_data;
+    ProbeResult *result = g_new0(ProbeResult, 1);
+
+    result->monitor = disk_monitor_ref(monitor);
+    result->name = g_strdup(request->name);
+    result->generation = request->generation;
+    result->disk = disk_info_probe(request->name, monitor->include_loop);
+
+    g_main_context_invoke_full(monitor->context, G_PRIORITY_DEFAULT,
+                               deliver_probe_result, result, probe_result_free);
+
+    probe_request_free(request);
+}
+
+// Lists /sys/block off the main loop and queues a probe per device;
+// disk_monitor_free() cancels and joins it before the pool goes away
+static gpointer enumerate_thread(gpointer data) {
+    DiskMonitor *monitor = data;
+    g_autoptr(GPtrArray) names = list_block_names();
+
+    debug_log("Probing %u block devices", names->len);
+    for (guint i = 0; i < names->len; i++) {
+        if (g_cancellable_is_cancelled(monitor->cancellable))
+            break;
+        queue_probe(monitor, g_strdup(g_ptr_array_index(names, i)));
+    }
+
+    return NULL;
+}
+
+static void handle_uevent(DiskMonitor *monitor, const char *buffer, gssize length) {
+    const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+    const char *devname = NULL, *devpath = NULL;
+
+    // Payload is "action@devpath\0KEY=value\0KEY=value\0..."
+    for (const char *cursor = buffer; cursor < buffer + length; cursor += strlen(cursor) + 1) {
+        if (g_str_has_prefix(cursor, "ACTION="))
+            action = cursor + strlen("ACTION=");
+        else if (g_str_has_prefix(cursor, "SUBSYSTEM="))
+            subsystem = cursor + strlen("SUBSYSTEM=");
+        else if (g_str_has_prefix(cursor, "DEVTYPE="))
+            devtype = cursor + strlen("DEVTYPE=");
+        else if (g_str_has_prefix(cursor, "DEVNAME="))
+            devname = cursor + strlen("DEVNAME=");
+        else if (g_str_has_prefix(cursor, "DEVPATH="))
+            devpath = cursor + strlen("DEVPATH=");
+    }
+
+    if (g_strcmp0(subsystem, "block") != 0 || action == NULL || devpath == NULL)
+        return;
+
+    g_autofree char *name = NULL;
+    if (g_strcmp0(devtype, "partition") == 0) {
+        // A partition appearing or vanishing changes its parent disk
+        g_autofree char *parent = g_path_get_dirname(devpath);
+        name = g_path_get_basename(parent);
+    } else if (devname != NULL) {
+        name = g_path_get_basename(devname);
+    } else {
+        name = g_path_get_basename(devpath);
+    }
+
+    debug_log("uevent %s for %s", action, name);
+
+    // Removals are re-probed too: sysfs is already gone, so the probe reports NULL
+    queue_probe(monitor, g_steal_pointer(&name));
+}
+
+static gboolean on_uevent_readable(int fd, GIOCondition condition, gpointer user_data) {
+    DiskMonitor *monitor = user_data;
+    char buffer[UEVENT_BUFFER_SIZE];
+
+    for (;;) {
+        gssize length = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+
+        if (length <= 0)
+            break;
+
+        buffer[length] = '\0';
+        handle_uevent(monitor, buffer, length);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static int open_uevent_socket(void) {
+    struct sockaddr_nl address = {
+        .nl_family = AF_NETLINK,
+        .nl_pid = 0,
+        .nl_groups = 1,     // kernel uevents
+    };
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+        return -1;
+
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+DiskMonitor* disk_monitor_new(gboolean include_loop, DiskMonitorFunc func, gpointer user_data) {
+    DiskMonitor *monitor = g_new0(DiskMonitor, 1);
+
+    g_atomic_ref_count_init(&monitor->ref_count);
+    monitor->include_loop = include_loop;
+    monitor->func = func;
+    monitor->user_data = user_data;
+    monitor->context = g_main_context_ref_thread_default();
+    monitor->known = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, (GDestroyNotify) disk_info_free);
+    monitor->generations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_mutex_init(&monitor->lock);
+    monitor->cancellable = g_cancellable_new();
+    monitor->pool = g_thread_pool_new_full(probe_in_thread, monitor, probe_request_free,
+                                           DISK_PROBE_THREADS, FALSE, NULL);
+
+    // Subscribe before enumerating so nothing plugged in meanwhile is missed
+    monitor->uevent_fd = open_uevent_socket();
+    if (monitor->uevent_fd >= 0) {
+        monitor->uevent_source = g_unix_fd_source_new(monitor->uevent_fd, G_IO_IN);
+        g_source_set_callback(monitor->uevent_source, G_SOURCE_FUNC(on_uevent_readable),
+                              monitor, NULL);
+        g_source_attach(monitor->uevent_source, monitor->context);
+    } else {
+        debug_log("Disk hotplug unavailable: %s", g_strerror(errno));
+    }
+
+    monitor->enumerate = g_thread_new("disk-enumerate", enumerate_thread, monitor);
+
+    return monitor;
+}
+
+void disk_monitor_free(DiskMonitor *monitor) {
+    if (monitor == NULL)
+        return;
+
+    monitor->disposed = TRUE;
+
+    if (monitor->uevent_source != NULL) {
+        g_source_destroy(monitor->uevent_source);
+        g_source_unref(monitor->uevent_source);
+    }
+    if (monitor->uevent_fd >= 0)
+        close(monitor->uevent_fd);
+
+    // The enumeration queues into the pool, so it has to be over first
+    g_cancellable_cancel(monitor->cancellable);
+    g_thread_join(monitor->enumerate);
+
+    // Drop queued probes and wait for the ones already reading sysfs
+    g_thread_pool_free(monitor->pool, TRUE, TRUE);
+
+    disk_monitor_unref(monitor);
+}
@@ -0,0 +1,59 @@
+// File   : disks.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Block device discovery. Disks are read from /sys/block on worker threads and
+// reported one at a time as they are probed, then kept up to date from kernel
+// uevents (hotplug, loop device attach/detach, partition table changes).
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_DISKS_H
+#define RARCH_DISKS_H
+
+#include <glib.h>
+
+typedef struct {
+    char *name;             // kernel name, e.g. sda
+    char *device;           // device node, e.g. /dev/sda
+    char *model;
+    guint64 size;           // bytes
+    guint64 optimal_io;     // bytes, 0 if the device doesn't report one
+    gboolean rotational;
+    gboolean removable;
+    gboolean read_only;
+    gboolean loop;
+    guint n_partitions;
+} DiskInfo;
+
+typedef enum {
+    DISK_ADDED,
+    DISK_CHANGED,
+    DISK_REMOVED
+} DiskEvent;
+
+// Runs on the main loop the monitor was created on; for DISK_REMOVED only
+// disk->name and disk->device are meaningful
+typedef void (*DiskMonitorFunc)(DiskEvent event, const DiskInfo *disk, gpointer user_data);
+
+typedef struct _DiskMonitor DiskMonitor;
+
+// Reads one disk from sysfs; blocking, returns NULL for devices not worth listing
+DiskInfo* disk_info_probe(const char *name, gboolean include_loop);
+DiskInfo* disk_info_copy(const DiskInfo *disk);
+void disk_info_free(DiskInfo *disk);
+
+// "/dev/sda - 500.1 GB SSD (Samsung SSD 860)"
+char* disk_info_describe(const DiskInfo *disk);
+
+// Blocking scan of every listable disk, for callers that have no main loop
+GPtrArray* disk_scan(gboolean include_loop);
+
+// Returns immediately; results arrive through func as probes complete
+DiskMonitor* disk_monitor_new(gboolean include_loop, DiskMonitorFunc func, gpointer user_data);
+void disk_monitor_free(DiskMonitor *monitor);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DiskInfo, disk_info_free)
+
+#endif // RARCH_DISKS_H
@@ -0,0 +1,500 @@
+// File   : engine.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Asynchronous job engine built on GTask and GSubprocess. See engine.h.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <signal.h>
+#include <string.h>
+
+#include "engine.h"
+#include "log.h"
+
+#define ENGINE_READ_SIZE (64 * 1024)
+
+// Longer lines are cut here; pacman's longest useful lines are far shorter
+#define ENGINE_LINE_SIZE 4096
+
+struct _EngineJob {
+    gatomicrefcount ref_count;
+    char *name;
+
+    // Exactly one of argv / func is set
+    char **argv;
+    GBytes *input;
+    EngineJobFunc func;
+    gpointer func_data;
+    GDestroyNotify func_destroy;
+
+    EngineLineFunc line_func;
+    gpointer line_data;
+
+    char *queue;                        // NULL runs on the shared worker pool
+
+    EngineProgressFunc progress_func;
+    gpointer progress_data;
+    GDestroyNotify progress_destroy;
+
+    // Everything below is guarded by lock
+    GMutex lock;
+    GMainContext *main_context;
+    EngineJob *parent;                  // set while run nested; reports go there
+    GSource *flush_source;
+    double fraction;
+    char status[ENGINE_STATUS_SIZE];    // empty until the first status
+};
+
+typedef struct _CommandState CommandState;
+
+typedef struct {
+    CommandState *state;
+    GInputStream *stream;
+    gboolean is_stderr;
+    gboolean done;
+    gsize line_len;
+    char line[ENGINE_LINE_SIZE];
+    char buffer[ENGINE_READ_SIZE];
+} PipeReader;
+
+// One single-thread pool per queue name, created on first use and kept for
+// the life of the process (there is one per target disk)
+static GMutex queues_lock;
+static GHashTable *queues;              // name -> GThreadPool*
+
+struct _CommandState {
+    EngineJob *job;
+    GCancellable *cancellable;
+    PipeReader out;
+    PipeReader err;
+    gboolean input_done;
+    GError *input_error;
+    gboolean exited;
+    char last_error[ENGINE_LINE_SIZE];
+};
+
+static EngineJob* engine_job_new(const char *name) {
+    EngineJob *job = g_new0(EngineJob, 1);
+
+    g_atomic_ref_count_init(&job->ref_count);
+    g_mutex_init(&job->lock);
+    job->name = g_strdup(name);
+    job->fraction = -1.0;
+
+    return job;
+}
+
+EngineJob* engine_job_new_command(const char *name, const char * const *argv) {
+    g_return_val_if_fail(argv != NULL && argv[0] != NULL, NULL);
+
+    EngineJob *job = engine_job_new(name);
+    job->argv = g_strdupv((char **) argv);
+
+    return job;
+}
+
+EngineJob* engine_job_new_func(const char *name,
+                               EngineJobFunc func,
+                               gpointer user_data,
+                               GDestroyNotify destroy) {
+    g_return_val_if_fail(func != NULL, NULL);
+
+    EngineJob *job = engine_job_new(name);
+    job->func = func;
+    job->func_data = user_data;
+    job->func_destroy = destroy;
+
+    return job;
+}
+
+EngineJob* engine_job_ref(EngineJob *job) {
+    g_atomic_ref_count_inc(&job->ref_count);
+    return job;
+}
+
+void engine_job_unref(EngineJob *job) {
+    if (!g_atomic_ref_count_dec(&job->ref_count))
+        return;
+
+    if (job->func_destroy != NULL)
+        job->func_destroy(job->func_data);
+    if (job->progress_destroy != NULL)
+        job->progress_destroy(job->progress_data);
+
+    g_clear_pointer(&job->main_context, g_main_context_unref);
+    g_strfreev(job->argv);
+    g_clear_pointer(&job->input, g_bytes_unref);
+    g_free(job->queue);
+    g_free(job->name);
+    g_mutex_clear(&job->lock);
+    g_free(job);
+}
+
+const char* engine_job_get_name(EngineJob *job) {
+    return job->name;
+}
+
+void engine_job_set_line_func(EngineJob *job, EngineLineFunc func, gpointer user_data) {
+    job->line_func = func;
+    job->line_data = user_data;
+}
+
+void engine_job_set_queue(EngineJob *job, const char *queue) {
+    g_free(job->queue);
+    job->queue = g_strdup(queue);
+}
+
+void engine_job_set_stdin(EngineJob *job, GBytes *input) {
+    g_clear_pointer(&job->input, g_bytes_unref);
+    job->input = input != NULL ? g_bytes_ref(input) : NULL;
+}
+
+void engine_job_set_progress_func(EngineJob *job,
+                                  EngineProgressFunc func,
+                                  gpointer user_data,
+                                  GDestroyNotify destroy) {
+    if (job->progress_destroy != NULL)
+        job->progress_destroy(job->progress_data);
+
+    job->progress_func = func;
+    job->progress_data = user_data;
+    job->progress_destroy = destroy;
+}
+
+// Delivers the latest batched progress; always runs on the job's main context
+static void deliver_progress(EngineJob *job) {
+    double fraction;
+    char status[ENGINE_STATUS_SIZE];
+
+    g_mutex_lock(&job->lock);
+    if (job->flush_source != NULL) {
+        g_source_destroy(job->flush_source);
+        g_source_unref(job->flush_source);
+        job->flush_source = NULL;
+    }
+    fraction = job->fraction;
+    memcpy(status, job->status, sizeof(status));
+    g_mutex_unlock(&job->lock);
+
+    if (job->progress_func != NULL)
+        job->progress_func(job, fraction, status[0] != '\0' ? status : NULL, job->progress_data);
+}
+
+static gboolean on_flush_timeout(gpointer user_data) {
+    deliver_progress(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+void engine_job_report(EngineJob *job, double fraction, const char *status) {
+    EngineJob *parent;
+
+    g_mutex_lock(&job->lock);
+    parent = job->parent;
+    if (parent != NULL) {
+        g_mutex_unlock(&job->lock);
+        engine_job_report(parent, fraction, status);
+        return;
+    }
+
+    job->fraction = CLAMP(fraction, -1.0, 1.0);
+    if (status != NULL)
+        g_strlcpy(job->status, status, sizeof(job->status));
+
+    // The first update after a flush arms a timer; everything until it fires is merged
+    if (job->flush_source == NULL && job->progress_func != NULL && job->main_context != NULL) {
+        job->flush_source = g_timeout_source_new(ENGINE_FLUSH_INTERVAL_MS);
+        g_source_set_callback(job->flush_source, on_flush_timeout,
+                              engine_job_ref(job), (GDestroyNotify) engine_job_unref);
+        g_source_attach(job->flush_source, job->main_context);
+    }
+
+    g_mutex_unlock(&job->lock);
+}
+
+static void emit_line(PipeReader *reader) {
+    CommandState *state = reader->state;
+    EngineJob *job = state->job;
+    const char *line = reader->line;
+
+    reader->line[reader->line_len] = '\0';
+    if (reader->is_stderr)
+        memcpy(state->last_error, line, reader->line_len + 1);
+
+    debug_log("%s: %s", job->name, line);
+
+    if (job->line_func != NULL)
+        job->line_func(job, line, reader->is_stderr, job->line_data);
+    else
+        engine_job_report(job, -1.0, line);
+
+    reader->line_len = 0;
+}
+
+static void on_pipe_read(GObject *source, GAsyncResult *result, gpointer user_data) {
+    PipeReader *reader = user_data;
+    gssize count;
+
+    count = g_input_stream_read_finish(G_INPUT_STREAM(source), result, NULL);
+    if (count <= 0) {
+        if (reader->line_len > 0)
+            emit_line(reader);
+        reader->done = TRUE;
+        return;
+    }
+
+    // pacman redraws progress with '\r', so both terminators end a line
+    const char *cursor = reader->buffer;
+    const char *end = reader->buffer + count;
+    while (cursor < end) {
+        const char *stop = cursor;
+        while (stop < end && *stop != '\n' && *stop != '\r')
+            stop++;
+
+        // The line buffer is fixed; whatever doesn't fit is dropped
+        gsize length = MIN((gsize) (stop - cursor), sizeof(reader->line) - 1 - reader->line_len);
+        memcpy(reader->line + reader->line_len, cursor, length);
+        reader->line_len += length;
+        if (stop == end)
+            break;
+
+        if (reader->line_len > 0)
+            emit_line(reader);
+        cursor = stop + 1;
+    }
+
+    g_input_stream_read_async(reader->stream, reader->buffer, sizeof(reader->buffer),
+                              G_PRIORITY_DEFAULT, reader->state->cancellable,
+                              on_pipe_read, reader);
+}
+
+static void on_wait_finished(GObject *source, GAsyncResult *result, gpointer user_data) {
+    CommandState *state = user_data;
+
+    g_subprocess_wait_finish(G_SUBPROCESS(source), result, NULL);
+    state->exited = TRUE;
+}
+
+static void on_input_written(GObject *source, GAsyncResult *result, gpointer user_data) {
+    CommandState *state = user_data;
+
+    g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, NULL, &state->input_error);
+    g_output_stream_close(G_OUTPUT_STREAM(source), NULL, NULL);
+    state->input_done = TRUE;
+}
+
+static void on_command_cancelled(GCancellable *cancellable, gpointer user_data) {
+    g_subprocess_force_exit(G_SUBPROCESS(user_data));
+}
+
+static void start_reader(PipeReader *reader, CommandState *state,
+                         GInputStream *stream, gboolean is_stderr) {
+    reader->state = state;
+    reader->stream = stream;
+    reader->is_stderr = is_stderr;
+    reader->line_len = 0;
+
+    g_input_stream_read_async(stream, reader->buffer, sizeof(reader->buffer),
+                              G_PRIORITY_DEFAULT, state->cancellable,
+                              on_pipe_read, reader);
+}
+
+static gboolean run_command(EngineJob *job, GCancellable *cancellable, GError **error) {
+    static gsize sigpipe_ignored;
+    GSubprocessLauncher *launcher;
+    GSubprocess *subprocess;
+    GMainContext *context;
+    CommandState *state;
+    gulong cancel_id = 0;
+    gboolean success;
+
+    debug_log("Running command for '%s': %s", job->name, job->argv[0]);
+
+    // A child that exits before reading all of its input must show up as
+    // EPIPE on the write, not kill the installer
+    if (g_once_init_enter(&sigpipe_ignored)) {
+        signal(SIGPIPE, SIG_IGN);
+        g_once_init_leave(&sigpipe_ignored, 1);
+    }
+
+    launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+                                         G_SUBPROCESS_FLAGS_STDERR_PIPE |
+                                         (job->input != NULL ? G_SUBPROCESS_FLAGS_STDIN_PIPE
+                                                             : G_SUBPROCESS_FLAGS_NONE));
+    // Keep tool output parseable regardless of the live environment's locale
+    g_subprocess_launcher_setenv(launcher, "LC_ALL", "C", TRUE);
+
+    subprocess = g_subprocess_launcher_spawnv(launcher, (const char * const *) job->argv, error);
+    g_object_unref(launcher);
+    if (subprocess == NULL)
+        return FALSE;
+
+    // Pipes are drained on a private context so this thread never touches the UI loop
+    context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+
+    state = g_new0(CommandState, 1);
+    state->job = job;
+    state->cancellable = cancellable;
+
+    if (cancellable != NULL)
+        cancel_id = g_cancellable_connect(cancellable, G_CALLBACK(on_command_cancelled),
+                                          subprocess, NULL);
+
+    start_reader(&state->out, state, g_subprocess_get_stdout_pipe(subprocess), FALSE);
+    start_reader(&state->err, state, g_subprocess_get_stderr_pipe(subprocess), TRUE);
+    g_subprocess_wait_async(subprocess, NULL, on_wait_finished, state);
+
+    // Written alongside the readers: input of any size (an sfdisk script
+    // grows with the partitions) can't deadlock against a full output pipe
+    state->input_done = job->input == NULL;
+    if (job->input != NULL) {
+        gsize size;
+        const void *data = g_bytes_get_data(job->input, &size);
+
+        g_output_stream_write_all_async(g_subprocess_get_stdin_pipe(subprocess), data, size,
+                                        G_PRIORITY_DEFAULT, cancellable, on_input_written, state);
+    }
+
+    while (!state->out.done || !state->err.done || !state->input_done || !state->exited)
+        g_main_context_iteration(context, TRUE);
+
+    if (cancel_id != 0)
+        g_cancellable_disconnect(cancellable, cancel_id);
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+
+    if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
+        success = FALSE;
+    } else if (!g_subprocess_get_successful(subprocess)) {
+        int status = g_subprocess_get_if_exited(subprocess)
+                   ? g_subprocess_get_exit_status(subprocess)
+                   : -1;
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "%s failed (exit status %d)%s%s",
+                    job->argv[0], status,
+                    state->last_error[0] != '\0' ? ": " : "",
+                    state->last_error);
+        success = FALSE;
+    } else if (state->input_error != NULL) {
+        g_propagate_prefixed_error(error, g_steal_pointer(&state->input_error),
+                                   "Could not write the input of %s: ", job->argv[0]);
+        success = FALSE;
+    } else {
+        success = TRUE;
+    }
+
+    g_clear_error(&state->input_error);
+    g_free(state);
+    g_object_unref(subprocess);
+
+    return success;
+}
+
+gboolean engine_job_run(EngineJob *job, GCancellable *cancellable, GError **error) {
+    gint64 start;
+    gboolean success;
+
+    if (g_cancellable_set_error_if_cancelled(cancellable, error))
+        return FALSE;
+
+    start = log_step_begin(job->name);
+
+    if (job->argv != NULL)
+        success = run_command(job, cancellable, error);
+    else
+        success = job->func(job, job->func_data, cancellable, error);
+
+    log_step_end(job->name, start, success);
+
+    return success;
+}
+
+gboolean engine_job_run_nested(EngineJob *job, EngineJob *parent,
+                               GCancellable *cancellable, GError **error) {
+    gboolean success;
+
+    g_mutex_lock(&job->lock);
+    job->parent = parent;
+    g_mutex_unlock(&job->lock);
+
+    success = engine_job_run(job, cancellable, error);
+
+    g_mutex_lock(&job->lock);
+    job->parent = NULL;
+    g_mutex_unlock(&job->lock);
+
+    return success;
+}
+
+static void run_job_in_thread(GTask *task,
+                              gpointer source_object,
+                              gpointer task_data,
+                              GCancellable *cancellable) {
+    GError *error = NULL;
+
+    if (engine_job_run(task_data, cancellable, &error))
+        g_task_return_boolean(task, TRUE);
+    else
+        g_task_return_error(task, error);
+}
+
+static void run_queued_task(gpointer data, gpointer user_data) {
+    GTask *task = data;
+
+    run_job_in_thread(task, NULL, g_task_get_task_data(task), g_task_get_cancellable(task));
+    g_object_unref(task);
+}
+
+static GThreadPool* get_queue(const char *name) {
+    GThreadPool *pool;
+
+    g_mutex_lock(&queues_lock);
+    if (queues == NULL)
+        queues = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    pool = g_hash_table_lookup(queues, name);
+    if (pool == NULL) {
+        pool = g_thread_pool_new(run_queued_task, NULL, 1, FALSE, NULL);
+        g_hash_table_insert(queues, g_strdup(name), pool);
+    }
+    g_mutex_unlock(&queues_lock);
+
+    return pool;
+}
+
+void engine_job_run_async(EngineJob *job,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data) {
+    GTask *task;
+
+    g_mutex_lock(&job->lock);
+    if (job->main_context == NULL)
+        job->main_context = g_main_context_ref_thread_default();
+    g_mutex_unlock(&job->lock);
+
+    task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_source_tag(task, engine_job_run_async);
+    g_task_set_task_data(task, engine_job_ref(job), (GDestroyNotify) engine_job_unref);
+
+    if (job->queue != NULL) {
+        // The pool's thread drops the reference once the job has returned
+        g_thread_pool_push(get_queue(job->queue), task, NULL);
+        return;
+    }
+
+    g_task_run_in_thread(task, run_job_in_thread);
+    g_object_unref(task);
+}
+
+gboolean engine_job_run_finish(EngineJob *job, GAsyncResult *result, GError **error) {
+    g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+
+    // Hand over whatever is still batched so the last update lands before completion
+    deliver_progress(job);
+
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -0,0 +1,89 @@
+// File   : engine.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Asynchronous job engine. Every install step runs on a worker thread, either
+// as an external command (pacstrap, mkfs, arch-chroot, ...) or as an in-process
+// function. Command output is streamed line by line on the worker thread and
+// progress is delivered to the caller's main loop in batches, so the UI never
+// waits on a step.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_ENGINE_H
+#define RARCH_ENGINE_H
+
+#include <gio/gio.h>
+
+// Progress is coalesced and handed to the main loop at most this often
+#define ENGINE_FLUSH_INTERVAL_MS 33
+
+// Status texts are kept in a fixed buffer and cut to this length
+#define ENGINE_STATUS_SIZE 256
+
+typedef struct _EngineJob EngineJob;
+
+// Runs on the worker thread for in-process steps
+typedef gboolean (*EngineJobFunc)(EngineJob *job,
+                                  gpointer user_data,
+                                  GCancellable *cancellable,
+                                  GError **error);
+
+// Runs on the worker thread for every line a command writes
+typedef void (*EngineLineFunc)(EngineJob *job,
+                               const char *line,
+                               gboolean is_stderr,
+                               gpointer user_data);
+
+// Runs on the main loop; a negative fraction means "no estimate, pulse"
+typedef void (*EngineProgressFunc)(EngineJob *job,
+                                   double fraction,
+                                   const char *status,
+                                   gpointer user_data);
+
+EngineJob* engine_job_new_command(const char *name, const char * const *argv);
+EngineJob* engine_job_new_func(const char *name,
+                               EngineJobFunc func,
+                               gpointer user_data,
+                               GDestroyNotify destroy);
+
+EngineJob* engine_job_ref(EngineJob *job);
+void engine_job_unref(EngineJob *job);
+
+const char* engine_job_get_name(EngineJob *job);
+
+void engine_job_set_line_func(EngineJob *job, EngineLineFunc func, gpointer user_data);
+void engine_job_set_progress_func(EngineJob *job,
+                                  EngineProgressFunc func,
+                                  gpointer user_data,
+                                  GDestroyNotify destroy);
+
+// Jobs with the same queue name run one at a time, in the order started, on
+// a thread of their own instead of the shared worker pool. Used per disk, so
+// every device gets its own I/O queue and never waits behind another one.
+void engine_job_set_queue(EngineJob *job, const char *queue);
+
+// Bytes fed to the command's stdin; used for secrets that must never reach argv
+void engine_job_set_stdin(EngineJob *job, GBytes *input);
+
+// Thread-safe; call from any thread, the update is batched
+void engine_job_report(EngineJob *job, double fraction, const char *status);
+
+void engine_job_run_async(EngineJob *job,
+                          GCancellable *cancellable,
+                          GAsyncReadyCallback callback,
+                          gpointer user_data);
+gboolean engine_job_run_finish(EngineJob *job, GAsyncResult *result, GError **error);
+
+// Blocking variant, only for use from a worker thread
+gboolean engine_job_run(EngineJob *job, GCancellable *cancellable, GError **error);
+
+// Blocking, from a worker thread: job runs as part of parent, and its
+// progress reports become parent's
+gboolean engine_job_run_nested(EngineJob *job, EngineJob *parent,
+                               GCancellable *cancellable, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(EngineJob, engine_job_unref)
+
+#endif // RARCH_ENGINE_H
@@ -0,0 +1,476 @@
+// File   : fstab.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// In-process fstab/crypttab generation. See fstab.h.
+//
+// genfstab runs findmnt and blkid once per mount; here the mount table is
+// read once from /proc/self/mountinfo and every device is probed on its own
+// thread, so the step costs about as long as the slowest single probe.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <blkid.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disks.h"
+#include "fstab.h"
+#include "log.h"
+
+#define SYS_CLASS_BLOCK "/sys/class/block"
+
+typedef struct {
+    char *source;           // device as mounted, e.g. /dev/sda2 or /dev/mapper/root
+    char *target;           // mount point inside the installed system
+    char *fstype;           // from the mount table
+    char *subvol;           // btrfs subvolume, NULL for everything else
+    gboolean swap;
+
+    // Filled in by the probe
+    char *uuid;
+    char *type;
+    gboolean rotational;
+    char *crypt_name;       // dm-crypt mapping, NULL when not encrypted
+    char *crypt_uuid;       // the LUKS container underneath
+    GError *error;
+} FstabEntry;
+
+static void fstab_entry_free(gpointer data) {
+    FstabEntry *entry = data;
+
+    g_free(entry->source);
+    g_free(entry->target);
+    g_free(entry->fstype);
+    g_free(entry->subvol);
+    g_free(entry->uuid);
+    g_free(entry->type);
+    g_free(entry->crypt_name);
+    g_free(entry->crypt_uuid);
+    g_clear_error(&entry->error);
+    g_free(entry);
+}
+
+// The mount table escapes space, tab, newline and backslash as \ooo
+static char* unescape_octal(const char *text) {
+    GString *result = g_string_sized_new(strlen(text));
+
+    for (const char *p = text; *p != '\0'; p++) {
+        if (p[0] == '\\' && g_ascii_isdigit(p[1]) && g_ascii_isdigit(p[2]) && g_ascii_isdigit(p[3])) {
+            g_string_append_c(result, (char) ((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0')));
+            p += 3;
+        } else {
+            g_string_append_c(result, *p);
+        }
+    }
+
+    return g_string_free(result, FALSE);
+}
+
+// fstab needs the same escaping for paths with spaces
+static void append_escaped(GString *out, const char *text) {
+    for (const char *p = text; *p != '\0'; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\\')
+            g_string_append_printf(out, "\\%03o", (guchar) *p);
+        else
+            g_string_append_c(out, *p);
+    }
+}
+
+static char* read_sys(const char *name, const char *attribute) {
+    g_autofree char *path = g_build_filename(SYS_CLASS_BLOCK, name, attribute, NULL);
+    char *contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return NULL;
+
+    return g_strstrip(contents);
+}
+
+// "sda2" -> "sda"; whole disks and anything unknown map to themselves
+static char* parent_disk(const char *name) {
+    g_autofree char *link = g_build_filename(SYS_CLASS_BLOCK, name, NULL);
+    g_autofree char *partition = g_build_filename(link, "partition", NULL);
+    g_autofree char *real = NULL;
+    g_autofree char *parent = NULL;
+
+    if (!g_file_test(partition, G_FILE_TEST_EXISTS))
+        return g_strdup(name);
+
+    real = realpath(link, NULL);
+    if (real == NULL)
+        return g_strdup(name);
+
+    parent = g_path_get_dirname(real);
+    return g_path_get_basename(parent);
+}
+
+// "/dev/mapper/root" -> "dm-0"
+static char* kernel_name(const char *device) {
+    g_autofree char *real = realpath(device, NULL);
+
+    return g_path_get_basename(real != NULL ? real : device);
+}
+
+// The first device a dm target sits on
+static char* dm_slave(const char *name) {
+    g_autofree char *path = g_build_filename(SYS_CLASS_BLOCK, name, "slaves", NULL);
+    GDir *dir = g_dir_open(path, 0, NULL);
+    char *slave = NULL;
+
+    if (dir != NULL) {
+        const char *entry = g_dir_read_name(dir);
+        slave = g_strdup(entry);
+        g_dir_close(dir);
+    }
+
+    return slave;
+}
+
+static gboolean probe_device(const char *device, char **uuid, char **type, GError **error) {
+    blkid_probe probe = blkid_new_probe_from_filename(device);
+    const char *value;
+    int result;
+
+    if (probe == NULL) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not probe %s: %s", device, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    blkid_probe_enable_superblocks(probe, 1);
+    blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_UUID | BLKID_SUBLKS_TYPE);
+    result = blkid_do_safeprobe(probe);
+
+    if (result == 0 && blkid_probe_lookup_value(probe, "UUID", &value, NULL) == 0)
+        *uuid = g_strdup(value);
+    if (result == 0 && type != NULL && blkid_probe_lookup_value(probe, "TYPE", &value, NULL) == 0)
+        *type = g_strdup(value);
+
+    blkid_free_probe(probe);
+
+    if (result != 0 || *uuid == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                    result == -2 ? "%s carries more than one file system signature"
+                                 : "No file system UUID found on %s", device);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Runs on a pool thread, one per device
+static void probe_entry(gpointer data, gpointer user_data) {
+    FstabEntry *entry = data;
+    g_autofree char *name = kernel_name(entry->source);
+    g_autofree char *media = NULL;
+    g_autofree char *dm_uuid = read_sys(name, "dm/uuid");
+    g_autofree char *disk = NULL;
+    g_autoptr(DiskInfo) info = NULL;
+
+    // dm-crypt maps report "CRYPT-LUKS2-<uuid>-<name>"; the media is the device below
+    if (dm_uuid != NULL && g_str_has_prefix(dm_uuid, "CRYPT-")) {
+        g_autofree char *slave = dm_slave(name);
+
+        entry->crypt_name = read_sys(name, "dm/name");
+        if (slave == NULL) {
+            g_set_error(&entry->error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                        "No device found below the encrypted %s", entry->source);
+            return;
+        }
+
+        g_autofree char *slave_device = g_build_filename("/dev", slave, NULL);
+        if (!probe_device(slave_device, &entry->crypt_uuid, NULL, &entry->error))
+            return;
+        media = g_steal_pointer(&slave);
+    }
+
+    if (!probe_device(entry->source, &entry->uuid, &entry->type, &entry->error))
+        return;
+
+    // Unknown media is treated as rotational, which only leaves options out
+    disk = parent_disk(media != NULL ? media : name);
+    info = disk_info_probe(disk, TRUE);
+    entry->rotational = info == NULL || info->rotational;
+}
+
+static GPtrArray* collect_mounts(const char *root, GError **error) {
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    g_autoptr(GHashTable) by_target = g_hash_table_new(g_str_hash, g_str_equal);
+    GPtrArray *entries = g_ptr_array_new_with_free_func(fstab_entry_free);
+    gsize root_len = strlen(root);
+
+    if (!g_file_get_contents("/proc/self/mountinfo", &contents, NULL, error)) {
+        g_ptr_array_unref(entries);
+        return NULL;
+    }
+
+    // "36 35 98:0 /root /mnt/point rw,noatime shared:1 - ext4 /dev/sda2 rw"
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = g_strsplit(lines[i], " ", -1);
+        g_autofree char *mountpoint = NULL;
+        guint n_fields = g_strv_length(fields);
+        guint separator = 6;
+
+        while (separator < n_fields && strcmp(fields[separator], "-") != 0)
+            separator++;
+        if (separator + 2 >= n_fields)
+            continue;
+
+        mountpoint = unescape_octal(fields[4]);
+        if (strncmp(mountpoint, root, root_len) != 0 ||
+            (mountpoint[root_len] != '\0' && mountpoint[root_len] != '/'))
+            continue;
+
+        // Bind mounts (arch-chroot's resolv.conf among them) show a root below
+        // the file system's own; only btrfs subvolumes are mounted that way on purpose
+        if (strcmp(fields[3], "/") != 0 && strcmp(fields[separator + 1], "btrfs") != 0) {
+            debug_log("fstab: skipping bind mount %s", mountpoint);
+            continue;
+        }
+
+        // Only block devices belong in fstab; API file systems are left to systemd
+        if (!g_str_has_prefix(fields[separator + 2], "/dev/"))
+            continue;
+
+        FstabEntry *entry = g_new0(FstabEntry, 1);
+        entry->source = unescape_octal(fields[separator + 2]);
+        entry->target = g_strdup(mountpoint[root_len] != '\0' ? mountpoint + root_len : "/");
+        entry->fstype = g_strdup(fields[separator + 1]);
+        if (strcmp(entry->fstype, "btrfs") == 0 && strcmp(fields[3], "/") != 0)
+            entry->subvol = unescape_octal(fields[3]);
+
+        // Mounted over: the later mount is the one that is visible
+        FstabEntry *hidden = g_hash_table_lookup(by_target, entry->target);
+        if (hidden != NULL) {
+            g_hash_table_remove(by_target, entry->target);
+            g_ptr_array_remove(entries, hidden);
+        }
+
+        g_ptr_array_add(entries, entry);
+        g_hash_table_insert(by_target, entry->target, entry);
+    }
+
+    return entries;
+}
+
+// Active swap partitions on a disk that also holds a target file system
+static void collect_swaps(GPtrArray *entries) {
+    g_autoptr(GHashTable) disks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+
+    for (guint i = 0; i < entries->len; i++) {
+        FstabEntry *entry = g_ptr_array_index(entries, i);
+        g_autofree char *name = kernel_name(entry->source);
+
+        g_hash_table_add(disks, parent_disk(name));
+    }
+
+    if (!g_file_get_contents("/proc/swaps", &contents, NULL, NULL))
+        return;
+
+    // "Filename  Type  Size  Used  Priority", header first
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 1; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = g_strsplit_set(lines[i], " \t", -1);
+        g_autofree char *device = NULL;
+        g_autofree char *name = NULL;
+        g_autofree char *disk = NULL;
+
+        if (fields[0] == NULL || !g_str_has_prefix(fields[0], "/dev/"))
+            continue;
+
+        device = unescape_octal(fields[0]);
+        name = kernel_name(device);
+        disk = parent_disk(name);
+        if (!g_hash_table_contains(disks, disk))
+            continue;
+
+        FstabEntry *entry = g_new0(FstabEntry, 1);
+        entry->source = g_steal_pointer(&device);
+        entry->target = g_strdup("none");
+        entry->fstype = g_strdup("swap");
+        entry->swap = TRUE;
+        g_ptr_array_add(entries, entry);
+    }
+}
+
+// Swaps last; everything else by mount point, which puts parents first
+static gint compare_entries(gconstpointer a, gconstpointer b) {
+    const FstabEntry *entry_a = *(FstabEntry * const *) a;
+    const FstabEntry *entry_b = *(FstabEntry * const *) b;
+
+    if (entry_a->swap != entry_b->swap)
+        return entry_a->swap ? 1 : -1;
+    if (entry_a->swap)
+        return g_strcmp0(entry_a->uuid, entry_b->uuid);
+
+    return strcmp(entry_a->target, entry_b->target);
+}
+
+static void append_options(GString *out, const FstabEntry *entry, const char *type) {
+    gboolean ssd = !entry->rotational;
+
+    if (entry->swap) {
+        g_string_append(out, ssd ? "defaults,discard" : "defaults");
+        return;
+    }
+
+    g_string_append(out, ssd ? "rw,noatime" : "rw,relatime");
+
+    if (strcmp(type, "vfat") == 0) {
+        // The ESP holds boot loaders and keys; keep it private to root
+        g_string_append(out, ",fmask=0077,dmask=0077");
+    } else if (strcmp(type, "btrfs") == 0) {
+        if (ssd)
+            g_string_append(out, ",ssd,discard=async");
+        if (entry->subvol != NULL) {
+            g_string_append(out, ",subvol=");
+            append_escaped(out, entry->subvol);
+        }
+    } else if (ssd && (strcmp(type, "ext4") == 0 || strcmp(type, "xfs") == 0 ||
+                       strcmp(type, "f2fs") == 0)) {
+        g_string_append(out, ",discard");
+    }
+}
+
+static void append_fstab_line(GString *fstab, const FstabEntry *entry) {
+    const char *type = entry->type != NULL ? entry->type : entry->fstype;
+    int pass;
+
+    // btrfs and xfs have no boot-time check; fsck.* for them does nothing
+    if (entry->swap || strcmp(type, "btrfs") == 0 || strcmp(type, "xfs") == 0)
+        pass = 0;
+    else
+        pass = strcmp(entry->target, "/") == 0 ? 1 : 2;
+
+    g_string_append_printf(fstab, "UUID=%s\t", entry->uuid);
+    append_escaped(fstab, entry->target);
+    g_string_append_printf(fstab, "\t%s\t", type);
+    append_options(fstab, entry, type);
+    g_string_append_printf(fstab, "\t0 %d\n", pass);
+}
+
+static gboolean write_file(const char *root, const char *relative, GString *contents, GError **error) {
+    g_autofree char *path = g_build_filename(root, relative, NULL);
+
+    return g_file_set_contents_full(path, contents->str, contents->len,
+                                    G_FILE_SET_CONTENTS_CONSISTENT | G_FILE_SET_CONTENTS_DURABLE,
+                                    0644, error);
+}
+
+static gboolean generate_fstab(EngineJob *job, gpointer user_data,
+                               GCancellable *cancellable, GError **error) {
+    const char *root = user_data;
+    g_autoptr(GPtrArray) entries = collect_mounts(root, error);
+    g_autoptr(GString) fstab = NULL;
+    g_autoptr(GString) crypttab = NULL;
+    gboolean encrypted = FALSE;
+    GThreadPool *pool;
+
+    if (entries == NULL)
+        return FALSE;
+    if (entries->len == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Nothing is mounted at %s", root);
+        return FALSE;
+    }
+
+    collect_swaps(entries);
+    engine_job_report(job, 0.0, "Probing file systems");
+
+    pool = g_thread_pool_new(probe_entry, NULL, entries->len, FALSE, NULL);
+    for (guint i = 0; i < entries->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(entries, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    if (g_cancellable_set_error_if_cancelled(cancellable, error))
+        return FALSE;
+
+    g_ptr_array_sort(entries, compare_entries);
+
+    fstab = g_string_new("# Static information about the filesystems.\n"
+                         "# See fstab(5) for details.\n\n"
+                         "# <file system>\t<dir>\t<type>\t<options>\t<dump>\t<pass>\n");
+    crypttab = g_string_new("# Configuration for encrypted block devices.\n"
+                            "# See crypttab(5) for details.\n\n"
+                            "# <name>\t<device>\t<password>\t<options>\n");
+
+    for (guint i = 0; i < entries->len; i++) {
+        FstabEntry *entry = g_ptr_array_index(entries, i);
+
+        if (entry->error != NULL) {
+            g_propagate_error(error, g_steal_pointer(&entry->error));
+            return FALSE;
+        }
+
+        debug_log("fstab: %s on %s (%s, UUID %s, %s)", entry->source, entry->target,
+                  entry->type != NULL ? entry->type : entry->fstype, entry->uuid,
+                  entry->rotational ? "rotational" : "non-rotational");
+        append_fstab_line(fstab, entry);
+
+        if (entry->crypt_name != NULL) {
+            encrypted = TRUE;
+            g_string_append_printf(crypttab, "%s\tUUID=%s\tnone\tluks%s\n", entry->crypt_name,
+                                   entry->crypt_uuid, entry->rotational ? "" : ",discard");
+        }
+    }
+
+    if (!write_file(root, "etc/fstab", fstab, error))
+        return FALSE;
+
+    // The default crypttab is only comments; leave it alone when nothing is encrypted
+    if (encrypted && !write_file(root, "etc/crypttab", crypttab, error))
+        return FALSE;
+
+    engine_job_report(job, 1.0, NULL);
+    return TRUE;
+}
+
+char* fstab_root_options(const char *root, GError **error) {
+    g_autoptr(GPtrArray) entries = collect_mounts(root, error);
+    FstabEntry *entry = NULL;
+    GString *options;
+
+    if (entries == NULL)
+        return NULL;
+
+    for (guint i = 0; i < entries->len && entry == NULL; i++) {
+        if (strcmp(((FstabEntry *) g_ptr_array_index(entries, i))->target, "/") == 0)
+            entry = g_ptr_array_index(entries, i);
+    }
+    if (entry == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Nothing is mounted at %s", root);
+        return NULL;
+    }
+
+    probe_entry(entry, NULL);
+    if (entry->error != NULL) {
+        g_propagate_error(error, g_steal_pointer(&entry->error));
+        return NULL;
+    }
+
+    options = g_string_new(NULL);
+
+    // sd-encrypt, in mkinitcpio's default hooks, opens the container by UUID
+    if (entry->crypt_name != NULL)
+        g_string_append_printf(options, "rd.luks.name=%s=%s ",
+                               entry->crypt_uuid, entry->crypt_name);
+    g_string_append_printf(options, "root=UUID=%s", entry->uuid);
+    if (entry->subvol != NULL) {
+        g_string_append(options, " rootflags=subvol=");
+        append_escaped(options, entry->subvol);
+    }
+    g_string_append(options, " rw");
+
+    return g_string_free(options, FALSE);
+}
+
+EngineJob* fstab_job_new(const char *name, const char *root) {
+    return engine_job_new_func(name, generate_fstab, g_strdup(root), g_free);
+}
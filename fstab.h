@@ -0,0 +1,28 @@
+// File   : fstab.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// In-process replacement for genfstab. Every file system mounted under the
+// target root (and every active swap on the same disks) is probed with
+// libblkid, all devices at once, and written out by UUID with mount options
+// chosen per file system and media type. dm-crypt devices also get their
+// crypttab line. Output is sorted, so the same layout always produces the
+// same files.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_FSTAB_H
+#define RARCH_FSTAB_H
+
+#include "engine.h"
+
+// Writes root/etc/fstab and, when anything is encrypted, root/etc/crypttab.
+// Both are replaced atomically.
+EngineJob* fstab_job_new(const char *name, const char *root);
+
+// Kernel command line options that find the file system mounted at root
+// by its probed UUID (with its subvolume and LUKS container, if any)
+char* fstab_root_options(const char *root, GError **error);
+
+#endif // RARCH_FSTAB_H
@@ -0,0 +1,16 @@
+// File   : headless.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Entry point of Rarch_Installer_headless, which links only the core and
+// GIO. Meant for minimal live images (PXE, imaging lines) that have no
+// display server; see cli.h.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include "cli.h"
+
+int main(int argc, char *argv[]) {
+    return cli_main(argc, argv);
+}
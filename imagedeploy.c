@@ -0,0 +1,629 @@
+// File   : imagedeploy.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Image deploy. See imagedeploy.h.
+//
+// A raw image is copied by two threads: a reader filling IMAGE_BUFFERS
+// aligned chunks (skipping the holes of a sparse image file with SEEK_DATA)
+// and the job's own thread writing them out with O_DIRECT, so reading the
+// next chunk overlaps writing the last. Runs of zero blocks are merged and
+// handed to the device as one BLKZEROOUT each, which the kernel turns into
+// discards or hole punches where the device can do that.
+//
+// When several targets deploy the same image at once, a raw image is read
+// through the page cache instead, so only the first reader of each chunk
+// touches the disk, and a squashfs image is loop-mounted once and copied
+// from: the kernel decompresses every block a single time into the page
+// cache and all targets copy from there, where N unsquashfs runs would each
+// decompress the whole image on every core.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#define _GNU_SOURCE
+
+#include <blkid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "imagedeploy.h"
+#include "log.h"
+#include "treecopy.h"
+
+#define IMAGE_BUFFERS       4
+#define SQUASHFS_MAGIC      "hsqs"
+
+// Shares of the job's progress: the image itself, then growing, then /boot
+#define IMAGE_WRITE_SHARE   0.85
+#define IMAGE_GROW_SHARE    0.90
+
+typedef struct {
+    char *image;
+    char *root_device;
+    char *esp_device;
+    gboolean shared;
+} ImageDeploy;
+
+// A squashfs image mounted for every target deploying it
+typedef struct {
+    char *dir;
+    guint users;
+} SharedImage;
+
+static GMutex shared_lock;
+static GHashTable *shared_images;   // image path -> SharedImage*
+
+typedef struct {
+    guchar *buffer;         // NULL for a hole; a zero length ends the image
+    guint64 offset;
+    gsize length;           // a multiple of IMAGE_BLOCK_SIZE
+} ImageChunk;
+
+typedef struct {
+    int fd;
+    guint64 size;           // rounded up to IMAGE_BLOCK_SIZE
+    GAsyncQueue *free_buffers;
+    GAsyncQueue *chunks;    // ImageChunk*, in offset order
+    gint stop;              // set by the writer after a failure
+    int read_errno;         // non-zero when reading failed
+} ImageReader;
+
+typedef struct {
+    int fd;
+    guint64 zero_start;     // zeros not yet passed to the device
+    guint64 zero_length;
+    guint64 written;
+} ImageWriter;
+
+static guint64 round_up(guint64 value) {
+    return (value + IMAGE_BLOCK_SIZE - 1) & ~(guint64) (IMAGE_BLOCK_SIZE - 1);
+}
+
+ImageFormat image_detect_format(const char *path) {
+    char magic[4] = { 0 };
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0)
+        return IMAGE_RAW;
+
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic))
+        memset(magic, 0, sizeof(magic));
+    close(fd);
+
+    return memcmp(magic, SQUASHFS_MAGIC, sizeof(magic)) == 0 ? IMAGE_SQUASHFS : IMAGE_RAW;
+}
+
+static char* probe_fs_type(const char *path) {
+    blkid_probe probe = blkid_new_probe_from_filename(path);
+    const char *value;
+    char *type = NULL;
+
+    if (probe == NULL)
+        return NULL;
+
+    blkid_probe_enable_superblocks(probe, 1);
+    blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
+    if (blkid_do_safeprobe(probe) == 0 && blkid_probe_lookup_value(probe, "TYPE", &value, NULL) == 0)
+        type = g_strdup(value);
+
+    blkid_free_probe(probe);
+    return type;
+}
+
+// ext* grows unmounted, btrfs and xfs only while mounted
+static gboolean fs_grows_offline(const char *type) {
+    return g_strcmp0(type, "ext2") == 0 || g_strcmp0(type, "ext3") == 0 ||
+           g_strcmp0(type, "ext4") == 0;
+}
+
+static gboolean fs_can_grow(const char *type) {
+    return fs_grows_offline(type) || g_strcmp0(type, "btrfs") == 0 || g_strcmp0(type, "xfs") == 0;
+}
+
+// Fills length bytes at offset; whatever lies past the end of the file reads as zeros
+static gboolean read_full(int fd, guchar *buffer, gsize length, guint64 offset) {
+    gsize done = 0;
+
+    while (done < length) {
+        ssize_t n = pread(fd, buffer + done, length - done, offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return FALSE;
+        if (n == 0)
+            break;
+
+        done += n;
+    }
+
+    memset(buffer + done, 0, length - done);
+    return TRUE;
+}
+
+static gpointer read_image(gpointer data) {
+    ImageReader *reader = data;
+    guint64 offset = 0;
+
+    while (offset < reader->size && !g_atomic_int_get(&reader->stop)) {
+        ImageChunk *chunk = g_new0(ImageChunk, 1);
+        off_t next = lseek(reader->fd, offset, SEEK_DATA);
+
+        // ENXIO: nothing but a hole up to the end. Other errors: no SEEK_DATA, read it all.
+        if (next < 0)
+            next = errno == ENXIO ? (off_t) reader->size : (off_t) offset;
+        next = MIN((guint64) next & ~(guint64) (IMAGE_BLOCK_SIZE - 1), reader->size);
+
+        chunk->offset = offset;
+        if ((guint64) next > offset) {
+            chunk->length = next - offset;
+        } else {
+            chunk->buffer = g_async_queue_pop(reader->free_buffers);
+            chunk->length = MIN(IMAGE_CHUNK_SIZE, reader->size - offset);
+
+            if (!read_full(reader->fd, chunk->buffer, chunk->length, offset)) {
+                reader->read_errno = errno;
+                g_async_queue_push(reader->free_buffers, chunk->buffer);
+                g_free(chunk);
+                break;
+            }
+        }
+
+        offset += chunk->length;
+        g_async_queue_push(reader->chunks, chunk);
+    }
+
+    g_async_queue_push(reader->chunks, g_new0(ImageChunk, 1));
+    return NULL;
+}
+
+static gboolean block_is_zero(const guchar *block) {
+    const guint64 *words = (const guint64 *) block;
+
+    for (gsize i = 0; i < IMAGE_BLOCK_SIZE / sizeof(guint64); i++) {
+        if (words[i] != 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean flush_zeros(ImageWriter *writer) {
+    guint64 range[2] = { writer->zero_start, writer->zero_length };
+
+    if (writer->zero_length == 0)
+        return TRUE;
+
+    writer->zero_length = 0;
+    return ioctl(writer->fd, BLKZEROOUT, range) == 0;
+}
+
+static gboolean add_zeros(ImageWriter *writer, guint64 offset, guint64 length) {
+    if (writer->zero_length > 0 && writer->zero_start + writer->zero_length == offset) {
+        writer->zero_length += length;
+        return TRUE;
+    }
+
+    if (!flush_zeros(writer))
+        return FALSE;
+
+    writer->zero_start = offset;
+    writer->zero_length = length;
+    return TRUE;
+}
+
+static gboolean write_data(ImageWriter *writer, const guchar *data, gsize length, guint64 offset) {
+    if (!flush_zeros(writer))
+        return FALSE;
+
+    while (length > 0) {
+        ssize_t n = pwrite(writer->fd, data, length, offset);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return FALSE;
+
+        data += n;
+        length -= n;
+        offset += n;
+        writer->written += n;
+    }
+
+    return TRUE;
+}
+
+// Splits the chunk into runs of data blocks and zero blocks
+static gboolean write_chunk(ImageWriter *writer, const ImageChunk *chunk) {
+    if (chunk->buffer == NULL)
+        return add_zeros(writer, chunk->offset, chunk->length);
+
+    for (gsize pos = 0; pos < chunk->length;) {
+        gboolean zero = block_is_zero(chunk->buffer + pos);
+        gsize end = pos + IMAGE_BLOCK_SIZE;
+
+        while (end < chunk->length && block_is_zero(chunk->buffer + end) == zero)
+            end += IMAGE_BLOCK_SIZE;
+
+        if (zero ? !add_zeros(writer, chunk->offset + pos, end - pos)
+                 : !write_data(writer, chunk->buffer + pos, end - pos, chunk->offset + pos))
+            return FALSE;
+
+        pos = end;
+    }
+
+    return TRUE;
+}
+
+static gboolean write_raw_image(EngineJob *job, ImageDeploy *deploy,
+                                GCancellable *cancellable, GError **error) {
+    ImageReader reader = { .fd = -1 };
+    ImageWriter writer = { .fd = -1 };
+    guchar *buffers[IMAGE_BUFFERS] = { NULL };
+    GThread *thread = NULL;
+    g_autofree char *total = NULL;
+    guint64 device_size = 0;
+    gboolean failed = FALSE;
+    struct stat st;
+
+    // The page cache is bypassed both ways; an image on a file system that
+    // can't do that (tmpfs, overlayfs) is read normally, and so is one the
+    // other targets are reading too
+    reader.fd = deploy->shared ? -1 : open(deploy->image, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (deploy->shared || (reader.fd < 0 && errno == EINVAL)) {
+        reader.fd = open(deploy->image, O_RDONLY | O_CLOEXEC);
+        if (reader.fd >= 0)
+            posix_fadvise(reader.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (reader.fd < 0 || fstat(reader.fd, &st) != 0) {
+        failed = !tree_copy_set_errno_error(error, "Could not open", deploy->image);
+        goto out;
+    }
+    reader.size = round_up(st.st_size);
+
+    // O_EXCL fails while anything has the partition mounted
+    writer.fd = open(deploy->root_device, O_WRONLY | O_DIRECT | O_EXCL | O_CLOEXEC);
+    if (writer.fd < 0 || ioctl(writer.fd, BLKGETSIZE64, &device_size) != 0) {
+        failed = !tree_copy_set_errno_error(error, "Could not open", deploy->root_device);
+        goto out;
+    }
+
+    total = g_format_size(st.st_size);
+    if (reader.size > device_size) {
+        g_autofree char *room = g_format_size(device_size);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "The image (%s) does not fit on %s (%s)", total, deploy->root_device, room);
+        failed = TRUE;
+        goto out;
+    }
+
+    reader.free_buffers = g_async_queue_new();
+    reader.chunks = g_async_queue_new();
+    for (guint i = 0; i < IMAGE_BUFFERS; i++) {
+        buffers[i] = g_aligned_alloc(1, IMAGE_CHUNK_SIZE, IMAGE_BLOCK_SIZE);
+        g_async_queue_push(reader.free_buffers, buffers[i]);
+    }
+
+    debug_log("Image: writing %s (%s) to %s", deploy->image, total, deploy->root_device);
+    thread = g_thread_new("image-reader", read_image, &reader);
+
+    // Every chunk is taken off the queue, also after a failure, so the reader always finishes
+    for (;;) {
+        ImageChunk *chunk = g_async_queue_pop(reader.chunks);
+
+        if (chunk->length == 0) {
+            g_free(chunk);
+            break;
+        }
+
+        if (!failed && g_cancellable_set_error_if_cancelled(cancellable, error))
+            failed = TRUE;
+        else if (!failed && !write_chunk(&writer, chunk))
+            failed = !tree_copy_set_errno_error(error, "Could not write", deploy->root_device);
+
+        if (failed) {
+            g_atomic_int_set(&reader.stop, 1);
+        } else {
+            g_autofree char *done = g_format_size(MIN(chunk->offset + chunk->length,
+                                                      (guint64) st.st_size));
+            g_autofree char *status = g_strdup_printf("Writing image: %s of %s", done, total);
+
+            engine_job_report(job, IMAGE_WRITE_SHARE * (chunk->offset + chunk->length) / reader.size,
+                              status);
+        }
+
+        if (chunk->buffer != NULL)
+            g_async_queue_push(reader.free_buffers, chunk->buffer);
+        g_free(chunk);
+    }
+
+    g_thread_join(thread);
+
+    if (!failed && reader.read_errno != 0) {
+        errno = reader.read_errno;
+        failed = !tree_copy_set_errno_error(error, "Could not read", deploy->image);
+    }
+
+    // O_DIRECT skips the page cache, not the device's own write cache
+    if (!failed && (!flush_zeros(&writer) || fsync(writer.fd) != 0))
+        failed = !tree_copy_set_errno_error(error, "Could not write", deploy->root_device);
+
+    if (!failed) {
+        g_autofree char *written = g_format_size(writer.written);
+        debug_log("Image: %s of %s written, the rest was zeros", written, total);
+    }
+
+out:
+    for (guint i = 0; i < IMAGE_BUFFERS; i++)
+        g_aligned_free(buffers[i]);
+    g_clear_pointer(&reader.free_buffers, g_async_queue_unref);
+    g_clear_pointer(&reader.chunks, g_async_queue_unref);
+    if (reader.fd >= 0)
+        close(reader.fd);
+    if (writer.fd >= 0)
+        close(writer.fd);
+
+    return !failed;
+}
+
+static gboolean run_tool(const char * const *argv, GCancellable *cancellable, GError **error) {
+    g_autoptr(EngineJob) command = engine_job_new_command(argv[0], argv);
+
+    return engine_job_run(command, cancellable, error);
+}
+
+// A raw image carries its own file system UUID, which every machine (and
+// every disk deployed side by side) would otherwise share
+static gboolean new_fs_uuid(const char *type, const char *device,
+                            GCancellable *cancellable, GError **error) {
+    const char *ext_argv[] = { "tune2fs", "-U", "random", device, NULL };
+    const char *xfs_argv[] = { "xfs_admin", "-U", "generate", device, NULL };
+    const char *btrfs_argv[] = { "btrfstune", "-f", "-u", device, NULL };   // -f: no prompt
+
+    if (fs_grows_offline(type))
+        return run_tool(ext_argv, cancellable, error);
+    if (g_strcmp0(type, "xfs") == 0)
+        return run_tool(xfs_argv, cancellable, error);
+    return run_tool(btrfs_argv, cancellable, error);
+}
+
+// Unmounting happens whatever became of the job, so it is never cancelled
+static gboolean unmount_dir(const char *dir, GError **error) {
+    const char *argv[] = { "umount", dir, NULL };
+
+    return run_tool(argv, NULL, error);
+}
+
+// unsquashfs -percentage prints nothing but the percentage done, one per line
+static void forward_unsquashfs_line(EngineJob *command, const char *line,
+                                    gboolean is_stderr, gpointer user_data) {
+    EngineJob *job = user_data;
+    char *end = NULL;
+    guint64 percent = g_ascii_strtoull(line, &end, 10);
+
+    if (end != line && *end == '\0' && percent <= 100)
+        engine_job_report(job, IMAGE_WRITE_SHARE * percent / 100.0, "Extracting image");
+}
+
+static gboolean extract_squashfs(EngineJob *job, ImageDeploy *deploy, const char *dest,
+                                 GCancellable *cancellable, GError **error) {
+    g_autofree char *processors = g_strdup_printf("%u", MAX(g_get_num_processors(), 1));
+    const char *argv[] = {
+        "unsquashfs", "-f", "-d", dest, "-processors", processors, "-percentage",
+        deploy->image, NULL
+    };
+    g_autoptr(EngineJob) command = engine_job_new_command("unsquashfs", argv);
+
+    debug_log("Image: extracting %s on %s threads", deploy->image, processors);
+    engine_job_set_line_func(command, forward_unsquashfs_line, job);
+
+    return engine_job_run(command, cancellable, error);
+}
+
+// Mounted on first use, unmounted when the last target is done with it
+static char* acquire_shared_image(const char *image, GCancellable *cancellable, GError **error) {
+    SharedImage *shared;
+    char *dir = NULL;
+
+    g_mutex_lock(&shared_lock);
+    if (shared_images == NULL)
+        shared_images = g_hash_table_new(g_str_hash, g_str_equal);
+
+    shared = g_hash_table_lookup(shared_images, image);
+    if (shared == NULL) {
+        g_autofree char *mount_dir = g_dir_make_tmp("rarch-squashfs-XXXXXX", error);
+        const char *argv[] = { "mount", "-t", "squashfs", "-o", "loop,ro", image, mount_dir, NULL };
+
+        if (mount_dir == NULL)
+            goto out;
+        if (!run_tool(argv, cancellable, error)) {
+            g_rmdir(mount_dir);
+            goto out;
+        }
+
+        debug_log("Image: %s mounted at %s for every target", image, mount_dir);
+        shared = g_new0(SharedImage, 1);
+        shared->dir = g_steal_pointer(&mount_dir);
+        g_hash_table_insert(shared_images, g_strdup(image), shared);
+    }
+
+    shared->users++;
+    dir = g_strdup(shared->dir);
+
+out:
+    g_mutex_unlock(&shared_lock);
+    return dir;
+}
+
+static void release_shared_image(const char *image) {
+    gpointer key;
+    SharedImage *shared;
+
+    g_mutex_lock(&shared_lock);
+    if (g_hash_table_lookup_extended(shared_images, image, &key, (gpointer *) &shared) &&
+        --shared->users == 0) {
+        g_hash_table_remove(shared_images, image);
+        unmount_dir(shared->dir, NULL);
+        g_rmdir(shared->dir);
+        g_free(shared->dir);
+        g_free(shared);
+        g_free(key);
+    }
+    g_mutex_unlock(&shared_lock);
+}
+
+static gboolean copy_shared_squashfs(EngineJob *job, ImageDeploy *deploy, const char *dest,
+                                     GCancellable *cancellable, GError **error) {
+    g_autofree char *source = acquire_shared_image(deploy->image, cancellable, error);
+    TreeCopyStats stats;
+    gboolean success;
+
+    if (source == NULL)
+        return FALSE;
+
+    // tree_copy has no running total to report
+    engine_job_report(job, -1.0, "Copying image");
+    success = tree_copy(source, dest, 0, &stats, cancellable, error);
+    release_shared_image(deploy->image);
+
+    if (success) {
+        g_autofree char *size = g_format_size(stats.bytes);
+        debug_log("Image: copied %" G_GUINT64_FORMAT " files (%s) to %s",
+                  stats.files, size, deploy->root_device);
+    }
+
+    return success;
+}
+
+static gboolean deploy_image(EngineJob *job, gpointer user_data,
+                             GCancellable *cancellable, GError **error) {
+    ImageDeploy *deploy = user_data;
+    ImageFormat format = image_detect_format(deploy->image);
+    g_autofree char *type = NULL;
+    g_autofree char *root_dir = NULL;
+    g_autofree char *esp_dir = NULL;
+    g_autofree char *boot = NULL;
+    gboolean root_mounted = FALSE;
+    gboolean esp_mounted = FALSE;
+    gboolean success = FALSE;
+    TreeCopyStats stats;
+
+    if (format == IMAGE_RAW) {
+        // Checked first: nothing is written for an image that couldn't fill the partition
+        type = probe_fs_type(deploy->image);
+        if (type == NULL || !fs_can_grow(type)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "%s is neither squashfs nor an ext4, btrfs or xfs image",
+                        deploy->image);
+            return FALSE;
+        }
+
+        if (!write_raw_image(job, deploy, cancellable, error))
+            return FALSE;
+
+        if (fs_grows_offline(type)) {
+            // resize2fs and tune2fs -U insist on a freshly checked file system
+            const char *check_argv[] = { "e2fsck", "-f", "-y", deploy->root_device, NULL };
+            const char *grow_argv[] = { "resize2fs", deploy->root_device, NULL };
+
+            engine_job_report(job, IMAGE_WRITE_SHARE, "Growing the file system");
+            if (!run_tool(check_argv, cancellable, error) ||
+                !new_fs_uuid(type, deploy->root_device, cancellable, error) ||
+                !run_tool(grow_argv, cancellable, error))
+                return FALSE;
+        } else {
+            // Before the first mount: xfs refuses a second file system with
+            // the same UUID, btrfs mixes up devices that share an fsid
+            engine_job_report(job, IMAGE_WRITE_SHARE, "Setting a new file system UUID");
+            if (!new_fs_uuid(type, deploy->root_device, cancellable, error))
+                return FALSE;
+        }
+    }
+
+    root_dir = g_dir_make_tmp("rarch-image-XXXXXX", error);
+    esp_dir = root_dir != NULL ? g_dir_make_tmp("rarch-esp-XXXXXX", error) : NULL;
+    if (esp_dir == NULL)
+        goto out;
+
+    const char *root_argv[] = { "mount", deploy->root_device, root_dir, NULL };
+    if (!run_tool(root_argv, cancellable, error))
+        goto out;
+    root_mounted = TRUE;
+
+    if (format == IMAGE_SQUASHFS && deploy->shared) {
+        if (!copy_shared_squashfs(job, deploy, root_dir, cancellable, error))
+            goto out;
+    } else if (format == IMAGE_SQUASHFS) {
+        if (!extract_squashfs(job, deploy, root_dir, cancellable, error))
+            goto out;
+    } else if (g_strcmp0(type, "btrfs") == 0) {
+        const char *grow_argv[] = { "btrfs", "filesystem", "resize", "max", root_dir, NULL };
+
+        engine_job_report(job, IMAGE_WRITE_SHARE, "Growing the file system");
+        if (!run_tool(grow_argv, cancellable, error))
+            goto out;
+    } else if (g_strcmp0(type, "xfs") == 0) {
+        const char *grow_argv[] = { "xfs_growfs", root_dir, NULL };
+
+        engine_job_report(job, IMAGE_WRITE_SHARE, "Growing the file system");
+        if (!run_tool(grow_argv, cancellable, error))
+            goto out;
+    }
+
+    // The kernel and initramfs live on the ESP, which hides the image's own /boot
+    // once mounted; FAT can't keep owners or modes, "quiet" stops it refusing them
+    const char *esp_argv[] = { "mount", "-o", "quiet", deploy->esp_device, esp_dir, NULL };
+    if (!run_tool(esp_argv, cancellable, error))
+        goto out;
+    esp_mounted = TRUE;
+
+    boot = g_build_filename(root_dir, "boot", NULL);
+    engine_job_report(job, IMAGE_GROW_SHARE, "Copying boot files");
+    if (g_file_test(boot, G_FILE_TEST_IS_DIR) &&
+        !tree_copy(boot, esp_dir, 0, &stats, cancellable, error))
+        goto out;
+
+    engine_job_report(job, 1.0, NULL);
+    success = TRUE;
+
+out:
+    if (esp_mounted && !unmount_dir(esp_dir, success ? error : NULL))
+        success = FALSE;
+    if (root_mounted && !unmount_dir(root_dir, success ? error : NULL))
+        success = FALSE;
+    if (esp_dir != NULL)
+        g_rmdir(esp_dir);
+    if (root_dir != NULL)
+        g_rmdir(root_dir);
+
+    return success;
+}
+
+static void image_deploy_free(gpointer data) {
+    ImageDeploy *deploy = data;
+
+    g_free(deploy->image);
+    g_free(deploy->root_device);
+    g_free(deploy->esp_device);
+    g_free(deploy);
+}
+
+EngineJob* image_deploy_job_new(const char *name, const char *image,
+                                const char *root_device, const char *esp_device,
+                                gboolean shared) {
+    ImageDeploy *deploy = g_new0(ImageDeploy, 1);
+
+    deploy->image = g_strdup(image);
+    deploy->root_device = g_strdup(root_device);
+    deploy->esp_device = g_strdup(esp_device);
+    deploy->shared = shared;
+
+    return engine_job_new_func(name, deploy_image, deploy, image_deploy_free);
+}
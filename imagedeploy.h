@@ -0,0 +1,50 @@
+// File   : imagedeploy.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Image deploy: fills the root partition from a prebuilt system image
+// instead of installing packages one by one, for OEM lines that put the
+// same system on every machine. Two kinds of image are taken:
+//
+// - A raw file system image (ext4, btrfs or xfs), written straight to the
+//   partition with large aligned direct I/O while the next chunk is read.
+//   Zero blocks and holes are never written; the device is asked to zero
+//   them instead, which keeps thin and loop-backed targets sparse. The
+//   written file system then gets a UUID of its own.
+// - A squashfs image (zstd or any other compressor), extracted onto the
+//   freshly formatted partition by unsquashfs on every core.
+//
+// Either way the file system then fills the partition and the image's
+// /boot is copied onto the ESP; only the per-machine steps are left.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_IMAGEDEPLOY_H
+#define RARCH_IMAGEDEPLOY_H
+
+#include <gio/gio.h>
+
+#include "engine.h"
+
+// Read and write unit; a multiple of every device's logical block size
+#define IMAGE_CHUNK_SIZE    (8 * 1024 * 1024)
+#define IMAGE_BLOCK_SIZE    4096
+
+typedef enum {
+    IMAGE_RAW,
+    IMAGE_SQUASHFS
+} ImageFormat;
+
+// From the file's magic; anything that isn't squashfs is taken as raw
+ImageFormat image_detect_format(const char *path);
+
+// Deploys image onto root_device (formatted beforehand only for squashfs)
+// and its /boot onto esp_device, which must already hold a FAT file system.
+// shared says other targets deploy the same image at the same time, so its
+// reads and decompression are shared between them.
+EngineJob* image_deploy_job_new(const char *name, const char *image,
+                                const char *root_device, const char *esp_device,
+                                gboolean shared);
+
+#endif // RARCH_IMAGEDEPLOY_H
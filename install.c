@@ -0,0 +1,1035 @@
+// File   : install.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// The install graph. See install.h.
+//
+// specs.md lists the steps as one sequence, but most of them only need the
+// target to be mounted or the base system to exist. The table below records
+// the real dependencies so the scheduler can overlap everything else.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "chroot.h"
+#include "fstab.h"
+#include "imagedeploy.h"
+#include "install.h"
+#include "log.h"
+#include "packages.h"
+#include "pacprogress.h"
+#include "pkgcache.h"
+#include "storage.h"
+#include "treecopy.h"
+#include "verify.h"
+
+#define MODE_BIT(mode) (1u << (mode))
+#define MODES_SETUP    (MODE_BIT(MODE_NORMAL) | MODE_BIT(MODE_OEM))
+#define MODES_ALL      (MODES_SETUP | MODE_BIT(MODE_RECOVERY))
+
+#define MAX_STEP_DEPS 8
+
+static const char * const default_packages[] = {
+    "base", "linux", "linux-firmware", "sudo", "networkmanager", NULL
+};
+
+static const char * const default_services[] = {
+    "NetworkManager", NULL
+};
+
+// Files written straight into the target instead of through arch-chroot
+typedef enum {
+    TARGET_WRITE,
+    TARGET_APPEND,
+    TARGET_SYMLINK
+} TargetFileOp;
+
+typedef struct {
+    TargetFileOp op;
+    char *path;         // relative to the target root, absolute once in a job
+    char *contents;     // file contents, or the link target
+} TargetFile;
+
+// Every step that runs inside the target shares the graph's one chroot session
+typedef EngineJob* (*InstallStepFactory)(const InstallSettings *settings,
+                                         ChrootSession *session,
+                                         const char *name);
+
+// What a step's checkpoint hash covers besides its dependencies' hashes.
+// Passwords are never hashed: a stored hash of one could be cracked, so the
+// steps that take them always run.
+#define INPUT_NONE      0
+#define INPUT_LAYOUT    (1u << 0)   // disks, partitioning and swap
+#define INPUT_PACKAGES  (1u << 1)   // package list and mirror
+#define INPUT_SYSTEM    (1u << 2)   // hostname, locale, timezone and keymap
+#define INPUT_ACCOUNT   (1u << 3)   // user name and full name
+#define INPUT_SERVICES  (1u << 4)
+#define INPUT_CONFIG    (1u << 5)   // everything in the configuration tree
+#define INPUT_IMAGE     (1u << 6)   // the root image's path, size and mtime
+#define DISK_IO         (1u << 30)  // bulk writes; runs on the target disk's own I/O queue
+#define ALWAYS_RUN      (1u << 31)  // never skipped or recorded
+
+typedef struct {
+    const char *id;
+    const char *name;
+    guint modes;
+    double weight;
+    const char *deps[MAX_STEP_DEPS];
+    InstallStepFactory factory;
+    guint inputs;
+} InstallStepInfo;
+
+static const InstallStepInfo* find_step(const char *id);
+static gboolean step_applies(const InstallStepInfo *step, const InstallSettings *settings);
+
+InstallSettings* install_settings_new(void) {
+    InstallSettings *settings = g_new0(InstallSettings, 1);
+
+    settings->mode = MODE_NORMAL;
+    settings->hostname = g_strdup("rarch");
+    settings->locale = g_strdup("en_US.UTF-8");
+    settings->timezone = g_strdup("UTC");
+    settings->keymap = g_strdup("us");
+    settings->packages = g_strdupv((char **) default_packages);
+    settings->services = g_strdupv((char **) default_services);
+    settings->root = g_strdup(INSTALL_ROOT);
+
+    return settings;
+}
+
+InstallSettings* install_settings_copy(const InstallSettings *settings) {
+    InstallSettings *copy = g_memdup2(settings, sizeof(InstallSettings));
+
+    copy->disk = g_strdup(settings->disk);
+    copy->extra_disks = g_strdupv(settings->extra_disks);
+    copy->home_disk = g_strdup(settings->home_disk);
+    copy->hostname = g_strdup(settings->hostname);
+    copy->full_name = g_strdup(settings->full_name);
+    copy->username = g_strdup(settings->username);
+    copy->password = g_strdup(settings->password);
+    copy->root_password = g_strdup(settings->root_password);
+    copy->remove_users = g_strdupv(settings->remove_users);
+    copy->locale = g_strdup(settings->locale);
+    copy->timezone = g_strdup(settings->timezone);
+    copy->keymap = g_strdup(settings->keymap);
+    copy->packages = g_strdupv(settings->packages);
+    copy->services = g_strdupv(settings->services);
+    copy->mirror = g_strdup(settings->mirror);
+    copy->config_dir = g_strdup(settings->config_dir);
+    copy->image = g_strdup(settings->image);
+    copy->root = g_strdup(settings->root);
+    if (settings->plan != NULL)
+        copy->plan = part_plan_ref(settings->plan);
+
+    return copy;
+}
+
+void install_settings_free(InstallSettings *settings) {
+    if (settings == NULL)
+        return;
+
+    g_free(settings->disk);
+    g_strfreev(settings->extra_disks);
+    g_free(settings->home_disk);
+    g_free(settings->hostname);
+    g_free(settings->full_name);
+    g_free(settings->username);
+    g_strfreev(settings->remove_users);
+    g_free(settings->locale);
+    g_free(settings->timezone);
+    g_free(settings->keymap);
+    g_strfreev(settings->packages);
+    g_strfreev(settings->services);
+    g_free(settings->mirror);
+    g_free(settings->config_dir);
+    g_free(settings->image);
+    g_free(settings->root);
+    g_clear_pointer(&settings->plan, part_plan_unref);
+
+    // Scrub secrets before the memory goes back to the allocator
+    if (settings->password != NULL)
+        memset(settings->password, 0, strlen(settings->password));
+    if (settings->root_password != NULL)
+        memset(settings->root_password, 0, strlen(settings->root_password));
+    g_free(settings->password);
+    g_free(settings->root_password);
+
+    g_free(settings);
+}
+
+gboolean install_check_username(const char *name, GError **error) {
+    gsize len = strlen(name);
+    gboolean valid = len > 0 && len <= 32 && (g_ascii_islower(name[0]) || name[0] == '_');
+
+    for (gsize i = 1; valid && i < len; i++)
+        valid = g_ascii_islower(name[i]) || g_ascii_isdigit(name[i]) ||
+                name[i] == '_' || name[i] == '-';
+
+    if (!valid)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Invalid user name \"%s\": lowercase letters, digits, _ and -, "
+                    "starting with a letter or _, at most 32 characters", name);
+    return valid;
+}
+
+gboolean install_check_hostname(const char *name, GError **error) {
+    gsize len = strlen(name);
+    gboolean valid = len > 0 && len <= 64;
+    gsize label = 0;
+
+    // Labels of letters, digits and -, neither starting nor ending with -
+    for (gsize i = 0; valid && i <= len; i++) {
+        if (name[i] == '.' || name[i] == '\0') {
+            valid = label > 0 && label <= 63 && name[i - 1] != '-';
+            label = 0;
+        } else {
+            valid = g_ascii_isalnum(name[i]) || (name[i] == '-' && label > 0);
+            label++;
+        }
+    }
+
+    if (!valid)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Invalid host name \"%s\": dot-separated labels of letters, digits "
+                    "and -, not starting or ending with -, at most 64 characters", name);
+    return valid;
+}
+
+static EngineJob* chroot_job(ChrootSession *session, const char *name,
+                             const char * const *argv, const char *input) {
+    ChrootBatch *batch = chroot_batch_new();
+
+    chroot_batch_add(batch, argv, input);
+    return chroot_job_new(name, session, batch);
+}
+
+static void target_file_free(gpointer data) {
+    TargetFile *file = data;
+
+    g_free(file->path);
+    g_free(file->contents);
+    g_free(file);
+}
+
+static void add_target_file(GPtrArray *files, TargetFileOp op,
+                            const char *path, const char *contents) {
+    TargetFile *file = g_new0(TargetFile, 1);
+
+    file->op = op;
+    file->path = g_strdup(path);
+    file->contents = g_strdup(contents);
+    g_ptr_array_add(files, file);
+}
+
+static gboolean write_target_files(EngineJob *job, gpointer user_data,
+                                   GCancellable *cancellable, GError **error) {
+    GPtrArray *files = user_data;
+
+    for (guint i = 0; i < files->len; i++) {
+        TargetFile *file = g_ptr_array_index(files, i);
+        const char *path = file->path;
+        g_autofree char *dir = g_path_get_dirname(path);
+
+        if (g_mkdir_with_parents(dir, 0755) != 0) {
+            int saved_errno = errno;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                        "Could not create %s: %s", dir, g_strerror(saved_errno));
+            return FALSE;
+        }
+
+        switch (file->op) {
+            case TARGET_WRITE:
+                if (!g_file_set_contents(path, file->contents, -1, error))
+                    return FALSE;
+                break;
+            case TARGET_APPEND: {
+                g_autofree char *old = NULL;
+                g_auto(GStrv) old_lines = NULL;
+                g_auto(GStrv) new_lines = NULL;
+                g_autoptr(GString) joined = NULL;
+                gsize old_len;
+
+                // A redone step must not add its lines a second time. Only
+                // whole lines count: locale.gen ships "#en_US.UTF-8 UTF-8".
+                g_file_get_contents(path, &old, NULL, NULL);
+                joined = g_string_new(old);
+                old_len = joined->len;
+                old_lines = g_strsplit(joined->str, "\n", -1);
+                new_lines = g_strsplit(file->contents, "\n", -1);
+
+                for (guint j = 0; new_lines[j] != NULL; j++) {
+                    const char *line = new_lines[j];
+
+                    if (*line == '\0' || g_strv_contains((const char * const *) old_lines, line))
+                        continue;
+                    if (joined->len > 0 && joined->str[joined->len - 1] != '\n')
+                        g_string_append_c(joined, '\n');
+                    g_string_append_printf(joined, "%s\n", line);
+                }
+
+                if (joined->len != old_len && !g_file_set_contents(path, joined->str, -1, error))
+                    return FALSE;
+                break;
+            }
+            case TARGET_SYMLINK:
+                g_unlink(path);
+                if (symlink(file->contents, path) != 0) {
+                    int saved_errno = errno;
+                    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                                "Could not link %s: %s", path, g_strerror(saved_errno));
+                    return FALSE;
+                }
+                break;
+        }
+
+        debug_log("Wrote target file %s", path);
+    }
+
+    return TRUE;
+}
+
+static EngineJob* target_files_job(const InstallSettings *settings, const char *name,
+                                   GPtrArray *files) {
+    for (guint i = 0; i < files->len; i++) {
+        TargetFile *file = g_ptr_array_index(files, i);
+        char *path = g_build_filename(settings->root, file->path, NULL);
+
+        g_free(file->path);
+        file->path = path;
+    }
+
+    return engine_job_new_func(name, write_target_files, files,
+                               (GDestroyNotify) g_ptr_array_unref);
+}
+
+// Erase uses fixed partition numbers; a plan has its own
+static StorageLayout* settings_layout(const InstallSettings *settings) {
+    if (settings->plan != NULL)
+        return part_plan_get_storage_layout(settings->plan);
+
+    return storage_layout_new(settings->disk, settings->home_disk, settings->swap_size);
+}
+
+static char* settings_partition(const InstallSettings *settings, PartUse use, guint number) {
+    const PlanPartition *partition;
+
+    if (settings->plan == NULL)
+        return storage_partition_path(settings->disk, number);
+
+    partition = part_plan_find_use(settings->plan, use);
+    return partition != NULL ? storage_partition_path(settings->disk, partition->number) : NULL;
+}
+
+static EngineJob* make_storage_job(const InstallSettings *settings, ChrootSession *session,
+                                   const char *name) {
+    StorageLayout *layout = settings_layout(settings);
+
+    // A raw image brings its own root file system
+    if (settings->image != NULL && image_detect_format(settings->image) == IMAGE_RAW)
+        storage_layout_set_unformatted(layout, STORAGE_ROOT);
+
+    if (settings->plan != NULL)
+        return part_plan_apply_job_new(name, settings->plan, layout);
+
+    return storage_prepare_job_new(name, layout);
+}
+
+static EngineJob* make_image_job(const InstallSettings *settings, ChrootSession *session,
+                                 const char *name) {
+    g_autofree char *root = settings_partition(settings, PART_USE_ROOT, STORAGE_ROOT_NUMBER);
+    g_autofree char *esp = settings_partition(settings, PART_USE_ESP, STORAGE_ESP_NUMBER);
+
+    return image_deploy_job_new(name, settings->image, root, esp, settings->shared);
+}
+
+static EngineJob* make_mount_job(const InstallSettings *settings, ChrootSession *session,
+                                 const char *name) {
+    return storage_mount_job_new(name, settings_layout(settings), settings->root);
+}
+
+// The command's output drives the outer job's progress instead of raw lines
+typedef struct {
+    EngineJob *job;
+    PacmanProgress progress;
+} PacstrapRun;
+
+static void forward_pacstrap_line(EngineJob *command, const char *line,
+                                  gboolean is_stderr, gpointer user_data) {
+    PacstrapRun *run = user_data;
+
+    if (pacman_progress_feed(&run->progress, line))
+        engine_job_report(run->job, pacman_progress_get_fraction(&run->progress),
+                          run->progress.status[0] != '\0' ? run->progress.status : NULL);
+}
+
+static gboolean run_pacstrap(EngineJob *job, gpointer user_data,
+                             GCancellable *cancellable, GError **error) {
+    g_autoptr(EngineJob) command = engine_job_new_command("pacstrap", user_data);
+    PacstrapRun run = { .job = job };
+
+    pacman_progress_init(&run.progress, NULL, NULL);
+    engine_job_set_line_func(command, forward_pacstrap_line, &run);
+
+    if (!engine_job_run(command, cancellable, error))
+        return FALSE;
+
+    pacman_progress_finish(&run.progress);
+    engine_job_report(job, 1.0, NULL);
+    return TRUE;
+}
+
+static EngineJob* make_packages_job(const InstallSettings *settings, ChrootSession *session,
+                                    const char *name) {
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+
+    if (settings->mirror != NULL) {
+        PackagePipelineOptions options = {
+            .mirror = settings->mirror,
+            .root = settings->root,
+            .connections = settings->connections,
+            .packages = (const char * const *) settings->packages,
+        };
+
+        return package_pipeline_job_new(name, &options);
+    }
+
+    g_ptr_array_add(argv, (gpointer) "pacstrap");
+    g_ptr_array_add(argv, (gpointer) "-K");
+    g_ptr_array_add(argv, settings->root);
+    for (guint i = 0; settings->packages[i] != NULL; i++)
+        g_ptr_array_add(argv, settings->packages[i]);
+    g_ptr_array_add(argv, NULL);
+
+    return engine_job_new_func(name, run_pacstrap,
+                               g_strdupv((char **) argv->pdata), (GDestroyNotify) g_strfreev);
+}
+
+// The package set pacstrap is about to install and the root it goes into
+typedef struct {
+    char *root;
+    char **packages;
+} SeedCache;
+
+static void seed_cache_free(gpointer data) {
+    SeedCache *seed = data;
+
+    g_free(seed->root);
+    g_strfreev(seed->packages);
+    g_free(seed);
+}
+
+static gboolean seed_package_cache(EngineJob *job, gpointer user_data,
+                                   GCancellable *cancellable, GError **error) {
+    SeedCache *seed = user_data;
+    g_autoptr(GPtrArray) cached = package_cache_list();
+    g_autoptr(GPtrArray) files = NULL;
+    g_autoptr(GError) resolve_error = NULL;
+    g_autofree char *cache_dir = g_build_filename(seed->root, PACKAGE_CACHE_HOST_DIR, NULL);
+    guint seeded = 0;
+
+    if (cached->len == 0)
+        return TRUE;
+
+    if (g_mkdir_with_parents(cache_dir, 0755) != 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not create %s: %s", cache_dir, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    // Only the files pacstrap will ask for; seeding is an optimization, so a
+    // failed resolve leaves pacstrap to download everything
+    files = package_resolve(NULL, (const char * const *) seed->packages, job, cancellable,
+                            &resolve_error);
+    if (files == NULL) {
+        if (g_error_matches(resolve_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_propagate_error(error, g_steal_pointer(&resolve_error));
+            return FALSE;
+        }
+        debug_log("Not seeding the package cache: %s", resolve_error->message);
+        return TRUE;
+    }
+
+    // pacstrap points pacman at the target's cache, so anything placed here is
+    // never downloaded. A file whose hash doesn't match is left out rather than
+    // failing pacman's own check later.
+    for (guint i = 0; i < files->len; i++) {
+        const PackageFile *file = g_ptr_array_index(files, i);
+        const CachedPackage *package = package_cache_lookup(file->filename, file->sha256);
+        g_autofree char *dest = g_build_filename(cache_dir, file->filename, NULL);
+
+        if (g_cancellable_set_error_if_cancelled(cancellable, error))
+            return FALSE;
+
+        if (package != NULL && package_cache_check(package, file->sha256)) {
+            if (!package_cache_link(package, dest, error))
+                return FALSE;
+            seeded++;
+        }
+
+        engine_job_report(job, (i + 1.0) / files->len, file->filename);
+    }
+
+    debug_log("Seeded %u of %u packages into the target from the cache", seeded, files->len);
+    return TRUE;
+}
+
+static EngineJob* make_seed_cache_job(const InstallSettings *settings, ChrootSession *session,
+                                      const char *name) {
+    SeedCache *seed = g_new0(SeedCache, 1);
+
+    seed->root = g_strdup(settings->root);
+    seed->packages = g_strdupv(settings->packages);
+
+    return engine_job_new_func(name, seed_package_cache, seed, seed_cache_free);
+}
+
+static EngineJob* make_fstab_job(const InstallSettings *settings, ChrootSession *session,
+                                 const char *name) {
+    return fstab_job_new(name, settings->root);
+}
+
+static EngineJob* make_system_config_job(const InstallSettings *settings, ChrootSession *session,
+                                         const char *name) {
+    GPtrArray *files = g_ptr_array_new_with_free_func(target_file_free);
+    g_autofree char *zone = g_build_filename("/usr/share/zoneinfo", settings->timezone, NULL);
+    g_autofree char *locale_gen = g_strdup_printf("%s UTF-8\n", settings->locale);
+    g_autofree char *locale_conf = g_strdup_printf("LANG=%s\n", settings->locale);
+    g_autofree char *vconsole = g_strdup_printf("KEYMAP=%s\n", settings->keymap);
+    g_autofree char *hostname = g_strdup_printf("%s\n", settings->hostname);
+    g_autofree char *hosts = g_strdup_printf("127.0.0.1 localhost\n"
+                                             "::1       localhost\n"
+                                             "127.0.1.1 %s\n", settings->hostname);
+
+    add_target_file(files, TARGET_SYMLINK, "etc/localtime", zone);
+    add_target_file(files, TARGET_APPEND, "etc/locale.gen", locale_gen);
+    add_target_file(files, TARGET_WRITE, "etc/locale.conf", locale_conf);
+    add_target_file(files, TARGET_WRITE, "etc/vconsole.conf", vconsole);
+    add_target_file(files, TARGET_WRITE, "etc/hostname", hostname);
+    add_target_file(files, TARGET_APPEND, "etc/hosts", hosts);
+
+    return target_files_job(settings, name, files);
+}
+
+static EngineJob* make_locale_gen_job(const InstallSettings *settings, ChrootSession *session,
+                                      const char *name) {
+    const char *argv[] = { "locale-gen", NULL };
+
+    return chroot_job(session, name, argv, NULL);
+}
+
+static EngineJob* make_root_password_job(const InstallSettings *settings, ChrootSession *session,
+                                         const char *name) {
+    if (settings->root_password == NULL) {
+        const char *argv[] = { "passwd", "--lock", "root", NULL };
+        return chroot_job(session, name, argv, NULL);
+    }
+
+    const char *argv[] = { "chpasswd", NULL };
+    g_autofree char *line = g_strdup_printf("root:%s\n", settings->root_password);
+    EngineJob *job = chroot_job(session, name, argv, line);
+
+    memset(line, 0, strlen(line));
+    return job;
+}
+
+// Creates the account, or in Recovery updates it if it already exists, and
+// sets its password (or locks it) in the same round trip
+static EngineJob* make_user_job(const InstallSettings *settings, ChrootSession *session,
+                                const char *name) {
+    const char *account_argv[] = {
+        "sh", "-c",
+        "if id -u \"$1\" >/dev/null 2>&1; then "
+        "usermod --append --groups wheel --comment \"$2\" \"$1\"; "
+        "else useradd --create-home --groups wheel --comment \"$2\" \"$1\"; fi",
+        "sh", settings->username, settings->full_name != NULL ? settings->full_name : "",
+        NULL
+    };
+    ChrootBatch *batch = chroot_batch_new();
+
+    chroot_batch_add(batch, account_argv, NULL);
+
+    // An empty password would let anyone log in. Without one the account is
+    // locked, except that Recovery leaves an existing account's password be.
+    if (settings->password != NULL && *settings->password != '\0') {
+        const char *password_argv[] = { "chpasswd", NULL };
+        g_autofree char *line = g_strdup_printf("%s:%s\n", settings->username, settings->password);
+
+        chroot_batch_add(batch, password_argv, line);
+        memset(line, 0, strlen(line));
+    } else if (settings->mode != MODE_RECOVERY) {
+        const char *lock_argv[] = { "passwd", "--lock", settings->username, NULL };
+
+        chroot_batch_add(batch, lock_argv, NULL);
+    }
+
+    return chroot_job_new(name, session, batch);
+}
+
+// Recovery's account removal; names that don't exist (any more) are skipped,
+// so a rerun finds nothing left to do
+static EngineJob* make_remove_users_job(const InstallSettings *settings, ChrootSession *session,
+                                        const char *name) {
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+
+    g_ptr_array_add(argv, (gpointer) "sh");
+    g_ptr_array_add(argv, (gpointer) "-c");
+    g_ptr_array_add(argv, (gpointer)
+                    "for name; do "
+                    "if [ \"$name\" = root ]; then "
+                    "echo \"The root account can't be removed\"; exit 1; fi; "
+                    "id -u \"$name\" >/dev/null 2>&1 || continue; "
+                    "userdel --remove \"$name\" || exit 1; "
+                    "done");
+    g_ptr_array_add(argv, (gpointer) "sh");
+    for (guint i = 0; settings->remove_users[i] != NULL; i++)
+        g_ptr_array_add(argv, settings->remove_users[i]);
+    g_ptr_array_add(argv, NULL);
+
+    return chroot_job(session, name, (const char * const *) argv->pdata, NULL);
+}
+
+static EngineJob* make_sudoers_job(const InstallSettings *settings, ChrootSession *session,
+                                   const char *name) {
+    GPtrArray *files = g_ptr_array_new_with_free_func(target_file_free);
+
+    add_target_file(files, TARGET_WRITE, "etc/sudoers.d/10-wheel", "%wheel ALL=(ALL:ALL) ALL\n");
+
+    return target_files_job(settings, name, files);
+}
+
+static EngineJob* make_services_job(const InstallSettings *settings, ChrootSession *session,
+                                    const char *name) {
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+
+    g_ptr_array_add(argv, (gpointer) "systemctl");
+    g_ptr_array_add(argv, (gpointer) "enable");
+    for (guint i = 0; settings->services[i] != NULL; i++)
+        g_ptr_array_add(argv, settings->services[i]);
+    g_ptr_array_add(argv, NULL);
+
+    return chroot_job(session, name, (const char * const *) argv->pdata, NULL);
+}
+
+static EngineJob* make_bootloader_job(const InstallSettings *settings, ChrootSession *session,
+                                      const char *name) {
+    const char *argv[] = { "bootctl", "install", NULL };
+
+    return chroot_job(session, name, argv, NULL);
+}
+
+// Root is found by the UUID probed from what is mounted: partition labels
+// repeat across disks installed side by side and partitions kept by a plan
+static gboolean write_boot_entry(EngineJob *job, gpointer user_data,
+                                 GCancellable *cancellable, GError **error) {
+    const char *root = user_data;
+    g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func(target_file_free);
+    g_autofree char *options = fstab_root_options(root, error);
+    g_autofree char *loader = NULL;
+    g_autofree char *entry = NULL;
+    g_autofree char *contents = NULL;
+
+    if (options == NULL)
+        return FALSE;
+
+    loader = g_build_filename(root, "boot/loader/loader.conf", NULL);
+    entry = g_build_filename(root, "boot/loader/entries/rarch.conf", NULL);
+    contents = g_strdup_printf("title   Rarch Linux\n"
+                               "linux   /vmlinuz-linux\n"
+                               "initrd  /initramfs-linux.img\n"
+                               "options %s\n", options);
+
+    add_target_file(files, TARGET_WRITE, loader,
+                    "default rarch.conf\n"
+                    "timeout 3\n");
+    add_target_file(files, TARGET_WRITE, entry, contents);
+
+    return write_target_files(job, files, cancellable, error);
+}
+
+static EngineJob* make_boot_entry_job(const InstallSettings *settings, ChrootSession *session,
+                                      const char *name) {
+    return engine_job_new_func(name, write_boot_entry, g_strdup(settings->root), g_free);
+}
+
+// The configuration tree and the root it is copied into
+typedef struct {
+    char *source;
+    char *root;
+} ConfigCopy;
+
+static void config_copy_free(gpointer data) {
+    ConfigCopy *copy = data;
+
+    g_free(copy->source);
+    g_free(copy->root);
+    g_free(copy);
+}
+
+static gboolean copy_config_tree(EngineJob *job, gpointer user_data,
+                                 GCancellable *cancellable, GError **error) {
+    ConfigCopy *copy = user_data;
+    TreeCopyStats stats;
+
+    if (!tree_copy(copy->source, copy->root, 0, &stats, cancellable, error))
+        return FALSE;
+
+    g_autofree char *size = g_format_size(stats.bytes);
+    g_autofree char *status = g_strdup_printf("Copied %" G_GUINT64_FORMAT " files (%s)",
+                                              stats.files, size);
+    engine_job_report(job, 1.0, status);
+
+    return TRUE;
+}
+
+static EngineJob* make_config_copy_job(const InstallSettings *settings, ChrootSession *session,
+                                       const char *name) {
+    ConfigCopy *copy = g_new0(ConfigCopy, 1);
+
+    copy->source = g_strdup(settings->config_dir);
+    copy->root = g_strdup(settings->root);
+
+    return engine_job_new_func(name, copy_config_tree, copy, config_copy_free);
+}
+
+static EngineJob* make_startup_scripts_job(const InstallSettings *settings, ChrootSession *session,
+                                           const char *name) {
+    const char *argv[] = {
+        "sh", "-c",
+        "for script in /etc/rarch/post-install.d/*; do "
+        "[ -x \"$script\" ] || continue; "
+        "echo \"Running $script\"; "
+        "\"$script\" || exit 1; "
+        "done",
+        NULL
+    };
+
+    return chroot_job(session, name, argv, NULL);
+}
+
+static EngineJob* make_verify_job(const InstallSettings *settings, ChrootSession *session,
+                                  const char *name) {
+    VerifyOptions options = {
+        .config_dir = settings->config_dir,
+    };
+
+    // OEM leaves accounts to first boot, whatever the settings say
+    if (step_applies(find_step("user"), settings))
+        options.username = settings->username;
+
+    // Recovery leaves root alone unless given a new password
+    if (settings->root_password != NULL)
+        options.root_account = VERIFY_ROOT_PASSWORD;
+    else if (settings->mode == MODE_RECOVERY)
+        options.root_account = VERIFY_ROOT_ANY;
+    else
+        options.root_account = VERIFY_ROOT_LOCKED;
+
+    return verify_job_new(name, settings->root, &options);
+}
+
+// Order matters: every dependency is listed before the steps that need it
+static const InstallStepInfo install_steps[] = {
+    { "storage",         "Preparing disks",             MODES_SETUP, 5.0,
+      { NULL }, make_storage_job,
+      INPUT_LAYOUT | INPUT_IMAGE | DISK_IO },
+    { "image",           "Deploying system image",      MODES_SETUP, 20.0,
+      { "storage" }, make_image_job,
+      INPUT_IMAGE | DISK_IO },
+    { "mount",           "Mounting file systems",       MODES_ALL, 1.0,
+      { "storage", "image" }, make_mount_job,
+      INPUT_LAYOUT | ALWAYS_RUN },
+    { "seed-cache",      "Seeding package cache",       MODES_SETUP, 2.0,
+      { "mount" }, make_seed_cache_job,
+      INPUT_PACKAGES | DISK_IO },
+    { "packages",        "Installing packages",         MODES_SETUP, 60.0,
+      { "mount", "seed-cache" }, make_packages_job,
+      INPUT_PACKAGES | DISK_IO },
+    // Every chroot step waits for fstab: the session's bind mounts (the
+    // host's resolv.conf) must not be in the mount table it is read from
+    { "fstab",           "Generating fstab",            MODES_SETUP, 0.5,
+      { "packages" }, make_fstab_job,
+      INPUT_LAYOUT },
+    { "system-config",   "Writing system configuration", MODES_SETUP, 0.5,
+      { "packages" }, make_system_config_job,
+      INPUT_SYSTEM },
+    { "locale-gen",      "Generating locales",          MODES_SETUP, 3.0,
+      { "system-config", "fstab" }, make_locale_gen_job,
+      INPUT_NONE },
+    { "root-password",   "Setting root password",       MODES_ALL, 0.5,
+      { "packages", "mount", "fstab" }, make_root_password_job,
+      ALWAYS_RUN },
+    { "user",            "Creating user account",       MODE_BIT(MODE_NORMAL) | MODE_BIT(MODE_RECOVERY), 1.0,
+      { "packages", "mount", "fstab" }, make_user_job,
+      INPUT_ACCOUNT | ALWAYS_RUN },
+    { "remove-users",    "Removing user accounts",      MODE_BIT(MODE_RECOVERY), 0.5,
+      { "mount" }, make_remove_users_job,
+      ALWAYS_RUN },
+    { "sudoers",         "Configuring sudo",            MODES_SETUP, 0.1,
+      { "packages" }, make_sudoers_job,
+      INPUT_NONE },
+    { "services",        "Enabling system services",    MODES_SETUP, 1.0,
+      { "packages", "fstab" }, make_services_job,
+      INPUT_SERVICES },
+    { "bootloader",      "Installing bootloader",       MODES_ALL, 2.0,
+      { "packages", "mount", "fstab" }, make_bootloader_job,
+      INPUT_LAYOUT },
+    { "boot-entry",      "Writing boot entry",          MODES_ALL, 0.1,
+      { "bootloader" }, make_boot_entry_job,
+      INPUT_NONE },
+    // Copied files override what the installer wrote to /etc, so they go last
+    { "config-copy",     "Copying configuration files", MODES_SETUP, 2.0,
+      { "packages", "user", "system-config", "sudoers" }, make_config_copy_job,
+      INPUT_CONFIG | DISK_IO },
+    { "startup-scripts", "Running startup scripts",     MODES_SETUP, 1.0,
+      { "config-copy", "services", "system-config", "fstab" }, make_startup_scripts_job,
+      INPUT_NONE },
+    { "verify",          "Verifying installation",      MODES_ALL, 3.0,
+      { "boot-entry", "startup-scripts", "fstab", "locale-gen", "root-password", "user", "sudoers",
+        "remove-users" },
+      make_verify_job,
+      ALWAYS_RUN },
+};
+
+static const InstallStepInfo* find_step(const char *id) {
+    for (guint i = 0; i < G_N_ELEMENTS(install_steps); i++) {
+        if (g_strcmp0(install_steps[i].id, id) == 0)
+            return &install_steps[i];
+    }
+
+    return NULL;
+}
+
+// A deployed image already holds these; everything else is per machine
+static const char * const image_covered_steps[] = {
+    "seed-cache", "packages", "sudoers", "services", "config-copy", "startup-scripts", NULL
+};
+
+static gboolean step_applies(const InstallStepInfo *step, const InstallSettings *settings) {
+    if ((step->modes & MODE_BIT(settings->mode)) == 0)
+        return FALSE;
+
+    if (g_strcmp0(step->id, "image") == 0)
+        return settings->image != NULL;
+    if (settings->image != NULL && g_strv_contains(image_covered_steps, step->id))
+        return FALSE;
+
+    // Steps whose input wasn't provided drop out like steps of another mode
+    if (g_strcmp0(step->id, "storage") == 0)
+        return settings->partitioning == PARTITION_ERASE || settings->plan != NULL;
+    if (g_strcmp0(step->id, "config-copy") == 0)
+        return settings->config_dir != NULL;
+    if (g_strcmp0(step->id, "user") == 0)
+        return settings->username != NULL && *settings->username != '\0';
+    if (g_strcmp0(step->id, "remove-users") == 0)
+        return settings->remove_users != NULL && settings->remove_users[0] != NULL;
+    if (g_strcmp0(step->id, "seed-cache") == 0)
+        return settings->mirror == NULL;     // the package pipeline looks packages up itself
+    if (g_strcmp0(step->id, "root-password") == 0 && settings->mode == MODE_RECOVERY)
+        return settings->root_password != NULL;
+    if (g_strcmp0(step->id, "services") == 0)
+        return settings->services != NULL && settings->services[0] != NULL;
+
+    return TRUE;
+}
+
+// A dependency on a step that was left out is replaced by that step's own
+// dependencies, so e.g. Recovery's "user" still waits for "mount"
+static void collect_deps(const InstallStepInfo *step, const InstallSettings *settings,
+                         GPtrArray *out) {
+    for (guint i = 0; i < MAX_STEP_DEPS && step->deps[i] != NULL; i++) {
+        const InstallStepInfo *dep = find_step(step->deps[i]);
+
+        if (dep == NULL)
+            continue;
+
+        if (step_applies(dep, settings)) {
+            if (!g_ptr_array_find_with_equal_func(out, dep->id, g_str_equal, NULL))
+                g_ptr_array_add(out, (gpointer) dep->id);
+        } else {
+            collect_deps(dep, settings, out);
+        }
+    }
+}
+
+// The terminator keeps "ab" + "c" apart from "a" + "bc"; NULL hashes as a lone 0xff
+static void hash_string(GChecksum *checksum, const char *value) {
+    if (value != NULL)
+        g_checksum_update(checksum, (const guchar *) value, strlen(value) + 1);
+    else
+        g_checksum_update(checksum, (const guchar *) "\xff", 1);
+}
+
+static void hash_strv(GChecksum *checksum, char * const *values) {
+    for (guint i = 0; values != NULL && values[i] != NULL; i++)
+        hash_string(checksum, values[i]);
+    hash_string(checksum, NULL);
+}
+
+static void hash_file(GChecksum *checksum, const char *path) {
+    guchar buffer[64 * 1024];
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    gssize len;
+
+    if (fd < 0) {
+        hash_string(checksum, NULL);
+        return;
+    }
+
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+        g_checksum_update(checksum, buffer, len);
+
+    close(fd);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Names, types, modes and contents of everything below path, in a fixed order
+static void hash_tree(GChecksum *checksum, const char *path) {
+    g_autoptr(GDir) dir = g_dir_open(path, 0, NULL);
+    g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func(g_free);
+    const char *name;
+
+    if (dir == NULL) {
+        hash_string(checksum, NULL);
+        return;
+    }
+
+    while ((name = g_dir_read_name(dir)) != NULL)
+        g_ptr_array_add(names, g_strdup(name));
+    g_ptr_array_sort(names, compare_names);
+
+    for (guint i = 0; i < names->len; i++) {
+        g_autofree char *child = g_build_filename(path, g_ptr_array_index(names, i), NULL);
+        g_autofree char *mode = NULL;
+        GStatBuf st;
+
+        hash_string(checksum, g_ptr_array_index(names, i));
+        if (g_lstat(child, &st) != 0) {
+            hash_string(checksum, NULL);
+            continue;
+        }
+
+        mode = g_strdup_printf("%o", (guint) st.st_mode);
+        hash_string(checksum, mode);
+
+        if (S_ISDIR(st.st_mode)) {
+            hash_tree(checksum, child);
+        } else if (S_ISLNK(st.st_mode)) {
+            g_autofree char *target = g_file_read_link(child, NULL);
+            hash_string(checksum, target);
+        } else if (S_ISREG(st.st_mode)) {
+            hash_file(checksum, child);
+        }
+    }
+}
+
+// The checkpoint hash of a step: its own inputs plus its dependencies' hashes,
+// so a change anywhere upstream reaches every step built on it
+static char* step_hash(const InstallStepInfo *step, const InstallSettings *settings,
+                       GPtrArray *deps, GHashTable *hashes) {
+    g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_autofree char *numbers = NULL;
+
+    hash_string(checksum, step->id);
+
+    if (step->inputs & INPUT_LAYOUT) {
+        numbers = g_strdup_printf("%d %" G_GUINT64_FORMAT, settings->partitioning,
+                                  settings->swap_size);
+        hash_string(checksum, settings->disk);
+        hash_string(checksum, settings->home_disk);
+        hash_string(checksum, numbers);
+
+        // What the plan would change covers every partition it touches
+        if (settings->plan != NULL) {
+            g_auto(GStrv) changes = part_plan_describe_changes(settings->plan);
+            hash_strv(checksum, changes);
+        }
+    }
+    if (step->inputs & INPUT_PACKAGES) {
+        hash_strv(checksum, settings->packages);
+        hash_string(checksum, settings->mirror);
+    }
+    if (step->inputs & INPUT_SYSTEM) {
+        hash_string(checksum, settings->hostname);
+        hash_string(checksum, settings->locale);
+        hash_string(checksum, settings->timezone);
+        hash_string(checksum, settings->keymap);
+    }
+    if (step->inputs & INPUT_ACCOUNT) {
+        hash_string(checksum, settings->username);
+        hash_string(checksum, settings->full_name);
+    }
+    if (step->inputs & INPUT_SERVICES)
+        hash_strv(checksum, settings->services);
+    if (step->inputs & INPUT_CONFIG) {
+        hash_string(checksum, settings->config_dir);
+        if (settings->config_dir != NULL)
+            hash_tree(checksum, settings->config_dir);
+    }
+    if (step->inputs & INPUT_IMAGE) {
+        GStatBuf st;
+
+        // Reading gigabytes of image would cost more than most of what it could skip
+        hash_string(checksum, settings->image);
+        if (settings->image != NULL && g_stat(settings->image, &st) == 0) {
+            g_autofree char *identity = g_strdup_printf("%" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+                                                        (gint64) st.st_size, (gint64) st.st_mtime);
+            hash_string(checksum, identity);
+        }
+    }
+
+    for (guint i = 0; i < deps->len; i++)
+        hash_string(checksum, g_hash_table_lookup(hashes, g_ptr_array_index(deps, i)));
+
+    return g_strdup(g_checksum_get_string(checksum));
+}
+
+Scheduler* install_build_graph(const InstallSettings *settings) {
+    Scheduler *scheduler = scheduler_new(MAX(g_get_num_processors(), 2));
+    g_autoptr(ChrootSession) session = chroot_session_new(settings->root);
+    g_autoptr(CheckpointJournal) journal = NULL;
+    g_autoptr(GHashTable) hashes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    g_autofree char *root_device = NULL;
+
+    // Until "storage" has run, an earlier journal can only be found on the disk itself
+    if ((settings->partitioning == PARTITION_ERASE || settings->plan != NULL) &&
+        settings->disk != NULL)
+        root_device = settings_partition(settings, PART_USE_ROOT, STORAGE_ROOT_NUMBER);
+    journal = checkpoint_journal_new(settings->root, root_device, settings->fresh);
+
+    for (guint i = 0; i < G_N_ELEMENTS(install_steps); i++) {
+        const InstallStepInfo *step = &install_steps[i];
+
+        if (!step_applies(step, settings))
+            continue;
+
+        g_autoptr(GPtrArray) deps = g_ptr_array_new();
+        collect_deps(step, settings, deps);
+
+        char *hash = step_hash(step, settings, deps, hashes);
+        g_hash_table_insert(hashes, (gpointer) step->id, hash);
+        g_ptr_array_add(deps, NULL);
+
+        g_autoptr(EngineJob) job = checkpoint_job_new(journal, step->id,
+                                                      (step->inputs & ALWAYS_RUN) ? NULL : hash,
+                                                      step->factory(settings, session, step->name));
+        if ((step->inputs & DISK_IO) && settings->disk != NULL)
+            engine_job_set_queue(job, settings->disk);
+        scheduler_add(scheduler, step->id, job, (const char * const *) deps->pdata, step->weight);
+    }
+
+    debug_log("Install graph built with %u steps for mode %d",
+              scheduler_get_n_nodes(scheduler), settings->mode);
+
+    return scheduler;
+}
@@ -0,0 +1,76 @@
+// File   : install.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// The install graph: every step from specs.md as a scheduler node with its
+// dependencies. Each InstallerMode runs the subset of nodes that applies to it.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_INSTALL_H
+#define RARCH_INSTALL_H
+
+#include <gio/gio.h>
+
+#include "partplan.h"
+#include "scheduler.h"
+
+#define INSTALL_ROOT "/mnt"
+
+typedef enum {
+    MODE_NORMAL,
+    MODE_OEM,
+    MODE_RECOVERY
+} InstallerMode;
+
+typedef enum {
+    PARTITION_ERASE,
+    PARTITION_ALONGSIDE,
+    PARTITION_MANUAL
+} PartitionScheme;
+
+typedef struct {
+    InstallerMode mode;
+    char *disk;             // whole device, e.g. /dev/sda
+    char **extra_disks;     // more devices installed the same way, side by side, may be NULL
+    PartitionScheme partitioning;
+    char *home_disk;        // separate disk for /home, may be NULL; unused with a plan
+    PartPlan *plan;         // partitions for Alongside and Manual, NULL for Erase
+    guint64 swap_size;      // MiB, 0 for no swap partition
+    char *hostname;
+    char *full_name;
+    char *username;
+    char *password;         // never logged
+    char *root_password;    // NULL locks the root account
+    char **remove_users;    // Recovery: accounts deleted with their homes, may be NULL
+    char *locale;
+    char *timezone;
+    char *keymap;
+    char **packages;
+    char **services;
+    char *mirror;           // package pipeline source; NULL installs with pacstrap
+    guint connections;      // concurrent package downloads, 0 for the default
+    char *config_dir;       // skeleton tree copied into the target, may be NULL
+    char *image;            // root image deployed instead of installing packages, may be NULL
+    gboolean fresh;         // redo every step, ignoring checkpoints of an earlier run
+    char *root;             // where the target is mounted, INSTALL_ROOT for a single target
+    gboolean shared;        // other targets install from the same sources at the same time
+} InstallSettings;
+
+InstallSettings* install_settings_new(void);
+InstallSettings* install_settings_copy(const InstallSettings *settings);
+void install_settings_free(InstallSettings *settings);
+
+// Names as useradd (^[a-z_][a-z0-9_-]{0,31}$) and hostnamectl (RFC 1123
+// labels, 64 characters in all) take them, checked before anything is
+// written to disk
+gboolean install_check_username(const char *name, GError **error);
+gboolean install_check_hostname(const char *name, GError **error);
+
+// Builds the graph for settings->mode; the jobs keep their own copies of the settings
+Scheduler* install_build_graph(const InstallSettings *settings);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(InstallSettings, install_settings_free)
+
+#endif // RARCH_INSTALL_H
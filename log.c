@@ -0,0 +1,369 @@
+// File   : log.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Debug logging shared by the front end and the install engine. See log.h.
+//
+// The ring is a bounded multi-producer queue: each slot carries a sequence
+// number, a producer claims a slot with one compare-and-swap on the head and
+// publishes it by advancing the slot's sequence. The ring has no lock and
+// no allocation (only the secrets list is locked, once there are secrets);
+// if the writer falls a whole ring behind, records are dropped and counted
+// rather than making the caller wait.
+//
+// Records are compact text: seconds since the log was opened, the delta
+// from the previous record in milliseconds, and the message. Secrets are
+// masked by the producer on the whole formatted message, before it is cut
+// to the slot size, so a secret straddling the cut can't leak its head.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gprintf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_DIR             "/var"
+#define LOG_RING_SIZE       4096    // slots, a power of two
+#define LOG_RECORD_SIZE     512     // longer messages are truncated
+#define LOG_FORMAT_SIZE     4096    // formatted on the stack up to this size
+#define LOG_WRITER_IDLE_US  10000
+#define LOG_SECRET_MASK     "********"
+
+G_STATIC_ASSERT((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0);
+
+typedef struct {
+    guintptr sequence;      // == position when free, position + 1 when filled
+    gint64 time;
+    char text[LOG_RECORD_SIZE];
+} LogRecord;
+
+static struct {
+    LogRecord *records;
+    guintptr head;          // next position to claim, shared by producers
+    guintptr tail;          // next position to write, writer thread only
+    gint dropped;
+    gint stopping;
+} ring;
+
+static gboolean debug_enabled = FALSE;
+static char *log_path;
+static int log_fd = -1;
+static GThread *writer;
+static gint64 log_start;
+
+static GMutex secrets_lock;
+static GPtrArray *secrets;  // char*, wiped at shutdown
+
+// Field names whose values are never written, whatever the caller asks
+static const char * const secret_fields[] = {
+    "password", "passwd", "passphrase", "secret", NULL
+};
+
+// /var/rarch_installer0.log, 1, 2, ... whichever doesn't exist yet
+static int open_log_file(const char *dir, char **path) {
+    for (guint x = 0; x < 10000; x++) {
+        g_autofree char *candidate = g_strdup_printf("%s/rarch_installer%u.log", dir, x);
+        int fd = open(candidate, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+        if (fd >= 0) {
+            *path = g_steal_pointer(&candidate);
+            return fd;
+        }
+        if (errno != EEXIST)
+            return -1;
+    }
+
+    return -1;
+}
+
+// Copies message into text, at most size - 1 bytes, with every secret masked
+static void copy_scrubbed(char *text, gsize size, const char *message) {
+    gsize length = 0;
+
+    if (g_atomic_pointer_get(&secrets) == NULL) {
+        g_strlcpy(text, message, size);
+        return;
+    }
+
+    g_mutex_lock(&secrets_lock);
+    while (*message != '\0' && length + 1 < size) {
+        gsize matched = 0;
+
+        for (guint i = 0; secrets != NULL && i < secrets->len; i++) {
+            const char *secret = g_ptr_array_index(secrets, i);
+            gsize secret_length = strlen(secret);
+
+            if (strncmp(message, secret, secret_length) == 0) {
+                matched = secret_length;
+                break;
+            }
+        }
+
+        if (matched > 0) {
+            length += g_strlcpy(text + length, LOG_SECRET_MASK, size - length);
+            length = MIN(length, size - 1);
+            message += matched;
+        } else {
+            text[length++] = *message++;
+        }
+    }
+    text[length] = '\0';
+    g_mutex_unlock(&secrets_lock);
+}
+
+// Drains every published record; returns FALSE when there was nothing to do
+static gboolean write_pending(GString *file_out, GString *console_out, gint64 *last_time) {
+    gint dropped = g_atomic_int_and(&ring.dropped, 0);
+
+    g_string_truncate(file_out, 0);
+    g_string_truncate(console_out, 0);
+
+    if (dropped > 0)
+        g_string_append_printf(file_out, "(%d log records dropped)\n", dropped);
+
+    for (;;) {
+        LogRecord *record = &ring.records[ring.tail & (LOG_RING_SIZE - 1)];
+
+        if (g_atomic_pointer_get(&record->sequence) != ring.tail + 1)
+            break;
+
+        g_string_append_printf(file_out, "%11.6f %+10.3f ",
+                               (record->time - log_start) / (double) G_USEC_PER_SEC,
+                               (record->time - *last_time) / 1000.0);
+        gsize message = file_out->len;
+        g_string_append(file_out, record->text);
+        g_string_append_c(file_out, '\n');
+
+        g_string_append(console_out, "[DEBUG] ");
+        g_string_append_len(console_out, file_out->str + message, file_out->len - message);
+
+        *last_time = record->time;
+
+        // Hand the slot back for the producer one lap ahead
+        g_atomic_pointer_set(&record->sequence, ring.tail + LOG_RING_SIZE);
+        ring.tail++;
+    }
+
+    if (file_out->len == 0)
+        return FALSE;
+
+    if (log_fd >= 0) {
+        const char *data = file_out->str;
+        gsize remaining = file_out->len;
+
+        while (remaining > 0) {
+            ssize_t written = write(log_fd, data, remaining);
+
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                break;
+            data += written;
+            remaining -= written;
+        }
+    }
+
+    fwrite(console_out->str, 1, console_out->len, stdout);
+    fflush(stdout);
+
+    return TRUE;
+}
+
+static gpointer writer_thread(gpointer data) {
+    g_autoptr(GString) file_out = g_string_sized_new(64 * 1024);
+    g_autoptr(GString) console_out = g_string_sized_new(64 * 1024);
+    gint64 last_time = log_start;
+
+    for (;;) {
+        gboolean stopping = g_atomic_int_get(&ring.stopping);
+
+        if (write_pending(file_out, console_out, &last_time))
+            continue;
+        if (stopping)
+            break;
+
+        g_usleep(LOG_WRITER_IDLE_US);
+    }
+
+    return NULL;
+}
+
+static void log_open(void) {
+    if (ring.records != NULL)
+        return;
+
+    ring.records = g_new0(LogRecord, LOG_RING_SIZE);
+    for (guintptr i = 0; i < LOG_RING_SIZE; i++)
+        ring.records[i].sequence = i;
+
+    log_fd = open_log_file(LOG_DIR, &log_path);
+    if (log_fd < 0) {
+        // Not running as root, e.g. while developing
+        g_autofree char *fallback = g_build_filename(g_get_user_cache_dir(), "rarch-installer", NULL);
+
+        g_mkdir_with_parents(fallback, 0700);
+        log_fd = open_log_file(fallback, &log_path);
+    }
+
+    log_start = g_get_monotonic_time();
+    writer = g_thread_new("log-writer", writer_thread, NULL);
+    atexit(log_shutdown);
+
+    if (log_fd < 0)
+        g_printerr("Could not open a log file in %s: %s\n", LOG_DIR, g_strerror(errno));
+}
+
+void log_shutdown(void) {
+    if (writer == NULL)
+        return;
+
+    g_atomic_int_set(&ring.stopping, TRUE);
+    g_thread_join(writer);
+    writer = NULL;
+    debug_enabled = FALSE;
+
+    if (log_fd >= 0) {
+        fsync(log_fd);
+        close(log_fd);
+        log_fd = -1;
+    }
+
+    g_mutex_lock(&secrets_lock);
+    for (guint i = 0; secrets != NULL && i < secrets->len; i++) {
+        char *secret = g_ptr_array_index(secrets, i);
+        memset(secret, 0, strlen(secret));
+    }
+    g_clear_pointer(&secrets, g_ptr_array_unref);
+    g_mutex_unlock(&secrets_lock);
+}
+
+void log_set_debug(gboolean enabled) {
+    gboolean opening = enabled && ring.records == NULL;
+
+    if (enabled)
+        log_open();
+
+    debug_enabled = enabled;
+
+    if (opening && log_path != NULL)
+        debug_log("Logging to %s", log_path);
+}
+
+gboolean log_get_debug(void) {
+    return debug_enabled;
+}
+
+const char* log_get_path(void) {
+    return log_path;
+}
+
+static void log_record_v(const char *format, va_list args) {
+    guintptr position = g_atomic_pointer_get(&ring.head);
+    gint64 now = g_get_monotonic_time();
+    g_autofree char *long_message = NULL;
+    const char *message;
+    char buffer[LOG_FORMAT_SIZE];
+    va_list copy;
+
+    // Formatted in full first so the secrets are masked before truncation
+    va_copy(copy, args);
+    if (g_vsnprintf(buffer, sizeof(buffer), format, copy) < (gint) sizeof(buffer)) {
+        message = buffer;
+    } else {
+        long_message = g_strdup_vprintf(format, args);
+        message = long_message;
+    }
+    va_end(copy);
+
+    for (;;) {
+        LogRecord *record = &ring.records[position & (LOG_RING_SIZE - 1)];
+        gintptr lag = (gintptr) (g_atomic_pointer_get(&record->sequence) - position);
+
+        if (lag == 0) {
+            if (g_atomic_pointer_compare_and_exchange(&ring.head, position, position + 1)) {
+                // The slot is ours until the sequence is published
+                record->time = now;
+                copy_scrubbed(record->text, sizeof(record->text), message);
+                g_atomic_pointer_set(&record->sequence, position + 1);
+                return;
+            }
+            position = g_atomic_pointer_get(&ring.head);
+        } else if (lag < 0) {
+            // The writer is a whole ring behind
+            g_atomic_int_inc(&ring.dropped);
+            return;
+        } else {
+            position = g_atomic_pointer_get(&ring.head);
+        }
+    }
+}
+
+static void log_record(const char *format, ...) G_GNUC_PRINTF(1, 2);
+
+static void log_record(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    log_record_v(format, args);
+    va_end(args);
+}
+
+void debug_log(const char *format, ...) {
+    if (!debug_enabled)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    log_record_v(format, args);
+    va_end(args);
+}
+
+void log_input(const char *field, const char *value) {
+    if (!debug_enabled)
+        return;
+
+    for (guint i = 0; secret_fields[i] != NULL; i++) {
+        if (strstr(field, secret_fields[i]) != NULL) {
+            log_record("Input %s: (not logged)", field);
+            return;
+        }
+    }
+
+    log_record("Input %s: %s", field, value != NULL ? value : "(unset)");
+}
+
+void log_add_secret(const char *value) {
+    if (!debug_enabled || value == NULL || *value == '\0')
+        return;
+
+    g_mutex_lock(&secrets_lock);
+    if (secrets == NULL)
+        g_atomic_pointer_set(&secrets, g_ptr_array_new_with_free_func(g_free));
+    if (!g_ptr_array_find_with_equal_func(secrets, value, g_str_equal, NULL))
+        g_ptr_array_add(secrets, g_strdup(value));
+    g_mutex_unlock(&secrets_lock);
+}
+
+gint64 log_step_begin(const char *name) {
+    gint64 begin = g_get_monotonic_time();
+
+    if (debug_enabled)
+        log_record("Step '%s' started", name);
+
+    return begin;
+}
+
+void log_step_end(const char *name, gint64 begin, gboolean success) {
+    if (!debug_enabled)
+        return;
+
+    log_record("Step '%s' %s after %.3f ms", name, success ? "finished" : "failed",
+               (g_get_monotonic_time() - begin) / 1000.0);
+}
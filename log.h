@@ -0,0 +1,47 @@
+// File   : log.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Debug logging shared by the front end and the install engine.
+//
+// With --debug every record goes to /var/rarch_installer[x].log (x counts up
+// so earlier logs are kept) and to stdout. Callers only format into a slot
+// of a lock-free ring buffer; a writer thread does all of the I/O, so
+// logging stays cheap on hot paths such as streamed command output.
+//
+// Passwords never reach the log: values given to log_add_secret() are
+// replaced in every record before it is written, and log_input() refuses
+// to write fields that hold secrets.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_LOG_H
+#define RARCH_LOG_H
+
+#include <glib.h>
+
+// Enabling opens the log file and starts the writer thread
+void log_set_debug(gboolean enabled);
+gboolean log_get_debug(void);
+
+// NULL until logging is enabled
+const char* log_get_path(void);
+
+// Writes out everything still queued and closes the log; safe to call twice
+void log_shutdown(void);
+
+void debug_log(const char *format, ...) G_GNUC_PRINTF(1, 2);
+
+// Records a user input ("Save every input" in specs.md); password fields are refused
+void log_input(const char *field, const char *value);
+
+// value is masked in every later record until log_shutdown()
+void log_add_secret(const char *value);
+
+// Per-step timing: begin returns the start time to pass to end, which
+// records the time from the press (or start) to completion
+gint64 log_step_begin(const char *name);
+void log_step_end(const char *name, gint64 begin, gboolean success);
+
+#endif // RARCH_LOG_H
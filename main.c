@@ -34,83 +34,50 @@
 #include <glib/gprintf.h>
 #include <gtk/gtk.h>
 #include <glib.h>
+#include <string.h>
 
-typedef enum {
-    MODE_NORMAL,
-    MODE_OEM,
-    MODE_RECOVERY
-} InstallerMode;
+#include "bench.h"
+#include "cli.h"
+#include "config.h"
+#include "disks.h"
+#include "engine.h"
+#include "install.h"
+#include "log.h"
+#include "partplan.h"
+#include "pkgcache.h"
+#include "targets.h"
 
-typedef struct {
-    InstallerMode mode;
-    gboolean fullscreen;
-    gboolean debug;
-    gboolean show_version;
-    gboolean show_help;
-} InstallerConfig;
-
-static InstallerConfig config = {
-    .mode = MODE_NORMAL,
-    .fullscreen = FALSE,
-    .debug = FALSE,
-    .show_version = FALSE,
-    .show_help = FALSE
-};
+// GtkApplication's resource base path; the bundle is compiled into the binary
+#define APP_ID          "com.github.RileyMeta.Rarch_Installer"
+#define RESOURCE_PREFIX "/com/github/RileyMeta/Rarch_Installer"
+
+static InstallerConfig *config;
 
 static void print_version(void) {
-    g_print("Rarch Linux Installer v1.0.0\n");
+    g_print("Rarch Linux Installer v" RARCH_VERSION "\n");
     g_print("Built with GTK %d.%d.%d\n",
             gtk_get_major_version(),
             gtk_get_minor_version(),
             gtk_get_micro_version());
 }
 
-static void debug_log(const char *format, ...) {
-    if (!config.debug)
-        return;
-
-    va_list args;
-    va_start(args, format);
-    g_print("[DEBUG] ");
-    g_vprintf(format, args);
-    g_print("\n");
-    va_end(args);
-}
-
 static gint handle_local_options(GApplication *app,
                                  GVariantDict *options,
                                  gpointer user_data) {
     // Handle --version
-    if (g_variant_dict_lookup(options, "version", "b", &config.show_version)) {
-        if (config.show_version) {
-            print_version();
-            return 0; // Exit successfully
-        }
+    if (config->show_version) {
+        print_version();
+        return 0; // Exit successfully
     }
 
-    // Handle --oem
-    if (g_variant_dict_lookup(options, "oem", "b", NULL)) {
-        config.mode = MODE_OEM;
-        debug_log("OEM mode enabled");
-    }
+    // Handle --oem, --recovery and --debug
+    installer_config_finish(config);
 
-    // Handle --recovery
-    if (g_variant_dict_lookup(options, "recovery", "b", NULL)) {
-        config.mode = MODE_RECOVERY;
-        debug_log("Recovery mode enabled");
-    }
-
-    // Handle --fullscreen
-    g_variant_dict_lookup(options, "fullscreen", "b", &config.fullscreen);
-    if (config.fullscreen) {
-        debug_log("Fullscreen mode enabled");
-    }
-
-    // Handle --debug
-    g_variant_dict_lookup(options, "debug", "b", &config.debug);
-    if (config.debug) {
-        g_print("[DEBUG] Debug mode enabled\n");
-    }
+    // Handle --benchmark and --config: run unattended and exit before any UI is built
+    if (config->benchmark)
+        return bench_run(config);
+    if (config->answer_file != NULL)
+        return cli_run(config);
 
     return -1; // Continue with normal startup
 }
@@ -119,7 +86,7 @@ static void setup_window_for_mode(GtkWindow *window) {
     const char *title;
     const char *css_class;
 
-    switch (config.mode) {
+    switch (config->mode) {
         case MODE_OEM:
             title = "Rarch Installer - OEM Mode";
             css_class = "oem-mode";
@@ -140,7 +107,7 @@ static void setup_window_for_mode(GtkWindow *window) {
     gtk_window_set_title(window, title);
     gtk_widget_add_css_class(GTK_WIDGET(window), css_class);
 
-    if (config.fullscreen) {
+    if (config->fullscreen) {
         gtk_window_fullscreen(window);
         debug_log("Window set to fullscreen");
     } else {
@@ -148,38 +115,120 @@ static void setup_window_for_mode(GtkWindow *window) {
     }
 }
 
+// The stylesheet comes from the bundle in memory, like every other asset;
+// nothing is read from the (often slow) boot medium
+static void load_styles(void) {
+    GtkCssProvider *provider = gtk_css_provider_new();
+
+    gtk_css_provider_load_from_resource(provider, RESOURCE_PREFIX "/style.css");
+    gtk_style_context_add_provider_for_display(gdk_display_get_default(),
+                                               GTK_STYLE_PROVIDER(provider),
+                                               GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+    g_object_unref(provider);
+}
+
+// Images are decoded on a worker thread the first time a picture asks for
+// them and kept for any later one; the picture stays empty until then
+static GHashTable *assets;  // resource path -> GdkTexture*, main thread only
+
+static void decode_asset(GTask *task, gpointer source_object, gpointer task_data,
+                         GCancellable *cancellable) {
+    const char *path = task_data;
+    g_autoptr(GBytes) bytes = NULL;
+    GdkTexture *texture = NULL;
+    GError *error = NULL;
+
+    bytes = g_resources_lookup_data(path, G_RESOURCE_LOOKUP_FLAGS_NONE, &error);
+    if (bytes != NULL)
+        texture = gdk_texture_new_from_bytes(bytes, &error);
+
+    if (texture == NULL)
+        g_task_return_error(task, error);
+    else
+        g_task_return_pointer(task, texture, g_object_unref);
+}
+
+static void on_asset_decoded(GObject *source, GAsyncResult *result, gpointer user_data) {
+    GtkPicture *picture = user_data;
+    const char *path = g_task_get_task_data(G_TASK(result));
+    g_autoptr(GError) error = NULL;
+    GdkTexture *texture = g_task_propagate_pointer(G_TASK(result), &error);
+
+    if (texture != NULL) {
+        g_hash_table_insert(assets, g_strdup(path), texture);
+        gtk_picture_set_paintable(picture, GDK_PAINTABLE(texture));
+    } else {
+        debug_log("Could not decode %s: %s", path, error->message);
+    }
+
+    g_object_unref(picture);
+}
+
+static void load_asset(GtkPicture *picture, const char *name) {
+    g_autofree char *path = g_strconcat(RESOURCE_PREFIX "/", name, NULL);
+    GdkTexture *texture;
+    GTask *task;
+
+    if (assets == NULL)
+        assets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+
+    texture = g_hash_table_lookup(assets, path);
+    if (texture != NULL) {
+        gtk_picture_set_paintable(picture, GDK_PAINTABLE(texture));
+        return;
+    }
+
+    task = g_task_new(NULL, NULL, on_asset_decoded, g_object_ref(picture));
+    g_task_set_task_data(task, g_steal_pointer(&path), g_free);
+    g_task_run_in_thread(task, decode_asset);
+    g_object_unref(task);
+}
+
+// Page IDs
+typedef enum {
+    PAGE_NONE = -1,
+    PAGE_WELCOME,
+    PAGE_DISK_SELECTION,
+    PAGE_PARTITIONING,
+    PAGE_USER_SETUP,
+    PAGE_INSTALLATION,
+    PAGE_COMPLETE,
+    N_PAGES
+} PageId;
+
 // Page management structure
 typedef struct {
     GtkStack *stack;
     GtkButton *back_button;
     GtkButton *next_button;
     GtkWindow *window;
-    int current_page;
+    PageId current_page;
     int total_pages;
 } PageManager;
 
 static PageManager page_manager;
 
-// Page IDs
-static const char* PAGE_WELCOME = "welcome";
-static const char* PAGE_DISK_SELECTION = "disk_selection";
-static const char* PAGE_PARTITIONING = "partitioning";
-static const char* PAGE_USER_SETUP = "user_setup";
-static const char* PAGE_INSTALLATION = "installation";
-static const char* PAGE_COMPLETE = "complete";
+// Set at the top of main(), for the time-to-first-frame report
+static gint64 startup_time;
 
 static void update_navigation_buttons(void);
+static gboolean page_skipped(PageId id);
 static void on_next_clicked(GtkButton *button, gpointer user_data);
 static void on_back_clicked(GtkButton *button, gpointer user_data);
 
 static GtkWidget* create_welcome_page(void) {
+    g_autoptr(GtkBuilder) builder = gtk_builder_new_from_resource(RESOURCE_PREFIX "/ui/welcome.ui");
     GtkWidget *box, *label;
 
     box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
     gtk_widget_set_valign(box, GTK_ALIGN_CENTER);
     gtk_widget_set_halign(box, GTK_ALIGN_CENTER);
 
-    switch (config.mode) {
+    // The box takes its own reference to the header before the builder goes
+    gtk_box_append(GTK_BOX(box), GTK_WIDGET(gtk_builder_get_object(builder, "header")));
+    load_asset(GTK_PICTURE(gtk_builder_get_object(builder, "logo")), "images/logo.png");
+
+    switch (config->mode) {
         case MODE_OEM:
             label = gtk_label_new("OEM Installation Mode\n\n"
                                 "This will prepare the system for OEM deployment.\n"
@@ -198,43 +247,409 @@ static GtkWidget* create_welcome_page(void) {
     gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
     gtk_box_append(GTK_BOX(box), label);
 
+    // Index local package caches while the user is still reading this page
+    package_cache_start((const char * const *) config->package_caches);
+
     debug_log("Welcome page created");
     return box;
 }
 
+// Inputs collected from the pages, read when the installation starts
+typedef struct {
+    GtkListBox *disk_list;
+    GtkCheckButton *erase_disk;
+    GtkCheckButton *alongside;
+    GtkCheckButton *deploy_image;
+    GtkButton *image_button;
+    char *image;                // chosen on the partitioning page, or --image
+    GtkEditable *full_name;
+    GtkEditable *username;
+    GtkEditable *password;
+    GtkEditable *remove_users;  // Recovery only, NULL otherwise
+} InstallInputs;
+
+static InstallInputs install_inputs;
+
+// Disk list rows, kept in sync with the disk monitor
+typedef struct {
+    GtkListBox *list;
+    GHashTable *rows;       // kernel name -> GtkListBoxRow*
+    DiskMonitor *monitor;
+} DiskView;
+
+static DiskView disk_view;
+
+static int sort_disk_rows(GtkListBoxRow *a, GtkListBoxRow *b, gpointer user_data) {
+    return g_strcmp0(g_object_get_data(G_OBJECT(a), "device"),
+                     g_object_get_data(G_OBJECT(b), "device"));
+}
+
+static void on_disk_event(DiskEvent event, const DiskInfo *disk, gpointer user_data) {
+    GtkListBoxRow *row = g_hash_table_lookup(disk_view.rows, disk->name);
+
+    // Only the affected row is touched; the rest of the list stays as it is
+    if (event == DISK_REMOVED) {
+        if (row != NULL) {
+            gtk_list_box_remove(disk_view.list, GTK_WIDGET(row));
+            g_hash_table_remove(disk_view.rows, disk->name);
+        }
+        return;
+    }
+
+    g_autofree char *description = disk_info_describe(disk);
+
+    if (row == NULL) {
+        row = GTK_LIST_BOX_ROW(gtk_list_box_row_new());
+        gtk_list_box_row_set_child(row, gtk_label_new(description));
+        g_object_set_data_full(G_OBJECT(row), "device", g_strdup(disk->device), g_free);
+        gtk_list_box_append(disk_view.list, GTK_WIDGET(row));
+        g_hash_table_insert(disk_view.rows, g_strdup(disk->name), row);
+    } else {
+        gtk_label_set_text(GTK_LABEL(gtk_list_box_row_get_child(row)), description);
+        gtk_list_box_row_changed(row);
+    }
+
+    g_object_set_data(G_OBJECT(row), "partitions", GUINT_TO_POINTER(disk->n_partitions));
+}
+
 static GtkWidget* create_disk_selection_page(void) {
     GtkWidget *box, *label, *listbox;
 
     box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
 
     label = gtk_label_new("Select Installation Disk\n\n"
-                         "Choose the disk where you want to install the system.");
+                         "Choose the disk where you want to install the system.\n"
+                         "Hold Ctrl to install onto several disks at once.");
     gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
     gtk_box_append(GTK_BOX(box), label);
 
     // Create a simple listbox for disk selection
     listbox = gtk_list_box_new();
     gtk_widget_set_size_request(listbox, -1, 200);
+    gtk_list_box_set_placeholder(GTK_LIST_BOX(listbox), gtk_label_new("Scanning for disks..."));
+    gtk_list_box_set_sort_func(GTK_LIST_BOX(listbox), sort_disk_rows, NULL, NULL);
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(listbox), GTK_SELECTION_MULTIPLE);
 
-    // Add some example disks (in real implementation, scan for actual disks)
-    GtkWidget *row1 = gtk_list_box_row_new();
-    GtkWidget *disk1_label = gtk_label_new("/dev/sda - 500 GB SSD");
-    gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(row1), disk1_label);
-    gtk_list_box_append(GTK_LIST_BOX(listbox), row1);
+    gtk_box_append(GTK_BOX(box), listbox);
 
-    GtkWidget *row2 = gtk_list_box_row_new();
-    GtkWidget *disk2_label = gtk_label_new("/dev/sdb - 1 TB HDD");
-    gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(row2), disk2_label);
-    gtk_list_box_append(GTK_LIST_BOX(listbox), row2);
+    install_inputs.disk_list = GTK_LIST_BOX(listbox);
 
-    gtk_box_append(GTK_BOX(box), listbox);
+    // Rows fill in as disks are probed in the background
+    disk_view.list = GTK_LIST_BOX(listbox);
+    disk_view.rows = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    disk_view.monitor = disk_monitor_new(config->include_loop, on_disk_event, NULL);
 
     debug_log("Disk selection page created");
     return box;
 }
 
+static void set_image(const char *path) {
+    g_autofree char *name = NULL;
+
+    g_free(install_inputs.image);
+    install_inputs.image = g_strdup(path);
+
+    name = path != NULL ? g_path_get_basename(path) : NULL;
+    gtk_button_set_label(install_inputs.image_button, name != NULL ? name : "Choose image...");
+}
+
+static void on_image_chosen(GObject *source, GAsyncResult *result, gpointer user_data) {
+    g_autoptr(GFile) file = gtk_file_dialog_open_finish(GTK_FILE_DIALOG(source), result, NULL);
+    g_autofree char *path = file != NULL ? g_file_get_path(file) : NULL;
+
+    // Dismissing the dialog keeps whatever was chosen before
+    if (path == NULL)
+        return;
+
+    debug_log("Root image chosen: %s", path);
+    set_image(path);
+    gtk_check_button_set_active(install_inputs.deploy_image, TRUE);
+}
+
+static void on_choose_image(GtkButton *button, gpointer user_data) {
+    g_autoptr(GtkFileDialog) dialog = gtk_file_dialog_new();
+
+    gtk_file_dialog_set_title(dialog, "Choose a System Image");
+    gtk_file_dialog_open(dialog, GTK_WINDOW(gtk_widget_get_root(GTK_WIDGET(button))), NULL,
+                         on_image_chosen, NULL);
+}
+
+// The partition planner for Alongside and Manual. The plan is read from the
+// first selected disk when the page is entered and kept until another disk
+// is chosen; every change only edits the plan until the install starts.
+typedef struct {
+    GtkWidget *box;             // hidden while Erase is chosen
+    GtkListBox *segments;       // one row per partition or stretch of free space
+    GtkDropDown *use;
+    GtkCheckButton *format;
+    GtkSpinButton *size;        // MiB; 0 takes all the free space
+    GtkWidget *add;
+    GtkWidget *change;
+    GtkWidget *remove;
+    GtkWidget *undo;
+    GtkLabel *changes;          // what applying the plan would do
+    GtkLabel *status;           // the last edit's error
+    PartPlan *plan;
+    char *disk;                 // the plan's disk
+} PlanView;
+
+static PlanView plan_view;
+
+static void set_plan_status(const GError *error) {
+    gtk_label_set_text(plan_view.status, error != NULL ? error->message : "");
+}
+
+static void on_segment_selected(GtkListBox *list, GtkListBoxRow *row, gpointer user_data) {
+    const PlanPartition *partition = row != NULL ? g_object_get_data(G_OBJECT(row), "partition")
+                                                 : NULL;
+
+    gtk_widget_set_sensitive(plan_view.add, row != NULL && partition == NULL);
+    gtk_widget_set_sensitive(plan_view.change, partition != NULL);
+    gtk_widget_set_sensitive(plan_view.remove, partition != NULL);
+    gtk_widget_set_sensitive(GTK_WIDGET(plan_view.size),
+                             row != NULL && (partition == NULL || !partition->existing));
+
+    if (partition != NULL) {
+        gtk_drop_down_set_selected(plan_view.use, partition->use);
+        gtk_check_button_set_active(plan_view.format, partition->format);
+        gtk_spin_button_set_value(plan_view.size, (double) (partition->size / (1024 * 1024)));
+    }
+}
+
+// The list is rebuilt from the plan after every edit; the row at the same
+// offset stays selected
+static void refresh_plan_view(void) {
+    GtkListBoxRow *selected = gtk_list_box_get_selected_row(plan_view.segments);
+    guint64 selected_start = selected != NULL
+        ? *(guint64 *) g_object_get_data(G_OBJECT(selected), "start") : G_MAXUINT64;
+    g_autoptr(GArray) segments = NULL;
+    g_auto(GStrv) changes = NULL;
+    g_autofree char *text = NULL;
+
+    // Keeps the placeholder, which shows while there is no plan
+    gtk_list_box_remove_all(plan_view.segments);
+
+    gtk_widget_set_sensitive(plan_view.undo, plan_view.plan != NULL &&
+                                             part_plan_can_undo(plan_view.plan));
+    if (plan_view.plan == NULL) {
+        gtk_label_set_text(plan_view.changes, "");
+        on_segment_selected(plan_view.segments, NULL, NULL);
+        return;
+    }
+
+    segments = part_plan_get_segments(plan_view.plan);
+    for (guint i = 0; i < segments->len; i++) {
+        const PlanSegment *segment = &g_array_index(segments, PlanSegment, i);
+        const PlanPartition *partition = segment->partition;
+        g_autofree char *size = g_format_size_full(segment->size, G_FORMAT_SIZE_IEC_UNITS);
+        g_autofree char *description = NULL;
+        GtkWidget *row = gtk_list_box_row_new();
+        GtkWidget *label;
+
+        if (partition == NULL)
+            description = g_strdup_printf("Free space, %s", size);
+        else if (partition->use != PART_USE_NONE)
+            description = g_strdup_printf("Partition %u, %s, %s: %s", partition->number, size,
+                                          part_plan_type_name(partition->type),
+                                          part_plan_use_name(partition->use));
+        else
+            description = g_strdup_printf("Partition %u, %s, %s", partition->number, size,
+                                          part_plan_type_name(partition->type));
+
+        label = gtk_label_new(description);
+        gtk_widget_set_halign(label, GTK_ALIGN_START);
+        gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(row), label);
+        g_object_set_data_full(G_OBJECT(row), "start", g_memdup2(&segment->start, sizeof(guint64)),
+                               g_free);
+        g_object_set_data(G_OBJECT(row), "partition", (gpointer) partition);
+        gtk_list_box_append(plan_view.segments, row);
+
+        if (segment->start == selected_start)
+            gtk_list_box_select_row(plan_view.segments, GTK_LIST_BOX_ROW(row));
+    }
+
+    changes = part_plan_describe_changes(plan_view.plan);
+    text = g_strjoinv("\n", changes);
+    gtk_label_set_text(plan_view.changes, text);
+    on_segment_selected(plan_view.segments, gtk_list_box_get_selected_row(plan_view.segments),
+                        NULL);
+}
+
+static const char* selected_disk(void) {
+    GList *rows = gtk_list_box_get_selected_rows(install_inputs.disk_list);
+    const char *disk = rows != NULL ? g_object_get_data(G_OBJECT(rows->data), "device") : NULL;
+
+    g_list_free(rows);
+    return disk;
+}
+
+// Alongside lays out the usual partitions again; Manual goes on from there
+static void reset_plan(void) {
+    g_autoptr(GError) error = NULL;
+
+    if (plan_view.plan != NULL && gtk_check_button_get_active(install_inputs.alongside) &&
+        !part_plan_auto_alongside(plan_view.plan, MAX(config->swap_size, 0), &error))
+        debug_log("Alongside: %s", error->message);
+
+    set_plan_status(error);
+    refresh_plan_view();
+}
+
+// Reads the disk's table the first time the page shows it
+static void enter_partitioning(void) {
+    const char *disk = selected_disk();
+    g_autoptr(GError) error = NULL;
+
+    if (plan_view.box == NULL || g_strcmp0(disk, plan_view.disk) == 0)
+        return;
+
+    g_clear_pointer(&plan_view.plan, part_plan_unref);
+    g_free(plan_view.disk);
+    plan_view.disk = g_strdup(disk);
+
+    if (disk != NULL)
+        plan_view.plan = part_plan_read(disk, &error);
+
+    if (error != NULL) {
+        debug_log("Partition plan: %s", error->message);
+        set_plan_status(error);
+        refresh_plan_view();
+        return;
+    }
+
+    reset_plan();
+}
+
+static void on_scheme_toggled(GtkCheckButton *button, gpointer user_data) {
+    // Each radio button of the group toggles; only the one turned on matters
+    if (!gtk_check_button_get_active(button))
+        return;
+
+    gtk_widget_set_visible(plan_view.box, button != install_inputs.erase_disk);
+    if (button != install_inputs.erase_disk)
+        reset_plan();
+}
+
+static void on_plan_add(GtkButton *button, gpointer user_data) {
+    GtkListBoxRow *row = gtk_list_box_get_selected_row(plan_view.segments);
+    g_autoptr(GError) error = NULL;
+
+    if (row == NULL || plan_view.plan == NULL)
+        return;
+
+    part_plan_add(plan_view.plan, *(guint64 *) g_object_get_data(G_OBJECT(row), "start"),
+                  gtk_spin_button_get_value_as_int(plan_view.size),
+                  gtk_drop_down_get_selected(plan_view.use), &error);
+    set_plan_status(error);
+    refresh_plan_view();
+}
+
+static void on_plan_change(GtkButton *button, gpointer user_data) {
+    GtkListBoxRow *row = gtk_list_box_get_selected_row(plan_view.segments);
+    const PlanPartition *partition = row != NULL ? g_object_get_data(G_OBJECT(row), "partition")
+                                                 : NULL;
+    guint64 size_mib = gtk_spin_button_get_value_as_int(plan_view.size);
+    g_autoptr(GError) error = NULL;
+
+    if (partition == NULL)
+        return;
+
+    // One edit, so one Undo reverts the size and the use together
+    part_plan_change(plan_view.plan, partition->number, size_mib,
+                     gtk_drop_down_get_selected(plan_view.use),
+                     gtk_check_button_get_active(plan_view.format), &error);
+
+    set_plan_status(error);
+    refresh_plan_view();
+}
+
+static void on_plan_remove(GtkButton *button, gpointer user_data) {
+    GtkListBoxRow *row = gtk_list_box_get_selected_row(plan_view.segments);
+    const PlanPartition *partition = row != NULL ? g_object_get_data(G_OBJECT(row), "partition")
+                                                 : NULL;
+    g_autoptr(GError) error = NULL;
+
+    if (partition == NULL)
+        return;
+
+    part_plan_remove(plan_view.plan, partition->number, &error);
+    set_plan_status(error);
+    refresh_plan_view();
+}
+
+static void on_plan_undo(GtkButton *button, gpointer user_data) {
+    if (plan_view.plan == NULL)
+        return;
+
+    part_plan_undo(plan_view.plan);
+    set_plan_status(NULL);
+    refresh_plan_view();
+}
+
+static GtkWidget* create_plan_view(void) {
+    const char *uses[] = {
+        part_plan_use_name(PART_USE_NONE), part_plan_use_name(PART_USE_ESP),
+        part_plan_use_name(PART_USE_ROOT), part_plan_use_name(PART_USE_SWAP),
+        part_plan_use_name(PART_USE_HOME), NULL
+    };
+    GtkWidget *box, *scroll, *list, *row, *changes, *status;
+
+    box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
+
+    list = gtk_list_box_new();
+    scroll = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scroll), list);
+    gtk_widget_set_size_request(scroll, -1, 150);
+    gtk_list_box_set_placeholder(GTK_LIST_BOX(list), gtk_label_new("No partition table read"));
+    g_signal_connect(list, "row-selected", G_CALLBACK(on_segment_selected), NULL);
+    gtk_box_append(GTK_BOX(box), scroll);
+
+    row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    plan_view.use = GTK_DROP_DOWN(gtk_drop_down_new_from_strings(uses));
+    plan_view.format = GTK_CHECK_BUTTON(gtk_check_button_new_with_label("Format"));
+    plan_view.size = GTK_SPIN_BUTTON(gtk_spin_button_new_with_range(0, G_MAXINT, 1024));
+    plan_view.add = gtk_button_new_with_label("Add");
+    plan_view.change = gtk_button_new_with_label("Change");
+    plan_view.remove = gtk_button_new_with_label("Delete");
+    plan_view.undo = gtk_button_new_with_label("Undo");
+    gtk_box_append(GTK_BOX(row), GTK_WIDGET(plan_view.use));
+    gtk_box_append(GTK_BOX(row), GTK_WIDGET(plan_view.format));
+    gtk_box_append(GTK_BOX(row), gtk_label_new("MiB:"));
+    gtk_box_append(GTK_BOX(row), GTK_WIDGET(plan_view.size));
+    gtk_box_append(GTK_BOX(row), plan_view.add);
+    gtk_box_append(GTK_BOX(row), plan_view.change);
+    gtk_box_append(GTK_BOX(row), plan_view.remove);
+    gtk_box_append(GTK_BOX(row), plan_view.undo);
+    gtk_box_append(GTK_BOX(box), row);
+
+    g_signal_connect(plan_view.add, "clicked", G_CALLBACK(on_plan_add), NULL);
+    g_signal_connect(plan_view.change, "clicked", G_CALLBACK(on_plan_change), NULL);
+    g_signal_connect(plan_view.remove, "clicked", G_CALLBACK(on_plan_remove), NULL);
+    g_signal_connect(plan_view.undo, "clicked", G_CALLBACK(on_plan_undo), NULL);
+
+    // The dry run: nothing is written before the install starts
+    gtk_box_append(GTK_BOX(box), gtk_label_new("Changes made when the installation starts:"));
+    changes = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(changes), 0.0);
+    gtk_label_set_selectable(GTK_LABEL(changes), TRUE);
+    gtk_box_append(GTK_BOX(box), changes);
+
+    status = gtk_label_new(NULL);
+    gtk_label_set_wrap(GTK_LABEL(status), TRUE);
+    gtk_widget_add_css_class(status, "error");
+    gtk_box_append(GTK_BOX(box), status);
+
+    plan_view.box = box;
+    plan_view.segments = GTK_LIST_BOX(list);
+    plan_view.changes = GTK_LABEL(changes);
+    plan_view.status = GTK_LABEL(status);
+    refresh_plan_view();
+
+    return box;
+}
+
 static GtkWidget* create_partitioning_page(void) {
-    GtkWidget *box, *label, *radio1, *radio2, *radio3;
+    GtkWidget *box, *label, *radio1, *radio2, *radio3, *image_row, *deploy, *choose, *planner;
 
     box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
 
@@ -256,6 +671,33 @@ static GtkWidget* create_partitioning_page(void) {
     gtk_box_append(GTK_BOX(box), radio2);
     gtk_box_append(GTK_BOX(box), radio3);
 
+    install_inputs.erase_disk = GTK_CHECK_BUTTON(radio1);
+    install_inputs.alongside = GTK_CHECK_BUTTON(radio2);
+
+    // A prebuilt root image replaces package installation; it needs the erase layout
+    image_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 12);
+    deploy = gtk_check_button_new_with_label("Deploy a system image");
+    choose = gtk_button_new();
+    gtk_box_append(GTK_BOX(image_row), deploy);
+    gtk_box_append(GTK_BOX(image_row), choose);
+    gtk_box_append(GTK_BOX(box), image_row);
+
+    g_object_bind_property(radio1, "active", image_row, "sensitive", G_BINDING_SYNC_CREATE);
+    g_signal_connect(choose, "clicked", G_CALLBACK(on_choose_image), NULL);
+
+    install_inputs.deploy_image = GTK_CHECK_BUTTON(deploy);
+    install_inputs.image_button = GTK_BUTTON(choose);
+    set_image(config->image);
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(deploy), config->image != NULL);
+
+    planner = create_plan_view();
+    gtk_widget_set_visible(planner, FALSE);
+    gtk_box_append(GTK_BOX(box), planner);
+
+    g_signal_connect(radio1, "toggled", G_CALLBACK(on_scheme_toggled), NULL);
+    g_signal_connect(radio2, "toggled", G_CALLBACK(on_scheme_toggled), NULL);
+    g_signal_connect(radio3, "toggled", G_CALLBACK(on_scheme_toggled), NULL);
+
     debug_log("Partitioning page created");
     return box;
 }
@@ -292,14 +734,324 @@ static GtkWidget* create_user_setup_page(void) {
     gtk_entry_set_visibility(GTK_ENTRY(password_entry), FALSE);
     gtk_grid_attach(GTK_GRID(grid), password_entry, 1, 2, 1, 1);
 
+    // Recovery can also delete accounts, names separated by spaces
+    if (config->mode == MODE_RECOVERY) {
+        GtkWidget *remove_entry = gtk_entry_new();
+
+        gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Delete Accounts:"), 0, 3, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), remove_entry, 1, 3, 1, 1);
+        install_inputs.remove_users = GTK_EDITABLE(remove_entry);
+    }
+
     gtk_box_append(GTK_BOX(box), grid);
 
+    install_inputs.full_name = GTK_EDITABLE(name_entry);
+    install_inputs.username = GTK_EDITABLE(username_entry);
+    install_inputs.password = GTK_EDITABLE(password_entry);
+
     debug_log("User setup page created");
     return box;
 }
 
+// One bar per disk when several are installed at once
+typedef struct {
+    GtkProgressBar *bar;
+    double fraction;
+    char pending_status[ENGINE_STATUS_SIZE];
+} TargetProgress;
+
+// Installation progress, driven by the install graph of every target
+typedef struct {
+    GtkProgressBar *progress;       // the whole install; the only bar for one disk
+    GtkBox *target_box;
+    GtkLabel *error;                // why the last attempt failed, hidden otherwise
+    TargetProgress *target_bars;    // NULL for one disk
+    guint n_targets;
+    GCancellable *cancellable;
+    InstallTargets *targets;
+    InstallSettings *settings;
+    gboolean running;
+    gboolean finished;
+
+    // Progress arrives from every running step; the bars are updated once per frame
+    guint tick_id;
+    double pending_fraction;
+    char pending_status[ENGINE_STATUS_SIZE];
+} InstallView;
+
+static InstallView install_view;
+
+static InstallSettings* collect_install_settings(void) {
+    InstallSettings *settings = install_settings_new();
+    GList *rows;
+
+    installer_config_apply(config, settings);
+
+    // The flow passes over the partitioning page for empty disks and in
+    // Recovery; its buttons may still hold a choice made for another disk
+    if (page_skipped(PAGE_PARTITIONING) || install_inputs.erase_disk == NULL ||
+        gtk_check_button_get_active(install_inputs.erase_disk))
+        settings->partitioning = PARTITION_ERASE;
+    else if (gtk_check_button_get_active(install_inputs.alongside))
+        settings->partitioning = PARTITION_ALONGSIDE;
+    else
+        settings->partitioning = PARTITION_MANUAL;
+
+    // Without the partitioning page, --image applies as given
+    if (install_inputs.deploy_image != NULL) {
+        g_free(settings->image);
+        settings->image = settings->partitioning == PARTITION_ERASE &&
+                          gtk_check_button_get_active(install_inputs.deploy_image)
+                        ? g_strdup(install_inputs.image)
+                        : NULL;
+    }
+
+    // A plan read from another disk than the one selected now is stale
+    if (settings->partitioning != PARTITION_ERASE && plan_view.plan != NULL &&
+        g_strcmp0(plan_view.disk, selected_disk()) == 0)
+        settings->plan = part_plan_ref(plan_view.plan);
+
+    // The first selected disk is the target, any others are installed alongside it
+    rows = gtk_list_box_get_selected_rows(install_inputs.disk_list);
+    if (rows != NULL) {
+        GPtrArray *extra = g_ptr_array_new();
+
+        settings->disk = g_strdup(g_object_get_data(G_OBJECT(rows->data), "device"));
+        for (GList *l = rows->next; l != NULL; l = l->next)
+            g_ptr_array_add(extra, g_strdup(g_object_get_data(G_OBJECT(l->data), "device")));
+        g_ptr_array_add(extra, NULL);
+        settings->extra_disks = (char **) g_ptr_array_free(extra, FALSE);
+    }
+    g_list_free(rows);
+
+    // OEM never builds the user page, accounts are made at first boot
+    if (!page_skipped(PAGE_USER_SETUP) && install_inputs.username != NULL) {
+        settings->full_name = g_strdup(gtk_editable_get_text(install_inputs.full_name));
+        settings->username = g_strdup(gtk_editable_get_text(install_inputs.username));
+        settings->password = g_strdup(gtk_editable_get_text(install_inputs.password));
+        log_add_secret(settings->password);
+    }
+
+    if (install_inputs.remove_users != NULL) {
+        g_auto(GStrv) names = g_strsplit_set(gtk_editable_get_text(install_inputs.remove_users),
+                                             " ,", -1);
+        GPtrArray *remove = g_ptr_array_new();
+
+        for (guint i = 0; names[i] != NULL; i++) {
+            if (*names[i] != '\0')
+                g_ptr_array_add(remove, g_strdup(names[i]));
+        }
+        g_ptr_array_add(remove, NULL);
+        g_strfreev(settings->remove_users);
+        settings->remove_users = (char **) g_ptr_array_free(remove, FALSE);
+    }
+
+    log_input("disk", settings->disk);
+    for (guint i = 0; settings->extra_disks != NULL && settings->extra_disks[i] != NULL; i++)
+        log_input("extra_disk", settings->extra_disks[i]);
+    log_input("image", settings->image);
+    log_input("full_name", settings->full_name);
+    log_input("username", settings->username);
+    log_input("password", settings->password);
+    for (guint i = 0; settings->remove_users != NULL && settings->remove_users[i] != NULL; i++)
+        log_input("remove_user", settings->remove_users[i]);
+    return settings;
+}
+
+static gboolean apply_install_progress(GtkWidget *widget, GdkFrameClock *frame_clock,
+                                       gpointer user_data) {
+    gtk_progress_bar_set_fraction(install_view.progress, install_view.pending_fraction);
+
+    if (install_view.pending_status[0] != '\0') {
+        gtk_progress_bar_set_text(install_view.progress, install_view.pending_status);
+        install_view.pending_status[0] = '\0';
+    }
+
+    for (guint i = 0; install_view.target_bars != NULL && i < install_view.n_targets; i++) {
+        TargetProgress *target = &install_view.target_bars[i];
+
+        gtk_progress_bar_set_fraction(target->bar, target->fraction);
+        if (target->pending_status[0] != '\0') {
+            g_autofree char *text = g_strdup_printf("%s: %s",
+                                                    install_targets_get_disk(install_view.targets, i),
+                                                    target->pending_status);
+            gtk_progress_bar_set_text(target->bar, text);
+            target->pending_status[0] = '\0';
+        }
+    }
+
+    install_view.tick_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void on_install_progress(InstallTargets *targets, guint index,
+                                InstallTargetState state, double fraction,
+                                const char *status, gpointer user_data) {
+    if (install_view.target_bars == NULL) {
+        install_view.pending_fraction = fraction;
+        if (status != NULL)
+            g_strlcpy(install_view.pending_status, status, sizeof(install_view.pending_status));
+    } else {
+        // The main bar shows how far all disks are together
+        TargetProgress *target = &install_view.target_bars[index];
+        double total = 0.0;
+
+        target->fraction = fraction;
+        if (status != NULL)
+            g_strlcpy(target->pending_status, status, sizeof(target->pending_status));
+
+        for (guint i = 0; i < install_view.n_targets; i++)
+            total += install_view.target_bars[i].fraction;
+        install_view.pending_fraction = total / install_view.n_targets;
+    }
+
+    if (install_view.tick_id == 0)
+        install_view.tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(install_view.progress),
+                                                            apply_install_progress, NULL, NULL);
+}
+
+// Next turns into a retry while the page shows this (see update_navigation_buttons)
+static void show_install_error(const char *message) {
+    gtk_progress_bar_set_text(install_view.progress, "Installation failed");
+    gtk_label_set_text(install_view.error, message);
+    gtk_widget_set_visible(GTK_WIDGET(install_view.error), TRUE);
+}
+
+static void on_install_finished(GObject *source, GAsyncResult *result, gpointer user_data) {
+    GError *error = NULL;
+
+    install_view.running = FALSE;
+
+    // The final text must not be replaced by a late update, so what is
+    // still pending (every disk's own last state) is shown right away
+    if (install_view.tick_id != 0) {
+        gtk_widget_remove_tick_callback(GTK_WIDGET(install_view.progress), install_view.tick_id);
+        apply_install_progress(NULL, NULL, NULL);
+    }
+
+    if (!install_targets_run_finish(install_view.targets, result, &error)) {
+        debug_log("Installation failed: %s", error->message);
+        show_install_error(error->message);
+        g_error_free(error);
+    } else {
+        gtk_progress_bar_set_fraction(install_view.progress, 1.0);
+        gtk_progress_bar_set_text(install_view.progress, "Installation finished");
+        install_view.finished = TRUE;
+        debug_log("Installation finished");
+    }
+
+    g_clear_pointer(&install_view.targets, install_targets_free);
+    g_clear_pointer(&install_view.settings, install_settings_free);
+    update_navigation_buttons();
+}
+
+// A bar per disk below the main one, or none for a single disk
+static void create_target_bars(void) {
+    GtkWidget *child;
+
+    while ((child = gtk_widget_get_first_child(GTK_WIDGET(install_view.target_box))) != NULL)
+        gtk_box_remove(install_view.target_box, child);
+    g_clear_pointer(&install_view.target_bars, g_free);
+
+    install_view.n_targets = install_targets_get_n_targets(install_view.targets);
+    if (install_view.n_targets < 2)
+        return;
+
+    install_view.target_bars = g_new0(TargetProgress, install_view.n_targets);
+    for (guint i = 0; i < install_view.n_targets; i++) {
+        GtkWidget *bar = gtk_progress_bar_new();
+        g_autofree char *text = g_strdup_printf("%s: Waiting to start...",
+                                                install_targets_get_disk(install_view.targets, i));
+
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(bar), text);
+        gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(bar), TRUE);
+        gtk_box_append(install_view.target_box, bar);
+        install_view.target_bars[i].bar = GTK_PROGRESS_BAR(bar);
+    }
+
+    g_autofree char *text = g_strdup_printf("Installing onto %u disks", install_view.n_targets);
+    gtk_progress_bar_set_text(install_view.progress, text);
+}
+
+// Caught here rather than by useradd or hostnamectl at the very end
+static gboolean check_names(const InstallSettings *settings, GError **error) {
+    if (settings->username != NULL && *settings->username != '\0' &&
+        !install_check_username(settings->username, error))
+        return FALSE;
+
+    for (guint i = 0; settings->remove_users != NULL && settings->remove_users[i] != NULL; i++) {
+        if (!install_check_username(settings->remove_users[i], error))
+            return FALSE;
+    }
+
+    return settings->hostname == NULL || install_check_hostname(settings->hostname, error);
+}
+
+static void start_installation(void) {
+    g_autoptr(GError) error = NULL;
+
+    if (install_view.running || install_view.finished)
+        return;
+
+    install_view.settings = collect_install_settings();
+    if (install_view.settings->disk == NULL) {
+        show_install_error("No installation disk selected");
+        g_clear_pointer(&install_view.settings, install_settings_free);
+        return;
+    }
+
+    if (!check_names(install_view.settings, &error)) {
+        show_install_error(error->message);
+        g_clear_pointer(&install_view.settings, install_settings_free);
+        return;
+    }
+
+    // Ticked without a file would quietly install packages instead
+    if (install_inputs.deploy_image != NULL && install_view.settings->partitioning == PARTITION_ERASE &&
+        gtk_check_button_get_active(install_inputs.deploy_image) && install_view.settings->image == NULL) {
+        show_install_error("No system image chosen to deploy");
+        g_clear_pointer(&install_view.settings, install_settings_free);
+        return;
+    }
+
+    if (install_view.settings->partitioning != PARTITION_ERASE && config->mode != MODE_RECOVERY) {
+        if (install_view.settings->extra_disks != NULL && install_view.settings->extra_disks[0] != NULL)
+            g_set_error(&error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                        "Only \"Erase disk and install\" can install onto several disks");
+        else if (install_view.settings->plan == NULL)
+            g_set_error(&error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "The partition table of %s could not be read", install_view.settings->disk);
+        else
+            part_plan_check(install_view.settings->plan, &error);
+
+        if (error != NULL) {
+            show_install_error(error->message);
+            g_clear_pointer(&install_view.settings, install_settings_free);
+            return;
+        }
+    }
+
+    debug_log("Installation started");
+
+    // A retry starts from a clean page
+    gtk_widget_set_visible(GTK_WIDGET(install_view.error), FALSE);
+    gtk_progress_bar_set_fraction(install_view.progress, 0.0);
+    gtk_progress_bar_set_text(install_view.progress, "Waiting to start...");
+    install_view.pending_fraction = 0.0;
+
+    g_clear_object(&install_view.cancellable);
+    install_view.cancellable = g_cancellable_new();
+    install_view.targets = install_targets_new(install_view.settings);
+    install_view.running = TRUE;
+    create_target_bars();
+
+    install_targets_set_func(install_view.targets, on_install_progress, NULL);
+    install_targets_run_async(install_view.targets, install_view.cancellable,
+                              on_install_finished, NULL);
+}
+
 static GtkWidget* create_installation_page(void) {
-    GtkWidget *box, *label, *progress;
+    GtkWidget *box, *label, *progress, *target_box, *error;
 
     box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
     gtk_widget_set_valign(box, GTK_ALIGN_CENTER);
@@ -310,14 +1062,33 @@ static GtkWidget* create_installation_page(void) {
     gtk_box_append(GTK_BOX(box), label);
 
     progress = gtk_progress_bar_new();
-    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress), 0.45);
-    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(progress), "Installing packages...");
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress), 0.0);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(progress), "Waiting to start...");
     gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(progress), TRUE);
     gtk_widget_set_size_request(progress, 400, -1);
     gtk_widget_set_halign(progress, GTK_ALIGN_CENTER);
 
     gtk_box_append(GTK_BOX(box), progress);
 
+    // Filled when the install starts, if there is more than one disk
+    target_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
+    gtk_widget_set_size_request(target_box, 400, -1);
+    gtk_widget_set_halign(target_box, GTK_ALIGN_CENTER);
+    gtk_box_append(GTK_BOX(box), target_box);
+
+    error = gtk_label_new(NULL);
+    gtk_label_set_wrap(GTK_LABEL(error), TRUE);
+    gtk_label_set_selectable(GTK_LABEL(error), TRUE);
+    gtk_widget_set_size_request(error, 400, -1);
+    gtk_widget_set_halign(error, GTK_ALIGN_CENTER);
+    gtk_widget_add_css_class(error, "error");
+    gtk_widget_set_visible(error, FALSE);
+    gtk_box_append(GTK_BOX(box), error);
+
+    install_view.progress = GTK_PROGRESS_BAR(progress);
+    install_view.target_box = GTK_BOX(target_box);
+    install_view.error = GTK_LABEL(error);
+
     debug_log("Installation page created");
     return box;
 }
@@ -329,7 +1100,7 @@ static GtkWidget* create_complete_page(void) {
     gtk_widget_set_valign(box, GTK_ALIGN_CENTER);
 
     label = gtk_label_new("Installation Complete!\n\n"
-                         "The system has been successfully installed.\n"
+                         "The system has been installed and verified.\n"
                          "Please restart your computer to boot into the new system.");
     gtk_widget_set_halign(label, GTK_ALIGN_CENTER);
     gtk_box_append(GTK_BOX(box), label);
@@ -338,98 +1109,232 @@ static GtkWidget* create_complete_page(void) {
     return box;
 }
 
+// What the navigation buttons look like on a page
+typedef struct {
+    const char *back_label;
+    gboolean back_exits;        // back closes the window instead of going back
+    const char *next_label;
+    const char *next_class;
+    const char *busy_label;     // next is disabled with this label while installing
+    const char *retry_label;    // next reruns the page's enter with this label until it succeeds
+} PageButtons;
+
+static const PageButtons default_buttons = { "Back", FALSE, "Next", "suggested-action", NULL, NULL };
+
+static gboolean partitioning_needed(void);
+
+// Page registry, indexed by PageId. Pages are only built the first time
+// they are shown or prefetched, so startup pays for the welcome page alone.
+typedef struct {
+    const char *name;
+    GtkWidget* (*create)(void);
+    void (*enter)(void);            // runs when Next arrives here, may be NULL
+    gboolean (*shown)(void);        // NULL: always; FALSE skips the page
+    const PageButtons *buttons;     // NULL: default_buttons
+    GtkWidget *widget;              // NULL until built
+} PageEntry;
+
+static PageEntry pages[N_PAGES] = {
+    [PAGE_WELCOME] = { "welcome", create_welcome_page, NULL, NULL,
+                       &(const PageButtons) { "Exit", TRUE, "Next", "suggested-action", NULL, NULL } },
+    [PAGE_DISK_SELECTION] = { "disk_selection", create_disk_selection_page, NULL, NULL, NULL },
+    [PAGE_PARTITIONING] = { "partitioning", create_partitioning_page, enter_partitioning,
+                            partitioning_needed, NULL },
+    [PAGE_USER_SETUP] = { "user_setup", create_user_setup_page, NULL, NULL, NULL },
+    [PAGE_INSTALLATION] = { "installation", create_installation_page, start_installation, NULL,
+                            &(const PageButtons) { "Back", FALSE, "Next", "suggested-action",
+                                                   "Installing...", "Try Again" } },
+    [PAGE_COMPLETE] = { "complete", create_complete_page, NULL, NULL,
+                        &(const PageButtons) { "Back", FALSE, "Restart", "destructive-action", NULL, NULL } },
+};
+
+typedef struct {
+    PageId next;
+    PageId back;
+} PageTransition;
+
+// Per-mode flows. OEM leaves accounts to first boot, and Recovery works on
+// an existing layout, so each skips the page whose input it never uses.
+static const PageTransition transitions[][N_PAGES] = {
+    [MODE_NORMAL] = {
+        [PAGE_WELCOME]        = { PAGE_DISK_SELECTION, PAGE_NONE },
+        [PAGE_DISK_SELECTION] = { PAGE_PARTITIONING,   PAGE_WELCOME },
+        [PAGE_PARTITIONING]   = { PAGE_USER_SETUP,     PAGE_DISK_SELECTION },
+        [PAGE_USER_SETUP]     = { PAGE_INSTALLATION,   PAGE_PARTITIONING },
+        [PAGE_INSTALLATION]   = { PAGE_COMPLETE,       PAGE_USER_SETUP },
+        [PAGE_COMPLETE]       = { PAGE_NONE,           PAGE_INSTALLATION },
+    },
+    [MODE_OEM] = {
+        [PAGE_WELCOME]        = { PAGE_DISK_SELECTION, PAGE_NONE },
+        [PAGE_DISK_SELECTION] = { PAGE_PARTITIONING,   PAGE_WELCOME },
+        [PAGE_PARTITIONING]   = { PAGE_INSTALLATION,   PAGE_DISK_SELECTION },
+        [PAGE_USER_SETUP]     = { PAGE_NONE,           PAGE_NONE },
+        [PAGE_INSTALLATION]   = { PAGE_COMPLETE,       PAGE_PARTITIONING },
+        [PAGE_COMPLETE]       = { PAGE_NONE,           PAGE_INSTALLATION },
+    },
+    [MODE_RECOVERY] = {
+        [PAGE_WELCOME]        = { PAGE_DISK_SELECTION, PAGE_NONE },
+        [PAGE_DISK_SELECTION] = { PAGE_USER_SETUP,     PAGE_WELCOME },
+        [PAGE_PARTITIONING]   = { PAGE_NONE,           PAGE_NONE },
+        [PAGE_USER_SETUP]     = { PAGE_INSTALLATION,   PAGE_DISK_SELECTION },
+        [PAGE_INSTALLATION]   = { PAGE_COMPLETE,       PAGE_USER_SETUP },
+        [PAGE_COMPLETE]       = { PAGE_NONE,           PAGE_INSTALLATION },
+    },
+};
+
+// An empty disk has nothing to keep, so there is nothing to choose either
+static gboolean partitioning_needed(void) {
+    GList *rows = gtk_list_box_get_selected_rows(install_inputs.disk_list);
+    gboolean needed = rows == NULL;
+
+    for (GList *l = rows; l != NULL && !needed; l = l->next)
+        needed = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(l->data), "partitions")) > 0;
+
+    g_list_free(rows);
+    return needed;
+}
+
+// Follows the mode's table past pages whose condition says to skip them
+static PageId resolve_transition(PageId page, gboolean forward) {
+    const PageTransition *table = transitions[config->mode];
+
+    do {
+        page = forward ? table[page].next : table[page].back;
+    } while (page != PAGE_NONE && pages[page].shown != NULL && !pages[page].shown());
+
+    return page;
+}
+
+// Whether the mode's flow leaves the page out, or its condition skips it now
+static gboolean page_skipped(PageId id) {
+    const PageTransition *table = transitions[config->mode];
+
+    if (table[id].next == PAGE_NONE && table[id].back == PAGE_NONE)
+        return TRUE;
+    return pages[id].shown != NULL && !pages[id].shown();
+}
+
+static void ensure_page(PageId id) {
+    PageEntry *page = &pages[id];
+    gint64 start;
+
+    if (page->widget != NULL)
+        return;
+
+    start = g_get_monotonic_time();
+    page->widget = page->create();
+    gtk_stack_add_named(page_manager.stack, page->widget, page->name);
+
+    debug_log("Page %s built in %.2f ms", page->name,
+              (g_get_monotonic_time() - start) / 1000.0);
+}
+
+static gboolean prefetch_page(gpointer user_data) {
+    ensure_page(GPOINTER_TO_INT(user_data));
+    return G_SOURCE_REMOVE;
+}
+
+// Builds the following page from an idle callback: the redraws of the slide
+// transition have higher priority, so the work lands between its frames
+static void schedule_prefetch(PageId id) {
+    PageId next = resolve_transition(id, TRUE);
+
+    if (next == PAGE_NONE || pages[next].widget != NULL)
+        return;
+
+    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, prefetch_page, GINT_TO_POINTER(next), NULL);
+}
+
+static void show_page(PageId id) {
+    ensure_page(id);
+    gtk_stack_set_visible_child(page_manager.stack, pages[id].widget);
+    page_manager.current_page = id;
+    schedule_prefetch(id);
+}
+
+static void on_first_frame(GdkFrameClock *frame_clock, gpointer user_data) {
+    g_signal_handlers_disconnect_by_func(frame_clock, on_first_frame, user_data);
+
+    debug_log("Time to first frame: %.1f ms",
+              (g_get_monotonic_time() - startup_time) / 1000.0);
+
+    // Only now start on the next page, so it never delays the first frame
+    schedule_prefetch(page_manager.current_page);
+}
+
+static void on_window_realize(GtkWidget *window, gpointer user_data) {
+    GdkFrameClock *frame_clock = gtk_widget_get_frame_clock(window);
+
+    g_signal_connect(frame_clock, "after-paint", G_CALLBACK(on_first_frame), NULL);
+}
+
 static void on_next_clicked(GtkButton *button, gpointer user_data) {
-    const char *current_visible = gtk_stack_get_visible_child_name(page_manager.stack);
+    const PageButtons *buttons = pages[page_manager.current_page].buttons;
+    PageId next = resolve_transition(page_manager.current_page, TRUE);
+    gint64 pressed;
 
-    debug_log("Next clicked from page: %s", current_visible);
+    debug_log("Next clicked from page: %s", pages[page_manager.current_page].name);
 
-    if (g_strcmp0(current_visible, PAGE_WELCOME) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_DISK_SELECTION);
-        page_manager.current_page = 1;
-    }
-    else if (g_strcmp0(current_visible, PAGE_DISK_SELECTION) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_PARTITIONING);
-        page_manager.current_page = 2;
-    }
-    else if (g_strcmp0(current_visible, PAGE_PARTITIONING) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_USER_SETUP);
-        page_manager.current_page = 3;
-    }
-    else if (g_strcmp0(current_visible, PAGE_USER_SETUP) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_INSTALLATION);
-        page_manager.current_page = 4;
-    }
-    else if (g_strcmp0(current_visible, PAGE_INSTALLATION) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_COMPLETE);
-        page_manager.current_page = 5;
+    // The page's work failed or never started; Next tries it again in place
+    if (buttons != NULL && buttons->retry_label != NULL && !install_view.finished) {
+        pages[page_manager.current_page].enter();
+        update_navigation_buttons();
+        return;
     }
 
+    if (next == PAGE_NONE)
+        return;
+
+    pressed = log_step_begin("next");
+    show_page(next);
+    if (pages[next].enter != NULL)
+        pages[next].enter();
+
     update_navigation_buttons();
+    log_step_end("next", pressed, TRUE);
 }
 
 static void on_back_clicked(GtkButton *button, gpointer user_data) {
-    const char *current_visible = gtk_stack_get_visible_child_name(page_manager.stack);
+    const PageButtons *buttons = pages[page_manager.current_page].buttons;
+    PageId back;
+    gint64 pressed;
 
-    debug_log("Back clicked from page: %s", current_visible);
+    debug_log("Back clicked from page: %s", pages[page_manager.current_page].name);
 
-    if (g_strcmp0(current_visible, PAGE_DISK_SELECTION) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_WELCOME);
-        page_manager.current_page = 0;
-    }
-    else if (g_strcmp0(current_visible, PAGE_PARTITIONING) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_DISK_SELECTION);
-        page_manager.current_page = 1;
-    }
-    else if (g_strcmp0(current_visible, PAGE_USER_SETUP) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_PARTITIONING);
-        page_manager.current_page = 2;
-    }
-    else if (g_strcmp0(current_visible, PAGE_INSTALLATION) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_USER_SETUP);
-        page_manager.current_page = 3;
-    }
-    else if (g_strcmp0(current_visible, PAGE_COMPLETE) == 0) {
-        gtk_stack_set_visible_child_name(page_manager.stack, PAGE_INSTALLATION);
-        page_manager.current_page = 4;
+    if (buttons != NULL && buttons->back_exits) {
+        gtk_window_close(page_manager.window);
+        return;
     }
 
+    back = resolve_transition(page_manager.current_page, FALSE);
+    if (back == PAGE_NONE)
+        return;
+
+    pressed = log_step_begin("back");
+    show_page(back);
     update_navigation_buttons();
+    log_step_end("back", pressed, TRUE);
 }
 
 static void update_navigation_buttons(void) {
-    const char *current_visible = gtk_stack_get_visible_child_name(page_manager.stack);
-
-    // Update back button
-    if (g_strcmp0(current_visible, PAGE_WELCOME) == 0) {
-        gtk_button_set_label(page_manager.back_button, "Exit");
-        g_signal_handlers_disconnect_by_func(page_manager.back_button,
-                                           G_CALLBACK(on_back_clicked), NULL);
-        g_signal_connect_swapped(page_manager.back_button, "clicked",
-                               G_CALLBACK(gtk_window_close), page_manager.window);
-    } else {
-        gtk_button_set_label(page_manager.back_button, "Back");
-        g_signal_handlers_disconnect_by_func(page_manager.back_button,
-                                           G_CALLBACK(gtk_window_close), NULL);
-        g_signal_connect(page_manager.back_button, "clicked",
-                        G_CALLBACK(on_back_clicked), NULL);
-    }
-
-    // Update next button
-    if (g_strcmp0(current_visible, PAGE_COMPLETE) == 0) {
-        gtk_button_set_label(page_manager.next_button, "Restart");
-        gtk_widget_remove_css_class(GTK_WIDGET(page_manager.next_button), "suggested-action");
-        gtk_widget_add_css_class(GTK_WIDGET(page_manager.next_button), "destructive-action");
-    } else if (g_strcmp0(current_visible, PAGE_INSTALLATION) == 0) {
-        gtk_widget_set_sensitive(GTK_WIDGET(page_manager.next_button), FALSE);
-        gtk_button_set_label(page_manager.next_button, "Installing...");
-    } else {
-        gtk_widget_set_sensitive(GTK_WIDGET(page_manager.next_button), TRUE);
-        gtk_button_set_label(page_manager.next_button, "Next");
-        gtk_widget_remove_css_class(GTK_WIDGET(page_manager.next_button), "destructive-action");
-        gtk_widget_add_css_class(GTK_WIDGET(page_manager.next_button), "suggested-action");
-    }
-
-    debug_log("Navigation buttons updated for page: %s", current_visible);
+    const PageButtons *buttons = pages[page_manager.current_page].buttons;
+    GtkWidget *next = GTK_WIDGET(page_manager.next_button);
+    gboolean busy, retry;
+
+    if (buttons == NULL)
+        buttons = &default_buttons;
+    busy = buttons->busy_label != NULL && install_view.running;
+    retry = buttons->retry_label != NULL && !install_view.running && !install_view.finished;
+
+    gtk_button_set_label(page_manager.back_button, buttons->back_label);
+    gtk_button_set_label(page_manager.next_button,
+                         busy ? buttons->busy_label : retry ? buttons->retry_label : buttons->next_label);
+    gtk_widget_set_sensitive(next, !busy);
+    gtk_widget_remove_css_class(next, "suggested-action");
+    gtk_widget_remove_css_class(next, "destructive-action");
+    gtk_widget_add_css_class(next, buttons->next_class);
+
+    debug_log("Navigation buttons updated for page: %s", pages[page_manager.current_page].name);
 }
 
 static void create_installer_ui(GtkWindow *window) {
@@ -442,14 +1347,6 @@ static void create_installer_ui(GtkWindow *window) {
     gtk_stack_set_transition_type(GTK_STACK(stack), GTK_STACK_TRANSITION_TYPE_SLIDE_LEFT_RIGHT);
     gtk_stack_set_transition_duration(GTK_STACK(stack), 300);
 
-    // Add all pages to the stack
-    gtk_stack_add_named(GTK_STACK(stack), create_welcome_page(), PAGE_WELCOME);
-    gtk_stack_add_named(GTK_STACK(stack), create_disk_selection_page(), PAGE_DISK_SELECTION);
-    gtk_stack_add_named(GTK_STACK(stack), create_partitioning_page(), PAGE_PARTITIONING);
-    gtk_stack_add_named(GTK_STACK(stack), create_user_setup_page(), PAGE_USER_SETUP);
-    gtk_stack_add_named(GTK_STACK(stack), create_installation_page(), PAGE_INSTALLATION);
-    gtk_stack_add_named(GTK_STACK(stack), create_complete_page(), PAGE_COMPLETE);
-
     // Set margins for the stack
     gtk_widget_set_margin_top(stack, 24);
     gtk_widget_set_margin_bottom(stack, 24);
@@ -480,21 +1377,21 @@ static void create_installer_ui(GtkWindow *window) {
     page_manager.back_button = GTK_BUTTON(back_button);
     page_manager.next_button = GTK_BUTTON(next_button);
     page_manager.window = window;
-    page_manager.current_page = 0;
-    page_manager.total_pages = 6;
+    page_manager.current_page = PAGE_WELCOME;
+    page_manager.total_pages = N_PAGES;
 
-    // Connect signals
+    // Connect signals once; the page tables decide what a click does
     g_signal_connect(next_button, "clicked", G_CALLBACK(on_next_clicked), NULL);
-    g_signal_connect_swapped(back_button, "clicked",
-                           G_CALLBACK(gtk_window_close), window);
+    g_signal_connect(back_button, "clicked", G_CALLBACK(on_back_clicked), NULL);
 
-    // Set initial page
-    gtk_stack_set_visible_child_name(GTK_STACK(stack), PAGE_WELCOME);
+    // Set initial page; the rest are built on demand, starting after the first frame
+    ensure_page(PAGE_WELCOME);
+    gtk_stack_set_visible_child(GTK_STACK(stack), pages[PAGE_WELCOME].widget);
     update_navigation_buttons();
 
     gtk_window_set_child(window, main_box);
 
-    debug_log("UI created for mode: %d with stack navigation", config.mode);
+    debug_log("UI created for mode: %d with stack navigation", config->mode);
 }
 
 static void activate(GtkApplication *app, gpointer user_data) {
@@ -502,7 +1399,11 @@ static void activate(GtkApplication *app, gpointer user_data) {
 
     debug_log("Application activating");
 
+    load_styles();
+    gtk_window_set_default_icon_name(APP_ID);
+
     window = gtk_application_window_new(app);
+    g_signal_connect(window, "realize", G_CALLBACK(on_window_realize), NULL);
     setup_window_for_mode(GTK_WINDOW(window));
     create_installer_ui(GTK_WINDOW(window));
 
@@ -515,33 +1416,21 @@ int main(int argc, char *argv[]) {
     GtkApplication *app;
     int status;
 
-    app = gtk_application_new("com.github.RileyMeta.Rarch_Installer", G_APPLICATION_DEFAULT_FLAGS);
+    startup_time = g_get_monotonic_time();
+    config = installer_config_get();
+
+    // --headless hands over before GTK is ever initialized
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0)
+            return cli_main(argc, argv);
+        if (strcmp(argv[i], "--") == 0)
+            break;
+    }
+
+    app = gtk_application_new(APP_ID, G_APPLICATION_DEFAULT_FLAGS);
 
     // Add command line options (--help is automatic)
-    g_application_add_main_option(G_APPLICATION(app),
-                                  "version", 'V', G_OPTION_FLAG_NONE,
-                                  G_OPTION_ARG_NONE,
-                                  "Show version information", NULL);
-
-    g_application_add_main_option(G_APPLICATION(app),
-                                  "oem", 'O', G_OPTION_FLAG_NONE,
-                                  G_OPTION_ARG_NONE,
-                                  "Run in OEM mode", NULL);
-
-    g_application_add_main_option(G_APPLICATION(app),
-                                "recovery", 'R', G_OPTION_FLAG_NONE,
-                                G_OPTION_ARG_NONE,
-                                "Show help information", NULL);
-
-    g_application_add_main_option(G_APPLICATION(app),
-                                  "fullscreen", 'f', G_OPTION_FLAG_NONE,
-                                  G_OPTION_ARG_NONE,
-                                  "Run in fullscreen mode", NULL);
-
-    g_application_add_main_option(G_APPLICATION(app),
-                                  "debug", 'd', G_OPTION_FLAG_NONE,
-                                  G_OPTION_ARG_NONE,
-                                  "Enable debug output", NULL);
+    g_application_add_main_option_entries(G_APPLICATION(app), installer_config_get_entries());
 
     // Connect signals
     g_signal_connect(app, "handle-local-options",
@@ -550,6 +1439,7 @@ int main(int argc, char *argv[]) {
 
     status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
+    log_shutdown();
 
     return status;
 }
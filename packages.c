@@ -0,0 +1,931 @@
+// File   : packages.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Package pipeline. See packages.h.
+//
+// Stages, all overlapping once resolution is done:
+//   resolve  - pacman -Sy/-Sp against a private dbpath, sync db desc entries
+//              read through bsdtar for sizes, checksums and dependencies
+//   fetch    - `connections` workers copying (file://) or curl-ing packages
+//              and their detached signatures
+//   verify   - one worker per core hashing finished downloads (sha256)
+//   install  - this job's own thread, handing every package whose
+//              dependencies are installed or verified to pacstrap -U
+//
+// Every download is claimed in the package cache first, so when several
+// pipelines run at once only one of them fetches and hashes each file and
+// the others copy (or reflink) the verified result from its target.
+//
+// Install batches are kept reasonably large because every pacman transaction
+// runs the hooks again.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/utsname.h>
+
+#include "log.h"
+#include "packages.h"
+#include "pacprogress.h"
+#include "pkgcache.h"
+
+#define PIPELINE_HASH_BUFFER  (1024 * 1024)
+#define PIPELINE_MIN_BATCH    32
+#define PIPELINE_WAIT_USEC    (100 * 1000)
+
+typedef enum {
+    PACKAGE_QUEUED,
+    PACKAGE_VERIFIED,
+    PACKAGE_INSTALLED
+} PackageState;
+
+typedef struct {
+    char *repo;
+    char *name;
+    char *version;
+    char *filename;
+    char *sha256;
+    char *path;             // local file once fetched
+    guint64 csize;
+    guint64 isize;          // installed size, weights install progress
+    GPtrArray *depends;     // raw dependency names, version constraints stripped
+    GPtrArray *provides;
+    GPtrArray *deps;        // PackageEntry* inside the set, not owned
+    PackageState state;     // guarded by Pipeline.lock
+    gboolean in_batch;
+    gboolean trusted;       // hash already matched in the package cache index
+    gboolean claimed;       // this pipeline fetches it for everyone, see package_cache_claim()
+} PackageEntry;
+
+// Copy of the caller's options, owned by the job
+typedef struct {
+    char *mirror;
+    char *root;
+    char *cache_dir;
+    guint connections;
+    char **packages;
+} PipelineConfig;
+
+typedef struct {
+    PipelineConfig *config;
+    EngineJob *job;
+    GCancellable *cancellable;
+    char *arch;
+    char *work_dir;
+    char *conf_path;
+    char *db_path;
+
+    GPtrArray *entries;     // PackageEntry*, owned
+    GHashTable *by_name;    // name and provided names -> PackageEntry*
+
+    GThreadPool *fetch_pool;
+    GThreadPool *verify_pool;
+
+    GMutex lock;
+    GCond cond;
+    GError *error;
+    guint n_verified;
+    guint n_installed;
+    guint64 total_bytes;    // download sizes
+    guint64 fetched_bytes;
+    guint64 total_isize;    // installed sizes
+    guint64 installed_bytes;
+    guint64 batch_bytes;    // unpacked so far by the running pacstrap -U
+    PacmanProgress batch;   // install thread only
+    gboolean keyring_ready;
+} Pipeline;
+
+// Scratch record while streaming a sync db
+typedef struct {
+    Pipeline *pipeline;
+    GString *section;
+    char *filename;
+    char *name;
+    char *version;
+    char *sha256;
+    guint64 csize;
+    guint64 isize;
+    GPtrArray *depends;
+    GPtrArray *provides;
+} DescParser;
+
+static void package_entry_free(gpointer data) {
+    PackageEntry *entry = data;
+
+    g_free(entry->repo);
+    g_free(entry->name);
+    g_free(entry->version);
+    g_free(entry->filename);
+    g_free(entry->sha256);
+    g_free(entry->path);
+    g_clear_pointer(&entry->depends, g_ptr_array_unref);
+    g_clear_pointer(&entry->provides, g_ptr_array_unref);
+    g_ptr_array_unref(entry->deps);
+    g_free(entry);
+}
+
+static void pipeline_config_free(gpointer data) {
+    PipelineConfig *config = data;
+
+    g_free(config->mirror);
+    g_free(config->root);
+    g_free(config->cache_dir);
+    g_strfreev(config->packages);
+    g_free(config);
+}
+
+static void pipeline_fail(Pipeline *pipeline, GError *error) {
+    g_mutex_lock(&pipeline->lock);
+    if (pipeline->error == NULL)
+        pipeline->error = error;
+    else
+        g_error_free(error);
+    g_cond_broadcast(&pipeline->cond);
+    g_mutex_unlock(&pipeline->lock);
+}
+
+static gboolean pipeline_failed(Pipeline *pipeline) {
+    gboolean failed;
+
+    g_mutex_lock(&pipeline->lock);
+    failed = pipeline->error != NULL;
+    g_mutex_unlock(&pipeline->lock);
+
+    return failed || g_cancellable_is_cancelled(pipeline->cancellable);
+}
+
+// Call with lock held
+static void report_locked(Pipeline *pipeline, const char *status) {
+    double fraction = 0.0;
+
+    // Fetching and installing each count for half of the step, in bytes
+    if (pipeline->total_bytes > 0)
+        fraction += 0.5 * pipeline->fetched_bytes / pipeline->total_bytes;
+    if (pipeline->total_isize > 0)
+        fraction += 0.5 * (pipeline->installed_bytes + pipeline->batch_bytes) / pipeline->total_isize;
+
+    engine_job_report(pipeline->job, fraction, status);
+}
+
+static char* expand_mirror(Pipeline *pipeline, const char *repo) {
+    GString *url = g_string_new(pipeline->config->mirror);
+
+    g_string_replace(url, "$repo", repo, 0);
+    g_string_replace(url, "$arch", pipeline->arch, 0);
+
+    return g_string_free(url, FALSE);
+}
+
+// "glibc>=2.38" -> "glibc"
+static char* strip_constraint(const char *dependency) {
+    return g_strndup(dependency, strcspn(dependency, "<>="));
+}
+
+static gboolean run_tool(const char *name, const char * const *argv,
+                         EngineLineFunc func, gpointer data,
+                         GCancellable *cancellable, GError **error) {
+    g_autoptr(EngineJob) job = engine_job_new_command(name, argv);
+
+    if (func != NULL)
+        engine_job_set_line_func(job, func, data);
+
+    return engine_job_run(job, cancellable, error);
+}
+
+static void remove_tree(const char *path) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const char *entry;
+
+    if (dir != NULL) {
+        while ((entry = g_dir_read_name(dir)) != NULL) {
+            g_autofree char *child = g_build_filename(path, entry, NULL);
+
+            if (g_file_test(child, G_FILE_TEST_IS_DIR) && !g_file_test(child, G_FILE_TEST_IS_SYMLINK))
+                remove_tree(child);
+            else
+                g_unlink(child);
+        }
+        g_dir_close(dir);
+    }
+
+    g_rmdir(path);
+}
+
+// Without a mirror, the host's own configuration and servers are used.
+// The packages go to pacstrap -U as local files, each with its detached
+// signature next to it, so LocalFileSigLevel is what checks them; like
+// pacstrap -K, pacman checks them against the host keyring, the target's
+// own is only populated once archlinux-keyring is installed.
+static gboolean write_pacman_conf(Pipeline *pipeline, GError **error) {
+    g_autoptr(GString) conf = NULL;
+    static const char * const repos[] = { "core", "extra", NULL };
+
+    if (pipeline->config->mirror == NULL) {
+        g_free(pipeline->conf_path);
+        pipeline->conf_path = g_strdup(PACKAGE_HOST_CONFIG);
+        return TRUE;
+    }
+
+    conf = g_string_new(NULL);
+
+    g_string_append(conf,
+                    "[options]\n"
+                    "Architecture = auto\n"
+                    "ParallelDownloads = 1\n"
+                    "SigLevel = Required DatabaseOptional\n"
+                    "LocalFileSigLevel = Required\n");
+
+    for (guint i = 0; repos[i] != NULL; i++) {
+        g_autofree char *server = expand_mirror(pipeline, repos[i]);
+        g_string_append_printf(conf, "\n[%s]\nServer = %s\n", repos[i], server);
+    }
+
+    return g_file_set_contents(pipeline->conf_path, conf->str, conf->len, error);
+}
+
+static void collect_stdout(EngineJob *job, const char *line, gboolean is_stderr, gpointer user_data) {
+    if (!is_stderr)
+        g_ptr_array_add(user_data, g_strdup(line));
+}
+
+static gboolean resolve_targets(Pipeline *pipeline, GError **error) {
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+    g_autoptr(GPtrArray) lines = g_ptr_array_new_with_free_func(g_free);
+    const char *sync_argv[] = {
+        "pacman", "--config", pipeline->conf_path, "--dbpath", pipeline->db_path,
+        "--noconfirm", "-Sy", NULL
+    };
+
+    engine_job_report(pipeline->job, 0.0, "Synchronizing package databases");
+    if (!run_tool("pacman -Sy", sync_argv, NULL, NULL, pipeline->cancellable, error))
+        return FALSE;
+
+    g_ptr_array_add(argv, (gpointer) "pacman");
+    g_ptr_array_add(argv, (gpointer) "--config");
+    g_ptr_array_add(argv, pipeline->conf_path);
+    g_ptr_array_add(argv, (gpointer) "--dbpath");
+    g_ptr_array_add(argv, pipeline->db_path);
+    g_ptr_array_add(argv, (gpointer) "--noconfirm");
+    g_ptr_array_add(argv, (gpointer) "-Sp");
+    g_ptr_array_add(argv, (gpointer) "--print-format");
+    g_ptr_array_add(argv, (gpointer) "%r %n");
+    for (guint i = 0; pipeline->config->packages[i] != NULL; i++)
+        g_ptr_array_add(argv, pipeline->config->packages[i]);
+    g_ptr_array_add(argv, NULL);
+
+    engine_job_report(pipeline->job, 0.0, "Resolving packages");
+    if (!run_tool("pacman -Sp", (const char * const *) argv->pdata, collect_stdout, lines,
+                  pipeline->cancellable, error))
+        return FALSE;
+
+    for (guint i = 0; i < lines->len; i++) {
+        g_auto(GStrv) fields = g_strsplit(g_ptr_array_index(lines, i), " ", 2);
+
+        if (g_strv_length(fields) != 2)
+            continue;
+
+        PackageEntry *entry = g_new0(PackageEntry, 1);
+        entry->repo = g_strdup(fields[0]);
+        entry->name = g_strdup(fields[1]);
+        entry->deps = g_ptr_array_new();
+        g_ptr_array_add(pipeline->entries, entry);
+        g_hash_table_insert(pipeline->by_name, entry->name, entry);
+    }
+
+    if (pipeline->entries->len == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No packages resolved from the mirror");
+        return FALSE;
+    }
+
+    debug_log("Resolved %u packages", pipeline->entries->len);
+    return TRUE;
+}
+
+static void desc_parser_commit(DescParser *parser) {
+    PackageEntry *entry = NULL;
+
+    if (parser->name != NULL)
+        entry = g_hash_table_lookup(parser->pipeline->by_name, parser->name);
+
+    // Only packages in the resolved set are kept
+    if (entry != NULL && entry->filename == NULL && g_strcmp0(entry->name, parser->name) == 0) {
+        entry->filename = g_steal_pointer(&parser->filename);
+        entry->version = g_steal_pointer(&parser->version);
+        entry->sha256 = g_steal_pointer(&parser->sha256);
+        entry->csize = parser->csize;
+        entry->isize = parser->isize;
+        entry->depends = g_steal_pointer(&parser->depends);
+        entry->provides = g_steal_pointer(&parser->provides);
+    }
+
+    g_clear_pointer(&parser->filename, g_free);
+    g_clear_pointer(&parser->name, g_free);
+    g_clear_pointer(&parser->version, g_free);
+    g_clear_pointer(&parser->sha256, g_free);
+    g_clear_pointer(&parser->depends, g_ptr_array_unref);
+    g_clear_pointer(&parser->provides, g_ptr_array_unref);
+    parser->csize = 0;
+    parser->isize = 0;
+}
+
+static void parse_desc_line(EngineJob *job, const char *line, gboolean is_stderr, gpointer user_data) {
+    DescParser *parser = user_data;
+    const char *section = parser->section->str;
+
+    if (is_stderr)
+        return;
+
+    if (line[0] == '%') {
+        // Every desc file starts with %FILENAME%, which closes the previous one
+        if (g_strcmp0(line, "%FILENAME%") == 0)
+            desc_parser_commit(parser);
+        g_string_assign(parser->section, line);
+        return;
+    }
+
+    if (g_strcmp0(section, "%FILENAME%") == 0) {
+        g_free(parser->filename);
+        parser->filename = g_strdup(line);
+    } else if (g_strcmp0(section, "%NAME%") == 0) {
+        g_free(parser->name);
+        parser->name = g_strdup(line);
+    } else if (g_strcmp0(section, "%VERSION%") == 0) {
+        g_free(parser->version);
+        parser->version = g_strdup(line);
+    } else if (g_strcmp0(section, "%SHA256SUM%") == 0) {
+        g_free(parser->sha256);
+        parser->sha256 = g_strdup(line);
+    } else if (g_strcmp0(section, "%CSIZE%") == 0) {
+        parser->csize = g_ascii_strtoull(line, NULL, 10);
+    } else if (g_strcmp0(section, "%ISIZE%") == 0) {
+        parser->isize = g_ascii_strtoull(line, NULL, 10);
+    } else if (g_strcmp0(section, "%DEPENDS%") == 0) {
+        if (parser->depends == NULL)
+            parser->depends = g_ptr_array_new_with_free_func(g_free);
+        g_ptr_array_add(parser->depends, strip_constraint(line));
+    } else if (g_strcmp0(section, "%PROVIDES%") == 0) {
+        if (parser->provides == NULL)
+            parser->provides = g_ptr_array_new_with_free_func(g_free);
+        g_ptr_array_add(parser->provides, strip_constraint(line));
+    }
+}
+
+static gboolean read_sync_databases(Pipeline *pipeline, GError **error) {
+    g_autoptr(GHashTable) repos = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTableIter iter;
+    gpointer repo;
+
+    for (guint i = 0; i < pipeline->entries->len; i++) {
+        PackageEntry *entry = g_ptr_array_index(pipeline->entries, i);
+        g_hash_table_add(repos, entry->repo);
+    }
+
+    g_hash_table_iter_init(&iter, repos);
+    while (g_hash_table_iter_next(&iter, &repo, NULL)) {
+        g_autofree char *db_name = g_strdup_printf("%s.db", (const char *) repo);
+        g_autofree char *db_file = g_build_filename(pipeline->db_path, "sync", db_name, NULL);
+        const char *argv[] = { "bsdtar", "-xOf", db_file, NULL };
+        DescParser parser = { .pipeline = pipeline, .section = g_string_new(NULL) };
+        gboolean success;
+
+        success = run_tool("bsdtar", argv, parse_desc_line, &parser, pipeline->cancellable, error);
+        desc_parser_commit(&parser);
+        g_string_free(parser.section, TRUE);
+
+        if (!success)
+            return FALSE;
+    }
+
+    // Register provided names so dependencies on virtual packages resolve too
+    for (guint i = 0; i < pipeline->entries->len; i++) {
+        PackageEntry *entry = g_ptr_array_index(pipeline->entries, i);
+
+        if (entry->filename == NULL) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                        "Package %s is missing from the %s database", entry->name, entry->repo);
+            return FALSE;
+        }
+
+        pipeline->total_bytes += entry->csize;
+        pipeline->total_isize += entry->isize;
+        for (guint j = 0; entry->provides != NULL && j < entry->provides->len; j++) {
+            const char *provided = g_ptr_array_index(entry->provides, j);
+            if (!g_hash_table_contains(pipeline->by_name, provided))
+                g_hash_table_insert(pipeline->by_name, (gpointer) provided, entry);
+        }
+    }
+
+    for (guint i = 0; i < pipeline->entries->len; i++) {
+        PackageEntry *entry = g_ptr_array_index(pipeline->entries, i);
+
+        for (guint j = 0; entry->depends != NULL && j < entry->depends->len; j++) {
+            PackageEntry *dep = g_hash_table_lookup(pipeline->by_name,
+                                                    g_ptr_array_index(entry->depends, j));
+            if (dep != NULL && dep != entry)
+                g_ptr_array_add(entry->deps, dep);
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean hash_matches(const char *path, const char *expected, GError **error) {
+    g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_autofree guchar *buffer = g_malloc(PIPELINE_HASH_BUFFER);
+    FILE *file = fopen(path, "rb");
+    size_t count;
+
+    if (file == NULL) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not open %s: %s", path, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    while ((count = fread(buffer, 1, PIPELINE_HASH_BUFFER, file)) > 0)
+        g_checksum_update(checksum, buffer, count);
+    fclose(file);
+
+    if (g_ascii_strcasecmp(g_checksum_get_string(checksum), expected) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Checksum mismatch for %s", path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Lets pipelines waiting on this download go on, with the file or without it
+static void release_claim(PackageEntry *entry, gboolean verified) {
+    if (!entry->claimed)
+        return;
+
+    entry->claimed = FALSE;
+    package_cache_publish(entry->sha256, entry->path, verified);
+}
+
+static void verify_package(gpointer data, gpointer user_data) {
+    PackageEntry *entry = data;
+    Pipeline *pipeline = user_data;
+    GError *error = NULL;
+
+    if (pipeline_failed(pipeline)) {
+        release_claim(entry, FALSE);
+        return;
+    }
+
+    if (!entry->trusted && entry->sha256 != NULL && !hash_matches(entry->path, entry->sha256, &error)) {
+        release_claim(entry, FALSE);
+        pipeline_fail(pipeline, error);
+        return;
+    }
+    release_claim(entry, entry->sha256 != NULL);
+
+    g_mutex_lock(&pipeline->lock);
+    entry->state = PACKAGE_VERIFIED;
+    pipeline->n_verified++;
+    g_cond_broadcast(&pipeline->cond);
+    g_mutex_unlock(&pipeline->lock);
+}
+
+static gboolean download(Pipeline *pipeline, const char *url, const char *dest, GError **error) {
+    g_autofree char *partial = g_strconcat(dest, ".part", NULL);
+
+    if (g_str_has_prefix(url, "file://")) {
+        g_autoptr(GFile) source = g_file_new_for_uri(url);
+        g_autoptr(GFile) target = g_file_new_for_path(partial);
+
+        if (!g_file_copy(source, target, G_FILE_COPY_OVERWRITE, pipeline->cancellable,
+                         NULL, NULL, error))
+            return FALSE;
+    } else {
+        const char *argv[] = { "curl", "--fail", "--silent", "--show-error", "--location",
+                               "--output", partial, url, NULL };
+
+        if (!run_tool("curl", argv, NULL, NULL, pipeline->cancellable, error))
+            return FALSE;
+    }
+
+    if (g_rename(partial, dest) != 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not rename %s: %s", partial, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// pacman -U wants <package>.sig next to the file. One from an earlier run
+// is kept only along with its package, and a local cache may keep one;
+// otherwise it comes from the mirror.
+static gboolean fetch_signature(Pipeline *pipeline, PackageEntry *entry, gboolean reused,
+                                const CachedPackage *cached, GError **error) {
+    g_autofree char *path = g_strconcat(entry->path, ".sig", NULL);
+    g_autofree char *base = NULL;
+    g_autofree char *url = NULL;
+
+    if (reused && g_file_test(path, G_FILE_TEST_IS_REGULAR))
+        return TRUE;
+    if (cached != NULL && package_cache_link_signature(cached, path))
+        return TRUE;
+
+    base = expand_mirror(pipeline, entry->repo);
+    url = g_strconcat(base, "/", entry->filename, ".sig", NULL);
+    return download(pipeline, url, path, error);
+}
+
+static void fetch_package(gpointer data, gpointer user_data) {
+    PackageEntry *entry = data;
+    Pipeline *pipeline = user_data;
+    GError *error = NULL;
+    GStatBuf st;
+    gint64 start;
+    gboolean downloaded = FALSE;
+    const CachedPackage *linked = NULL;
+    g_autofree char *status = NULL;
+
+    if (pipeline_failed(pipeline))
+        return;
+
+    entry->path = g_build_filename(pipeline->config->cache_dir, entry->filename, NULL);
+    start = g_get_monotonic_time();
+
+    // Blocks while another pipeline fetches the same file, which then turns up below
+    entry->claimed = package_cache_claim(entry->sha256, pipeline->cancellable);
+
+    // A file from an earlier run or a local cache is only used when its hash
+    // matches; the lookup may have matched by name alone. Anything else is
+    // downloaded again over it.
+    const CachedPackage *cached = package_cache_lookup(entry->filename, entry->sha256);
+    if (entry->sha256 != NULL && g_stat(entry->path, &st) == 0 &&
+        (guint64) st.st_size == entry->csize && hash_matches(entry->path, entry->sha256, NULL)) {
+        debug_log("%s already in the target cache", entry->filename);
+        entry->trusted = TRUE;
+    } else if (cached != NULL && cached->size == entry->csize &&
+               package_cache_check(cached, entry->sha256) &&
+               package_cache_link(cached, entry->path, NULL)) {
+        entry->trusted = TRUE;
+        linked = cached;
+    } else {
+        g_autofree char *base = expand_mirror(pipeline, entry->repo);
+        g_autofree char *url = g_strconcat(base, "/", entry->filename, NULL);
+
+        if (!download(pipeline, url, entry->path, &error)) {
+            release_claim(entry, FALSE);
+            g_prefix_error(&error, "%s: ", entry->name);
+            pipeline_fail(pipeline, error);
+            return;
+        }
+        downloaded = TRUE;
+    }
+
+    // Published with the package, so pipelines linking it find this too
+    if (!fetch_signature(pipeline, entry, !downloaded && linked == NULL, linked, &error)) {
+        release_claim(entry, FALSE);
+        g_prefix_error(&error, "%s: ", entry->name);
+        pipeline_fail(pipeline, error);
+        return;
+    }
+
+    // A cache hit takes no time worth a rate
+    g_autofree char *size = g_format_size(entry->csize);
+    if (downloaded) {
+        double seconds = MAX((g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC, 0.001);
+        g_autofree char *rate = g_format_size((guint64) (entry->csize / seconds));
+        status = g_strdup_printf("Fetched %s (%s, %s/s)", entry->name, size, rate);
+    } else {
+        status = g_strdup_printf("Found %s in the cache (%s)", entry->name, size);
+    }
+
+    debug_log("%s", status);
+
+    g_mutex_lock(&pipeline->lock);
+    pipeline->fetched_bytes += entry->csize;
+    report_locked(pipeline, status);
+    g_mutex_unlock(&pipeline->lock);
+
+    g_thread_pool_push(pipeline->verify_pool, entry, NULL);
+}
+
+// Call with lock held. Picks every verified package whose dependencies are
+// either installed or part of the same batch.
+static GPtrArray* take_batch_locked(Pipeline *pipeline) {
+    GPtrArray *batch = g_ptr_array_new();
+    gboolean changed = TRUE;
+
+    for (guint i = 0; i < pipeline->entries->len; i++) {
+        PackageEntry *entry = g_ptr_array_index(pipeline->entries, i);
+        entry->in_batch = entry->state == PACKAGE_VERIFIED;
+    }
+
+    while (changed) {
+        changed = FALSE;
+
+        for (guint i = 0; i < pipeline->entries->len; i++) {
+            PackageEntry *entry = g_ptr_array_index(pipeline->entries, i);
+
+            if (!entry->in_batch)
+                continue;
+
+            for (guint j = 0; j < entry->deps->len; j++) {
+                PackageEntry *dep = g_ptr_array_index(entry->deps, j);
+
+                if (dep->state != PACKAGE_INSTALLED && !dep->in_batch) {
+                    entry->in_batch = FALSE;
+                    changed = TRUE;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (guint i = 0; i < pipeline->entries->len; i++) {
+        PackageEntry *entry = g_ptr_array_index(pipeline->entries, i);
+        if (entry->in_batch)
+            g_ptr_array_add(batch, entry);
+    }
+
+    return batch;
+}
+
+// by_name is only read once resolution is done, so no lock is needed
+static guint64 lookup_isize(const char *name, gpointer user_data) {
+    Pipeline *pipeline = user_data;
+    PackageEntry *entry = g_hash_table_lookup(pipeline->by_name, name);
+
+    return entry != NULL ? entry->isize : 0;
+}
+
+static void forward_install_line(EngineJob *job, const char *line, gboolean is_stderr, gpointer user_data) {
+    Pipeline *pipeline = user_data;
+
+    if (!pacman_progress_feed(&pipeline->batch, line))
+        return;
+
+    g_mutex_lock(&pipeline->lock);
+    pipeline->batch_bytes = pacman_progress_get_installed(&pipeline->batch);
+    report_locked(pipeline, pipeline->batch.status[0] != '\0' ? pipeline->batch.status : NULL);
+    g_mutex_unlock(&pipeline->lock);
+}
+
+static gboolean install_batch(Pipeline *pipeline, GPtrArray *batch, GError **error) {
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+
+    // The first transaction sets up the target keyring; later ones must not replace it
+    g_ptr_array_add(argv, (gpointer) "pacstrap");
+    g_ptr_array_add(argv, (gpointer) (pipeline->keyring_ready ? "-G" : "-K"));
+    g_ptr_array_add(argv, (gpointer) "-C");
+    g_ptr_array_add(argv, pipeline->conf_path);
+    g_ptr_array_add(argv, (gpointer) "-U");
+    g_ptr_array_add(argv, pipeline->config->root);
+    for (guint i = 0; i < batch->len; i++)
+        g_ptr_array_add(argv, ((PackageEntry *) g_ptr_array_index(batch, i))->path);
+    g_ptr_array_add(argv, NULL);
+
+    debug_log("Installing batch of %u packages", batch->len);
+    pacman_progress_init(&pipeline->batch, lookup_isize, pipeline);
+
+    if (!run_tool("pacstrap -U", (const char * const *) argv->pdata,
+                  forward_install_line, pipeline, pipeline->cancellable, error))
+        return FALSE;
+
+    pipeline->keyring_ready = TRUE;
+    return TRUE;
+}
+
+static gboolean install_loop(Pipeline *pipeline, GError **error) {
+    guint total = pipeline->entries->len;
+
+    for (;;) {
+        g_autoptr(GPtrArray) batch = NULL;
+
+        g_mutex_lock(&pipeline->lock);
+        for (;;) {
+            if (pipeline->error != NULL || g_cancellable_is_cancelled(pipeline->cancellable))
+                break;
+
+            guint waiting = pipeline->n_verified - pipeline->n_installed;
+            gboolean all_verified = pipeline->n_verified == total;
+
+            // Small batches only once nothing else is coming
+            if (waiting >= PIPELINE_MIN_BATCH || (all_verified && waiting > 0)) {
+                g_clear_pointer(&batch, g_ptr_array_unref);
+                batch = take_batch_locked(pipeline);
+                if (batch->len >= PIPELINE_MIN_BATCH || (all_verified && batch->len > 0))
+                    break;
+            }
+
+            if (pipeline->n_installed == total)
+                break;
+
+            g_cond_wait_until(&pipeline->cond, &pipeline->lock,
+                              g_get_monotonic_time() + PIPELINE_WAIT_USEC);
+        }
+
+        if (pipeline->error != NULL) {
+            g_propagate_error(error, g_steal_pointer(&pipeline->error));
+            g_mutex_unlock(&pipeline->lock);
+            return FALSE;
+        }
+        g_mutex_unlock(&pipeline->lock);
+
+        if (g_cancellable_set_error_if_cancelled(pipeline->cancellable, error))
+            return FALSE;
+        if (pipeline->n_installed == total)
+            return TRUE;
+
+        if (batch == NULL || batch->len == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "Package dependencies could not be ordered");
+            return FALSE;
+        }
+
+        if (!install_batch(pipeline, batch, error))
+            return FALSE;
+
+        g_mutex_lock(&pipeline->lock);
+        for (guint i = 0; i < batch->len; i++) {
+            PackageEntry *entry = g_ptr_array_index(batch, i);
+
+            entry->state = PACKAGE_INSTALLED;
+            pipeline->n_installed++;
+            pipeline->installed_bytes += entry->isize;
+        }
+        pipeline->batch_bytes = 0;
+        report_locked(pipeline, NULL);
+        g_mutex_unlock(&pipeline->lock);
+    }
+}
+
+static void pipeline_init(Pipeline *pipeline, PipelineConfig *config,
+                          EngineJob *job, GCancellable *cancellable) {
+    struct utsname machine;
+
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->config = config;
+    pipeline->job = job;
+    pipeline->cancellable = cancellable;
+    pipeline->entries = g_ptr_array_new_with_free_func(package_entry_free);
+    pipeline->by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    g_mutex_init(&pipeline->lock);
+    g_cond_init(&pipeline->cond);
+
+    uname(&machine);
+    pipeline->arch = g_strdup(machine.machine);
+}
+
+// Everything before the fetch stage: a private database, the resolved set
+// and its sync database records
+static gboolean pipeline_prepare(Pipeline *pipeline, GError **error) {
+    pipeline->work_dir = g_dir_make_tmp("rarch-packages-XXXXXX", error);
+    if (pipeline->work_dir == NULL)
+        return FALSE;
+    pipeline->conf_path = g_build_filename(pipeline->work_dir, "pacman.conf", NULL);
+    pipeline->db_path = g_build_filename(pipeline->work_dir, "db", NULL);
+
+    if (g_mkdir_with_parents(pipeline->db_path, 0755) != 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not create %s: %s", pipeline->db_path, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    return write_pacman_conf(pipeline, error) &&
+           resolve_targets(pipeline, error) &&
+           read_sync_databases(pipeline, error);
+}
+
+static void pipeline_clear(Pipeline *pipeline) {
+    if (pipeline->work_dir != NULL)
+        remove_tree(pipeline->work_dir);
+
+    g_clear_error(&pipeline->error);
+    g_hash_table_unref(pipeline->by_name);
+    g_ptr_array_unref(pipeline->entries);
+    g_free(pipeline->arch);
+    g_free(pipeline->work_dir);
+    g_free(pipeline->conf_path);
+    g_free(pipeline->db_path);
+    g_mutex_clear(&pipeline->lock);
+    g_cond_clear(&pipeline->cond);
+}
+
+static gboolean run_pipeline(EngineJob *job, gpointer user_data,
+                             GCancellable *cancellable, GError **error) {
+    PipelineConfig *config = user_data;
+    Pipeline pipeline;
+    gboolean success = FALSE;
+
+    pipeline_init(&pipeline, config, job, cancellable);
+
+    if (!pipeline_prepare(&pipeline, error))
+        goto out;
+
+    if (g_mkdir_with_parents(config->cache_dir, 0755) != 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not create %s: %s", config->cache_dir, g_strerror(saved_errno));
+        goto out;
+    }
+
+    pipeline.fetch_pool = g_thread_pool_new(fetch_package, &pipeline,
+                                            config->connections, FALSE, NULL);
+    pipeline.verify_pool = g_thread_pool_new(verify_package, &pipeline,
+                                             MAX(g_get_num_processors(), 1), FALSE, NULL);
+
+    // pacman -Sp lists dependencies first and the pool is FIFO, so keeping
+    // that order lets the earliest batches start installing sooner
+    for (guint i = 0; i < pipeline.entries->len; i++)
+        g_thread_pool_push(pipeline.fetch_pool, g_ptr_array_index(pipeline.entries, i), NULL);
+
+    success = install_loop(&pipeline, error);
+
+    // Workers still reference the pipeline on this stack frame
+    g_thread_pool_free(pipeline.fetch_pool, TRUE, TRUE);
+    g_thread_pool_free(pipeline.verify_pool, TRUE, TRUE);
+
+    // Verifications dropped with the pool never published their downloads
+    for (guint i = 0; i < pipeline.entries->len; i++)
+        release_claim(g_ptr_array_index(pipeline.entries, i), FALSE);
+
+out:
+    pipeline_clear(&pipeline);
+    return success;
+}
+
+void package_file_free(gpointer data) {
+    PackageFile *file = data;
+
+    g_free(file->name);
+    g_free(file->filename);
+    g_free(file->sha256);
+    g_free(file);
+}
+
+GPtrArray* package_resolve(const char *mirror, const char * const *packages,
+                           EngineJob *job, GCancellable *cancellable, GError **error) {
+    PipelineConfig config = { .mirror = (char *) mirror, .packages = (char **) packages };
+    Pipeline pipeline;
+    GPtrArray *files = NULL;
+
+    pipeline_init(&pipeline, &config, job, cancellable);
+
+    if (pipeline_prepare(&pipeline, error)) {
+        files = g_ptr_array_new_with_free_func(package_file_free);
+
+        for (guint i = 0; i < pipeline.entries->len; i++) {
+            PackageEntry *entry = g_ptr_array_index(pipeline.entries, i);
+            PackageFile *file = g_new0(PackageFile, 1);
+
+            file->name = g_strdup(entry->name);
+            file->filename = g_strdup(entry->filename);
+            file->sha256 = g_strdup(entry->sha256);
+            g_ptr_array_add(files, file);
+        }
+    }
+
+    pipeline_clear(&pipeline);
+    return files;
+}
+
+char* package_host_mirror(void) {
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+
+    if (!g_file_get_contents(PACKAGE_HOST_MIRRORLIST, &contents, NULL, NULL))
+        return NULL;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        char *line = g_strstrip(lines[i]);
+        char *equals = strchr(line, '=');
+
+        if (!g_str_has_prefix(line, "Server") || equals == NULL)
+            continue;
+
+        *equals = '\0';
+        if (g_strcmp0(g_strstrip(line), "Server") == 0)
+            return g_strdup(g_strstrip(equals + 1));
+    }
+
+    return NULL;
+}
+
+EngineJob* package_pipeline_job_new(const char *name, const PackagePipelineOptions *options) {
+    PipelineConfig *config = g_new0(PipelineConfig, 1);
+
+    config->mirror = g_strdup(options->mirror);
+    config->root = g_strdup(options->root);
+    config->cache_dir = options->cache_dir != NULL
+                      ? g_strdup(options->cache_dir)
+                      : g_build_filename(options->root, "var/cache/pacman/pkg", NULL);
+    config->connections = options->connections > 0 ? options->connections
+                                                   : PACKAGE_DEFAULT_CONNECTIONS;
+    config->packages = g_strdupv((char **) options->packages);
+
+    return engine_job_new_func(name, run_pipeline, config, pipeline_config_free);
+}
@@ -0,0 +1,53 @@
+// File   : packages.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Package pipeline, the installer-side replacement for a plain pacstrap run.
+// The package set is resolved once against the mirror's sync databases, then
+// packages are fetched over several connections, checksummed on all cores and
+// handed to pacman in batches as soon as everything they depend on is on disk.
+// Pipelines running side by side (one per target disk) download and verify
+// every file only once between them.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_PACKAGES_H
+#define RARCH_PACKAGES_H
+
+#include "engine.h"
+
+#define PACKAGE_DEFAULT_CONNECTIONS 4
+#define PACKAGE_HOST_MIRRORLIST     "/etc/pacman.d/mirrorlist"
+#define PACKAGE_HOST_CONFIG         "/etc/pacman.conf"
+
+typedef struct {
+    const char *mirror;             // Server= URL, may use $repo and $arch
+    const char *root;               // install root
+    const char *cache_dir;          // NULL for <root>/var/cache/pacman/pkg
+    guint connections;              // concurrent downloads, 0 for the default
+    const char * const *packages;   // requested targets
+} PackagePipelineOptions;
+
+// A resolved package and the file it is installed from
+typedef struct {
+    char *name;
+    char *filename;
+    char *sha256;                   // NULL when the sync database has none
+} PackageFile;
+
+// The returned job copies everything it needs from options
+EngineJob* package_pipeline_job_new(const char *name, const PackagePipelineOptions *options);
+
+// Resolves packages the way the pipeline does, against mirror or, when that
+// is NULL, the host's own pacman.conf, in pacman's order. The databases are
+// synced into a private directory; nothing on the host changes. Reports its
+// progress on job. Returns PackageFile*.
+GPtrArray* package_resolve(const char *mirror, const char * const *packages,
+                           EngineJob *job, GCancellable *cancellable, GError **error);
+void package_file_free(gpointer data);
+
+// The first Server= of the host's mirrorlist, NULL if there is none
+char* package_host_mirror(void);
+
+#endif // RARCH_PACKAGES_H
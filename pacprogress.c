@@ -0,0 +1,219 @@
+// File   : pacprogress.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Streaming parser for pacman/pacstrap output. See pacprogress.h.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <string.h>
+
+#include "pacprogress.h"
+
+// Verbs pacman prints as it unpacks each package
+static const char * const operations[] = {
+    "installing ", "upgrading ", "reinstalling ", "downgrading ", NULL
+};
+
+static const char* skip_prefix(const char *line, const char *prefix) {
+    gsize length = strlen(prefix);
+
+    return strncmp(line, prefix, length) == 0 ? line + length : NULL;
+}
+
+// "  1234.56 MiB" as printed in the transaction summary
+static guint64 parse_size(const char *text) {
+    static const char * const units[] = { "B", "KiB", "MiB", "GiB", "TiB", NULL };
+    char *end;
+    double value = g_ascii_strtod(text, &end);
+
+    while (*end == ' ')
+        end++;
+
+    for (guint i = 0; units[i] != NULL; i++) {
+        if (strncmp(end, units[i], strlen(units[i])) == 0) {
+            for (; i > 0; i--)
+                value *= 1024.0;
+            break;
+        }
+    }
+
+    return value > 0.0 ? (guint64) value : 0;
+}
+
+// The "42%" that ends a progress line, or -1
+static int trailing_percent(const char *line) {
+    const char *percent = strrchr(line, '%');
+    const char *digits = percent;
+
+    if (percent == NULL)
+        return -1;
+
+    while (digits > line && g_ascii_isdigit(digits[-1]))
+        digits--;
+
+    return digits < percent ? (int) MIN(g_ascii_strtoull(digits, NULL, 10), 100) : -1;
+}
+
+static gboolean set_status(PacmanProgress *progress, const char *status) {
+    if (strcmp(progress->status, status) == 0)
+        return FALSE;
+
+    g_strlcpy(progress->status, status, sizeof(progress->status));
+    return TRUE;
+}
+
+static void complete_current(PacmanProgress *progress) {
+    if (!progress->installing)
+        return;
+
+    progress->install_done += progress->current_size;
+    progress->packages_done++;
+    progress->installing = FALSE;
+    progress->current[0] = '\0';
+}
+
+static gboolean start_package(PacmanProgress *progress, const char *name) {
+    complete_current(progress);
+
+    // Unpacking starts once every download is in
+    progress->download_done = progress->download_total;
+    progress->installing = TRUE;
+    g_strlcpy(progress->current, name, sizeof(progress->current));
+
+    progress->current_size = progress->size_func != NULL
+                           ? progress->size_func(name, progress->size_data)
+                           : 0;
+    if (progress->current_size == 0 && progress->packages_total > 0)
+        progress->current_size = progress->install_total / progress->packages_total;
+
+    if (progress->packages_total > 0)
+        g_snprintf(progress->status, sizeof(progress->status), "Installing %s (%u/%u)",
+                   name, progress->packages_done + 1, progress->packages_total);
+    else
+        g_snprintf(progress->status, sizeof(progress->status), "Installing %s", name);
+
+    return TRUE;
+}
+
+static gboolean parse_operation(PacmanProgress *progress, const char *line) {
+    char name[PACMAN_NAME_SIZE];
+    const char *rest = NULL;
+    gsize length;
+
+    // A terminal gets "(  3/120) installing glibc  [####] 42%"
+    if (*line == '(') {
+        const char *close = strchr(line, ')');
+
+        if (close == NULL)
+            return FALSE;
+        for (line = close + 1; *line == ' '; line++);
+    }
+
+    for (guint i = 0; operations[i] != NULL && rest == NULL; i++)
+        rest = skip_prefix(line, operations[i]);
+    if (rest == NULL)
+        return FALSE;
+
+    // A pipe gets "installing glibc..."
+    length = strcspn(rest, " \t");
+    if (length >= 3 && strncmp(rest + length - 3, "...", 3) == 0)
+        length -= 3;
+    if (length == 0)
+        return FALSE;
+
+    length = MIN(length, sizeof(name) - 1);
+    memcpy(name, rest, length);
+    name[length] = '\0';
+
+    // Terminal progress redraws repeat the same package
+    if (progress->installing && strcmp(name, progress->current) == 0)
+        return FALSE;
+
+    return start_package(progress, name);
+}
+
+void pacman_progress_init(PacmanProgress *progress, PacmanSizeFunc size_func, gpointer user_data) {
+    memset(progress, 0, sizeof(*progress));
+    progress->size_func = size_func;
+    progress->size_data = user_data;
+}
+
+gboolean pacman_progress_feed(PacmanProgress *progress, const char *line) {
+    const char *rest;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    if ((rest = skip_prefix(line, "Packages (")) != NULL) {
+        progress->packages_total = (guint) g_ascii_strtoull(rest, NULL, 10);
+        return FALSE;
+    }
+
+    if ((rest = skip_prefix(line, "Total Download Size:")) != NULL) {
+        progress->download_total = parse_size(rest);
+        return TRUE;
+    }
+
+    if ((rest = skip_prefix(line, "Total Installed Size:")) != NULL) {
+        progress->install_total = parse_size(rest);
+        return TRUE;
+    }
+
+    // Parallel downloads print an aggregate " Total ( 3/120) ... 42%" line
+    if (skip_prefix(line, "Total (") != NULL) {
+        int percent = trailing_percent(line);
+        guint64 done;
+
+        if (percent < 0)
+            return FALSE;
+
+        done = progress->download_total * percent / 100;
+        if (done == progress->download_done)
+            return FALSE;
+
+        progress->download_done = done;
+        return TRUE;
+    }
+
+    if (skip_prefix(line, ":: Retrieving packages") != NULL)
+        return set_status(progress, "Downloading packages");
+
+    if (skip_prefix(line, ":: Processing package changes") != NULL)
+        return set_status(progress, "Installing packages");
+
+    if (skip_prefix(line, ":: Running post-transaction hooks") != NULL) {
+        complete_current(progress);
+        progress->install_done = MAX(progress->install_done, progress->install_total);
+        set_status(progress, "Running post-transaction hooks");
+        return TRUE;
+    }
+
+    return parse_operation(progress, line);
+}
+
+void pacman_progress_finish(PacmanProgress *progress) {
+    complete_current(progress);
+    progress->download_done = progress->download_total;
+    progress->install_done = MAX(progress->install_done, progress->install_total);
+}
+
+double pacman_progress_get_fraction(const PacmanProgress *progress) {
+    guint64 total = progress->download_total + progress->install_total;
+
+    if (total == 0) {
+        return progress->packages_total > 0
+             ? (double) progress->packages_done / progress->packages_total
+             : 0.0;
+    }
+
+    return MIN((double) (progress->download_done + pacman_progress_get_installed(progress)) / total, 1.0);
+}
+
+guint64 pacman_progress_get_installed(const PacmanProgress *progress) {
+    if (progress->install_total == 0)
+        return progress->install_done;
+
+    return MIN(progress->install_done, progress->install_total);
+}
@@ -0,0 +1,59 @@
+// File   : pacprogress.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Streaming parser for pacman/pacstrap output. Lines are fed as they arrive
+// and turned into an overall fraction weighted by bytes: the download size
+// and installed size from pacman's transaction summary, with each package
+// weighted by its installed size when the caller knows it. The state is a
+// fixed-size struct and feeding a line never allocates, so a multi-GB
+// install costs the same memory as a small one.
+//
+// Output is parsed as pacman prints it to a pipe (LC_ALL=C, no progress
+// bars): "installing glibc...", but the counted "(  3/120) installing
+// glibc" form of a terminal is understood too.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_PACPROGRESS_H
+#define RARCH_PACPROGRESS_H
+
+#include <glib.h>
+
+#define PACMAN_STATUS_SIZE 256
+#define PACMAN_NAME_SIZE   128
+
+// Installed size of a package in bytes, 0 when unknown
+typedef guint64 (*PacmanSizeFunc)(const char *name, gpointer user_data);
+
+typedef struct {
+    PacmanSizeFunc size_func;
+    gpointer size_data;
+    guint packages_total;       // from "Packages (N)"
+    guint packages_done;
+    guint64 download_total;     // from "Total Download Size"
+    guint64 download_done;
+    guint64 install_total;      // from "Total Installed Size"
+    guint64 install_done;       // packages that finished unpacking
+    guint64 current_size;       // weight of the package being unpacked
+    gboolean installing;
+    char current[PACMAN_NAME_SIZE];
+    char status[PACMAN_STATUS_SIZE];
+} PacmanProgress;
+
+// size_func may be NULL; packages then share the installed size equally
+void pacman_progress_init(PacmanProgress *progress, PacmanSizeFunc size_func, gpointer user_data);
+
+// Returns TRUE when the fraction or status changed
+gboolean pacman_progress_feed(PacmanProgress *progress, const char *line);
+
+// The transaction is over (the command exited successfully)
+void pacman_progress_finish(PacmanProgress *progress);
+
+double pacman_progress_get_fraction(const PacmanProgress *progress);
+
+// Installed bytes of the packages unpacked so far
+guint64 pacman_progress_get_installed(const PacmanProgress *progress);
+
+#endif // RARCH_PACPROGRESS_H
@@ -0,0 +1,1080 @@
+// File   : partplan.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Partition plans. See partplan.h.
+//
+// A version is a sorted array of refcounted entries plus the gaps between
+// them: gap i lies before entry i and the last gap after the last entry.
+// An edit copies the array of pointers, swaps in the one or two entries it
+// changed and recomputes the gaps on either side of them. Entries are never
+// modified once they are in a version, so an entry that is still the very
+// pointer read from the disk is unchanged, and versions can be handed to a
+// worker thread as they are.
+//
+// Applying skips sfdisk's own reread and udev round trip: the table is
+// written with the kernel left alone, then reread with a single BLKRRPART,
+// and the storage job waits for the nodes once.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <blkid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "partplan.h"
+
+#define MIB                 (1024 * 1024)
+#define PART_PLAN_MAX_ALIGN (16 * MIB)
+#define GPT_ENTRIES_SIZE    (128 * 128)
+#define GPT_MAX_PARTITIONS  128
+
+#define TYPE_ESP            "C12A7328-F81F-11D2-BA4B-00A0C93EC93B"
+#define TYPE_LINUX          "0FC63DAF-8483-4772-8E79-3D69D8477DE4"
+#define TYPE_SWAP           "0657FD6D-A4AB-43C4-84E5-0933C84B4F4F"
+#define TYPE_HOME           "933AC7E1-2EB4-4F13-B844-0E14E2AEF915"
+
+typedef struct {
+    const char *name;       // shown to the user
+    const char *type;       // GPT type GUID of a formatted partition
+    const char *label;      // GPT partition name of a formatted partition
+    StorageRole role;
+} PartUseInfo;
+
+static const PartUseInfo use_info[] = {
+    [PART_USE_NONE] = { "Unused",               TYPE_LINUX, "",           STORAGE_ROOT },
+    [PART_USE_ESP]  = { "EFI system partition", TYPE_ESP,   "rarch-esp",  STORAGE_ESP },
+    [PART_USE_ROOT] = { "Root (/)",             TYPE_LINUX, "rarch-root", STORAGE_ROOT },
+    [PART_USE_SWAP] = { "Swap",                 TYPE_SWAP,  "rarch-swap", STORAGE_SWAP },
+    [PART_USE_HOME] = { "Home (/home)",         TYPE_HOME,  "rarch-home", STORAGE_HOME },
+};
+
+static const struct {
+    const char *type;
+    const char *name;
+} type_names[] = {
+    { TYPE_ESP,                               "EFI system" },
+    { TYPE_LINUX,                             "Linux filesystem" },
+    { TYPE_SWAP,                              "Linux swap" },
+    { TYPE_HOME,                              "Linux home" },
+    { "4F68BCE3-E8CD-4DB1-96E7-FBCAF984B709", "Linux root (x86-64)" },
+    { "E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM" },
+    { "CA7D7CCB-63ED-4C53-861C-1742536059CC", "Linux LUKS" },
+    { "21686148-6449-6E6F-744E-656564454649", "BIOS boot" },
+    { "E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft reserved" },
+    { "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft basic data" },
+    { "DE94BBA4-06D1-4D40-A16A-BFD50179D6AC", "Windows recovery" },
+    { "7C3457EF-0000-11AA-AA11-00306543ECAC", "Apple APFS" },
+};
+
+typedef struct {
+    PlanPartition partition;
+    gatomicrefcount ref_count;
+} PlanEntry;
+
+typedef struct {
+    guint64 start;
+    guint64 size;
+} PlanGap;
+
+typedef struct {
+    gatomicrefcount ref_count;
+    GPtrArray *entries;     // PlanEntry*, sorted by start
+    GArray *gaps;           // PlanGap, entries->len + 1 of them
+} PlanVersion;
+
+struct _PartPlan {
+    gatomicrefcount ref_count;
+    char *disk;
+    guint sector_size;
+    guint64 usable_start;   // bytes, from the GPT header and entry array size
+    guint64 usable_end;     // exclusive
+    guint64 align;
+    guint64 align_offset;
+    char *label_id;         // disk GUID, NULL when the disk had no table
+    PlanVersion *original;
+    GPtrArray *history;     // PlanVersion*, the current one last
+};
+
+static PlanEntry* entry_new(const PlanPartition *partition) {
+    PlanEntry *entry = g_new0(PlanEntry, 1);
+
+    entry->partition = *partition;
+    entry->partition.type = g_strdup(partition->type);
+    entry->partition.uuid = g_strdup(partition->uuid);
+    entry->partition.name = g_strdup(partition->name != NULL ? partition->name : "");
+    g_atomic_ref_count_init(&entry->ref_count);
+
+    return entry;
+}
+
+static PlanEntry* entry_ref(PlanEntry *entry) {
+    g_atomic_ref_count_inc(&entry->ref_count);
+    return entry;
+}
+
+static void entry_unref(gpointer data) {
+    PlanEntry *entry = data;
+
+    if (!g_atomic_ref_count_dec(&entry->ref_count))
+        return;
+
+    g_free(entry->partition.type);
+    g_free(entry->partition.uuid);
+    g_free(entry->partition.name);
+    g_free(entry);
+}
+
+static PlanVersion* version_new(void) {
+    PlanVersion *version = g_new0(PlanVersion, 1);
+
+    version->entries = g_ptr_array_new_with_free_func(entry_unref);
+    version->gaps = g_array_new(FALSE, TRUE, sizeof(PlanGap));
+    g_atomic_ref_count_init(&version->ref_count);
+
+    return version;
+}
+
+// Shares every entry; only the arrays are new
+static PlanVersion* version_copy(const PlanVersion *version) {
+    PlanVersion *copy = version_new();
+
+    for (guint i = 0; i < version->entries->len; i++)
+        g_ptr_array_add(copy->entries, entry_ref(g_ptr_array_index(version->entries, i)));
+    g_array_append_vals(copy->gaps, version->gaps->data, version->gaps->len);
+
+    return copy;
+}
+
+static PlanVersion* version_ref(PlanVersion *version) {
+    g_atomic_ref_count_inc(&version->ref_count);
+    return version;
+}
+
+static void version_unref(gpointer data) {
+    PlanVersion *version = data;
+
+    if (!g_atomic_ref_count_dec(&version->ref_count))
+        return;
+
+    g_ptr_array_unref(version->entries);
+    g_array_unref(version->gaps);
+    g_free(version);
+}
+
+static PlanVersion* current_version(PartPlan *plan) {
+    return g_ptr_array_index(plan->history, plan->history->len - 1);
+}
+
+static const PlanPartition* entry_at(const PlanVersion *version, guint index) {
+    return &((PlanEntry *) g_ptr_array_index(version->entries, index))->partition;
+}
+
+static guint64 align_up(const PartPlan *plan, guint64 offset) {
+    if (offset <= plan->align_offset)
+        return plan->align_offset;
+
+    return plan->align_offset +
+           (offset - plan->align_offset + plan->align - 1) / plan->align * plan->align;
+}
+
+static guint64 align_down(const PartPlan *plan, guint64 offset) {
+    if (offset < plan->align_offset)
+        return 0;
+
+    return plan->align_offset + (offset - plan->align_offset) / plan->align * plan->align;
+}
+
+// The space after entry index - 1 and before entry index that a new partition could use
+static void update_gap(const PartPlan *plan, PlanVersion *version, guint index) {
+    PlanGap *gap = &g_array_index(version->gaps, PlanGap, index);
+    guint64 from = plan->usable_start;
+    guint64 to = plan->usable_end;
+    guint64 end;
+
+    if (index > 0) {
+        const PlanPartition *before = entry_at(version, index - 1);
+        from = MAX(from, before->start + before->size);
+    }
+    if (index < version->entries->len)
+        to = MIN(to, entry_at(version, index)->start);
+
+    gap->start = align_up(plan, from);
+    end = align_down(plan, to);
+    gap->size = end > gap->start ? end - gap->start : 0;
+}
+
+static void update_all_gaps(const PartPlan *plan, PlanVersion *version) {
+    g_array_set_size(version->gaps, version->entries->len + 1);
+    for (guint i = 0; i < version->gaps->len; i++)
+        update_gap(plan, version, i);
+}
+
+static gboolean find_entry(const PlanVersion *version, guint number, guint *index,
+                           GError **error) {
+    for (guint i = 0; i < version->entries->len; i++) {
+        if (entry_at(version, i)->number == number) {
+            *index = i;
+            return TRUE;
+        }
+    }
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "There is no partition %u", number);
+    return FALSE;
+}
+
+static gboolean find_gap(const PlanVersion *version, guint64 offset, guint *index,
+                         GError **error) {
+    for (guint i = 0; i < version->gaps->len; i++) {
+        const PlanGap *gap = &g_array_index(version->gaps, PlanGap, i);
+
+        if (gap->size > 0 && offset >= gap->start && offset < gap->start + gap->size) {
+            *index = i;
+            return TRUE;
+        }
+    }
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "There is no free space there");
+    return FALSE;
+}
+
+// The partition as it was on the disk, NULL for one the plan created
+static const PlanPartition* find_read(const PartPlan *plan, guint number) {
+    for (guint i = 0; i < plan->original->entries->len; i++) {
+        if (entry_at(plan->original, i)->number == number)
+            return entry_at(plan->original, i);
+    }
+
+    return NULL;
+}
+
+static guint lowest_free_number(const PlanVersion *version) {
+    for (guint number = 1; number <= GPT_MAX_PARTITIONS; number++) {
+        gboolean taken = FALSE;
+
+        for (guint i = 0; i < version->entries->len && !taken; i++)
+            taken = entry_at(version, i)->number == number;
+
+        if (!taken)
+            return number;
+    }
+
+    return 0;
+}
+
+// Toggling a partition back to how it was read gives back the entry read,
+// so it counts as unchanged again
+static PlanEntry* intern_entry(const PartPlan *plan, PlanEntry *entry) {
+    const PlanPartition *partition = &entry->partition;
+    const PlanPartition *read = partition->existing ? find_read(plan, partition->number) : NULL;
+
+    if (read != NULL && read->start == partition->start && read->size == partition->size &&
+        read->use == partition->use && read->format == partition->format &&
+        g_strcmp0(read->type, partition->type) == 0 && g_strcmp0(read->name, partition->name) == 0) {
+        entry_unref(entry);
+
+        // PlanPartition is the entry's first member
+        return entry_ref((PlanEntry *) read);
+    }
+
+    return entry;
+}
+
+static void push_version(PartPlan *plan, PlanVersion *version) {
+    g_ptr_array_add(plan->history, version);
+}
+
+static gboolean version_add(PartPlan *plan, PlanVersion *version, guint gap_index,
+                            guint64 size_mib, PartUse use, GError **error) {
+    const PlanGap *gap = &g_array_index(version->gaps, PlanGap, gap_index);
+    const PartUseInfo *info = &use_info[use];
+    PlanPartition partition = { 0 };
+    guint64 size = size_mib > 0 ? align_up(plan, gap->start + size_mib * MIB) - gap->start
+                                : gap->size;
+
+    partition.number = lowest_free_number(version);
+    if (partition.number == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "The partition table is full (%d partitions)", GPT_MAX_PARTITIONS);
+        return FALSE;
+    }
+
+    if (size == 0 || size > gap->size) {
+        g_autofree char *free_space = g_format_size_full(gap->size, G_FORMAT_SIZE_IEC_UNITS);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "Only %s of free space there", free_space);
+        return FALSE;
+    }
+
+    partition.start = gap->start;
+    partition.size = size;
+    partition.type = (char *) info->type;
+    partition.name = (char *) info->label;
+    partition.use = use;
+    partition.format = TRUE;
+
+    // Entry gap_index goes between gap gap_index and a new gap after it
+    g_ptr_array_insert(version->entries, gap_index, entry_new(&partition));
+    g_array_insert_vals(version->gaps, gap_index + 1, &(PlanGap) { 0 }, 1);
+    update_gap(plan, version, gap_index);
+    update_gap(plan, version, gap_index + 1);
+
+    return TRUE;
+}
+
+static gboolean version_set_use(PartPlan *plan, PlanVersion *version, guint index,
+                                PartUse use, gboolean format, GError **error) {
+    PlanEntry *old = g_ptr_array_index(version->entries, index);
+    const PlanPartition *current = &old->partition;
+    PlanPartition partition = *current;
+
+    for (guint i = 0; use != PART_USE_NONE && i < version->entries->len; i++) {
+        const PlanPartition *other = entry_at(version, i);
+
+        if (i != index && other->use == use) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "Partition %u is already %s",
+                        other->number, use_info[use].name);
+            return FALSE;
+        }
+    }
+
+    partition.use = use;
+    partition.format = !current->existing || use == PART_USE_ROOT ||
+                       (format && use != PART_USE_NONE);
+
+    // A kept partition keeps its type and name, whatever it is used for
+    if (!current->existing || partition.format) {
+        partition.type = (char *) use_info[use].type;
+        partition.name = (char *) use_info[use].label;
+    }
+
+    // An existing partition that is neither used nor formatted is as it was read
+    if (current->existing && !partition.format) {
+        const PlanPartition *read = find_read(plan, current->number);
+
+        partition.type = read->type;
+        partition.name = read->name;
+    }
+
+    g_ptr_array_index(version->entries, index) = intern_entry(plan, entry_new(&partition));
+    entry_unref(old);
+
+    return TRUE;
+}
+
+static PartPlan* plan_new(const char *disk) {
+    PartPlan *plan = g_new0(PartPlan, 1);
+
+    plan->disk = g_strdup(disk);
+    plan->history = g_ptr_array_new_with_free_func(version_unref);
+    g_atomic_ref_count_init(&plan->ref_count);
+
+    return plan;
+}
+
+static gint compare_entries(gconstpointer a, gconstpointer b) {
+    const PlanEntry *entry_a = *(PlanEntry * const *) a;
+    const PlanEntry *entry_b = *(PlanEntry * const *) b;
+
+    return entry_a->partition.start < entry_b->partition.start ? -1 :
+           entry_a->partition.start > entry_b->partition.start;
+}
+
+static char* upper_or_null(const char *value) {
+    return value != NULL && *value != '\0' ? g_ascii_strup(value, -1) : NULL;
+}
+
+// Alignment is 1 MiB, or the optimal I/O size when that is a larger and
+// sane multiple; the offset corrects for devices that report one
+static void read_topology(PartPlan *plan, blkid_probe probe) {
+    blkid_topology topology = blkid_probe_get_topology(probe);
+    guint64 optimal = 0;
+    guint64 a, b;
+
+    plan->sector_size = 512;
+    plan->align = MIB;
+    plan->align_offset = 0;
+
+    if (topology == NULL)
+        return;
+
+    if (blkid_topology_get_logical_sector_size(topology) > 0)
+        plan->sector_size = blkid_topology_get_logical_sector_size(topology);
+    optimal = blkid_topology_get_optimal_io_size(topology);
+    plan->align_offset = blkid_topology_get_alignment_offset(topology);
+
+    if (optimal > 0 && optimal % plan->sector_size == 0) {
+        for (a = MIB, b = optimal; b != 0; ) {
+            guint64 t = a % b;
+            a = b;
+            b = t;
+        }
+
+        if (MIB / a * optimal <= PART_PLAN_MAX_ALIGN)
+            plan->align = MIB / a * optimal;
+    }
+
+    plan->align_offset %= plan->align;
+}
+
+PartPlan* part_plan_read(const char *disk, GError **error) {
+    g_autoptr(PartPlan) plan = plan_new(disk);
+    blkid_probe probe = blkid_new_probe_from_filename(disk);
+    blkid_partlist list = NULL;
+    blkid_parttable table = NULL;
+    PlanVersion *version = NULL;
+    gint64 disk_size;
+    const char *table_type;
+
+    if (probe == NULL) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not read the partition table of %s: %s", disk, g_strerror(saved_errno));
+        return NULL;
+    }
+
+    read_topology(plan, probe);
+    disk_size = blkid_probe_get_size(probe);
+    if (disk_size <= 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not read the size of %s", disk);
+        blkid_free_probe(probe);
+        return NULL;
+    }
+
+    blkid_probe_enable_partitions(probe, 1);
+    blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
+    list = blkid_probe_get_partitions(probe);
+    if (list != NULL)
+        table = blkid_partlist_get_table(list);
+
+    table_type = table != NULL ? blkid_parttable_get_type(table) : NULL;
+    if (table_type != NULL && g_strcmp0(table_type, "gpt") != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "%s has a %s partition table; only GPT disks can be partitioned here",
+                    disk, table_type);
+        blkid_free_probe(probe);
+        return NULL;
+    }
+
+    // The GPT header and entry array at each end; the backup has no protective MBR
+    plan->usable_start = 2 * plan->sector_size + GPT_ENTRIES_SIZE;
+    plan->usable_end = (guint64) disk_size > plan->sector_size + GPT_ENTRIES_SIZE
+                       ? (guint64) disk_size - plan->sector_size - GPT_ENTRIES_SIZE : 0;
+
+    version = version_new();
+    if (table_type != NULL) {
+        plan->label_id = upper_or_null(blkid_parttable_get_id(table));
+
+        for (int i = 0; i < blkid_partlist_numof_partitions(list); i++) {
+            blkid_partition part = blkid_partlist_get_partition(list, i);
+            g_autofree char *type = upper_or_null(blkid_partition_get_type_string(part));
+            g_autofree char *uuid = upper_or_null(blkid_partition_get_uuid(part));
+            PlanPartition partition = { 0 };
+
+            // libblkid counts in 512-byte sectors whatever the device's own size
+            partition.number = blkid_partition_get_partno(part);
+            partition.start = (guint64) blkid_partition_get_start(part) * 512;
+            partition.size = (guint64) blkid_partition_get_size(part) * 512;
+            partition.type = type;
+            partition.uuid = uuid;
+            partition.name = (char *) blkid_partition_get_name(part);
+            partition.attributes = blkid_partition_get_flags(part);
+            partition.existing = TRUE;
+            g_ptr_array_add(version->entries, entry_new(&partition));
+        }
+    }
+
+    blkid_free_probe(probe);
+
+    g_ptr_array_sort(version->entries, compare_entries);
+    update_all_gaps(plan, version);
+
+    plan->original = version_ref(version);
+    push_version(plan, version);
+
+    debug_log("Partition plan: %s, %u partitions, %" G_GUINT64_FORMAT "-byte sectors, "
+              "aligned to %" G_GUINT64_FORMAT " bytes", disk, version->entries->len,
+              (guint64) plan->sector_size, plan->align);
+
+    return g_steal_pointer(&plan);
+}
+
+PartPlan* part_plan_ref(PartPlan *plan) {
+    g_atomic_ref_count_inc(&plan->ref_count);
+    return plan;
+}
+
+void part_plan_unref(PartPlan *plan) {
+    if (plan == NULL || !g_atomic_ref_count_dec(&plan->ref_count))
+        return;
+
+    g_free(plan->disk);
+    g_free(plan->label_id);
+    g_clear_pointer(&plan->original, version_unref);
+    g_ptr_array_unref(plan->history);
+    g_free(plan);
+}
+
+const char* part_plan_get_disk(PartPlan *plan) {
+    return plan->disk;
+}
+
+GArray* part_plan_get_segments(PartPlan *plan) {
+    PlanVersion *version = current_version(plan);
+    GArray *segments = g_array_new(FALSE, TRUE, sizeof(PlanSegment));
+
+    for (guint i = 0; i < version->gaps->len; i++) {
+        const PlanGap *gap = &g_array_index(version->gaps, PlanGap, i);
+
+        if (gap->size >= plan->align) {
+            PlanSegment segment = { gap->start, gap->size, NULL };
+            g_array_append_val(segments, segment);
+        }
+
+        if (i < version->entries->len) {
+            const PlanPartition *partition = entry_at(version, i);
+            PlanSegment segment = { partition->start, partition->size, partition };
+            g_array_append_val(segments, segment);
+        }
+    }
+
+    return segments;
+}
+
+const PlanPartition* part_plan_find_use(PartPlan *plan, PartUse use) {
+    PlanVersion *version = current_version(plan);
+
+    for (guint i = 0; use != PART_USE_NONE && i < version->entries->len; i++) {
+        if (entry_at(version, i)->use == use)
+            return entry_at(version, i);
+    }
+
+    return NULL;
+}
+
+gboolean part_plan_add(PartPlan *plan, guint64 offset, guint64 size_mib, PartUse use,
+                       GError **error) {
+    PlanVersion *version = current_version(plan);
+    guint gap_index;
+
+    if (!find_gap(version, offset, &gap_index, error))
+        return FALSE;
+
+    if (use != PART_USE_NONE && part_plan_find_use(plan, use) != NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "Partition %u is already %s",
+                    part_plan_find_use(plan, use)->number, use_info[use].name);
+        return FALSE;
+    }
+
+    version = version_copy(version);
+    if (!version_add(plan, version, gap_index, size_mib, use, error)) {
+        version_unref(version);
+        return FALSE;
+    }
+
+    push_version(plan, version);
+    return TRUE;
+}
+
+gboolean part_plan_remove(PartPlan *plan, guint number, GError **error) {
+    PlanVersion *version = current_version(plan);
+    guint index;
+
+    if (!find_entry(version, number, &index, error))
+        return FALSE;
+
+    // The gaps on either side of the partition become one
+    version = version_copy(version);
+    g_ptr_array_remove_index(version->entries, index);
+    g_array_remove_index(version->gaps, index + 1);
+    update_gap(plan, version, index);
+
+    push_version(plan, version);
+    return TRUE;
+}
+
+static gboolean version_resize(PartPlan *plan, PlanVersion *version, guint index,
+                               guint64 size_mib, GError **error) {
+    PlanEntry *old = g_ptr_array_index(version->entries, index);
+    const PlanPartition *current = &old->partition;
+    PlanPartition partition;
+    guint64 limit;
+
+    if (current->existing) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "Partition %u already exists; only new partitions can be resized",
+                    current->number);
+        return FALSE;
+    }
+
+    limit = index + 1 < version->entries->len ? entry_at(version, index + 1)->start
+                                              : plan->usable_end;
+    limit = align_down(plan, MIN(limit, plan->usable_end));
+
+    // 0 grows it as far as it goes, like a new partition taking all of a gap
+    partition = *current;
+    partition.size = size_mib > 0 ? align_up(plan, current->start + size_mib * MIB) - current->start
+                                  : limit - current->start;
+    if (current->start + partition.size > limit) {
+        g_autofree char *space = g_format_size_full(limit - current->start,
+                                                    G_FORMAT_SIZE_IEC_UNITS);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "Partition %u can grow to at most %s", current->number, space);
+        return FALSE;
+    }
+
+    // The version holds its own reference to the old entry until it is replaced
+    g_ptr_array_index(version->entries, index) = entry_new(&partition);
+    entry_unref(old);
+    update_gap(plan, version, index + 1);
+
+    return TRUE;
+}
+
+gboolean part_plan_resize(PartPlan *plan, guint number, guint64 size_mib, GError **error) {
+    PlanVersion *version = current_version(plan);
+    guint index;
+
+    if (!find_entry(version, number, &index, error))
+        return FALSE;
+
+    version = version_copy(version);
+    if (!version_resize(plan, version, index, size_mib, error)) {
+        version_unref(version);
+        return FALSE;
+    }
+
+    push_version(plan, version);
+    return TRUE;
+}
+
+gboolean part_plan_set_use(PartPlan *plan, guint number, PartUse use, gboolean format,
+                           GError **error) {
+    PlanVersion *version = current_version(plan);
+    guint index;
+
+    if (!find_entry(version, number, &index, error))
+        return FALSE;
+
+    version = version_copy(version);
+    if (!version_set_use(plan, version, index, use, format, error)) {
+        version_unref(version);
+        return FALSE;
+    }
+
+    push_version(plan, version);
+    return TRUE;
+}
+
+gboolean part_plan_change(PartPlan *plan, guint number, guint64 size_mib, PartUse use,
+                          gboolean format, GError **error) {
+    PlanVersion *version = current_version(plan);
+    const PlanPartition *current;
+    guint index;
+
+    if (!find_entry(version, number, &index, error))
+        return FALSE;
+
+    current = entry_at(version, index);
+    version = version_copy(version);
+    if ((!current->existing && size_mib != current->size / MIB &&
+         !version_resize(plan, version, index, size_mib, error)) ||
+        !version_set_use(plan, version, index, use, format, error)) {
+        version_unref(version);
+        return FALSE;
+    }
+
+    push_version(plan, version);
+    return TRUE;
+}
+
+gboolean part_plan_auto_alongside(PartPlan *plan, guint64 swap_mib, GError **error) {
+    g_autoptr(GError) local_error = NULL;
+    PlanVersion *version = version_copy(plan->original);
+    gint esp = -1;
+    guint largest = 0;
+    guint64 needed = PART_PLAN_MIN_ROOT_MIB + swap_mib;
+
+    for (guint i = 0; i < version->entries->len && esp < 0; i++) {
+        const PlanPartition *partition = entry_at(version, i);
+
+        if (g_strcmp0(partition->type, TYPE_ESP) == 0 &&
+            partition->size >= (guint64) PART_PLAN_MIN_ESP_MIB * MIB)
+            esp = i;
+    }
+    if (esp < 0)
+        needed += STORAGE_ESP_SIZE_MIB;
+
+    for (guint i = 1; i < version->gaps->len; i++) {
+        if (g_array_index(version->gaps, PlanGap, i).size >
+            g_array_index(version->gaps, PlanGap, largest).size)
+            largest = i;
+    }
+
+    if (g_array_index(version->gaps, PlanGap, largest).size < needed * MIB) {
+        g_autofree char *size = g_format_size_full(needed * MIB, G_FORMAT_SIZE_IEC_UNITS);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "%s needs %s of unallocated space in one piece; shrink the other "
+                    "system's partitions first", plan->disk, size);
+        version_unref(version);
+        return FALSE;
+    }
+
+    // The other system's ESP is shared, never formatted
+    if (esp >= 0)
+        version_set_use(plan, version, esp, PART_USE_ESP, FALSE, &local_error);
+    else
+        version_add(plan, version, largest++, STORAGE_ESP_SIZE_MIB, PART_USE_ESP, &local_error);
+    if (local_error == NULL && swap_mib > 0)
+        version_add(plan, version, largest++, swap_mib, PART_USE_SWAP, &local_error);
+    if (local_error == NULL)
+        version_add(plan, version, largest, 0, PART_USE_ROOT, &local_error);
+
+    if (local_error != NULL) {
+        g_propagate_error(error, g_steal_pointer(&local_error));
+        version_unref(version);
+        return FALSE;
+    }
+
+    push_version(plan, version);
+    return TRUE;
+}
+
+gboolean part_plan_can_undo(PartPlan *plan) {
+    return plan->history->len > 1;
+}
+
+void part_plan_undo(PartPlan *plan) {
+    if (part_plan_can_undo(plan))
+        g_ptr_array_remove_index(plan->history, plan->history->len - 1);
+}
+
+static gboolean same_table_entry(const PlanPartition *a, const PlanPartition *b) {
+    return a->number == b->number && a->start == b->start && a->size == b->size &&
+           g_strcmp0(a->type, b->type) == 0 && g_strcmp0(a->name, b->name) == 0;
+}
+
+static gboolean version_contains(const PlanVersion *version, const PlanPartition *partition) {
+    for (guint i = 0; i < version->entries->len; i++) {
+        if (same_table_entry(entry_at(version, i), partition))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean version_is_changed(const PartPlan *plan, const PlanVersion *version) {
+    if (plan->label_id == NULL)
+        return TRUE;
+    if (version->entries->len != plan->original->entries->len)
+        return TRUE;
+
+    for (guint i = 0; i < version->entries->len; i++) {
+        if (g_ptr_array_index(version->entries, i) != g_ptr_array_index(plan->original->entries, i) &&
+            !version_contains(plan->original, entry_at(version, i)))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+gboolean part_plan_is_changed(PartPlan *plan) {
+    return version_is_changed(plan, current_version(plan));
+}
+
+const char* part_plan_type_name(const char *type) {
+    for (guint i = 0; i < G_N_ELEMENTS(type_names); i++) {
+        if (g_strcmp0(type_names[i].type, type) == 0)
+            return type_names[i].name;
+    }
+
+    return type != NULL ? type : "unknown type";
+}
+
+char** part_plan_describe_changes(PartPlan *plan) {
+    PlanVersion *version = current_version(plan);
+    g_autoptr(GStrvBuilder) lines = g_strv_builder_new();
+    gboolean any = FALSE;
+
+    if (plan->label_id == NULL) {
+        g_strv_builder_take(lines, g_strdup_printf("Create a new GPT partition table on %s",
+                                                   plan->disk));
+        any = TRUE;
+    }
+
+    for (guint i = 0; i < plan->original->entries->len; i++) {
+        const PlanPartition *read = entry_at(plan->original, i);
+        g_autofree char *size = NULL;
+        gboolean kept = FALSE;
+
+        for (guint j = 0; j < version->entries->len && !kept; j++)
+            kept = entry_at(version, j)->existing && entry_at(version, j)->number == read->number;
+        if (kept)
+            continue;
+
+        size = g_format_size_full(read->size, G_FORMAT_SIZE_IEC_UNITS);
+        g_strv_builder_take(lines, g_strdup_printf("Delete partition %u (%s, %s)", read->number,
+                                                   part_plan_type_name(read->type), size));
+        any = TRUE;
+    }
+
+    for (guint i = 0; i < version->entries->len; i++) {
+        const PlanPartition *partition = entry_at(version, i);
+        const PlanPartition *read = find_read(plan, partition->number);
+        g_autofree char *size = g_format_size_full(partition->size, G_FORMAT_SIZE_IEC_UNITS);
+        g_autofree char *offset = g_format_size_full(partition->start, G_FORMAT_SIZE_IEC_UNITS);
+        const char *use = use_info[partition->use].name;
+        char *line = NULL;
+
+        if (!partition->existing && partition->use == PART_USE_NONE)
+            line = g_strdup_printf("Create partition %u (%s at %s), left unformatted",
+                                   partition->number, size, offset);
+        else if (!partition->existing)
+            line = g_strdup_printf("Create partition %u (%s at %s) and format it as %s",
+                                   partition->number, size, offset, use);
+        else if (partition->format)
+            line = g_strdup_printf("Format partition %u (%s, %s) as %s", partition->number,
+                                   part_plan_type_name(read->type), size, use);
+
+        // Not a change, but worth seeing next to the changes
+        if (line == NULL && partition->use != PART_USE_NONE)
+            g_strv_builder_take(lines, g_strdup_printf("Use partition %u (%s, %s) as %s, "
+                                                       "keeping its contents",
+                                                       partition->number,
+                                                       part_plan_type_name(partition->type),
+                                                       size, use));
+
+        if (line != NULL) {
+            g_strv_builder_take(lines, line);
+            any = TRUE;
+        }
+    }
+
+    if (!any)
+        g_strv_builder_add(lines, "No changes to the partition table");
+
+    return g_strv_builder_end(lines);
+}
+
+static gboolean check_size(const PlanPartition *partition, guint64 minimum_mib, GError **error) {
+    g_autofree char *minimum = NULL;
+
+    if (partition->size >= minimum_mib * MIB)
+        return TRUE;
+
+    minimum = g_format_size_full(minimum_mib * MIB, G_FORMAT_SIZE_IEC_UNITS);
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                "Partition %u is too small for %s; it needs at least %s",
+                partition->number, use_info[partition->use].name, minimum);
+    return FALSE;
+}
+
+gboolean part_plan_check(PartPlan *plan, GError **error) {
+    const PlanPartition *root = part_plan_find_use(plan, PART_USE_ROOT);
+    const PlanPartition *esp = part_plan_find_use(plan, PART_USE_ESP);
+    const PlanPartition *swap = part_plan_find_use(plan, PART_USE_SWAP);
+
+    if (root == NULL || esp == NULL) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Choose a partition for %s", use_info[root == NULL ? PART_USE_ROOT
+                                                                        : PART_USE_ESP].name);
+        return FALSE;
+    }
+
+    if (!check_size(root, PART_PLAN_MIN_ROOT_MIB, error) ||
+        !check_size(esp, PART_PLAN_MIN_ESP_MIB, error))
+        return FALSE;
+
+    // Kept contents only make sense where they already are what they are used for
+    if (!esp->format && g_strcmp0(esp->type, TYPE_ESP) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Partition %u is not an EFI system partition; format it to use it as one",
+                    esp->number);
+        return FALSE;
+    }
+    if (swap != NULL && !swap->format && g_strcmp0(swap->type, TYPE_SWAP) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                    "Partition %u is not swap; format it to use it as swap", swap->number);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+const char* part_plan_use_name(PartUse use) {
+    return use_info[use].name;
+}
+
+StorageLayout* part_plan_get_storage_layout(PartPlan *plan) {
+    PlanVersion *version = current_version(plan);
+    StorageLayout *layout = storage_layout_new_existing();
+
+    for (guint i = 0; i < version->entries->len; i++) {
+        const PlanPartition *partition = entry_at(version, i);
+
+        if (partition->use != PART_USE_NONE)
+            storage_layout_add_existing(layout, use_info[partition->use].role, plan->disk,
+                                        partition->number, partition->format);
+    }
+
+    return layout;
+}
+
+typedef struct {
+    PartPlan *plan;         // for the disk's geometry; only the snapshot is read
+    PlanVersion *version;
+    gboolean changed;
+    EngineJob *prepare;
+} ApplyData;
+
+static void apply_data_free(gpointer data) {
+    ApplyData *apply = data;
+
+    part_plan_unref(apply->plan);
+    version_unref(apply->version);
+    engine_job_unref(apply->prepare);
+    g_free(apply);
+}
+
+// sfdisk's attribute names; bits 48-63 belong to the partition type
+static void append_attributes(GString *script, guint64 attributes) {
+    static const char * const names[] = {
+        "RequiredPartition", "NoBlockIOProtocol", "LegacyBIOSBootable"
+    };
+    gboolean first = TRUE;
+
+    if ((attributes & (G_GUINT64_CONSTANT(0xffff) << 48 | 0x7)) == 0)
+        return;
+
+    g_string_append(script, ", attrs=\"");
+    for (guint bit = 0; bit < 64; bit++) {
+        if (!(attributes & (G_GUINT64_CONSTANT(1) << bit)) || (bit > 2 && bit < 48))
+            continue;
+
+        g_string_append(script, first ? "" : " ");
+        if (bit < G_N_ELEMENTS(names))
+            g_string_append(script, names[bit]);
+        else
+            g_string_append_printf(script, "GUID:%u", bit);
+        first = FALSE;
+    }
+    g_string_append_c(script, '"');
+}
+
+// The whole table, every kept partition exactly as read. sfdisk wipes
+// nothing: to it even a kept partition is new, and formatting overwrites
+// the old signatures of the ones that aren't kept.
+static GBytes* table_script(const ApplyData *apply) {
+    const PartPlan *plan = apply->plan;
+    GString *script = g_string_new("label: gpt\n");
+
+    if (plan->label_id != NULL)
+        g_string_append_printf(script, "label-id: %s\n", plan->label_id);
+    g_string_append_printf(script, "unit: sectors\nfirst-lba: %" G_GUINT64_FORMAT "\n"
+                           "last-lba: %" G_GUINT64_FORMAT "\n",
+                           plan->usable_start / plan->sector_size,
+                           plan->usable_end / plan->sector_size - 1);
+
+    for (guint i = 0; i < apply->version->entries->len; i++) {
+        const PlanPartition *partition = entry_at(apply->version, i);
+        g_autofree char *device = storage_partition_path(plan->disk, partition->number);
+        g_autofree char *name = g_strdup(partition->name);
+
+        g_strdelimit(name, "\"\\\n", '_');
+        g_string_append_printf(script, "%s : start=%" G_GUINT64_FORMAT ", size=%" G_GUINT64_FORMAT
+                               ", type=%s", device, partition->start / plan->sector_size,
+                               partition->size / plan->sector_size, partition->type);
+        if (partition->uuid != NULL)
+            g_string_append_printf(script, ", uuid=%s", partition->uuid);
+        g_string_append_printf(script, ", name=\"%s\"", name);
+        append_attributes(script, partition->attributes);
+        g_string_append_c(script, '\n');
+    }
+
+    return g_string_free_to_bytes(script);
+}
+
+// One BLKRRPART for the whole table instead of a BLKPG call per partition.
+// The kernel refuses while any partition of the disk is in use (an active
+// swap, a mounted ESP); partx then updates just the ones that changed.
+static gboolean reread_table(EngineJob *job, const char *disk, GCancellable *cancellable,
+                             GError **error) {
+    const char *argv[] = { "partx", "--update", disk, NULL };
+    g_autoptr(EngineJob) partx = NULL;
+    int fd = open(disk, O_RDONLY | O_CLOEXEC);
+    int saved_errno;
+    int result;
+
+    if (fd < 0) {
+        saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Could not open %s: %s", disk, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    result = ioctl(fd, BLKRRPART);
+    saved_errno = errno;
+    close(fd);
+
+    if (result == 0)
+        return TRUE;
+
+    if (saved_errno != EBUSY) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "The kernel could not reread the partition table of %s: %s",
+                    disk, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    debug_log("Partition plan: %s is in use, updating its partitions one by one", disk);
+
+    partx = engine_job_new_command("Updating partitions", argv);
+    return engine_job_run_nested(partx, job, cancellable, error);
+}
+
+static gboolean apply_plan(EngineJob *job, gpointer user_data,
+                           GCancellable *cancellable, GError **error) {
+    ApplyData *apply = user_data;
+    const char *disk = apply->plan->disk;
+
+    if (apply->changed) {
+        const char *argv[] = {
+            "sfdisk", "--no-reread", "--no-tell-kernel",
+            "--wipe", "never", "--wipe-partitions", "never", disk, NULL
+        };
+        g_autofree char *name = g_strdup_printf("Partitioning %s", disk);
+        g_autoptr(EngineJob) table = engine_job_new_command(name, argv);
+        g_autoptr(GBytes) script = table_script(apply);
+
+        engine_job_set_stdin(table, script);
+        if (!engine_job_run_nested(table, job, cancellable, error))
+            return FALSE;
+
+        if (!reread_table(job, disk, cancellable, error))
+            return FALSE;
+    } else {
+        debug_log("Partition plan: the table of %s is unchanged, not writing it", disk);
+    }
+
+    return engine_job_run_nested(apply->prepare, job, cancellable, error);
+}
+
+EngineJob* part_plan_apply_job_new(const char *name, PartPlan *plan, StorageLayout *layout) {
+    ApplyData *apply = g_new0(ApplyData, 1);
+    g_auto(GStrv) changes = part_plan_describe_changes(plan);
+
+    apply->plan = part_plan_ref(plan);
+    apply->version = version_ref(current_version(plan));
+    apply->changed = part_plan_is_changed(plan);
+    apply->prepare = storage_prepare_job_new(name, layout);
+
+    for (guint i = 0; changes[i] != NULL; i++)
+        debug_log("Partition plan: %s", changes[i]);
+
+    return engine_job_new_func(name, apply_plan, apply, apply_data_free);
+}
@@ -0,0 +1,128 @@
+// File   : partplan.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Partition plans for "Install alongside existing OS" and "Manual
+// partitioning". The disk's GPT is read once; every edit after that only
+// touches the plan, a list of versions that share whatever an edit left
+// alone, so each edit and each undo costs a handful of pointers. Free space
+// is kept as a map of aligned gaps (1 MiB, or the disk's optimal I/O size
+// when that is larger) updated next to the edit instead of rebuilt.
+//
+// Nothing reaches the disk until the install runs: the plan describes its
+// changes for review first, then writes the whole table in one sfdisk pass
+// and has the kernel reread it once.
+//
+// Existing file systems are never resized; partitions can only be created
+// in free space, deleted, reused or reformatted.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_PARTPLAN_H
+#define RARCH_PARTPLAN_H
+
+#include <gio/gio.h>
+
+#include "engine.h"
+#include "storage.h"
+
+#define PART_PLAN_MIN_ROOT_MIB  (8 * 1024)
+#define PART_PLAN_MIN_ESP_MIB   256
+
+typedef enum {
+    PART_USE_NONE,
+    PART_USE_ESP,
+    PART_USE_ROOT,
+    PART_USE_SWAP,
+    PART_USE_HOME
+} PartUse;
+
+typedef struct {
+    guint number;
+    guint64 start;          // bytes from the start of the disk
+    guint64 size;           // bytes
+    char *type;             // GPT type GUID, upper case
+    char *uuid;             // partition GUID, NULL until a new partition is written
+    char *name;             // GPT partition name, may be empty
+    guint64 attributes;     // GPT attribute bits, kept as read
+    PartUse use;
+    gboolean format;        // gets a new file system; always set for new partitions and root
+    gboolean existing;      // was on the disk when the plan was read
+} PlanPartition;
+
+typedef struct {
+    guint64 start;
+    guint64 size;
+    const PlanPartition *partition;     // NULL for free space
+} PlanSegment;
+
+typedef struct _PartPlan PartPlan;
+
+// Reads disk's partition table and topology; a disk without a table gets an
+// empty GPT. Any other kind of table is an error.
+PartPlan* part_plan_read(const char *disk, GError **error);
+PartPlan* part_plan_ref(PartPlan *plan);
+void part_plan_unref(PartPlan *plan);
+
+const char* part_plan_get_disk(PartPlan *plan);
+
+// Partitions and usable free space in disk order. Gaps smaller than the
+// alignment are left out. The partitions stay valid until the next edit or
+// undo.
+GArray* part_plan_get_segments(PartPlan *plan);
+
+// The partition with use, NULL when none has it
+const PlanPartition* part_plan_find_use(PartPlan *plan, PartUse use);
+
+// A new partition at the start of the free space holding offset; size_mib
+// 0 takes all of it
+gboolean part_plan_add(PartPlan *plan, guint64 offset, guint64 size_mib, PartUse use,
+                       GError **error);
+gboolean part_plan_remove(PartPlan *plan, guint number, GError **error);
+
+// Only partitions the plan created can be resized, into the space after them
+gboolean part_plan_resize(PartPlan *plan, guint number, guint64 size_mib, GError **error);
+
+// Root is always formatted; formatting also sets the partition's type and name
+gboolean part_plan_set_use(PartPlan *plan, guint number, PartUse use, gboolean format,
+                           GError **error);
+
+// A resize and a use change as one edit, so one undo reverts both. The size
+// only applies to partitions the plan created, and only when it differs.
+gboolean part_plan_change(PartPlan *plan, guint number, guint64 size_mib, PartUse use,
+                          gboolean format, GError **error);
+
+// Replaces every edit so far with the usual layout in the largest free
+// space: an ESP unless the disk has one to share, swap when swap_mib > 0,
+// and root in the rest. Can be undone like any other edit.
+gboolean part_plan_auto_alongside(PartPlan *plan, guint64 swap_mib, GError **error);
+
+gboolean part_plan_can_undo(PartPlan *plan);
+void part_plan_undo(PartPlan *plan);
+
+// Whether applying the plan writes the partition table at all
+gboolean part_plan_is_changed(PartPlan *plan);
+
+// One line per change, in the order they would be made, for review before
+// anything is written
+char** part_plan_describe_changes(PartPlan *plan);
+
+// Whether the plan has everything an install needs: one ESP and one root
+// partition, each large enough
+gboolean part_plan_check(PartPlan *plan, GError **error);
+
+const char* part_plan_use_name(PartUse use);
+
+// "Microsoft basic data" for its type GUID; the GUID itself when unknown
+const char* part_plan_type_name(const char *type);
+
+// A storage layout over the partitions that have a use
+StorageLayout* part_plan_get_storage_layout(PartPlan *plan);
+
+// Writes the plan as it is now and then prepares layout, which it takes
+EngineJob* part_plan_apply_job_new(const char *name, PartPlan *plan, StorageLayout *layout);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(PartPlan, part_plan_unref)
+
+#endif // RARCH_PARTPLAN_H
@@ -0,0 +1,455 @@
+// File   : pkgcache.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Content-addressed package cache index. See pkgcache.h.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pkgcache.h"
+#include "treecopy.h"
+
+#define CACHE_HASH_BUFFER (1024 * 1024)
+#define CACHE_CLAIM_WAIT_USEC (100 * 1000)
+
+static GMutex cache_lock;
+static GCond cache_cond;
+static gboolean cache_started;
+static gboolean cache_scanned;
+static GPtrArray *cache_packages;   // CachedPackage*, never freed
+static GHashTable *by_sha256;       // sha256 -> CachedPackage*
+static GHashTable *by_filename;     // filename -> CachedPackage*
+static GHashTable *in_flight;       // sha256 of every claimed, unpublished download
+
+typedef struct {
+    gint64 mtime;
+    guint64 size;
+    char sha256[65];
+} IndexRecord;
+
+static char* index_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "rarch-installer", "pkgindex", NULL);
+}
+
+// Lines are "sha256 size mtime path"
+static GHashTable* load_index(void) {
+    GHashTable *records = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_autofree char *path = index_path();
+    g_autofree char *contents = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL))
+        return records;
+
+    g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = g_strsplit(lines[i], " ", 4);
+
+        if (g_strv_length(fields) != 4 || strlen(fields[0]) != 64)
+            continue;
+
+        IndexRecord *record = g_new0(IndexRecord, 1);
+        g_strlcpy(record->sha256, fields[0], sizeof(record->sha256));
+        record->size = g_ascii_strtoull(fields[1], NULL, 10);
+        record->mtime = g_ascii_strtoll(fields[2], NULL, 10);
+        g_hash_table_insert(records, g_strdup(fields[3]), record);
+    }
+
+    return records;
+}
+
+static void save_index(void) {
+    g_autofree char *path = index_path();
+    g_autofree char *dir = g_path_get_dirname(path);
+    g_autoptr(GString) contents = g_string_new(NULL);
+
+    g_mutex_lock(&cache_lock);
+    for (guint i = 0; i < cache_packages->len; i++) {
+        CachedPackage *package = g_ptr_array_index(cache_packages, i);
+
+        if (package->sha256[0] != '\0') {
+            g_string_append_printf(contents, "%s %" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %s\n",
+                                   package->sha256, package->size, package->mtime, package->path);
+        }
+    }
+    g_mutex_unlock(&cache_lock);
+
+    if (g_mkdir_with_parents(dir, 0755) == 0)
+        g_file_set_contents(path, contents->str, contents->len, NULL);
+}
+
+// name-pkgver-pkgrel-arch.pkg.tar.zst -> name, pkgver-pkgrel
+static gboolean parse_filename(const char *filename, char **name, char **version) {
+    const char *suffix = strstr(filename, ".pkg.tar");
+    g_autofree char *stem = NULL;
+    char *dash[3];
+
+    if (suffix == NULL || g_str_has_suffix(filename, ".sig") || g_str_has_suffix(filename, ".part"))
+        return FALSE;
+
+    stem = g_strndup(filename, suffix - filename);
+    for (guint i = 0; i < G_N_ELEMENTS(dash); i++) {
+        dash[i] = strrchr(stem, '-');
+        if (dash[i] == NULL || dash[i] == stem)
+            return FALSE;
+        *dash[i] = '\0';
+    }
+
+    // dash[0] split off arch, dash[1] pkgrel, dash[2] pkgver
+    *name = g_strdup(stem);
+    *version = g_strdup_printf("%s-%s", dash[2] + 1, dash[1] + 1);
+    return TRUE;
+}
+
+static gboolean hash_file(const char *path, char sha256[65]) {
+    g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_autofree guchar *buffer = g_malloc(CACHE_HASH_BUFFER);
+    gssize count;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while ((count = read(fd, buffer, CACHE_HASH_BUFFER)) > 0)
+        g_checksum_update(checksum, buffer, count);
+    close(fd);
+
+    if (count < 0)
+        return FALSE;
+
+    g_strlcpy(sha256, g_checksum_get_string(checksum), 65);
+    return TRUE;
+}
+
+static void hash_package(gpointer data, gpointer user_data) {
+    CachedPackage *package = data;
+    char sha256[65];
+
+    if (!hash_file(package->path, sha256))
+        return;
+
+    g_mutex_lock(&cache_lock);
+    g_strlcpy(package->sha256, sha256, sizeof(package->sha256));
+    g_hash_table_insert(by_sha256, package->sha256, package);
+    g_mutex_unlock(&cache_lock);
+}
+
+static void scan_dir(const char *dir_path, GHashTable *records, GPtrArray *unhashed) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    const char *entry;
+
+    if (dir == NULL)
+        return;
+
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        char *name, *version;
+        GStatBuf st;
+
+        if (!parse_filename(entry, &name, &version))
+            continue;
+
+        g_autofree char *path = g_build_filename(dir_path, entry, NULL);
+        if (g_stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            g_free(name);
+            g_free(version);
+            continue;
+        }
+
+        CachedPackage *package = g_new0(CachedPackage, 1);
+        package->name = name;
+        package->version = version;
+        package->filename = g_strdup(entry);
+        package->path = g_steal_pointer(&path);
+        package->size = st.st_size;
+        package->mtime = st.st_mtime;
+
+        IndexRecord *record = g_hash_table_lookup(records, package->path);
+        if (record != NULL && record->size == package->size && record->mtime == package->mtime)
+            g_strlcpy(package->sha256, record->sha256, sizeof(package->sha256));
+
+        g_mutex_lock(&cache_lock);
+        g_ptr_array_add(cache_packages, package);
+        if (!g_hash_table_contains(by_filename, package->filename))
+            g_hash_table_insert(by_filename, package->filename, package);
+        if (package->sha256[0] != '\0')
+            g_hash_table_insert(by_sha256, package->sha256, package);
+        g_mutex_unlock(&cache_lock);
+
+        if (package->sha256[0] == '\0')
+            g_ptr_array_add(unhashed, package);
+    }
+
+    g_dir_close(dir);
+}
+
+static gpointer index_thread(gpointer data) {
+    g_auto(GStrv) dirs = data;
+    g_autoptr(GHashTable) records = load_index();
+    g_autoptr(GPtrArray) unhashed = g_ptr_array_new();
+    gint64 start = g_get_monotonic_time();
+    GThreadPool *pool;
+
+    for (guint i = 0; dirs[i] != NULL; i++)
+        scan_dir(dirs[i], records, unhashed);
+
+    // Lookups only need the scan; hashing continues behind them
+    g_mutex_lock(&cache_lock);
+    cache_scanned = TRUE;
+    g_cond_broadcast(&cache_cond);
+    g_mutex_unlock(&cache_lock);
+
+    debug_log("Package cache scanned: %u packages, %u to hash",
+              cache_packages->len, unhashed->len);
+
+    if (unhashed->len == 0)
+        return NULL;
+
+    pool = g_thread_pool_new(hash_package, NULL, MAX(g_get_num_processors(), 1), FALSE, NULL);
+    for (guint i = 0; i < unhashed->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(unhashed, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    save_index();
+
+    debug_log("Package cache indexed in %.3f s",
+              (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC);
+    return NULL;
+}
+
+// Call with lock held. Shared downloads can come before (or without) a scan.
+static void ensure_tables_locked(void) {
+    if (cache_packages != NULL)
+        return;
+
+    cache_packages = g_ptr_array_new();
+    by_sha256 = g_hash_table_new(g_str_hash, g_str_equal);
+    by_filename = g_hash_table_new(g_str_hash, g_str_equal);
+    in_flight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+void package_cache_start(const char * const *extra_dirs) {
+    g_autoptr(GPtrArray) dirs = g_ptr_array_new_with_free_func(g_free);
+
+    g_mutex_lock(&cache_lock);
+    if (cache_started) {
+        g_mutex_unlock(&cache_lock);
+        return;
+    }
+    cache_started = TRUE;
+    ensure_tables_locked();
+    g_mutex_unlock(&cache_lock);
+
+    g_ptr_array_add(dirs, g_strdup(PACKAGE_CACHE_HOST_DIR));
+    for (guint i = 0; extra_dirs != NULL && extra_dirs[i] != NULL; i++)
+        g_ptr_array_add(dirs, g_strdup(extra_dirs[i]));
+    g_ptr_array_add(dirs, NULL);
+
+    g_thread_unref(g_thread_new("pkgcache", index_thread,
+                                g_ptr_array_free(g_steal_pointer(&dirs), FALSE)));
+}
+
+static gboolean wait_for_scan_locked(void) {
+    if (!cache_started)
+        return FALSE;
+
+    while (!cache_scanned)
+        g_cond_wait(&cache_cond, &cache_lock);
+
+    return TRUE;
+}
+
+const CachedPackage* package_cache_lookup(const char *filename, const char *sha256) {
+    CachedPackage *package = NULL;
+
+    g_mutex_lock(&cache_lock);
+    if (wait_for_scan_locked() || cache_packages != NULL) {
+        if (sha256 != NULL)
+            package = g_hash_table_lookup(by_sha256, sha256);
+        if (package == NULL && filename != NULL)
+            package = g_hash_table_lookup(by_filename, filename);
+    }
+    g_mutex_unlock(&cache_lock);
+
+    return package;
+}
+
+gboolean package_cache_verified(const CachedPackage *package, const char *sha256) {
+    gboolean verified;
+
+    g_mutex_lock(&cache_lock);
+    verified = sha256 != NULL && g_ascii_strcasecmp(package->sha256, sha256) == 0;
+    g_mutex_unlock(&cache_lock);
+
+    return verified;
+}
+
+gboolean package_cache_check(const CachedPackage *package, const char *sha256) {
+    char actual[65];
+    gboolean hashed;
+
+    if (sha256 == NULL)
+        return FALSE;
+
+    g_mutex_lock(&cache_lock);
+    hashed = package->sha256[0] != '\0';
+    g_mutex_unlock(&cache_lock);
+
+    if (hashed)
+        return package_cache_verified(package, sha256);
+
+    return hash_file(package->path, actual) && g_ascii_strcasecmp(actual, sha256) == 0;
+}
+
+GPtrArray* package_cache_list(void) {
+    GPtrArray *list;
+
+    g_mutex_lock(&cache_lock);
+    if (wait_for_scan_locked())
+        list = g_ptr_array_copy(cache_packages, NULL, NULL);
+    else
+        list = g_ptr_array_new();
+    g_mutex_unlock(&cache_lock);
+
+    return list;
+}
+
+gboolean package_cache_claim(const char *sha256, GCancellable *cancellable) {
+    gboolean claimed = FALSE;
+
+    if (sha256 == NULL)
+        return FALSE;
+
+    g_mutex_lock(&cache_lock);
+    ensure_tables_locked();
+
+    for (;;) {
+        CachedPackage *package = g_hash_table_lookup(by_sha256, sha256);
+
+        if (package != NULL || g_cancellable_is_cancelled(cancellable))
+            break;
+
+        if (!g_hash_table_contains(in_flight, sha256)) {
+            g_hash_table_add(in_flight, g_strdup(sha256));
+            claimed = TRUE;
+            break;
+        }
+
+        // Woken by every publish; the timeout only catches cancellation
+        g_cond_wait_until(&cache_cond, &cache_lock,
+                          g_get_monotonic_time() + CACHE_CLAIM_WAIT_USEC);
+    }
+    g_mutex_unlock(&cache_lock);
+
+    return claimed;
+}
+
+void package_cache_publish(const char *sha256, const char *path, gboolean verified) {
+    g_autofree char *filename = g_path_get_basename(path);
+    char *name, *version;
+    GStatBuf st;
+
+    g_mutex_lock(&cache_lock);
+    g_hash_table_remove(in_flight, sha256);
+
+    if (verified && !g_hash_table_contains(by_sha256, sha256) &&
+        g_stat(path, &st) == 0 && parse_filename(filename, &name, &version)) {
+        CachedPackage *package = g_new0(CachedPackage, 1);
+
+        package->name = name;
+        package->version = version;
+        package->filename = g_steal_pointer(&filename);
+        package->path = g_strdup(path);
+        package->size = st.st_size;
+        package->mtime = st.st_mtime;
+        g_strlcpy(package->sha256, sha256, sizeof(package->sha256));
+
+        g_ptr_array_add(cache_packages, package);
+        if (!g_hash_table_contains(by_filename, package->filename))
+            g_hash_table_insert(by_filename, package->filename, package);
+        g_hash_table_insert(by_sha256, package->sha256, package);
+    }
+
+    g_cond_broadcast(&cache_cond);
+    g_mutex_unlock(&cache_lock);
+}
+
+gboolean package_cache_link(const CachedPackage *package, const char *dest, GError **error) {
+    g_autofree char *partial = g_strconcat(dest, ".part", NULL);
+    gboolean success;
+    int in, out;
+
+    in = open(package->path, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return tree_copy_set_errno_error(error, "Could not open", package->path);
+
+    out = open(partial, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return tree_copy_set_errno_error(error, "Could not create", partial);
+    }
+
+    if (tree_copy_reflink(in, out)) {
+        debug_log("Reflinked %s", package->filename);
+        success = TRUE;
+    } else {
+        close(out);
+        out = -1;
+        g_unlink(partial);
+        g_unlink(dest);
+
+        if (link(package->path, dest) == 0) {
+            debug_log("Hardlinked %s", package->filename);
+            close(in);
+            return TRUE;
+        }
+
+        out = open(partial, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+            close(in);
+            return tree_copy_set_errno_error(error, "Could not create", partial);
+        }
+
+        debug_log("Copying %s", package->filename);
+        success = tree_copy_data(in, out, package->size, error);
+    }
+
+    close(in);
+    if (close(out) != 0 && success)
+        success = tree_copy_set_errno_error(error, "Could not write", partial);
+
+    if (success && g_rename(partial, dest) != 0)
+        success = tree_copy_set_errno_error(error, "Could not rename", partial);
+    if (!success)
+        g_unlink(partial);
+
+    return success;
+}
+
+gboolean package_cache_link_signature(const CachedPackage *package, const char *dest) {
+    g_autofree char *signature = g_strconcat(package->path, ".sig", NULL);
+    g_autoptr(GFile) source = NULL;
+    g_autoptr(GFile) target = NULL;
+
+    if (!g_file_test(signature, G_FILE_TEST_IS_REGULAR))
+        return FALSE;
+
+    g_unlink(dest);
+    if (link(signature, dest) == 0)
+        return TRUE;
+
+    source = g_file_new_for_path(signature);
+    target = g_file_new_for_path(dest);
+    return g_file_copy(source, target, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, NULL);
+}
@@ -0,0 +1,70 @@
+// File   : pkgcache.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Content-addressed index of package files already on the machine: the live
+// medium's pacman cache plus any extra cache directories. Packages found here
+// are reflinked or hardlinked into the target instead of being downloaded.
+//
+// The index is built on a background thread; hashes are remembered between
+// runs, keyed by path, size and mtime, so only new files are ever hashed.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_PKGCACHE_H
+#define RARCH_PKGCACHE_H
+
+#include <gio/gio.h>
+
+#define PACKAGE_CACHE_HOST_DIR "/var/cache/pacman/pkg"
+
+typedef struct {
+    char *name;
+    char *version;          // pkgver-pkgrel, with epoch if any
+    char *filename;
+    char *path;
+    guint64 size;
+    gint64 mtime;
+    char sha256[65];        // empty until hashed
+} CachedPackage;
+
+// Starts indexing dirs (plus the host cache) in the background; later calls
+// are ignored once indexing has begun
+void package_cache_start(const char * const *extra_dirs);
+
+// Blocks until the directory scan is done (not the hashing). Prefers a match
+// by sha256 and falls back to the file name; NULL if neither is present.
+// The result stays valid for the life of the process.
+const CachedPackage* package_cache_lookup(const char *filename, const char *sha256);
+
+// TRUE when the package's hash is known and equals sha256
+gboolean package_cache_verified(const CachedPackage *package, const char *sha256);
+
+// Like package_cache_verified(), but hashes the file now when indexing
+// hasn't got to it yet
+gboolean package_cache_check(const CachedPackage *package, const char *sha256);
+
+// Every indexed package, in no particular order
+GPtrArray* package_cache_list(void);
+
+// Downloads shared between installs running side by side. The first caller
+// to claim a sha256 gets TRUE, fetches the file and must publish it, verified
+// or not. Everyone else blocks here until it is published, then gets FALSE
+// and finds the file with package_cache_lookup(); if the claimer gave up,
+// the next caller claims it instead. FALSE too without a sha256 or once
+// cancelled, with nothing to publish.
+gboolean package_cache_claim(const char *sha256, GCancellable *cancellable);
+
+// Ends a claim; a verified file at path is added to the index for the rest
+// of the process
+void package_cache_publish(const char *sha256, const char *path, gboolean verified);
+
+// Places the package at dest: reflink, then hardlink, then an in-kernel copy
+gboolean package_cache_link(const CachedPackage *package, const char *dest, GError **error);
+
+// Places the detached signature kept next to the package (<path>.sig) at
+// dest; FALSE when the cache has none
+gboolean package_cache_link_signature(const CachedPackage *package, const char *dest);
+
+#endif // RARCH_PKGCACHE_H
@@ -0,0 +1,313 @@
+// File   : scheduler.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Dependency-graph scheduler for install steps. See scheduler.h.
+//
+// The graph is driven entirely from the main loop: nodes are started with
+// engine_job_run_async() and their completions release dependents, so the
+// only threads involved are the engine's workers.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include "scheduler.h"
+#include "log.h"
+
+typedef enum {
+    NODE_WAITING,
+    NODE_RUNNING,
+    NODE_DONE,
+    NODE_FAILED
+} NodeState;
+
+typedef struct {
+    Scheduler *scheduler;
+    char *id;
+    EngineJob *job;
+    double weight;
+    double fraction;
+    NodeState state;
+    guint pending_deps;
+    GPtrArray *dependents;  // SchedulerNode*, not owned
+} SchedulerNode;
+
+struct _Scheduler {
+    guint max_workers;
+    GPtrArray *nodes;       // SchedulerNode*, owned, in insertion order
+    GHashTable *by_id;      // id -> SchedulerNode*
+
+    SchedulerProgressFunc progress_func;
+    gpointer progress_data;
+    SchedulerNodeFunc node_func;
+    gpointer node_data;
+
+    GTask *task;
+    GCancellable *cancellable;
+    GCancellable *parent_cancellable;
+    gulong parent_cancel_id;
+    GError *error;
+    guint running;
+    guint finished;
+    double total_weight;
+    double done_weight;
+};
+
+static void scheduler_node_free(gpointer data) {
+    SchedulerNode *node = data;
+
+    engine_job_unref(node->job);
+    g_ptr_array_unref(node->dependents);
+    g_free(node->id);
+    g_free(node);
+}
+
+Scheduler* scheduler_new(guint max_workers) {
+    Scheduler *scheduler = g_new0(Scheduler, 1);
+
+    scheduler->max_workers = MAX(max_workers, 1);
+    scheduler->nodes = g_ptr_array_new_with_free_func(scheduler_node_free);
+    scheduler->by_id = g_hash_table_new(g_str_hash, g_str_equal);
+
+    return scheduler;
+}
+
+void scheduler_free(Scheduler *scheduler) {
+    if (scheduler == NULL)
+        return;
+
+    g_return_if_fail(scheduler->task == NULL);
+
+    g_hash_table_unref(scheduler->by_id);
+    g_ptr_array_unref(scheduler->nodes);
+    g_clear_error(&scheduler->error);
+    g_free(scheduler);
+}
+
+void scheduler_add(Scheduler *scheduler,
+                   const char *id,
+                   EngineJob *job,
+                   const char * const *deps,
+                   double weight) {
+    g_return_if_fail(scheduler->task == NULL);
+    g_return_if_fail(!g_hash_table_contains(scheduler->by_id, id));
+
+    SchedulerNode *node = g_new0(SchedulerNode, 1);
+    node->scheduler = scheduler;
+    node->id = g_strdup(id);
+    node->job = engine_job_ref(job);
+    node->weight = MAX(weight, 0.0);
+    node->dependents = g_ptr_array_new();
+
+    // Dependencies must already exist, which also rules out cycles
+    for (guint i = 0; deps != NULL && deps[i] != NULL; i++) {
+        SchedulerNode *dep = g_hash_table_lookup(scheduler->by_id, deps[i]);
+
+        if (dep == NULL) {
+            g_critical("Scheduler node '%s' depends on unknown node '%s'", id, deps[i]);
+            continue;
+        }
+
+        g_ptr_array_add(dep->dependents, node);
+        node->pending_deps++;
+    }
+
+    g_ptr_array_add(scheduler->nodes, node);
+    g_hash_table_insert(scheduler->by_id, node->id, node);
+    scheduler->total_weight += node->weight;
+}
+
+guint scheduler_get_n_nodes(Scheduler *scheduler) {
+    return scheduler->nodes->len;
+}
+
+void scheduler_set_progress_func(Scheduler *scheduler,
+                                 SchedulerProgressFunc func,
+                                 gpointer user_data) {
+    scheduler->progress_func = func;
+    scheduler->progress_data = user_data;
+}
+
+void scheduler_set_node_func(Scheduler *scheduler,
+                             SchedulerNodeFunc func,
+                             gpointer user_data) {
+    scheduler->node_func = func;
+    scheduler->node_data = user_data;
+}
+
+static void notify_node(Scheduler *scheduler, SchedulerNode *node, SchedulerNodeEvent event) {
+    if (scheduler->node_func != NULL)
+        scheduler->node_func(scheduler, node->id, event, scheduler->node_data);
+}
+
+static void report_progress(Scheduler *scheduler, const char *status) {
+    double weight = scheduler->done_weight;
+
+    if (scheduler->progress_func == NULL)
+        return;
+
+    for (guint i = 0; i < scheduler->nodes->len; i++) {
+        SchedulerNode *node = g_ptr_array_index(scheduler->nodes, i);
+
+        if (node->state == NODE_RUNNING && node->fraction > 0.0)
+            weight += node->weight * node->fraction;
+    }
+
+    scheduler->progress_func(scheduler,
+                             scheduler->total_weight > 0.0 ? weight / scheduler->total_weight : 0.0,
+                             status, scheduler->progress_data);
+}
+
+static void on_node_progress(EngineJob *job, double fraction,
+                             const char *status, gpointer user_data) {
+    SchedulerNode *node = user_data;
+
+    node->fraction = fraction;
+    report_progress(node->scheduler, status);
+}
+
+static void complete(Scheduler *scheduler) {
+    GTask *task = scheduler->task;
+
+    scheduler->task = NULL;
+    if (scheduler->parent_cancel_id != 0)
+        g_cancellable_disconnect(scheduler->parent_cancellable, scheduler->parent_cancel_id);
+    scheduler->parent_cancel_id = 0;
+    g_clear_object(&scheduler->parent_cancellable);
+    g_clear_object(&scheduler->cancellable);
+
+    if (scheduler->error != NULL)
+        g_task_return_error(task, g_steal_pointer(&scheduler->error));
+    else
+        g_task_return_boolean(task, TRUE);
+
+    g_object_unref(task);
+}
+
+static void on_node_finished(GObject *source, GAsyncResult *result, gpointer user_data);
+
+static void start_ready_nodes(Scheduler *scheduler) {
+    for (guint i = 0; i < scheduler->nodes->len; i++) {
+        if (scheduler->error != NULL || scheduler->running >= scheduler->max_workers)
+            break;
+
+        SchedulerNode *node = g_ptr_array_index(scheduler->nodes, i);
+        if (node->state != NODE_WAITING || node->pending_deps > 0)
+            continue;
+
+        debug_log("Scheduler starting '%s' (%u running)", node->id, scheduler->running + 1);
+
+        node->state = NODE_RUNNING;
+        scheduler->running++;
+        engine_job_set_progress_func(node->job, on_node_progress, node, NULL);
+        notify_node(scheduler, node, SCHEDULER_NODE_STARTED);
+        engine_job_run_async(node->job, scheduler->cancellable, on_node_finished, node);
+    }
+
+    if (scheduler->running > 0)
+        return;
+
+    // Nothing running and nothing startable: either done, failed, or stuck
+    if (scheduler->error == NULL && scheduler->finished < scheduler->nodes->len) {
+        g_set_error(&scheduler->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Install graph has %u unreachable steps",
+                    scheduler->nodes->len - scheduler->finished);
+    }
+
+    complete(scheduler);
+}
+
+static void on_node_finished(GObject *source, GAsyncResult *result, gpointer user_data) {
+    SchedulerNode *node = user_data;
+    Scheduler *scheduler = node->scheduler;
+    GError *error = NULL;
+
+    scheduler->running--;
+    scheduler->finished++;
+
+    if (engine_job_run_finish(node->job, result, &error)) {
+        node->state = NODE_DONE;
+        scheduler->done_weight += node->weight;
+        notify_node(scheduler, node, SCHEDULER_NODE_DONE);
+
+        for (guint i = 0; i < node->dependents->len; i++) {
+            SchedulerNode *dependent = g_ptr_array_index(node->dependents, i);
+            dependent->pending_deps--;
+        }
+
+        report_progress(scheduler, NULL);
+    } else {
+        node->state = NODE_FAILED;
+        debug_log("Scheduler node '%s' failed: %s", node->id, error->message);
+        notify_node(scheduler, node, SCHEDULER_NODE_FAILED);
+
+        // Keep the first failure and stop everything else that is in flight
+        if (scheduler->error == NULL) {
+            scheduler->error = error;
+            g_prefix_error(&scheduler->error, "%s: ", engine_job_get_name(node->job));
+            g_cancellable_cancel(scheduler->cancellable);
+        } else {
+            g_error_free(error);
+        }
+    }
+
+    start_ready_nodes(scheduler);
+}
+
+// Counts the dependencies again, so the same graph can run a second time
+static void reset_nodes(Scheduler *scheduler) {
+    for (guint i = 0; i < scheduler->nodes->len; i++) {
+        SchedulerNode *node = g_ptr_array_index(scheduler->nodes, i);
+
+        node->state = NODE_WAITING;
+        node->fraction = 0.0;
+        node->pending_deps = 0;
+    }
+
+    for (guint i = 0; i < scheduler->nodes->len; i++) {
+        SchedulerNode *node = g_ptr_array_index(scheduler->nodes, i);
+
+        for (guint j = 0; j < node->dependents->len; j++)
+            ((SchedulerNode *) g_ptr_array_index(node->dependents, j))->pending_deps++;
+    }
+}
+
+static void on_parent_cancelled(GCancellable *parent, gpointer user_data) {
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+}
+
+void scheduler_run_async(Scheduler *scheduler,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer user_data) {
+    g_return_if_fail(scheduler->task == NULL);
+
+    scheduler->task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_source_tag(scheduler->task, scheduler_run_async);
+
+    // A private cancellable lets one failing node stop its siblings
+    scheduler->cancellable = g_cancellable_new();
+    if (cancellable != NULL) {
+        scheduler->parent_cancellable = g_object_ref(cancellable);
+        scheduler->parent_cancel_id =
+            g_cancellable_connect(cancellable, G_CALLBACK(on_parent_cancelled),
+                                  g_object_ref(scheduler->cancellable), g_object_unref);
+    }
+
+    reset_nodes(scheduler);
+    scheduler->running = 0;
+    scheduler->finished = 0;
+    scheduler->done_weight = 0.0;
+    g_clear_error(&scheduler->error);
+
+    debug_log("Scheduler running %u nodes on %u workers",
+              scheduler->nodes->len, scheduler->max_workers);
+
+    start_ready_nodes(scheduler);
+}
+
+gboolean scheduler_run_finish(Scheduler *scheduler, GAsyncResult *result, GError **error) {
+    g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
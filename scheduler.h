@@ -0,0 +1,68 @@
+// File   : scheduler.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Dependency-graph scheduler for install steps. Each node wraps an EngineJob
+// and names the nodes it depends on; every node whose dependencies are done
+// is started, up to a bounded number of concurrent workers.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_SCHEDULER_H
+#define RARCH_SCHEDULER_H
+
+#include <gio/gio.h>
+
+#include "engine.h"
+
+typedef struct _Scheduler Scheduler;
+
+// Runs on the main loop with the weighted progress of the whole graph
+typedef void (*SchedulerProgressFunc)(Scheduler *scheduler,
+                                      double fraction,
+                                      const char *status,
+                                      gpointer user_data);
+
+typedef enum {
+    SCHEDULER_NODE_STARTED,
+    SCHEDULER_NODE_DONE,
+    SCHEDULER_NODE_FAILED
+} SchedulerNodeEvent;
+
+// Runs on the main loop as each node starts and finishes (profiling)
+typedef void (*SchedulerNodeFunc)(Scheduler *scheduler,
+                                  const char *id,
+                                  SchedulerNodeEvent event,
+                                  gpointer user_data);
+
+Scheduler* scheduler_new(guint max_workers);
+void scheduler_free(Scheduler *scheduler);
+
+// deps is a NULL-terminated list of node ids added earlier; weight is the
+// node's expected share of the total run time (any unit, relative to others)
+void scheduler_add(Scheduler *scheduler,
+                   const char *id,
+                   EngineJob *job,
+                   const char * const *deps,
+                   double weight);
+
+guint scheduler_get_n_nodes(Scheduler *scheduler);
+
+void scheduler_set_progress_func(Scheduler *scheduler,
+                                 SchedulerProgressFunc func,
+                                 gpointer user_data);
+
+void scheduler_set_node_func(Scheduler *scheduler,
+                             SchedulerNodeFunc func,
+                             gpointer user_data);
+
+void scheduler_run_async(Scheduler *scheduler,
+                         GCancellable *cancellable,
+                         GAsyncReadyCallback callback,
+                         gpointer user_data);
+gboolean scheduler_run_finish(Scheduler *scheduler, GAsyncResult *result, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(Scheduler, scheduler_free)
+
+#endif // RARCH_SCHEDULER_H
@@ -0,0 +1,486 @@
+// File   : storage.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// The "Erase disk and install" storage layout. See storage.h.
+//
+// Commands are grouped into queues: everything in one queue runs in order,
+// separate queues run at the same time. A rotational disk is a single queue
+// so its head never seeks between two mkfs runs; on anything else every
+// partition is its own queue.
+//
+// Partition numbers are fixed per role (ESP 1, root 2, swap 3) whatever
+// their order on disk, so Recovery can find root and ESP without a layout.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "disks.h"
+#include "log.h"
+#include "storage.h"
+
+#define PARTITION_WAIT_MS     10000
+#define PARTITION_POLL_MS     50
+
+typedef struct {
+    const char *label;          // GPT partition name and file system label
+    const char *type;           // sfdisk type shortcut
+    const char *mountpoint;     // NULL for swap
+    const char * const mkfs[6]; // the device is appended
+} StorageRoleInfo;
+
+static const StorageRoleInfo role_info[] = {
+    [STORAGE_ESP]  = { "rarch-esp",  "U", "/boot",
+                       { "mkfs.fat", "-F", "32", "-n", "RARCH_ESP", NULL } },
+    [STORAGE_ROOT] = { "rarch-root", "L", "/",
+                       { "mkfs.ext4", "-F", "-L", "rarch-root", NULL } },
+    [STORAGE_SWAP] = { "rarch-swap", "S", NULL,
+                       { "mkswap", "-L", "rarch-swap", NULL } },
+    [STORAGE_HOME] = { "rarch-home", "H", "/home",
+                       { "mkfs.ext4", "-F", "-L", "rarch-home", NULL } },
+};
+
+struct _StorageLayout {
+    GPtrArray *partitions;  // StoragePartition*, in table order
+    GPtrArray *disks;       // char*, in first-use order
+    gboolean existing;      // the partitions are there already; no table is written
+};
+
+typedef struct {
+    StorageLayout *layout;
+    char *root;
+} MountData;
+
+// One storage job's queues in flight
+typedef struct {
+    EngineJob *job;
+    GCancellable *cancellable;
+
+    double base;            // share of the job's progress before and during this run
+    double span;
+
+    GMutex lock;
+    GError *error;
+    guint done;
+    guint total;
+} QueueRun;
+
+char* storage_partition_path(const char *disk, guint number) {
+    gsize len = strlen(disk);
+
+    if (len > 0 && g_ascii_isdigit(disk[len - 1]))
+        return g_strdup_printf("%sp%u", disk, number);
+
+    return g_strdup_printf("%s%u", disk, number);
+}
+
+// Unknown disks are treated as rotational: serializing is only ever slower
+static gboolean disk_is_rotational(const char *disk) {
+    g_autofree char *name = g_path_get_basename(disk);
+    g_autoptr(DiskInfo) info = disk_info_probe(name, TRUE);
+
+    return info == NULL || info->rotational;
+}
+
+static void storage_partition_free(gpointer data) {
+    StoragePartition *partition = data;
+
+    g_free(partition->disk);
+    g_free(partition->device);
+    g_free(partition);
+}
+
+static void add_partition(StorageLayout *layout, StorageRole role, const char *disk,
+                          guint number, guint64 size_mib, gboolean rotational) {
+    StoragePartition *partition = g_new0(StoragePartition, 1);
+
+    partition->role = role;
+    partition->disk = g_strdup(disk);
+    partition->device = storage_partition_path(disk, number);
+    partition->number = number;
+    partition->size_mib = size_mib;
+    partition->rotational = rotational;
+    g_ptr_array_add(layout->partitions, partition);
+
+    if (!g_ptr_array_find_with_equal_func(layout->disks, disk, g_str_equal, NULL))
+        g_ptr_array_add(layout->disks, g_strdup(disk));
+}
+
+StorageLayout* storage_layout_new(const char *disk, const char *home_disk, guint64 swap_mib) {
+    StorageLayout *layout = g_new0(StorageLayout, 1);
+    gboolean rotational = disk_is_rotational(disk);
+
+    layout->partitions = g_ptr_array_new_with_free_func(storage_partition_free);
+    layout->disks = g_ptr_array_new_with_free_func(g_free);
+
+    // Root goes last on the disk so it can take whatever is left
+    add_partition(layout, STORAGE_ESP, disk, STORAGE_ESP_NUMBER, STORAGE_ESP_SIZE_MIB, rotational);
+    if (swap_mib > 0)
+        add_partition(layout, STORAGE_SWAP, disk, 3, swap_mib, rotational);
+    add_partition(layout, STORAGE_ROOT, disk, STORAGE_ROOT_NUMBER, 0, rotational);
+
+    if (home_disk != NULL && g_strcmp0(home_disk, disk) != 0)
+        add_partition(layout, STORAGE_HOME, home_disk, 1, 0, disk_is_rotational(home_disk));
+    else if (home_disk != NULL)
+        debug_log("Home disk %s is the root disk, keeping /home on root", home_disk);
+
+    for (guint i = 0; i < layout->partitions->len; i++) {
+        StoragePartition *partition = g_ptr_array_index(layout->partitions, i);
+
+        debug_log("Layout: %s %s (%s)", partition->device, role_info[partition->role].label,
+                  partition->rotational ? "rotational" : "non-rotational");
+    }
+
+    return layout;
+}
+
+StorageLayout* storage_layout_new_existing(void) {
+    StorageLayout *layout = g_new0(StorageLayout, 1);
+
+    layout->partitions = g_ptr_array_new_with_free_func(storage_partition_free);
+    layout->disks = g_ptr_array_new_with_free_func(g_free);
+    layout->existing = TRUE;
+
+    return layout;
+}
+
+void storage_layout_add_existing(StorageLayout *layout, StorageRole role, const char *disk,
+                                 guint number, gboolean format) {
+    StoragePartition *partition;
+
+    add_partition(layout, role, disk, number, 0, disk_is_rotational(disk));
+    partition = g_ptr_array_index(layout->partitions, layout->partitions->len - 1);
+    partition->unformatted = !format;
+
+    debug_log("Layout: %s %s (%s)", partition->device, role_info[role].label,
+              format ? "formatted" : "kept as it is");
+}
+
+void storage_layout_free(StorageLayout *layout) {
+    if (layout == NULL)
+        return;
+
+    g_ptr_array_unref(layout->partitions);
+    g_ptr_array_unref(layout->disks);
+    g_free(layout);
+}
+
+GPtrArray* storage_layout_get_partitions(StorageLayout *layout) {
+    return layout->partitions;
+}
+
+void storage_layout_set_unformatted(StorageLayout *layout, StorageRole role) {
+    for (guint i = 0; i < layout->partitions->len; i++) {
+        StoragePartition *partition = g_ptr_array_index(layout->partitions, i);
+
+        if (partition->role == role)
+            partition->unformatted = TRUE;
+    }
+}
+
+static void queue_run_finish_one(QueueRun *run, EngineJob *job, GError *error) {
+    g_autofree char *status = NULL;
+    double fraction;
+
+    g_mutex_lock(&run->lock);
+    run->done++;
+    fraction = run->base + run->span * run->done / run->total;
+    if (error != NULL) {
+        if (run->error == NULL)
+            run->error = error;
+        else
+            g_error_free(error);
+    }
+    g_mutex_unlock(&run->lock);
+
+    status = g_strdup_printf("%s done", engine_job_get_name(job));
+    engine_job_report(run->job, fraction, status);
+}
+
+static void run_queue(gpointer data, gpointer user_data) {
+    GPtrArray *queue = data;
+    QueueRun *run = user_data;
+
+    for (guint i = 0; i < queue->len; i++) {
+        EngineJob *job = g_ptr_array_index(queue, i);
+        GError *error = NULL;
+        gboolean failed;
+
+        // After the first failure nothing new is started
+        g_mutex_lock(&run->lock);
+        failed = run->error != NULL;
+        g_mutex_unlock(&run->lock);
+        if (failed)
+            return;
+
+        engine_job_report(run->job, -1.0, engine_job_get_name(job));
+        if (!engine_job_run(job, run->cancellable, &error))
+            g_prefix_error(&error, "%s: ", engine_job_get_name(job));
+        queue_run_finish_one(run, job, error);
+    }
+}
+
+// queues is a GPtrArray of GPtrArray of EngineJob*; blocks until all are done
+static gboolean run_queues(EngineJob *job, GPtrArray *queues, double base, double span,
+                           GCancellable *cancellable, GError **error) {
+    QueueRun run = { 0 };
+    GThreadPool *pool;
+
+    run.job = job;
+    run.cancellable = cancellable;
+    run.base = base;
+    run.span = span;
+    g_mutex_init(&run.lock);
+    for (guint i = 0; i < queues->len; i++)
+        run.total += ((GPtrArray *) g_ptr_array_index(queues, i))->len;
+
+    pool = g_thread_pool_new(run_queue, &run, MAX(queues->len, 1), FALSE, NULL);
+    for (guint i = 0; i < queues->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(queues, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    g_mutex_clear(&run.lock);
+
+    if (run.error != NULL) {
+        g_propagate_error(error, run.error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GPtrArray* new_queue(GPtrArray *queues) {
+    GPtrArray *queue = g_ptr_array_new_with_free_func((GDestroyNotify) engine_job_unref);
+
+    g_ptr_array_add(queues, queue);
+    return queue;
+}
+
+static EngineJob* partition_table_job(StorageLayout *layout, const char *disk) {
+    const char *argv[] = {
+        "sfdisk", "--wipe", "always", "--wipe-partitions", "always", disk, NULL
+    };
+    g_autofree char *name = g_strdup_printf("Partitioning %s", disk);
+    GString *script = g_string_new("label: gpt\n");
+
+    // Named lines pin the partition number; the order of lines sets the order on disk
+    for (guint i = 0; i < layout->partitions->len; i++) {
+        StoragePartition *partition = g_ptr_array_index(layout->partitions, i);
+        const StorageRoleInfo *info = &role_info[partition->role];
+
+        if (g_strcmp0(partition->disk, disk) != 0)
+            continue;
+
+        g_string_append_printf(script, "%s : ", partition->device);
+        if (partition->size_mib > 0)
+            g_string_append_printf(script, "size=%" G_GUINT64_FORMAT "MiB, ", partition->size_mib);
+        g_string_append_printf(script, "type=%s, name=%s\n", info->type, info->label);
+    }
+
+    EngineJob *job = engine_job_new_command(name, argv);
+    g_autoptr(GBytes) input = g_string_free_to_bytes(script);
+    engine_job_set_stdin(job, input);
+
+    return job;
+}
+
+static EngineJob* format_job(const StoragePartition *partition) {
+    const StorageRoleInfo *info = &role_info[partition->role];
+    g_autofree char *name = g_strdup_printf("Formatting %s", partition->device);
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+
+    for (guint i = 0; info->mkfs[i] != NULL; i++)
+        g_ptr_array_add(argv, (gpointer) info->mkfs[i]);
+    g_ptr_array_add(argv, partition->device);
+    g_ptr_array_add(argv, NULL);
+
+    return engine_job_new_command(name, (const char * const *) argv->pdata);
+}
+
+// sfdisk asks the kernel to reread the table; the nodes follow shortly after
+static gboolean wait_for_partitions(StorageLayout *layout, GCancellable *cancellable,
+                                    GError **error) {
+    gint64 deadline = g_get_monotonic_time() + PARTITION_WAIT_MS * G_TIME_SPAN_MILLISECOND;
+
+    for (guint i = 0; i < layout->partitions->len; i++) {
+        StoragePartition *partition = g_ptr_array_index(layout->partitions, i);
+
+        while (!g_file_test(partition->device, G_FILE_TEST_EXISTS)) {
+            if (g_cancellable_set_error_if_cancelled(cancellable, error))
+                return FALSE;
+
+            if (g_get_monotonic_time() > deadline) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                            "Partition %s did not appear (loop devices need losetup -P)",
+                            partition->device);
+                return FALSE;
+            }
+
+            g_usleep(PARTITION_POLL_MS * 1000);
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean prepare_storage(EngineJob *job, gpointer user_data,
+                                GCancellable *cancellable, GError **error) {
+    StorageLayout *layout = user_data;
+    g_autoptr(GPtrArray) tables = g_ptr_array_new_with_free_func((GDestroyNotify) g_ptr_array_unref);
+    g_autoptr(GPtrArray) formats = g_ptr_array_new_with_free_func((GDestroyNotify) g_ptr_array_unref);
+    g_autoptr(GHashTable) disk_queues = g_hash_table_new(g_str_hash, g_str_equal);
+
+    // Each disk's table is a single sfdisk run; different disks are independent
+    for (guint i = 0; !layout->existing && i < layout->disks->len; i++) {
+        const char *disk = g_ptr_array_index(layout->disks, i);
+
+        g_ptr_array_add(new_queue(tables), partition_table_job(layout, disk));
+    }
+
+    if (tables->len > 0 && !run_queues(job, tables, 0.0, 0.2, cancellable, error))
+        return FALSE;
+
+    if (!wait_for_partitions(layout, cancellable, error))
+        return FALSE;
+
+    for (guint i = 0; i < layout->partitions->len; i++) {
+        StoragePartition *partition = g_ptr_array_index(layout->partitions, i);
+        GPtrArray *queue = NULL;
+
+        if (partition->unformatted)
+            continue;
+
+        if (partition->rotational) {
+            queue = g_hash_table_lookup(disk_queues, partition->disk);
+            if (queue == NULL) {
+                queue = new_queue(formats);
+                g_hash_table_insert(disk_queues, partition->disk, queue);
+            }
+        } else {
+            queue = new_queue(formats);
+        }
+
+        g_ptr_array_add(queue, format_job(partition));
+    }
+
+    debug_log("Formatting %u partitions in %u queues", layout->partitions->len, formats->len);
+
+    return run_queues(job, formats, 0.2, 0.8, cancellable, error);
+}
+
+EngineJob* storage_prepare_job_new(const char *name, StorageLayout *layout) {
+    return engine_job_new_func(name, prepare_storage, layout,
+                               (GDestroyNotify) storage_layout_free);
+}
+
+static guint mount_depth(const StoragePartition *partition) {
+    const char *mountpoint = role_info[partition->role].mountpoint;
+    guint depth = 0;
+
+    // Swap has no mountpoint and goes last
+    if (mountpoint == NULL)
+        return G_MAXUINT;
+
+    for (const char *c = mountpoint; *c != '\0'; c++) {
+        if (*c == '/' && c[1] != '\0')
+            depth++;
+    }
+
+    return depth;
+}
+
+static gint compare_mount_order(gconstpointer a, gconstpointer b) {
+    guint depth_a = mount_depth(*(StoragePartition * const *) a);
+    guint depth_b = mount_depth(*(StoragePartition * const *) b);
+
+    return depth_a < depth_b ? -1 : depth_a > depth_b;
+}
+
+gboolean storage_is_mounted(const char *path) {
+    g_autofree char *parent = g_build_filename(path, "..", NULL);
+    GStatBuf self, above;
+
+    if (g_stat(path, &self) != 0 || g_stat(parent, &above) != 0)
+        return FALSE;
+
+    return self.st_dev != above.st_dev;
+}
+
+static gboolean swap_is_active(const char *device) {
+    g_autofree char *swaps = NULL;
+    gsize len = strlen(device);
+
+    if (!g_file_get_contents("/proc/swaps", &swaps, NULL, NULL))
+        return FALSE;
+
+    for (const char *line = swaps; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+        if (*line == '\n')
+            line++;
+        if (strncmp(line, device, len) == 0 && g_ascii_isspace(line[len]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean mount_storage(EngineJob *job, gpointer user_data,
+                              GCancellable *cancellable, GError **error) {
+    MountData *data = user_data;
+    g_autoptr(GPtrArray) order = g_ptr_array_copy(data->layout->partitions, NULL, NULL);
+
+    // A mountpoint's parent is always mounted before it
+    g_ptr_array_sort(order, compare_mount_order);
+
+    for (guint i = 0; i < order->len; i++) {
+        StoragePartition *partition = g_ptr_array_index(order, i);
+        const char *mountpoint = role_info[partition->role].mountpoint;
+        g_autofree char *target = NULL;
+        g_autoptr(EngineJob) step = NULL;
+
+        // A resumed install may still have everything mounted from before
+        if (mountpoint != NULL) {
+            target = g_build_filename(data->root, mountpoint, NULL);
+            if (storage_is_mounted(target)) {
+                debug_log("%s is already mounted", target);
+                continue;
+            }
+
+            const char *argv[] = { "mount", "--mkdir", partition->device, target, NULL };
+            step = engine_job_new_command(target, argv);
+        } else {
+            if (swap_is_active(partition->device)) {
+                debug_log("%s is already in use as swap", partition->device);
+                continue;
+            }
+
+            const char *argv[] = { "swapon", partition->device, NULL };
+            step = engine_job_new_command(partition->device, argv);
+        }
+
+        engine_job_report(job, i / (double) order->len, engine_job_get_name(step));
+        if (!engine_job_run(step, cancellable, error))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void mount_data_free(gpointer user_data) {
+    MountData *data = user_data;
+
+    storage_layout_free(data->layout);
+    g_free(data->root);
+    g_free(data);
+}
+
+EngineJob* storage_mount_job_new(const char *name, StorageLayout *layout, const char *root) {
+    MountData *data = g_new0(MountData, 1);
+
+    data->layout = layout;
+    data->root = g_strdup(root);
+
+    return engine_job_new_func(name, mount_storage, data, mount_data_free);
+}
@@ -0,0 +1,79 @@
+// File   : storage.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// The "Erase disk and install" storage layout: partition tables, file systems
+// and mounts. Each disk gets its whole GPT in one sfdisk pass, then every
+// file system is created at once, except that partitions sharing a rotational
+// disk are formatted one after another. Mounts follow the mountpoint order.
+// Works the same on loop devices attached with partition scanning (losetup -P).
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_STORAGE_H
+#define RARCH_STORAGE_H
+
+#include <gio/gio.h>
+
+#include "engine.h"
+
+#define STORAGE_ESP_SIZE_MIB 1024
+
+// Partition numbers on the install disk, whatever else the layout holds
+#define STORAGE_ESP_NUMBER  1
+#define STORAGE_ROOT_NUMBER 2
+
+typedef enum {
+    STORAGE_ESP,
+    STORAGE_ROOT,
+    STORAGE_SWAP,
+    STORAGE_HOME
+} StorageRole;
+
+typedef struct {
+    StorageRole role;
+    char *disk;             // whole device, e.g. /dev/sda
+    char *device;           // partition node, e.g. /dev/sda1
+    guint number;
+    guint64 size_mib;       // 0 takes the rest of the disk
+    gboolean rotational;    // from the disk's queue/rotational in sysfs
+    gboolean unformatted;   // created but left for something else to fill
+} StoragePartition;
+
+typedef struct _StorageLayout StorageLayout;
+
+// disk gets the ESP, root and (swap_mib > 0) swap; home_disk, when set and
+// different from disk, is given over entirely to /home
+StorageLayout* storage_layout_new(const char *disk, const char *home_disk, guint64 swap_mib);
+void storage_layout_free(StorageLayout *layout);
+
+// A layout over partitions that already exist, or that a partition plan
+// writes (see partplan.h): no table is written, and only partitions added
+// with format get a file system
+StorageLayout* storage_layout_new_existing(void);
+void storage_layout_add_existing(StorageLayout *layout, StorageRole role, const char *disk,
+                                 guint number, gboolean format);
+
+// Partitions in table order; the layout keeps ownership
+GPtrArray* storage_layout_get_partitions(StorageLayout *layout);
+
+// role's partition gets no file system; an image deploy writes one instead
+void storage_layout_set_unformatted(StorageLayout *layout, StorageRole role);
+
+// /dev/sda -> /dev/sda1, /dev/nvme0n1 -> /dev/nvme0n1p1
+char* storage_partition_path(const char *disk, guint number);
+
+// A mount point lives on another device than its parent directory
+gboolean storage_is_mounted(const char *path);
+
+// Writes the partition tables and creates the file systems; takes the layout
+EngineJob* storage_prepare_job_new(const char *name, StorageLayout *layout);
+
+// Mounts the layout below root and enables swap, leaving alone whatever an
+// earlier attempt already mounted; takes the layout
+EngineJob* storage_mount_job_new(const char *name, StorageLayout *layout, const char *root);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(StorageLayout, storage_layout_free)
+
+#endif // RARCH_STORAGE_H
@@ -0,0 +1,261 @@
+// File   : targets.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Multi-target installs. See targets.h.
+//
+// The targets share nothing but the main loop: each has its own settings
+// copy, scheduler, chroot session and checkpoint journal. Sharing happens
+// below them, in the package cache and the image deploy, keyed by what is
+// being fetched rather than by target.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#include "log.h"
+#include "packages.h"
+#include "targets.h"
+
+typedef struct {
+    InstallTargets *targets;
+    guint index;
+    InstallSettings *settings;
+    Scheduler *scheduler;
+    InstallTargetState state;
+    double fraction;
+    GError *error;
+} InstallTarget;
+
+struct _InstallTargets {
+    GPtrArray *targets;     // InstallTarget*, owned, in disk order
+
+    InstallTargetsFunc func;
+    gpointer func_data;
+
+    GTask *task;
+    guint running;
+};
+
+static void install_target_free(gpointer data) {
+    InstallTarget *target = data;
+
+    scheduler_free(target->scheduler);
+    install_settings_free(target->settings);
+    g_clear_error(&target->error);
+    g_free(target);
+}
+
+// Each target gets the settings as given, except for where it is mounted
+// and what can't be shared between disks
+static InstallSettings* target_settings(const InstallSettings *settings, const char *disk,
+                                        gboolean several, const char *mirror) {
+    InstallSettings *copy = install_settings_copy(settings);
+    g_autofree char *name = g_path_get_basename(disk);
+
+    g_free(copy->disk);
+    copy->disk = g_strdup(disk);
+    g_clear_pointer(&copy->extra_disks, g_strfreev);
+
+    if (!several)
+        return copy;
+
+    g_free(copy->root);
+    copy->root = g_strconcat(INSTALL_TARGETS_ROOT, name, NULL);
+    copy->shared = TRUE;
+
+    // Every target would format the same /home disk
+    g_clear_pointer(&copy->home_disk, g_free);
+
+    if (copy->mirror == NULL && mirror != NULL)
+        copy->mirror = g_strdup(mirror);
+
+    return copy;
+}
+
+InstallTargets* install_targets_new(const InstallSettings *settings) {
+    InstallTargets *targets = g_new0(InstallTargets, 1);
+    g_autoptr(GPtrArray) disks = g_ptr_array_new();
+    g_autofree char *mirror = NULL;
+    gboolean several;
+
+    targets->targets = g_ptr_array_new_with_free_func(install_target_free);
+
+    if (settings->disk != NULL)
+        g_ptr_array_add(disks, settings->disk);
+
+    // A partition plan is read from and written to one disk only
+    if (settings->plan != NULL && settings->extra_disks != NULL)
+        debug_log("Targets: a partition plan only applies to %s, ignoring the other disks",
+                  settings->disk);
+
+    for (guint i = 0; settings->plan == NULL && settings->extra_disks != NULL &&
+                      settings->extra_disks[i] != NULL; i++) {
+        if (!g_ptr_array_find_with_equal_func(disks, settings->extra_disks[i], g_str_equal, NULL))
+            g_ptr_array_add(disks, settings->extra_disks[i]);
+    }
+
+    several = disks->len > 1;
+    if (several && settings->home_disk != NULL)
+        debug_log("Targets: a separate /home disk only applies to single installs, ignoring %s",
+                  settings->home_disk);
+
+    // pacstrap can't share its downloads, the package pipeline can; the
+    // host's own mirror is as good a source as any
+    if (several && settings->mirror == NULL && settings->image == NULL) {
+        mirror = package_host_mirror();
+        if (mirror != NULL)
+            debug_log("Targets: fetching packages once for all disks from %s", mirror);
+        else
+            debug_log("Targets: no mirror in %s, every disk downloads its own packages",
+                      PACKAGE_HOST_MIRRORLIST);
+    }
+
+    for (guint i = 0; i < disks->len; i++) {
+        InstallTarget *target = g_new0(InstallTarget, 1);
+
+        target->targets = targets;
+        target->index = i;
+        target->settings = target_settings(settings, g_ptr_array_index(disks, i), several, mirror);
+        target->scheduler = install_build_graph(target->settings);
+        g_ptr_array_add(targets->targets, target);
+
+        debug_log("Targets: %s mounted at %s", target->settings->disk, target->settings->root);
+    }
+
+    return targets;
+}
+
+void install_targets_free(InstallTargets *targets) {
+    if (targets == NULL)
+        return;
+
+    g_return_if_fail(targets->task == NULL);
+
+    g_ptr_array_unref(targets->targets);
+    g_free(targets);
+}
+
+guint install_targets_get_n_targets(InstallTargets *targets) {
+    return targets->targets->len;
+}
+
+const char* install_targets_get_disk(InstallTargets *targets, guint index) {
+    InstallTarget *target = g_ptr_array_index(targets->targets, index);
+
+    return target->settings->disk;
+}
+
+void install_targets_set_func(InstallTargets *targets,
+                              InstallTargetsFunc func,
+                              gpointer user_data) {
+    targets->func = func;
+    targets->func_data = user_data;
+}
+
+static void notify_target(InstallTarget *target, const char *status) {
+    InstallTargets *targets = target->targets;
+
+    if (targets->func != NULL)
+        targets->func(targets, target->index, target->state, target->fraction, status,
+                      targets->func_data);
+}
+
+static void on_target_progress(Scheduler *scheduler, double fraction,
+                               const char *status, gpointer user_data) {
+    InstallTarget *target = user_data;
+
+    target->fraction = fraction;
+    notify_target(target, status);
+}
+
+static void complete(InstallTargets *targets) {
+    GTask *task = targets->task;
+    g_autoptr(GString) message = g_string_new(NULL);
+    guint failed = 0;
+
+    targets->task = NULL;
+
+    for (guint i = 0; i < targets->targets->len; i++) {
+        InstallTarget *target = g_ptr_array_index(targets->targets, i);
+
+        if (target->error == NULL)
+            continue;
+
+        if (failed++ > 0)
+            g_string_append(message, "; ");
+        g_string_append_printf(message, "%s: %s", target->settings->disk, target->error->message);
+    }
+
+    // A single target fails with its own error, as it always has
+    if (failed > 0 && targets->targets->len == 1) {
+        InstallTarget *target = g_ptr_array_index(targets->targets, 0);
+        g_task_return_error(task, g_error_copy(target->error));
+    } else if (failed > 0) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "%u of %u disks failed: %s",
+                                failed, targets->targets->len, message->str);
+    } else {
+        g_task_return_boolean(task, TRUE);
+    }
+
+    g_object_unref(task);
+}
+
+static void on_target_finished(GObject *source, GAsyncResult *result, gpointer user_data) {
+    InstallTarget *target = user_data;
+    InstallTargets *targets = target->targets;
+
+    if (scheduler_run_finish(target->scheduler, result, &target->error)) {
+        target->state = TARGET_DONE;
+        target->fraction = 1.0;
+        debug_log("Targets: %s finished", target->settings->disk);
+        notify_target(target, "Installation finished");
+    } else {
+        target->state = TARGET_FAILED;
+        debug_log("Targets: %s failed: %s", target->settings->disk, target->error->message);
+        notify_target(target, target->error->message);
+    }
+
+    if (--targets->running == 0)
+        complete(targets);
+}
+
+void install_targets_run_async(InstallTargets *targets,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data) {
+    g_return_if_fail(targets->task == NULL);
+
+    targets->task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_source_tag(targets->task, install_targets_run_async);
+
+    if (targets->targets->len == 0) {
+        GTask *task = g_steal_pointer(&targets->task);
+
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                "No installation disk selected");
+        g_object_unref(task);
+        return;
+    }
+
+    debug_log("Targets: installing %u disks side by side", targets->targets->len);
+
+    // Each scheduler stops its own graph on a failure; only the caller's
+    // cancellable stops them all
+    targets->running = targets->targets->len;
+    for (guint i = 0; i < targets->targets->len; i++) {
+        InstallTarget *target = g_ptr_array_index(targets->targets, i);
+
+        target->state = TARGET_RUNNING;
+        target->fraction = 0.0;
+        g_clear_error(&target->error);
+        scheduler_set_progress_func(target->scheduler, on_target_progress, target);
+        scheduler_run_async(target->scheduler, cancellable, on_target_finished, target);
+    }
+}
+
+gboolean install_targets_run_finish(InstallTargets *targets, GAsyncResult *result, GError **error) {
+    g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
@@ -0,0 +1,67 @@
+// File   : targets.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Multi-target installs: the same system onto several disks from one
+// session, for benches that image a batch of drives at once. Every disk gets
+// its own install graph, mounted under its own root and run side by side
+// with the others; a disk that fails leaves the rest running. Whatever the
+// targets have in common is fetched or decoded only once: package downloads
+// (see packages.h) and the root image (see imagedeploy.h). Each disk's bulk
+// writes go through that disk's own I/O queue (see engine.h).
+//
+// A single disk runs exactly as before, mounted at INSTALL_ROOT.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_TARGETS_H
+#define RARCH_TARGETS_H
+
+#include <gio/gio.h>
+
+#include "install.h"
+
+// With several targets, each is mounted at this plus its kernel name (/mnt/rarch-sdb)
+#define INSTALL_TARGETS_ROOT INSTALL_ROOT "/rarch-"
+
+typedef struct _InstallTargets InstallTargets;
+
+typedef enum {
+    TARGET_RUNNING,
+    TARGET_DONE,
+    TARGET_FAILED
+} InstallTargetState;
+
+// Runs on the main loop with one target's progress; once it failed, status
+// is the error message
+typedef void (*InstallTargetsFunc)(InstallTargets *targets,
+                                   guint index,
+                                   InstallTargetState state,
+                                   double fraction,
+                                   const char *status,
+                                   gpointer user_data);
+
+// One target for settings->disk and one for each of settings->extra_disks
+InstallTargets* install_targets_new(const InstallSettings *settings);
+void install_targets_free(InstallTargets *targets);
+
+guint install_targets_get_n_targets(InstallTargets *targets);
+const char* install_targets_get_disk(InstallTargets *targets, guint index);
+
+void install_targets_set_func(InstallTargets *targets,
+                              InstallTargetsFunc func,
+                              gpointer user_data);
+
+// Completes once every target has finished or failed
+void install_targets_run_async(InstallTargets *targets,
+                               GCancellable *cancellable,
+                               GAsyncReadyCallback callback,
+                               gpointer user_data);
+
+// FALSE if any target failed; the message names every disk that did
+gboolean install_targets_run_finish(InstallTargets *targets, GAsyncResult *result, GError **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(InstallTargets, install_targets_free)
+
+#endif // RARCH_TARGETS_H
@@ -0,0 +1,536 @@
+// File   : treecopy.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Bulk tree copy. See treecopy.h.
+//
+// Every directory is one thread pool task. A task opens its source and
+// destination directories relative to the two root fds, reads the source in
+// large getdents64 batches, copies the entries with *at() calls and queues a
+// new task per subdirectory. Directory timestamps are applied at the end,
+// once nothing will create entries in them any more.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "treecopy.h"
+
+#define DENTS_BUFFER_SIZE  (64 * 1024)
+#define COPY_CHUNK         (64 * 1024 * 1024)
+#define FALLBACK_BUFFER    (1024 * 1024)
+#define XATTR_LIST_SIZE    (16 * 1024)
+#define XATTR_VALUE_SIZE   (64 * 1024)
+
+// Kernel record layout returned by getdents64
+typedef struct {
+    guint64 d_ino;
+    gint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+typedef struct {
+    char *path;
+    struct timespec times[2];
+} DirTimes;
+
+// The first copy of a file with several links; the others link to it
+typedef struct {
+    char *path;             // relative to the destination root
+    gboolean done;
+    gboolean failed;
+} HardLink;
+
+typedef struct {
+    int source_root;
+    int dest_root;
+    GCancellable *cancellable;
+    GThreadPool *pool;
+
+    GMutex lock;
+    GCond cond;             // pending reaching 0, or a HardLink being done
+    guint pending;
+    GError *error;
+    GArray *dir_times;      // DirTimes
+    GHashTable *links;      // "dev:ino" -> HardLink*
+    TreeCopyStats stats;
+} TreeCopy;
+
+static void hard_link_free(gpointer data) {
+    HardLink *link = data;
+
+    g_free(link->path);
+    g_free(link);
+}
+
+gboolean tree_copy_set_errno_error(GError **error, const char *what, const char *path) {
+    int saved_errno = errno;
+
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                "%s %s: %s", what, path, g_strerror(saved_errno));
+    return FALSE;
+}
+
+gboolean tree_copy_reflink(int in, int out) {
+    return ioctl(out, FICLONE, in) == 0;
+}
+
+gboolean tree_copy_data(int in, int out, guint64 size, GError **error) {
+    g_autofree char *buffer = NULL;
+    guint64 remaining = size;
+
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(in, NULL, out, NULL, MIN(remaining, COPY_CHUNK), 0);
+
+        if (copied > 0) {
+            remaining -= copied;
+            continue;
+        }
+        if (copied == 0)
+            return TRUE;
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+            return tree_copy_set_errno_error(error, "Could not copy", "file data");
+
+        // Old kernel or mismatched filesystems: plain read/write for the rest
+        ssize_t count;
+        buffer = g_malloc(FALLBACK_BUFFER);
+        while ((count = read(in, buffer, FALLBACK_BUFFER)) > 0) {
+            if (write(out, buffer, count) != count)
+                return tree_copy_set_errno_error(error, "Could not write", "file data");
+        }
+        if (count < 0)
+            return tree_copy_set_errno_error(error, "Could not read", "file data");
+        return TRUE;
+    }
+
+    return TRUE;
+}
+
+// Best effort: filesystems without xattr support simply don't get them.
+// Lists and values too large for the usual buffers are sized first.
+static void copy_xattrs(int in, int out) {
+    g_autofree char *names = g_malloc(XATTR_LIST_SIZE);
+    g_autofree char *value = NULL;
+    size_t value_size = XATTR_VALUE_SIZE;
+    ssize_t length;
+
+    length = flistxattr(in, names, XATTR_LIST_SIZE);
+    if (length < 0 && errno == ERANGE) {
+        length = flistxattr(in, NULL, 0);
+        if (length > 0) {
+            names = g_realloc(names, length);
+            length = flistxattr(in, names, length);
+        }
+    }
+    if (length <= 0)
+        return;
+
+    value = g_malloc(value_size);
+    for (char *name = names; name < names + length; name += strlen(name) + 1) {
+        ssize_t size = fgetxattr(in, name, value, value_size);
+
+        if (size < 0 && errno == ERANGE) {
+            size = fgetxattr(in, name, NULL, 0);
+            if (size > 0) {
+                value_size = size;
+                value = g_realloc(value, value_size);
+                size = fgetxattr(in, name, value, value_size);
+            }
+        }
+
+        if (size >= 0)
+            fsetxattr(out, name, value, size, 0);
+    }
+}
+
+// Written under a temporary name and renamed over the destination, so
+// whatever was there (a symlink like etc/localtime, too) is replaced
+static gboolean copy_file(int source_dir, int dest_dir, const char *name,
+                          const struct stat *st, gboolean *reflinked, GError **error) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    g_autofree char *temp = g_strdup_printf(".%s.rarch-copy", name);
+    gboolean success = TRUE;
+    int in, out;
+
+    in = openat(source_dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0)
+        return tree_copy_set_errno_error(error, "Could not open", name);
+
+    unlinkat(dest_dir, temp, 0);
+    out = openat(dest_dir, temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out < 0) {
+        close(in);
+        return tree_copy_set_errno_error(error, "Could not create", name);
+    }
+
+    *reflinked = st->st_size > 0 && tree_copy_reflink(in, out);
+    if (!*reflinked && st->st_size > 0)
+        success = tree_copy_data(in, out, st->st_size, error);
+
+    if (success) {
+        // chown first: it clears setuid/setgid bits that fchmod then restores
+        if (fchown(out, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+            success = tree_copy_set_errno_error(error, "Could not chown", name);
+        else if (fchmod(out, st->st_mode & 07777) != 0)
+            success = tree_copy_set_errno_error(error, "Could not chmod", name);
+    }
+
+    if (success) {
+        copy_xattrs(in, out);
+        futimens(out, times);
+    }
+
+    close(in);
+    close(out);
+
+    if (success && renameat(dest_dir, temp, dest_dir, name) != 0)
+        success = tree_copy_set_errno_error(error, "Could not replace", name);
+    if (!success)
+        unlinkat(dest_dir, temp, 0);
+
+    return success;
+}
+
+// Files with several links are copied once; the other names link to that
+// copy once it is complete
+static gboolean copy_linked_file(TreeCopy *copy, int source_dir, int dest_dir,
+                                 const char *name, const char *path, const struct stat *st,
+                                 gboolean *reflinked, gboolean *linked, GError **error) {
+    g_autofree char *key = g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                                           (guint64) st->st_dev, (guint64) st->st_ino);
+    HardLink *link;
+    gboolean success;
+
+    *linked = FALSE;
+
+    g_mutex_lock(&copy->lock);
+    link = g_hash_table_lookup(copy->links, key);
+    if (link == NULL) {
+        link = g_new0(HardLink, 1);
+        link->path = g_strdup(path);
+        g_hash_table_insert(copy->links, g_steal_pointer(&key), link);
+        g_mutex_unlock(&copy->lock);
+
+        success = copy_file(source_dir, dest_dir, name, st, reflinked, error);
+
+        g_mutex_lock(&copy->lock);
+        link->done = TRUE;
+        link->failed = !success;
+        g_cond_broadcast(&copy->cond);
+        g_mutex_unlock(&copy->lock);
+        return success;
+    }
+
+    while (!link->done)
+        g_cond_wait(&copy->cond, &copy->lock);
+    success = !link->failed;
+    g_mutex_unlock(&copy->lock);
+
+    // The first copy failed and the copy stops anyway; no link to make
+    if (!success)
+        return copy_file(source_dir, dest_dir, name, st, reflinked, error);
+
+    unlinkat(dest_dir, name, 0);
+    if (linkat(copy->dest_root, link->path, dest_dir, name, 0) != 0)
+        return tree_copy_set_errno_error(error, "Could not link", path);
+
+    *linked = TRUE;
+    return TRUE;
+}
+
+static gboolean copy_symlink(int source_dir, int dest_dir, const char *name,
+                             const struct stat *st, GError **error) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    char target[PATH_MAX];
+    ssize_t length;
+
+    length = readlinkat(source_dir, name, target, sizeof(target) - 1);
+    if (length < 0)
+        return tree_copy_set_errno_error(error, "Could not read link", name);
+    target[length] = '\0';
+
+    unlinkat(dest_dir, name, 0);
+    if (symlinkat(target, dest_dir, name) != 0)
+        return tree_copy_set_errno_error(error, "Could not create link", name);
+
+    fchownat(dest_dir, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+    utimensat(dest_dir, name, times, AT_SYMLINK_NOFOLLOW);
+    return TRUE;
+}
+
+static gboolean copy_special(int dest_dir, const char *name, const struct stat *st, GError **error) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+    unlinkat(dest_dir, name, 0);
+    if (mknodat(dest_dir, name, st->st_mode, st->st_rdev) != 0)
+        return tree_copy_set_errno_error(error, "Could not create node", name);
+
+    fchownat(dest_dir, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+    fchmodat(dest_dir, name, st->st_mode & 07777, 0);
+    utimensat(dest_dir, name, times, AT_SYMLINK_NOFOLLOW);
+    return TRUE;
+}
+
+// Opens a directory below root without following any symlink on the way,
+// so nothing already in the destination can lead the copy out of it
+static int open_dir_beneath(int root, const char *path) {
+    struct open_how how = {
+        .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS,
+    };
+    int fd = syscall(SYS_openat2, root, path, &how, sizeof(how));
+
+    // Before Linux 5.6; make_directory() made every component a real directory
+    if (fd < 0 && errno == ENOSYS)
+        fd = openat(root, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    return fd;
+}
+
+static gboolean make_directory(TreeCopy *copy, int source_dir, int dest_dir,
+                               const char *name, const char *path,
+                               const struct stat *st, GError **error) {
+    struct stat existing;
+    int in, out;
+
+    if (mkdirat(dest_dir, name, 0700) != 0) {
+        if (errno != EEXIST)
+            return tree_copy_set_errno_error(error, "Could not create directory", path);
+
+        // A file or symlink in the way is replaced like any other entry
+        if (fstatat(dest_dir, name, &existing, AT_SYMLINK_NOFOLLOW) != 0)
+            return tree_copy_set_errno_error(error, "Could not stat", path);
+        if (!S_ISDIR(existing.st_mode) &&
+            (unlinkat(dest_dir, name, 0) != 0 || mkdirat(dest_dir, name, 0700) != 0))
+            return tree_copy_set_errno_error(error, "Could not replace", path);
+    }
+
+    out = openat(dest_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (out < 0)
+        return tree_copy_set_errno_error(error, "Could not open directory", path);
+
+    in = openat(source_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (in >= 0) {
+        if (fchown(out, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+            debug_log("Could not chown %s: %s", path, g_strerror(errno));
+        fchmod(out, st->st_mode & 07777);
+        copy_xattrs(in, out);
+    }
+    if (in >= 0)
+        close(in);
+    close(out);
+
+    DirTimes times = { g_strdup(path), { st->st_atim, st->st_mtim } };
+    g_mutex_lock(&copy->lock);
+    g_array_append_val(copy->dir_times, times);
+    g_mutex_unlock(&copy->lock);
+
+    return TRUE;
+}
+
+static void queue_directory(TreeCopy *copy, char *path) {
+    g_mutex_lock(&copy->lock);
+    copy->pending++;
+    g_mutex_unlock(&copy->lock);
+
+    g_thread_pool_push(copy->pool, path, NULL);
+}
+
+static gboolean copy_directory(TreeCopy *copy, const char *path, TreeCopyStats *stats, GError **error) {
+    g_autofree char *buffer = NULL;
+    int source_dir, dest_dir;
+    gboolean success = TRUE;
+    long count;
+
+    // The roots are "." relative to themselves
+    source_dir = openat(copy->source_root, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (source_dir < 0)
+        return tree_copy_set_errno_error(error, "Could not open directory", path);
+
+    dest_dir = open_dir_beneath(copy->dest_root, path);
+    if (dest_dir < 0) {
+        close(source_dir);
+        return tree_copy_set_errno_error(error, "Could not open directory", path);
+    }
+
+    buffer = g_malloc(DENTS_BUFFER_SIZE);
+    while (success && (count = syscall(SYS_getdents64, source_dir, buffer, DENTS_BUFFER_SIZE)) > 0) {
+        for (long offset = 0; success && offset < count;) {
+            LinuxDirent64 *entry = (LinuxDirent64 *) (buffer + offset);
+            const char *name = entry->d_name;
+            g_autofree char *child = NULL;
+            struct stat st;
+            gboolean reflinked = FALSE;
+            gboolean linked = FALSE;
+
+            offset += entry->d_reclen;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            if (fstatat(source_dir, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                success = tree_copy_set_errno_error(error, "Could not stat", name);
+                break;
+            }
+
+            child = g_build_filename(path, name, NULL);
+
+            switch (st.st_mode & S_IFMT) {
+                case S_IFDIR:
+                    success = make_directory(copy, source_dir, dest_dir, name, child, &st, error);
+                    if (success) {
+                        stats->directories++;
+                        queue_directory(copy, g_steal_pointer(&child));
+                    }
+                    break;
+                case S_IFREG:
+                    if (st.st_nlink > 1)
+                        success = copy_linked_file(copy, source_dir, dest_dir, name, child, &st,
+                                                   &reflinked, &linked, error);
+                    else
+                        success = copy_file(source_dir, dest_dir, name, &st, &reflinked, error);
+                    stats->files++;
+                    stats->bytes += linked ? 0 : st.st_size;
+                    stats->reflinked += reflinked ? 1 : 0;
+                    break;
+                case S_IFLNK:
+                    success = copy_symlink(source_dir, dest_dir, name, &st, error);
+                    stats->files++;
+                    break;
+                default:
+                    success = copy_special(dest_dir, name, &st, error);
+                    stats->files++;
+                    break;
+            }
+        }
+    }
+
+    if (success && count < 0)
+        success = tree_copy_set_errno_error(error, "Could not read directory", path);
+
+    close(source_dir);
+    close(dest_dir);
+    return success;
+}
+
+static void copy_directory_task(gpointer data, gpointer user_data) {
+    g_autofree char *path = data;
+    TreeCopy *copy = user_data;
+    TreeCopyStats stats = { 0 };
+    GError *error = NULL;
+    gboolean skip;
+
+    g_mutex_lock(&copy->lock);
+    skip = copy->error != NULL;
+    g_mutex_unlock(&copy->lock);
+
+    if (!skip && g_cancellable_set_error_if_cancelled(copy->cancellable, &error))
+        skip = TRUE;
+
+    if (!skip)
+        copy_directory(copy, path, &stats, &error);
+
+    g_mutex_lock(&copy->lock);
+    copy->stats.files += stats.files;
+    copy->stats.directories += stats.directories;
+    copy->stats.bytes += stats.bytes;
+    copy->stats.reflinked += stats.reflinked;
+    if (error != NULL) {
+        if (copy->error == NULL)
+            copy->error = error;
+        else
+            g_error_free(error);
+    }
+    if (--copy->pending == 0)
+        g_cond_broadcast(&copy->cond);
+    g_mutex_unlock(&copy->lock);
+}
+
+gboolean tree_copy(const char *source,
+                   const char *dest,
+                   guint n_threads,
+                   TreeCopyStats *stats,
+                   GCancellable *cancellable,
+                   GError **error) {
+    TreeCopy copy = { 0 };
+    gint64 start = g_get_monotonic_time();
+    gboolean success;
+
+    copy.source_root = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (copy.source_root < 0)
+        return tree_copy_set_errno_error(error, "Could not open", source);
+
+    copy.dest_root = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (copy.dest_root < 0) {
+        close(copy.source_root);
+        return tree_copy_set_errno_error(error, "Could not open", dest);
+    }
+
+    copy.cancellable = cancellable;
+    copy.dir_times = g_array_new(FALSE, FALSE, sizeof(DirTimes));
+    copy.links = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, hard_link_free);
+    g_mutex_init(&copy.lock);
+    g_cond_init(&copy.cond);
+    copy.pool = g_thread_pool_new_full(copy_directory_task, &copy, g_free,
+                                       n_threads > 0 ? n_threads : MAX(g_get_num_processors(), 1),
+                                       FALSE, NULL);
+
+    queue_directory(&copy, g_strdup("."));
+
+    g_mutex_lock(&copy.lock);
+    while (copy.pending > 0)
+        g_cond_wait(&copy.cond, &copy.lock);
+    g_mutex_unlock(&copy.lock);
+
+    g_thread_pool_free(copy.pool, FALSE, TRUE);
+
+    // Only now are the directories final, so their times stick
+    for (guint i = 0; i < copy.dir_times->len; i++) {
+        DirTimes *times = &g_array_index(copy.dir_times, DirTimes, i);
+
+        int dir = open_dir_beneath(copy.dest_root, times->path);
+
+        if (dir >= 0) {
+            futimens(dir, times->times);
+            close(dir);
+        }
+        g_free(times->path);
+    }
+    g_array_unref(copy.dir_times);
+    g_hash_table_unref(copy.links);
+
+    success = copy.error == NULL;
+    if (!success)
+        g_propagate_error(error, copy.error);
+
+    if (stats != NULL)
+        *stats = copy.stats;
+
+    debug_log("Tree copy %s -> %s: %" G_GUINT64_FORMAT " files, %" G_GUINT64_FORMAT
+              " dirs, %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT " reflinked) in %.3f s",
+              source, dest, copy.stats.files, copy.stats.directories,
+              copy.stats.bytes, copy.stats.reflinked,
+              (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC);
+
+    close(copy.source_root);
+    close(copy.dest_root);
+    g_mutex_clear(&copy.lock);
+    g_cond_clear(&copy.cond);
+
+    return success;
+}
@@ -0,0 +1,46 @@
+// File   : treecopy.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Bulk tree copy for the "Copy over relevant config files" step. Directories
+// are read with getdents64 relative to open directory fds and processed in
+// parallel; file data is reflinked or copied in the kernel with
+// copy_file_range, so it never passes through userspace. Ownership, modes,
+// timestamps, hard links and extended attributes are preserved, and
+// whatever is already in the destination under the same name is replaced.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_TREECOPY_H
+#define RARCH_TREECOPY_H
+
+#include <gio/gio.h>
+
+typedef struct {
+    guint64 files;
+    guint64 directories;
+    guint64 bytes;
+    guint64 reflinked;      // files that shared extents instead of copying
+} TreeCopyStats;
+
+// Copies the contents of source into dest (like `cp -a source/. dest/`);
+// dest itself must exist and keeps its own metadata. n_threads 0 = one per CPU.
+gboolean tree_copy(const char *source,
+                   const char *dest,
+                   guint n_threads,
+                   TreeCopyStats *stats,
+                   GCancellable *cancellable,
+                   GError **error);
+
+// Shares in's extents with out (FICLONE); FALSE if the filesystems can't
+gboolean tree_copy_reflink(int in, int out);
+
+// Copies size bytes from the current offsets, in-kernel where possible
+gboolean tree_copy_data(int in, int out, guint64 size, GError **error);
+
+// Sets error from errno as "what path: reason" and returns FALSE, for the
+// other modules working on raw fds as well
+gboolean tree_copy_set_errno_error(GError **error, const char *what, const char *path);
+
+#endif // RARCH_TREECOPY_H
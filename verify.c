@@ -0,0 +1,898 @@
+// File   : verify.c
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Post-install verification. See verify.h.
+//
+// Two passes over pacman's local database. The first reads every package's
+// mtree on the thread pool and checks what an lstat can tell (existence,
+// type, size, link target); the files left to hash are collected with their
+// inode and first physical extent. The second sorts them into disk order,
+// cuts the list into batches and hashes the batches on all cores. Within a
+// batch the next file's readahead is started before the current one is
+// hashed, so reads overlap the hashing without holding many files open.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#define _GNU_SOURCE
+
+#include <blkid.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "verify.h"
+
+#define VERIFY_PACMAN_DB    "var/lib/pacman/local"
+#define HASH_BUFFER_SIZE    (256 * 1024)
+#define BATCH_MAX_BYTES     (8 * 1024 * 1024)
+#define BATCH_MAX_FILES     64
+#define KEPT_PROBLEMS       1000
+#define KEPT_WARNINGS       1000
+#define SHOWN_PROBLEMS      3
+
+// Share of the progress bar for the mtree pass; hashing takes the rest but
+// the few system checks at the end
+#define SCAN_SHARE          0.2
+#define HASH_SHARE          0.75
+
+typedef struct {
+    char *path;                 // below the target root
+    char *relative;
+    const char *package;        // owned by the run
+    char *digest;
+    GChecksumType digest_type;
+    guint64 size;
+    guint64 device;
+    guint64 offset;             // first physical extent, 0 when unknown
+    guint64 inode;
+} HashWork;
+
+typedef struct {
+    char *root;
+    char *username;
+    VerifyRootAccount root_account;
+    GHashTable *config_paths;   // relative paths the configuration tree provides, may be NULL
+
+    EngineJob *job;
+    GCancellable *cancellable;
+
+    GMutex lock;
+    GPtrArray *packages;        // package names, for HashWork
+    GPtrArray *work;            // HashWork*
+    GPtrArray *problems;        // the first KEPT_PROBLEMS
+    guint n_problems;
+    GPtrArray *warnings;        // the first KEPT_WARNINGS
+    guint n_warnings;
+    guint scanned;
+    guint n_packages;
+    guint64 total_bytes;
+    guint64 hashed_bytes;
+} VerifyRun;
+
+typedef struct {
+    VerifyRun *run;
+    guint first;
+    guint count;
+    guint64 bytes;
+} HashBatch;
+
+// The mtree keywords the checks look at; values point into the split line
+typedef struct {
+    const char *type;
+    const char *size;
+    const char *link;
+    const char *sha256;
+    const char *md5;
+} MtreeKeys;
+
+static void hash_work_free(gpointer data) {
+    HashWork *work = data;
+
+    g_free(work->path);
+    g_free(work->relative);
+    g_free(work->digest);
+    g_free(work);
+}
+
+static void verify_run_free(gpointer data) {
+    VerifyRun *run = data;
+
+    g_free(run->root);
+    g_free(run->username);
+    g_clear_pointer(&run->config_paths, g_hash_table_unref);
+    g_clear_pointer(&run->packages, g_ptr_array_unref);
+    g_clear_pointer(&run->work, g_ptr_array_unref);
+    g_clear_pointer(&run->problems, g_ptr_array_unref);
+    g_clear_pointer(&run->warnings, g_ptr_array_unref);
+    g_mutex_clear(&run->lock);
+    g_free(run);
+}
+
+static void add_finding(VerifyRun *run, GPtrArray *list, guint *count, guint kept,
+                        const char *kind, const char *format, va_list args) {
+    char *finding = g_strdup_vprintf(format, args);
+
+    g_mutex_lock(&run->lock);
+    if ((*count)++ < kept) {
+        debug_log("Verify: %s%s", kind, finding);
+        g_ptr_array_add(list, finding);
+    } else {
+        g_free(finding);
+    }
+    g_mutex_unlock(&run->lock);
+}
+
+static void add_problem(VerifyRun *run, const char *format, ...) G_GNUC_PRINTF(2, 3);
+static void add_warning(VerifyRun *run, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+// Fails the install
+static void add_problem(VerifyRun *run, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    add_finding(run, run->problems, &run->n_problems, KEPT_PROBLEMS, "", format, args);
+    va_end(args);
+}
+
+// Only goes into the report
+static void add_warning(VerifyRun *run, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    add_finding(run, run->warnings, &run->n_warnings, KEPT_WARNINGS, "warning: ", format, args);
+    va_end(args);
+}
+
+// mtree escapes anything but printable ASCII as \ooo
+static char* unescape_octal(const char *text) {
+    GString *result = g_string_sized_new(strlen(text));
+
+    for (const char *p = text; *p != '\0'; p++) {
+        if (p[0] == '\\' && g_ascii_isdigit(p[1]) && g_ascii_isdigit(p[2]) && g_ascii_isdigit(p[3])) {
+            g_string_append_c(result, (char) ((p[1] - '0') * 64 + (p[2] - '0') * 8 + (p[3] - '0')));
+            p += 3;
+        } else {
+            g_string_append_c(result, *p);
+        }
+    }
+
+    return g_string_free(result, FALSE);
+}
+
+static void collect_config_paths(const char *dir_path, const char *relative, GHashTable *paths) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    const char *entry;
+
+    if (dir == NULL)
+        return;
+
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        g_autofree char *path = g_build_filename(dir_path, entry, NULL);
+        char *entry_relative = relative != NULL ? g_build_filename(relative, entry, NULL)
+                                                : g_strdup(entry);
+
+        if (g_file_test(path, G_FILE_TEST_IS_DIR) && !g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+            collect_config_paths(path, entry_relative, paths);
+        g_hash_table_add(paths, entry_relative);
+    }
+
+    g_dir_close(dir);
+}
+
+static void parse_keys(char **tokens, MtreeKeys *keys) {
+    for (guint i = 0; tokens[i] != NULL; i++) {
+        char *value = strchr(tokens[i], '=');
+
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+
+        if (strcmp(tokens[i], "type") == 0)
+            keys->type = value;
+        else if (strcmp(tokens[i], "size") == 0)
+            keys->size = value;
+        else if (strcmp(tokens[i], "link") == 0)
+            keys->link = value;
+        else if (strcmp(tokens[i], "sha256digest") == 0)
+            keys->sha256 = value;
+        else if (strcmp(tokens[i], "md5digest") == 0)
+            keys->md5 = value;
+    }
+}
+
+// Where the file starts on the disk, so the hash pass can read in disk
+// order; 0 when the file system can't say (no FIEMAP, delayed allocation)
+static guint64 first_extent(const char *path) {
+    guint64 buffer[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(guint64) + 1];
+    struct fiemap *map = (struct fiemap *) buffer;
+    guint64 offset = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return 0;
+
+    memset(buffer, 0, sizeof(buffer));
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+        (map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) == 0)
+        offset = map->fm_extents[0].fe_physical;
+
+    close(fd);
+    return offset;
+}
+
+// Checks what lstat can tell and queues regular files with a digest for
+// hashing. A missing file or one of the wrong type is a problem; different
+// contents (size, link target, checksum) are only warnings, since pacman's
+// backup files and much of /etc, /var and /boot are edited on purpose.
+// Files the configuration tree replaced are only checked for existence.
+static void check_entry(VerifyRun *run, const char *package, char *relative,
+                        const MtreeKeys *keys, gboolean replaced, GPtrArray *work) {
+    g_autofree char *path = g_build_filename(run->root, relative, NULL);
+    struct stat st;
+
+    if (lstat(path, &st) != 0) {
+        int saved_errno = errno;
+
+        if (saved_errno == ENOENT)
+            add_problem(run, "%s: /%s is missing", package, relative);
+        else
+            add_problem(run, "%s: /%s cannot be read: %s", package, relative,
+                        g_strerror(saved_errno));
+        g_free(relative);
+        return;
+    }
+
+    if (replaced || keys->type == NULL) {
+        g_free(relative);
+        return;
+    }
+
+    if (strcmp(keys->type, "dir") == 0) {
+        if (!S_ISDIR(st.st_mode))
+            add_problem(run, "%s: /%s is not a directory", package, relative);
+    } else if (strcmp(keys->type, "link") == 0) {
+        g_autofree char *expected = keys->link != NULL ? unescape_octal(keys->link) : NULL;
+        g_autofree char *target = NULL;
+
+        if (!S_ISLNK(st.st_mode)) {
+            add_problem(run, "%s: /%s is not a symbolic link", package, relative);
+        } else {
+            target = g_file_read_link(path, NULL);
+            if (g_strcmp0(target, expected) != 0)
+                add_warning(run, "%s: /%s points to %s instead of %s", package, relative,
+                            target != NULL ? target : "nothing", expected != NULL ? expected : "nothing");
+        }
+    } else if (strcmp(keys->type, "file") == 0) {
+        if (!S_ISREG(st.st_mode)) {
+            add_problem(run, "%s: /%s is not a regular file", package, relative);
+        } else if (keys->size != NULL &&
+                   (guint64) st.st_size != g_ascii_strtoull(keys->size, NULL, 10)) {
+            add_warning(run, "%s: /%s is %" G_GUINT64_FORMAT " bytes instead of %s",
+                        package, relative, (guint64) st.st_size, keys->size);
+        } else if (keys->sha256 != NULL || keys->md5 != NULL) {
+            HashWork *item = g_new0(HashWork, 1);
+
+            item->path = g_steal_pointer(&path);
+            item->relative = g_steal_pointer(&relative);
+            item->package = package;
+            item->digest = g_strdup(keys->sha256 != NULL ? keys->sha256 : keys->md5);
+            item->digest_type = keys->sha256 != NULL ? G_CHECKSUM_SHA256 : G_CHECKSUM_MD5;
+            item->size = st.st_size;
+            item->device = st.st_dev;
+            item->inode = st.st_ino;
+            item->offset = st.st_size > 0 ? first_extent(item->path) : 0;
+            g_ptr_array_add(work, item);
+        }
+    }
+
+    g_free(relative);
+}
+
+static gboolean read_mtree(VerifyRun *run, const char *package_dir, const char *package,
+                           GPtrArray *work, GError **error) {
+    g_autoptr(GFile) file = g_file_new_build_filename(package_dir, "mtree", NULL);
+    g_autoptr(GFileInputStream) raw = NULL;
+    g_autoptr(GZlibDecompressor) gunzip = NULL;
+    g_autoptr(GInputStream) stream = NULL;
+    g_autoptr(GDataInputStream) lines = NULL;
+    g_autofree char *default_type = NULL;
+    char *line;
+
+    raw = g_file_read(file, run->cancellable, error);
+    if (raw == NULL)
+        return FALSE;
+
+    gunzip = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+    stream = g_converter_input_stream_new(G_INPUT_STREAM(raw), G_CONVERTER(gunzip));
+    lines = g_data_input_stream_new(stream);
+
+    while ((line = g_data_input_stream_read_line(lines, NULL, run->cancellable, error)) != NULL) {
+        g_auto(GStrv) tokens = g_strsplit(line, " ", -1);
+        MtreeKeys keys = { 0 };
+        char *relative;
+
+        g_free(line);
+
+        if (tokens[0] == NULL || tokens[0][0] == '#' || tokens[0][0] == '\0')
+            continue;
+
+        // Keywords set for every entry that follows; only the type matters here
+        if (strcmp(tokens[0], "/set") == 0) {
+            parse_keys(tokens + 1, &keys);
+            if (keys.type != NULL) {
+                g_free(default_type);
+                default_type = g_strdup(keys.type);
+            }
+            continue;
+        }
+        if (strcmp(tokens[0], "/unset") == 0) {
+            for (guint i = 1; tokens[i] != NULL; i++) {
+                if (strcmp(tokens[i], "type") == 0 || strcmp(tokens[i], "all") == 0)
+                    g_clear_pointer(&default_type, g_free);
+            }
+            continue;
+        }
+        if (!g_str_has_prefix(tokens[0], "./"))
+            continue;
+
+        // .PKGINFO, .BUILDINFO and the like describe the package and are
+        // never installed
+        if (tokens[0][2] == '.' && strchr(tokens[0] + 2, '/') == NULL)
+            continue;
+
+        keys.type = default_type;
+        parse_keys(tokens + 1, &keys);
+
+        relative = unescape_octal(tokens[0] + 2);
+        if (*relative == '\0') {
+            g_free(relative);
+            continue;
+        }
+
+        check_entry(run, package, relative, &keys,
+                    run->config_paths != NULL && g_hash_table_contains(run->config_paths, relative),
+                    work);
+    }
+
+    return error == NULL || *error == NULL;
+}
+
+static void verify_package(gpointer data, gpointer user_data) {
+    const char *package_dir = data;
+    VerifyRun *run = user_data;
+    g_autoptr(GPtrArray) work = g_ptr_array_new();
+    g_autoptr(GError) error = NULL;
+    char *package = g_path_get_basename(package_dir);
+    guint64 bytes = 0;
+
+    // The HashWork items point at the name; the run keeps it
+    g_mutex_lock(&run->lock);
+    g_ptr_array_add(run->packages, package);
+    g_mutex_unlock(&run->lock);
+
+    if (!g_cancellable_is_cancelled(run->cancellable) &&
+        !read_mtree(run, package_dir, package, work, &error) &&
+        !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        add_problem(run, "%s: cannot read its file list: %s", package, error->message);
+
+    for (guint i = 0; i < work->len; i++)
+        bytes += ((HashWork *) g_ptr_array_index(work, i))->size;
+
+    g_mutex_lock(&run->lock);
+    g_ptr_array_extend_and_steal(run->work, g_steal_pointer(&work));
+    run->total_bytes += bytes;
+    run->scanned++;
+    engine_job_report(run->job, SCAN_SHARE * run->scanned / run->n_packages, "Checking package files");
+    g_mutex_unlock(&run->lock);
+}
+
+// Disk order: by physical offset where known, otherwise by inode, which most
+// file systems allocate close to the data
+static gint compare_work(gconstpointer a, gconstpointer b) {
+    const HashWork *x = *(HashWork * const *) a;
+    const HashWork *y = *(HashWork * const *) b;
+
+    if (x->device != y->device)
+        return x->device < y->device ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    if (x->inode != y->inode)
+        return x->inode < y->inode ? -1 : 1;
+    return 0;
+}
+
+// Starts the file's readahead; the hash of the file before it runs meanwhile
+static int open_for_hash(const HashWork *item) {
+    int fd = open(item->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+
+    // O_NOATIME needs the file's owner or CAP_FOWNER
+    if (fd < 0 && errno == EPERM)
+        fd = open(item->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+        posix_fadvise(fd, 0, MIN(item->size, BATCH_MAX_BYTES), POSIX_FADV_WILLNEED);
+
+    return fd;
+}
+
+static void hash_file(VerifyRun *run, const HashWork *item, int fd, int open_errno,
+                      guchar *buffer) {
+    g_autoptr(GChecksum) checksum = NULL;
+    gssize count;
+
+    if (fd < 0) {
+        add_problem(run, "%s: /%s cannot be read: %s", item->package, item->relative,
+                    g_strerror(open_errno));
+        return;
+    }
+
+    checksum = g_checksum_new(item->digest_type);
+
+    if (item->size > HASH_BUFFER_SIZE)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while ((count = read(fd, buffer, HASH_BUFFER_SIZE)) > 0)
+        g_checksum_update(checksum, buffer, count);
+
+    if (count < 0)
+        add_problem(run, "%s: /%s cannot be read: %s", item->package, item->relative,
+                    g_strerror(errno));
+    else if (g_ascii_strcasecmp(g_checksum_get_string(checksum), item->digest) != 0)
+        add_warning(run, "%s: /%s does not match its checksum", item->package, item->relative);
+}
+
+static void hash_batch(gpointer data, gpointer user_data) {
+    HashBatch *batch = data;
+    VerifyRun *run = batch->run;
+    g_autofree guchar *buffer = g_malloc(HASH_BUFFER_SIZE);
+    guint end = batch->first + batch->count;
+    int next_fd = -1;
+    int next_errno = 0;
+
+    if (g_cancellable_is_cancelled(run->cancellable))
+        return;
+
+    next_fd = open_for_hash(g_ptr_array_index(run->work, batch->first));
+    next_errno = errno;
+
+    for (guint i = batch->first; i < end; i++) {
+        int fd = next_fd;
+        int saved_errno = next_errno;
+
+        if (i + 1 < end) {
+            next_fd = open_for_hash(g_ptr_array_index(run->work, i + 1));
+            next_errno = errno;
+        }
+
+        hash_file(run, g_ptr_array_index(run->work, i), fd, saved_errno, buffer);
+        if (fd >= 0)
+            close(fd);
+
+        if (g_cancellable_is_cancelled(run->cancellable)) {
+            if (i + 1 < end && next_fd >= 0)
+                close(next_fd);
+            return;
+        }
+    }
+
+    g_mutex_lock(&run->lock);
+    run->hashed_bytes += batch->bytes;
+    engine_job_report(run->job,
+                      SCAN_SHARE + HASH_SHARE * run->hashed_bytes / MAX(run->total_bytes, 1),
+                      "Checking package files");
+    g_mutex_unlock(&run->lock);
+}
+
+static gboolean verify_packages(VerifyRun *run, GError **error) {
+    g_autofree char *db = g_build_filename(run->root, VERIFY_PACMAN_DB, NULL);
+    g_autoptr(GPtrArray) package_dirs = g_ptr_array_new_with_free_func(g_free);
+    g_autoptr(GArray) batches = g_array_new(FALSE, FALSE, sizeof(HashBatch));
+    guint threads = MAX(g_get_num_processors(), 1);
+    gint64 start = g_get_monotonic_time();
+    GThreadPool *pool;
+    GDir *dir;
+    const char *entry;
+
+    dir = g_dir_open(db, 0, error);
+    if (dir == NULL)
+        return FALSE;
+
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        char *package_dir = g_build_filename(db, entry, NULL);
+
+        if (g_file_test(package_dir, G_FILE_TEST_IS_DIR))
+            g_ptr_array_add(package_dirs, package_dir);
+        else
+            g_free(package_dir);
+    }
+    g_dir_close(dir);
+
+    if (package_dirs->len == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No packages installed in %s", db);
+        return FALSE;
+    }
+
+    run->n_packages = package_dirs->len;
+    pool = g_thread_pool_new(verify_package, run, threads, FALSE, NULL);
+    for (guint i = 0; i < package_dirs->len; i++)
+        g_thread_pool_push(pool, g_ptr_array_index(package_dirs, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    if (g_cancellable_set_error_if_cancelled(run->cancellable, error))
+        return FALSE;
+
+    g_ptr_array_sort(run->work, compare_work);
+
+    // Batches are handed out in disk order, so the threads between them read
+    // one region of the disk at a time
+    for (guint i = 0; i < run->work->len; i++) {
+        HashWork *item = g_ptr_array_index(run->work, i);
+        HashBatch *last = batches->len > 0 ? &g_array_index(batches, HashBatch, batches->len - 1) : NULL;
+
+        if (last == NULL || last->count >= BATCH_MAX_FILES || last->bytes >= BATCH_MAX_BYTES) {
+            HashBatch batch = { run, i, 0, 0 };
+
+            g_array_append_val(batches, batch);
+            last = &g_array_index(batches, HashBatch, batches->len - 1);
+        }
+
+        last->count++;
+        last->bytes += item->size;
+    }
+
+    pool = g_thread_pool_new(hash_batch, NULL, threads, FALSE, NULL);
+    for (guint i = 0; i < batches->len; i++)
+        g_thread_pool_push(pool, &g_array_index(batches, HashBatch, i), NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    if (g_cancellable_set_error_if_cancelled(run->cancellable, error))
+        return FALSE;
+
+    g_autofree char *size = g_format_size(run->total_bytes);
+    debug_log("Verify: checked %u packages, hashed %u files (%s) in %.3f s",
+              run->n_packages, run->work->len, size,
+              (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC);
+    return TRUE;
+}
+
+// A non-empty file of the ESP directory whose name starts with prefix, in
+// any case since the ESP is FAT
+static gboolean has_efi_binary(const char *dir_path, const char *prefix) {
+    GDir *dir = g_dir_open(dir_path, 0, NULL);
+    const char *entry;
+    gboolean found = FALSE;
+
+    if (dir == NULL)
+        return FALSE;
+
+    while (!found && (entry = g_dir_read_name(dir)) != NULL) {
+        g_autofree char *name = g_ascii_strdown(entry, -1);
+        g_autofree char *path = g_build_filename(dir_path, entry, NULL);
+        GStatBuf st;
+
+        found = g_str_has_prefix(name, prefix) && g_str_has_suffix(name, ".efi") &&
+                g_stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+    }
+
+    g_dir_close(dir);
+    return found;
+}
+
+// The kernel, initramfs and EFI images an entry loads, relative to the ESP
+static void check_boot_entry(VerifyRun *run, const char *boot, const char *entry_path,
+                             const char *entry) {
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    gboolean loads = FALSE;
+
+    if (!g_file_get_contents(entry_path, &contents, NULL, NULL)) {
+        add_problem(run, "Boot entry %s cannot be read", entry);
+        return;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = g_strsplit_set(g_strstrip(lines[i]), " \t", 2);
+        GStatBuf st;
+
+        if (fields[0] == NULL || fields[1] == NULL)
+            continue;
+        if (strcmp(fields[0], "linux") != 0 && strcmp(fields[0], "initrd") != 0 &&
+            strcmp(fields[0], "efi") != 0)
+            continue;
+
+        g_autofree char *path = g_build_filename(boot, g_strstrip(fields[1]), NULL);
+        if (g_stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+            add_problem(run, "Boot entry %s loads %s, which is missing", entry, fields[1]);
+        loads |= strcmp(fields[0], "initrd") != 0;
+    }
+
+    if (!loads)
+        add_problem(run, "Boot entry %s loads no kernel", entry);
+}
+
+static void check_bootloader(VerifyRun *run) {
+    g_autofree char *boot = g_build_filename(run->root, "boot", NULL);
+    g_autofree char *systemd = g_build_filename(boot, "EFI", "systemd", NULL);
+    g_autofree char *fallback = g_build_filename(boot, "EFI", "BOOT", NULL);
+    g_autofree char *loader = g_build_filename(boot, "loader", "loader.conf", NULL);
+    g_autofree char *entries_path = g_build_filename(boot, "loader", "entries", NULL);
+    g_autofree char *contents = NULL;
+    g_autofree char *default_entry = NULL;
+    gboolean default_found = FALSE;
+    guint n_entries = 0;
+    GDir *entries;
+    const char *entry;
+
+    if (!has_efi_binary(systemd, "systemd-boot"))
+        add_problem(run, "No systemd-boot binary in /boot/EFI/systemd");
+    if (!has_efi_binary(fallback, "boot"))
+        add_problem(run, "No fallback boot loader in /boot/EFI/BOOT");
+
+    if (g_file_get_contents(loader, &contents, NULL, NULL)) {
+        g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+
+        for (guint i = 0; lines[i] != NULL; i++) {
+            g_auto(GStrv) fields = g_strsplit_set(g_strstrip(lines[i]), " \t", 2);
+
+            if (fields[0] != NULL && fields[1] != NULL && strcmp(fields[0], "default") == 0) {
+                g_free(default_entry);
+                default_entry = g_strdup(g_strstrip(fields[1]));
+            }
+        }
+    } else {
+        add_problem(run, "/boot/loader/loader.conf is missing");
+    }
+
+    entries = g_dir_open(entries_path, 0, NULL);
+    while (entries != NULL && (entry = g_dir_read_name(entries)) != NULL) {
+        g_autofree char *entry_path = g_build_filename(entries_path, entry, NULL);
+
+        if (!g_str_has_suffix(entry, ".conf"))
+            continue;
+
+        check_boot_entry(run, boot, entry_path, entry);
+        default_found |= g_strcmp0(entry, default_entry) == 0;
+        n_entries++;
+    }
+    if (entries != NULL)
+        g_dir_close(entries);
+
+    if (n_entries == 0)
+        add_problem(run, "No boot entries in /boot/loader/entries");
+    else if (default_entry != NULL && strpbrk(default_entry, "*?[") == NULL && !default_found)
+        add_problem(run, "The default boot entry %s is missing", default_entry);
+}
+
+static void check_fstab(VerifyRun *run) {
+    g_autofree char *path = g_build_filename(run->root, "etc", "fstab", NULL);
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+    gboolean has_root = FALSE;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        add_problem(run, "/etc/fstab is missing");
+        return;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) all = g_strsplit_set(g_strstrip(lines[i]), " \t", -1);
+        const char *fields[3] = { NULL };
+        guint n_fields = 0;
+
+        if (lines[i][0] == '#' || lines[i][0] == '\0')
+            continue;
+
+        for (guint j = 0; all[j] != NULL && n_fields < G_N_ELEMENTS(fields); j++) {
+            if (all[j][0] != '\0')
+                fields[n_fields++] = all[j];
+        }
+        if (n_fields < G_N_ELEMENTS(fields))
+            continue;
+
+        g_autofree char *source = unescape_octal(fields[0]);
+        g_autofree char *target = unescape_octal(fields[1]);
+
+        if (strchr(source, '=') != NULL) {
+            char *device = blkid_evaluate_tag(source, NULL, NULL);
+
+            if (device == NULL)
+                add_problem(run, "/etc/fstab: no device has %s", source);
+            free(device);
+        } else if (g_str_has_prefix(source, "/dev/") && !g_file_test(source, G_FILE_TEST_EXISTS)) {
+            add_problem(run, "/etc/fstab: %s does not exist", source);
+        }
+
+        if (strcmp(fields[2], "swap") == 0 || strcmp(target, "none") == 0)
+            continue;
+
+        g_autofree char *mountpoint = g_build_filename(run->root, target, NULL);
+        if (!g_file_test(mountpoint, G_FILE_TEST_IS_DIR))
+            add_problem(run, "/etc/fstab: mount point %s does not exist", target);
+        has_root |= strcmp(target, "/") == 0;
+    }
+
+    if (!has_root)
+        add_problem(run, "/etc/fstab does not mount /");
+}
+
+// passwd, shadow and group by their first field
+static GHashTable* read_account_file(VerifyRun *run, const char *name) {
+    GHashTable *table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_strfreev);
+    g_autofree char *path = g_build_filename(run->root, "etc", name, NULL);
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) lines = NULL;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        add_problem(run, "/etc/%s cannot be read", name);
+        return table;
+    }
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        char **fields = g_strsplit(lines[i], ":", -1);
+
+        if (fields[0] == NULL || fields[0][0] == '\0' || fields[1] == NULL) {
+            g_strfreev(fields);
+            continue;
+        }
+        g_hash_table_replace(table, fields[0], fields);
+    }
+
+    return table;
+}
+
+static gboolean is_locked(const char *hash) {
+    return hash[0] == '!' || hash[0] == '*';
+}
+
+static void check_users(VerifyRun *run) {
+    g_autoptr(GHashTable) passwd = read_account_file(run, "passwd");
+    g_autoptr(GHashTable) shadow = read_account_file(run, "shadow");
+    g_autoptr(GHashTable) group = read_account_file(run, "group");
+    char **root = g_hash_table_lookup(shadow, "root");
+
+    if (!g_hash_table_contains(passwd, "root") || root == NULL)
+        add_problem(run, "The root account is missing");
+    else if (run->root_account == VERIFY_ROOT_LOCKED && !is_locked(root[1]))
+        add_problem(run, "The root account is not locked");
+    else if (run->root_account == VERIFY_ROOT_PASSWORD && (is_locked(root[1]) || root[1][0] == '\0'))
+        add_problem(run, "The root account has no password");
+
+    if (run->username == NULL)
+        return;
+
+    char **user = g_hash_table_lookup(passwd, run->username);
+    char **user_shadow = g_hash_table_lookup(shadow, run->username);
+    char **wheel = g_hash_table_lookup(group, "wheel");
+
+    if (user == NULL || g_strv_length(user) < 7) {
+        add_problem(run, "The account %s is missing", run->username);
+        return;
+    }
+
+    g_autofree char *home = g_build_filename(run->root, user[5], NULL);
+    GStatBuf st;
+
+    if (g_stat(home, &st) != 0 || !S_ISDIR(st.st_mode))
+        add_problem(run, "The home directory %s of %s is missing", user[5], run->username);
+    else if (st.st_uid != g_ascii_strtoull(user[2], NULL, 10))
+        add_problem(run, "The home directory %s is not owned by %s", user[5], run->username);
+
+    if (user_shadow == NULL || is_locked(user_shadow[1]))
+        add_problem(run, "The account %s has no password", run->username);
+
+    g_auto(GStrv) members = wheel != NULL && g_strv_length(wheel) >= 4 ? g_strsplit(wheel[3], ",", -1) : NULL;
+    if (members == NULL || !g_strv_contains((const char * const *) members, run->username))
+        add_problem(run, "The account %s is not in the wheel group", run->username);
+}
+
+static gboolean write_report(VerifyRun *run, GError **error) {
+    g_autofree char *path = g_build_filename(run->root, VERIFY_REPORT, NULL);
+    g_autoptr(GString) report = g_string_new(NULL);
+
+    for (guint i = 0; i < run->problems->len; i++)
+        g_string_append_printf(report, "%s\n", (const char *) g_ptr_array_index(run->problems, i));
+    if (run->n_problems > run->problems->len)
+        g_string_append_printf(report, "... and %u more\n", run->n_problems - run->problems->len);
+
+    for (guint i = 0; i < run->warnings->len; i++)
+        g_string_append_printf(report, "warning: %s\n",
+                               (const char *) g_ptr_array_index(run->warnings, i));
+    if (run->n_warnings > run->warnings->len)
+        g_string_append_printf(report, "... and %u more warnings\n",
+                               run->n_warnings - run->warnings->len);
+
+    return g_file_set_contents(path, report->str, report->len, error);
+}
+
+static gboolean run_verify(EngineJob *job, gpointer user_data,
+                           GCancellable *cancellable, GError **error) {
+    VerifyRun *run = user_data;
+    g_autoptr(GString) summary = g_string_new(NULL);
+    g_autoptr(GError) report_error = NULL;
+
+    run->job = job;
+    run->cancellable = cancellable;
+
+    // A run that failed once starts over
+    g_ptr_array_set_size(run->packages, 0);
+    g_ptr_array_set_size(run->work, 0);
+    g_ptr_array_set_size(run->problems, 0);
+    run->n_problems = 0;
+    g_ptr_array_set_size(run->warnings, 0);
+    run->n_warnings = 0;
+    run->scanned = 0;
+    run->total_bytes = 0;
+    run->hashed_bytes = 0;
+
+    engine_job_report(job, 0.0, "Checking package files");
+    if (!verify_packages(run, error))
+        return FALSE;
+
+    engine_job_report(job, SCAN_SHARE + HASH_SHARE, "Checking boot loader, fstab and accounts");
+    check_bootloader(run);
+    check_fstab(run);
+    check_users(run);
+
+    if (run->n_problems == 0 && run->n_warnings == 0) {
+        engine_job_report(job, 1.0, "No problems found");
+        return TRUE;
+    }
+
+    if (!write_report(run, &report_error))
+        debug_log("Verify: cannot write the report: %s", report_error->message);
+
+    if (run->n_problems == 0) {
+        g_autofree char *message = g_strdup_printf("No problems found, %u warning%s (see /%s)",
+                                                   run->n_warnings,
+                                                   run->n_warnings == 1 ? "" : "s", VERIFY_REPORT);
+
+        engine_job_report(job, 1.0, message);
+        return TRUE;
+    }
+
+    for (guint i = 0; i < MIN(run->problems->len, SHOWN_PROBLEMS); i++)
+        g_string_append_printf(summary, "%s%s", i > 0 ? "; " : "",
+                               (const char *) g_ptr_array_index(run->problems, i));
+    if (run->n_problems > SHOWN_PROBLEMS)
+        g_string_append(summary, "; ...");
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                "Verification found %u problem%s: %s (all of them are in /%s)",
+                run->n_problems, run->n_problems == 1 ? "" : "s", summary->str, VERIFY_REPORT);
+    return FALSE;
+}
+
+EngineJob* verify_job_new(const char *name, const char *root, const VerifyOptions *options) {
+    VerifyRun *run = g_new0(VerifyRun, 1);
+
+    run->root = g_strdup(root);
+    run->username = g_strdup(options->username);
+    run->root_account = options->root_account;
+    run->packages = g_ptr_array_new_with_free_func(g_free);
+    run->work = g_ptr_array_new_with_free_func(hash_work_free);
+    run->problems = g_ptr_array_new_with_free_func(g_free);
+    run->warnings = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_init(&run->lock);
+
+    if (options->config_dir != NULL) {
+        run->config_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        collect_config_paths(options->config_dir, NULL, run->config_paths);
+    }
+
+    return engine_job_new_func(name, run_verify, run, verify_run_free);
+}
@@ -0,0 +1,46 @@
+// File   : verify.h
+// Project: Rarch Installer - Riley's (customized) Arch Installer
+//
+// Description:
+// Post-install verification, the last step of every install. Every file of
+// every installed package is checked against pacman's mtree data: type,
+// size, symlink target and checksum. Files are hashed on all cores in disk
+// order (by physical offset where the file system reports one, by inode
+// otherwise), so a rotational disk keeps streaming. The boot loader, fstab
+// and accounts are checked as well. Any problem fails the install with a
+// summary; the full list is written to VERIFY_REPORT on the target.
+//
+// Of the package files, only a missing file or one of the wrong type is a
+// problem. Different contents are reported as warnings: pacman's backup
+// files and much of /etc, /var and /boot are edited after installation.
+// Files the configuration tree replaced are only checked for existence.
+//
+// License: Mozilla Public License 2.0 - MPL-2
+// Copyright (c) 2025 Riley Ava
+
+#ifndef RARCH_VERIFY_H
+#define RARCH_VERIFY_H
+
+#include <gio/gio.h>
+
+#include "engine.h"
+
+// Relative to the target root
+#define VERIFY_REPORT "var/log/rarch-verify.log"
+
+typedef enum {
+    VERIFY_ROOT_ANY,        // left as it was
+    VERIFY_ROOT_LOCKED,
+    VERIFY_ROOT_PASSWORD
+} VerifyRootAccount;
+
+typedef struct {
+    const char *username;           // must exist with a home and be in wheel, may be NULL
+    VerifyRootAccount root_account;
+    const char *config_dir;         // tree copied over the packages' files, may be NULL
+} VerifyOptions;
+
+// Checks the system installed below root; options are copied
+EngineJob* verify_job_new(const char *name, const char *root, const VerifyOptions *options);
+
+#endif // RARCH_VERIFY_H